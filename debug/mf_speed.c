@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       mf_speed.c
+/// \brief      Times compression of highly repetitive input
+///
+/// The input is a pseudorandom 64 KiB block that is repeated with a few
+/// changed bytes in each copy. Nearly all matches are long and hit
+/// nice_len, so most of the time is spent in lzma_memcmplen(). The input
+/// is compressed with the presets 6-9 and the times are printed.
+///
+/// To see the effect of the x86 SIMD versions of lzma_memcmplen(),
+/// compare the results of builds made with and without --disable-x86-simd.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "sysdefs.h"
+#include "lzma.h"
+#include <stdio.h>
+#include <time.h>
+
+
+#define BLOCK_SIZE (1U << 16)
+#define DEFAULT_SIZE (64U << 20)
+
+
+int
+main(int argc, char **argv)
+{
+	const size_t in_size = argc > 1
+			? (size_t)strtoull(argv[1], NULL, 10) << 20
+			: DEFAULT_SIZE;
+	if (in_size < BLOCK_SIZE) {
+		fprintf(stderr, "Usage: %s [MiB]\n", argv[0]);
+		return 1;
+	}
+
+	const size_t out_size = lzma_stream_buffer_bound(in_size);
+	uint8_t *in = malloc(in_size);
+	uint8_t *out = malloc(out_size);
+	if (in == NULL || out == NULL)
+		return 1;
+
+	uint32_t seed = 12345;
+	for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+		seed = seed * 1103515245 + 12345;
+		in[i] = (uint8_t)(seed >> 24);
+	}
+
+	for (size_t i = BLOCK_SIZE; i < in_size; ++i)
+		in[i] = in[i - BLOCK_SIZE];
+
+	for (size_t i = BLOCK_SIZE; i < in_size; i += 4093) {
+		seed = seed * 1103515245 + 12345;
+		in[i] = (uint8_t)(seed >> 24);
+	}
+
+	for (uint32_t preset = 6; preset <= 9; ++preset) {
+		size_t out_pos = 0;
+		const clock_t start = clock();
+		const lzma_ret ret = lzma_easy_buffer_encode(preset,
+				LZMA_CHECK_CRC32, NULL, in, in_size,
+				out, &out_pos, out_size);
+		const double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		if (ret != LZMA_OK) {
+			fprintf(stderr, "Encoding failed: %d\n", (int)ret);
+			return 1;
+		}
+
+		printf("-%" PRIu32 ": %zu -> %zu bytes, %.2f s, %.1f MiB/s\n",
+				preset, in_size, out_pos, secs,
+				(double)in_size / (1 << 20) / secs);
+	}
+
+	free(in);
+	free(out);
+	return 0;
+}
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       12_seekable_checkpoints.c
+/// \brief      Random access to .xz files using decoder checkpoints
+///
+/// Usage:      ./12_seekable_checkpoints INFILE.xz CHECKPOINTS
+///             ./12_seekable_checkpoints INFILE.xz CHECKPOINTS OFFSET SIZE
+///
+/// With two arguments, INFILE.xz is decoded once and the decoder
+/// checkpoints are written to the file CHECKPOINTS. With four arguments,
+/// the checkpoints are loaded and SIZE bytes of uncompressed data
+/// starting at OFFSET are written to standard output.
+///
+/// Example:    ./12_seekable_checkpoints foo.xz foo.xz.cp
+///             ./12_seekable_checkpoints foo.xz foo.xz.cp 123456789 1000
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <lzma.h>
+
+
+// A checkpoint is created after roughly this many bytes of uncompressed
+// data. Each checkpoint needs about as much memory and disk space as
+// the dictionary size of the file, so this should be much bigger than
+// the dictionary size.
+#define CHECKPOINT_INTERVAL (UINT64_C(64) << 20)
+
+
+// Read callback for the seekable decoder. fseek() uses long so this
+// doesn't support large files on 32-bit systems. On POSIX systems
+// pread() would be a better choice.
+static lzma_ret
+read_callback(void *opaque, uint8_t *buf, size_t size, uint64_t pos)
+{
+	FILE *file = opaque;
+
+	if (pos > LONG_MAX || fseek(file, (long)pos, SEEK_SET))
+		return LZMA_DATA_ERROR;
+
+	if (fread(buf, 1, size, file) != size)
+		return LZMA_DATA_ERROR;
+
+	return LZMA_OK;
+}
+
+
+// Read the whole file into a newly-allocated buffer.
+static uint8_t *
+read_file(FILE *file, size_t *size)
+{
+	if (fseek(file, 0, SEEK_END))
+		return NULL;
+
+	const long file_size = ftell(file);
+	if (file_size < 0 || (unsigned long)file_size > SIZE_MAX)
+		return NULL;
+
+	rewind(file);
+
+	*size = (size_t)file_size;
+	uint8_t *buf = malloc(*size > 0 ? *size : 1);
+	if (buf != NULL && fread(buf, 1, *size, file) != *size) {
+		free(buf);
+		buf = NULL;
+	}
+
+	return buf;
+}
+
+
+// Decode the whole file to create the checkpoints and write them to cpfile.
+static bool
+create_checkpoints(lzma_seekable *seekable, FILE *cpfile)
+{
+	const uint64_t uncompressed_size = lzma_index_uncompressed_size(
+			lzma_seekable_index(seekable));
+
+	static uint8_t outbuf[BUFSIZ];
+	uint64_t pos = 0;
+
+	while (pos < uncompressed_size) {
+		size_t out_pos = 0;
+		const lzma_ret ret = lzma_seekable_read(seekable, pos,
+				outbuf, &out_pos, sizeof(outbuf));
+		if (ret != LZMA_OK) {
+			fprintf(stderr, "Decoder error (error code %u)\n", ret);
+			return false;
+		}
+
+		pos += out_pos;
+	}
+
+	const uint64_t size = lzma_seekable_checkpoints_size(seekable);
+	if (size > SIZE_MAX) {
+		fprintf(stderr, "Checkpoints are too big\n");
+		return false;
+	}
+
+	uint8_t *buf = malloc((size_t)size);
+	if (buf == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+
+	size_t buf_pos = 0;
+	bool success = lzma_seekable_checkpoints_encode(seekable, buf,
+			&buf_pos, (size_t)size) == LZMA_OK;
+
+	if (!success)
+		fprintf(stderr, "Encoding the checkpoints failed\n");
+	else if (fwrite(buf, 1, buf_pos, cpfile) != buf_pos
+			|| fclose(cpfile)) {
+		fprintf(stderr, "Write error: %s\n", strerror(errno));
+		success = false;
+	}
+
+	free(buf);
+	return success;
+}
+
+
+// Load the checkpoints and write size bytes starting at offset to stdout.
+static bool
+read_range(lzma_seekable *seekable, FILE *cpfile,
+		uint64_t offset, uint64_t size)
+{
+	size_t cp_size;
+	uint8_t *cp = read_file(cpfile, &cp_size);
+	fclose(cpfile);
+	if (cp == NULL) {
+		fprintf(stderr, "Error reading the checkpoints\n");
+		return false;
+	}
+
+	size_t cp_pos = 0;
+	const lzma_ret ret = lzma_seekable_checkpoints_decode(seekable,
+			cp, &cp_pos, cp_size);
+	free(cp);
+
+	if (ret != LZMA_OK) {
+		fprintf(stderr, "The checkpoints are corrupt or don't match "
+				"the .xz file (error code %u)\n", ret);
+		return false;
+	}
+
+	static uint8_t outbuf[BUFSIZ];
+
+	while (size > 0) {
+		const size_t want = size < sizeof(outbuf)
+				? (size_t)size : sizeof(outbuf);
+		size_t out_pos = 0;
+		const lzma_ret ret2 = lzma_seekable_read(seekable, offset,
+				outbuf, &out_pos, want);
+		if (ret2 != LZMA_OK) {
+			fprintf(stderr, "Decoder error (error code %u)\n",
+					ret2);
+			return false;
+		}
+
+		// The end of the uncompressed data
+		if (out_pos == 0)
+			break;
+
+		if (fwrite(outbuf, 1, out_pos, stdout) != out_pos) {
+			fprintf(stderr, "Write error: %s\n", strerror(errno));
+			return false;
+		}
+
+		offset += out_pos;
+		size -= out_pos;
+	}
+
+	return true;
+}
+
+
+extern int
+main(int argc, char **argv)
+{
+	if (argc != 3 && argc != 5) {
+		fprintf(stderr, "Usage: %s INFILE.xz CHECKPOINTS "
+				"[OFFSET SIZE]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE *infile = fopen(argv[1], "rb");
+	if (infile == NULL) {
+		fprintf(stderr, "Error opening '%s': %s\n",
+				argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (fseek(infile, 0, SEEK_END)) {
+		fprintf(stderr, "Error seeking '%s': %s\n",
+				argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	const lzma_seekable_options options = {
+		.read = &read_callback,
+		.opaque = infile,
+		.file_size = (uint64_t)ftell(infile),
+		.memlimit = UINT64_MAX,
+
+		// New checkpoints are only needed when creating them.
+		.checkpoint_interval = argc == 3 ? CHECKPOINT_INTERVAL : 0,
+	};
+
+	lzma_seekable *seekable;
+	const lzma_ret ret = lzma_seekable_decoder(&seekable, &options, NULL);
+	if (ret != LZMA_OK) {
+		fprintf(stderr, "Error reading the Index of '%s' "
+				"(error code %u)\n", argv[1], ret);
+		return EXIT_FAILURE;
+	}
+
+	FILE *cpfile = fopen(argv[2], argc == 3 ? "wb" : "rb");
+	if (cpfile == NULL) {
+		fprintf(stderr, "Error opening '%s': %s\n",
+				argv[2], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	const bool success = argc == 3
+			? create_checkpoints(seekable, cpfile)
+			: read_range(seekable, cpfile,
+				strtoull(argv[3], NULL, 10),
+				strtoull(argv[4], NULL, 10));
+
+	lzma_seekable_end(seekable);
+	fclose(infile);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
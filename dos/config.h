@@ -96,6 +96,12 @@
 /* Define to 1 to enable bt4 match finder. */
 #define HAVE_MF_BT4 1
 
+/* Define to 1 to enable bt4x match finder. */
+#define HAVE_MF_BT4X 1
+
+/* Define to 1 to enable hb4 match finder. */
+#define HAVE_MF_HB4 1
+
 /* Define to 1 to enable hc3 match finder. */
 #define HAVE_MF_HC3 1
 
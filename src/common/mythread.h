@@ -349,6 +349,28 @@ mythread_condtime_set(mythread_condtime *condtime, const mythread_cond *cond,
 	}
 }
 
+// Returns the value of a clock in microseconds. This is meant for
+// measuring elapsed time; the starting point is unspecified. Like with
+// mythread_cond_init(), CLOCK_MONOTONIC is used if it is available.
+static inline uint64_t
+mythread_time_usec(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec now;
+#	ifdef HAVE_CLOCK_MONOTONIC
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+#	endif
+		clock_gettime(CLOCK_REALTIME, &now);
+
+	return (uint64_t)now.tv_sec * 1000000
+			+ (uint64_t)now.tv_nsec / 1000;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_usec;
+#endif
+}
+
 
 #elif defined(MYTHREAD_WIN95) || defined(MYTHREAD_VISTA)
 
@@ -544,6 +566,94 @@ mythread_condtime_set(mythread_condtime *condtime, const mythread_cond *cond,
 	condtime->timeout = timeout;
 }
 
+// Returns the value of a monotonic clock in microseconds.
+static inline uint64_t
+mythread_time_usec(void)
+{
+	LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	// Avoid integer overflow in the multiplication.
+	const uint64_t f = (uint64_t)freq.QuadPart;
+	const uint64_t c = (uint64_t)now.QuadPart;
+	return c / f * 1000000 + c % f * 1000000 / f;
+}
+
+#endif
+
+
+#ifdef MYTHREAD_ENABLED
+
+////////////////////////
+// Atomic size_t type //
+////////////////////////
+
+// mythread_atomic_size is a size_t that one thread may modify while other
+// threads read it without holding a mutex. It must be accessed only with
+// mythread_atomic_load() and mythread_atomic_store(), which are sequentially
+// consistent. These are meant for counters and positions that one thread
+// publishes and others poll. Anything more complex still needs a mutex.
+#if defined(__ATOMIC_SEQ_CST)
+// GCC >= 4.7 and Clang
+typedef size_t mythread_atomic_size;
+#	define mythread_atomic_load(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#	define mythread_atomic_store(ptr, value) \
+		__atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+		&& !defined(__STDC_NO_ATOMICS__)
+#	include <stdatomic.h>
+typedef _Atomic size_t mythread_atomic_size;
+#	define mythread_atomic_load(ptr) atomic_load(ptr)
+#	define mythread_atomic_store(ptr, value) atomic_store(ptr, value)
+
+#elif defined(MYTHREAD_WIN95) || defined(MYTHREAD_VISTA)
+// size_t has the same size as a pointer on Windows. The Interlocked
+// functions are full memory barriers.
+typedef volatile size_t mythread_atomic_size;
+
+static inline size_t
+mythread_atomic_load(const mythread_atomic_size *ptr)
+{
+	return (size_t)InterlockedCompareExchangePointer(
+			(PVOID volatile *)ptr, NULL, NULL);
+}
+
+static inline void
+mythread_atomic_store(mythread_atomic_size *ptr, size_t value)
+{
+	InterlockedExchangePointer((PVOID volatile *)ptr, (PVOID)value);
+}
+
+#else
+// No atomics are available. Protect every access with one mutex that is
+// shared by the whole library. This is slow but these are used only for
+// progress info and other values that aren't accessed in tight loops.
+// The mutex is defined in common.c when MYTHREAD_ATOMIC_MUTEX is defined.
+#	define MYTHREAD_ATOMIC_MUTEX 1
+typedef size_t mythread_atomic_size;
+extern mythread_mutex lzma_mythread_atomic_mutex;
+
+static inline size_t
+mythread_atomic_load(const mythread_atomic_size *ptr)
+{
+	mythread_mutex_lock(&lzma_mythread_atomic_mutex);
+	const size_t value = *ptr;
+	mythread_mutex_unlock(&lzma_mythread_atomic_mutex);
+	return value;
+}
+
+static inline void
+mythread_atomic_store(mythread_atomic_size *ptr, size_t value)
+{
+	mythread_mutex_lock(&lzma_mythread_atomic_mutex);
+	*ptr = value;
+	mythread_mutex_unlock(&lzma_mythread_atomic_mutex);
+}
+#endif
+
 #endif
 
 #endif
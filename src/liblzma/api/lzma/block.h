@@ -52,6 +52,7 @@ typedef struct {
 	 *  - lzma_block_buffer_encode()
 	 *  - lzma_block_uncomp_encode()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 *
 	 * Written by:
 	 *  - lzma_block_header_decode()
@@ -71,6 +72,7 @@ typedef struct {
 	 *  - lzma_block_total_size()
 	 *  - lzma_block_decoder()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 *
 	 * Written by:
 	 *  - lzma_block_header_size()
@@ -97,6 +99,7 @@ typedef struct {
 	 *  - lzma_block_decoder()
 	 *  - lzma_block_buffer_encode()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 */
 	lzma_check check;
 
@@ -144,6 +147,7 @@ typedef struct {
 	 *  - lzma_block_total_size()
 	 *  - lzma_block_decoder()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 *
 	 * Written by:
 	 *  - lzma_block_header_decode()
@@ -153,6 +157,7 @@ typedef struct {
 	 *  - lzma_block_buffer_encode()
 	 *  - lzma_block_uncomp_encode()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 */
 	lzma_vli compressed_size;
 
@@ -170,6 +175,7 @@ typedef struct {
 	 *  - lzma_block_header_encode()
 	 *  - lzma_block_decoder()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 *
 	 * Written by:
 	 *  - lzma_block_header_decode()
@@ -178,6 +184,7 @@ typedef struct {
 	 *  - lzma_block_buffer_encode()
 	 *  - lzma_block_uncomp_encode()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 */
 	lzma_vli uncompressed_size;
 
@@ -194,6 +201,7 @@ typedef struct {
 	 *  - lzma_block_decoder()
 	 *  - lzma_block_buffer_encode()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 *
 	 * Written by:
 	 *  - lzma_block_header_decode(): Note that this does NOT free()
@@ -224,6 +232,7 @@ typedef struct {
 	 *  - lzma_block_buffer_encode()
 	 *  - lzma_block_uncomp_encode()
 	 *  - lzma_block_buffer_decode()
+	 *  - lzma_block_buffer_decode_inplace()
 	 */
 	uint8_t raw_check[LZMA_CHECK_SIZE_MAX];
 
@@ -295,6 +304,7 @@ typedef struct {
 	 * If .version >= 1, read by:
 	 *   - lzma_block_decoder()
 	 *   - lzma_block_buffer_decode()
+	 *   - lzma_block_buffer_decode_inplace()
 	 *
 	 * Written by (.version is ignored):
 	 *   - lzma_block_header_decode() always sets this to false
@@ -577,6 +587,37 @@ extern LZMA_API(size_t) lzma_block_buffer_bound(size_t uncompressed_size)
 		lzma_nothrow;
 
 
+/**
+ * \brief       Calculate the safety margin for in-place Block decoding
+ *
+ * lzma_block_buffer_decode_inplace() decodes a Block in a single buffer
+ * that holds the compressed data at its end. The decoder must never
+ * overwrite compressed data that it hasn't read yet. This function
+ * returns how much bigger than the uncompressed data the buffer has to be
+ * for that to be guaranteed:
+ *
+ *     buf_size = uncompressed_size
+ *             + lzma_block_inplace_margin(uncompressed_size);
+ *
+ * The Block (including the Block Header) is placed at the end of the
+ * buffer, that is, starting at buf[buf_size - block_size]. The decoded
+ * data is written starting at buf[0]. The memory needed is thus
+ * the bigger of the compressed and uncompressed sizes plus a small margin
+ * instead of their sum.
+ *
+ * The margin is valid for Blocks created with lzma_block_buffer_encode()
+ * and for Blocks created with lzma_block_encoder() without using
+ * LZMA_SYNC_FLUSH. It is bigger than needed for most files.
+ *
+ * \param       uncompressed_size   Uncompressed size of the Block
+ *
+ * \return      Safety margin in bytes, or zero if the calculation would
+ *              overflow size_t.
+ */
+extern LZMA_API(size_t) lzma_block_inplace_margin(size_t uncompressed_size)
+		lzma_nothrow;
+
+
 /**
  * \brief       Single-call .xz Block encoder
  *
@@ -692,3 +733,55 @@ extern LZMA_API(lzma_ret) lzma_block_buffer_decode(
 		const uint8_t *in, size_t *in_pos, size_t in_size,
 		uint8_t *out, size_t *out_pos, size_t out_size)
 		lzma_nothrow;
+
+
+/**
+ * \brief       Single-call .xz Block decoder that decodes in place
+ *
+ * This is like lzma_block_buffer_decode() but the input and output are
+ * in the same buffer. The decoded data is written to buf[*out_pos] and
+ * onwards while the compressed data is read from buf[*in_pos] and onwards.
+ * The decoder never writes to the part of the buffer that hasn't been
+ * read yet. If the output would get there, decoding fails with
+ * LZMA_BUF_ERROR.
+ *
+ * Usually the compressed Block is placed at the end of the buffer and
+ * the decoded data is written to the beginning of the buffer. See
+ * lzma_block_inplace_margin() for how big the buffer has to be.
+ *
+ * Like with lzma_block_buffer_decode(), the Block Header must have been
+ * decoded already. It may be in the same buffer since it isn't needed
+ * after lzma_block_header_decode() has returned.
+ *
+ * \param       block       Block options
+ * \param       allocator   lzma_allocator for custom allocator functions.
+ *                          Set to NULL to use malloc() and free().
+ * \param       buf         Beginning of the buffer
+ * \param       in_pos      The next byte will be read from buf[*in_pos].
+ *                          *in_pos is updated only if decoding succeeds.
+ * \param       in_size     The first byte that won't be read is
+ *                          buf[in_size].
+ * \param[out]  out_pos     The next byte will be written to buf[*out_pos].
+ *                          *out_pos is updated only if decoding succeeds.
+ *                          *out_pos must not be greater than *in_pos.
+ * \param       out_size    The first byte into which no data is written
+ *                          to is buf[out_size].
+ *
+ * \return      Possible lzma_ret values:
+ *              - LZMA_OK: Decoding was successful.
+ *              - LZMA_OPTIONS_ERROR
+ *              - LZMA_DATA_ERROR
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_BUF_ERROR: Output buffer was too small or the
+ *                output would have overwritten input that hasn't
+ *                been read yet.
+ *              - LZMA_PROG_ERROR
+ *
+ *              On error, the compressed data in the buffer may have been
+ *              overwritten.
+ */
+extern LZMA_API(lzma_ret) lzma_block_buffer_decode_inplace(
+		lzma_block *block, const lzma_allocator *allocator,
+		uint8_t *buf, size_t *in_pos, size_t in_size,
+		size_t *out_pos, size_t out_size)
+		lzma_nothrow;
@@ -58,6 +58,15 @@
 #define LZMA_PRESET_EXTREME       (UINT32_C(1) << 31)
 
 
+/**
+ * \brief       Pool of worker threads shared by multithreaded coders
+ *
+ * This is an opaque type. Use lzma_thread_pool_init() to create a pool
+ * and lzma_thread_pool_end() to free it. See lzma_mt.thread_pool.
+ */
+typedef struct lzma_thread_pool_s lzma_thread_pool;
+
+
 /**
  * \brief       Multithreading options
  */
@@ -67,7 +76,12 @@ typedef struct {
 	 *
 	 * Set this to zero if no flags are wanted.
 	 *
-	 * Encoder: No flags are currently supported.
+	 * Encoder: Bitwise-or of zero or more of the encoder flags:
+	 * - LZMA_MT_USE_PART_SIZE
+	 * - LZMA_MT_USE_THREAD_POOL
+	 * - LZMA_MT_DIRECT_INPUT
+	 * - LZMA_MT_USE_NOTIFY
+	 * - LZMA_MT_NUMA
 	 *
 	 * Decoder: Bitwise-or of zero or more of the decoder flags:
 	 * - LZMA_TELL_NO_CHECK
@@ -76,9 +90,115 @@ typedef struct {
 	 * - LZMA_IGNORE_CHECK
 	 * - LZMA_CONCATENATED
 	 * - LZMA_FAIL_FAST
+	 * - LZMA_MT_USE_THREAD_POOL
+	 * - LZMA_MT_USE_NOTIFY
+	 * - LZMA_MT_NUMA
+	 * - LZMA_MT_USE_INDEX
+	 * - LZMA_MT_SPLIT_BLOCKS
 	 */
 	uint32_t flags;
 
+	/**
+	 * \brief       Encoder flag: Use lzma_mt.part_size
+	 *
+	 * lzma_mt.part_size replaced a reserved member that applications
+	 * were allowed to leave uninitialized. The encoder reads part_size
+	 * only if this flag is set.
+	 */
+#	define LZMA_MT_USE_PART_SIZE UINT32_C(0x100)
+
+	/**
+	 * \brief       Encoder and decoder flag: Use lzma_mt.thread_pool
+	 *
+	 * lzma_mt.thread_pool replaced a reserved member that applications
+	 * were allowed to leave uninitialized. It is read only if this
+	 * flag is set.
+	 */
+#	define LZMA_MT_USE_THREAD_POOL UINT32_C(0x200)
+
+	/**
+	 * \brief       Encoder flag: Read the input directly from the
+	 *              application's buffer
+	 *
+	 * Normally the multithreaded encoder copies the input into
+	 * a buffer of each worker thread. With this flag the worker
+	 * threads read the input from the buffer given in next_in
+	 * instead, which saves one input buffer per thread and the
+	 * cost of copying.
+	 *
+	 * The application must keep all the input given to the encoder
+	 * valid and unmodified until lzma_code() has returned
+	 * LZMA_STREAM_END with LZMA_FULL_FLUSH or LZMA_FINISH, or until
+	 * lzma_end() has been called. This is the case, for example,
+	 * when the whole input is in memory or is memory-mapped.
+	 *
+	 * If the input of a Block isn't contiguous in memory (next_in of
+	 * a lzma_code() call doesn't continue where the earlier input
+	 * ended), the input of that Block is copied into a buffer which
+	 * is allocated when needed. Such allocations aren't included in
+	 * lzma_stream_encoder_mt_memusage().
+	 */
+#	define LZMA_MT_DIRECT_INPUT UINT32_C(0x400)
+
+	/**
+	 * \brief       Encoder and decoder flag: Use lzma_mt.notify
+	 *
+	 * lzma_mt.notify and lzma_mt.notify_opaque replaced reserved
+	 * members that applications were allowed to leave uninitialized.
+	 * They are read only if this flag is set.
+	 */
+#	define LZMA_MT_USE_NOTIFY UINT32_C(0x800)
+
+	/**
+	 * \brief       Encoder and decoder flag: Spread the worker threads
+	 *              across NUMA nodes
+	 *
+	 * On Linux systems that have more than one NUMA node with
+	 * processors that the process is allowed to use, each worker
+	 * thread is pinned to the processors of one node so that the
+	 * threads are spread evenly across the nodes. The encoder
+	 * allocates and initializes the match finder and other encoder
+	 * state in the worker thread, so under the default memory policy
+	 * that memory comes from the node of the thread. The decoder
+	 * does the same for the dictionary buffer.
+	 *
+	 * The nodes are detected at runtime from /sys/devices/system/node.
+	 * If the information isn't available or there is only one node,
+	 * or on other operating systems, this flag does nothing. This flag
+	 * is ignored also when LZMA_MT_USE_THREAD_POOL is used because
+	 * the threads of a pool aren't owned by a single coder.
+	 */
+#	define LZMA_MT_NUMA UINT32_C(0x1000)
+
+	/**
+	 * \brief       Decoder flag: Use lzma_mt.index
+	 *
+	 * lzma_mt.index replaced a reserved member that applications
+	 * were allowed to leave uninitialized. It is read only if this
+	 * flag is set.
+	 */
+#	define LZMA_MT_USE_INDEX UINT32_C(0x2000)
+
+	/**
+	 * \brief       Decoder flag: Decode parts of a Block in parallel
+	 *
+	 * Normally one Block is decoded by one thread. If the only filter
+	 * of a Block is LZMA2 and the LZMA2 data resets the dictionary
+	 * in the middle of the Block, the parts between the resets can be
+	 * decoded independently. With this flag such parts are given to
+	 * different worker threads. This makes it possible to decode big
+	 * Blocks in parallel if the encoder used LZMA_MF_RESET_INTERVAL.
+	 *
+	 * A Block is decoded like without this flag until a second chunk
+	 * that resets the dictionary is found, so Blocks without such resets
+	 * are unaffected. The later parts of a split Block are given to
+	 * worker threads only once all of their input has been received,
+	 * and the calling thread calculates the integrity check of these
+	 * parts. Thus with truncated input the output of a split Block
+	 * can end earlier than without this flag.
+	 */
+#	define LZMA_MT_SPLIT_BLOCKS UINT32_C(0x4000)
+
 	/**
 	 * \brief       Number of worker threads to use
 	 */
@@ -235,25 +355,383 @@ typedef struct {
 	 */
 	uint64_t memlimit_stop;
 
-	/** \private     Reserved member. */
-	uint64_t reserved_int7;
+	/**
+	 * \brief       Encoder only: Split Blocks into parts encoded in parallel
+	 *
+	 * By default every Block is compressed by a single worker thread,
+	 * so the encoder scales only by splitting the input into many
+	 * independent Blocks. Small Blocks hurt the compression ratio and
+	 * big Blocks need a lot of memory per thread.
+	 *
+	 * If part_size is non-zero and less than block_size, each Block
+	 * is split into parts of part_size bytes of uncompressed data and
+	 * the parts are compressed by different worker threads. Each worker
+	 * primes its match finder with up to dict_size bytes of the input
+	 * that precedes its part in the same Block, the same way a preset
+	 * dictionary works. Thus the compression ratio stays close to that
+	 * of single-threaded compression even though a single Block is
+	 * compressed using many threads. The resulting Block is a normal
+	 * LZMA2 Block that every .xz decoder can decompress.
+	 *
+	 * Notes:
+	 *
+	 *   - The filter chain must consist of LZMA2 only. Otherwise
+	 *     lzma_stream_encoder_mt() will return LZMA_OPTIONS_ERROR.
+	 *
+	 *   - part_size must be at least LZMA_DICT_SIZE_MIN. A value that
+	 *     is a few times the LZMA2 dictionary size is a good start.
+	 *     Smaller parts give more parallelism inside a Block but each
+	 *     part spends time priming the match finder with the history.
+	 *
+	 *   - Blocks that consist of more than one part have no size
+	 *     information in the Block Header. lzma_stream_decoder_mt()
+	 *     decompresses such Blocks in single-threaded mode.
+	 *
+	 *   - For each thread, about dict_size + 3 * part_size bytes of
+	 *     memory will be allocated for buffers in addition to the
+	 *     memory needed by the LZMA2 encoder.
+	 *
+	 * This is read only if LZMA_MT_USE_PART_SIZE is set in
+	 * lzma_mt.flags. Set this to 0 to disable splitting Blocks
+	 * into parts.
+	 *
+	 * Decoder: Ignored.
+	 */
+	uint64_t part_size;
 
 	/** \private     Reserved member. */
 	uint64_t reserved_int8;
 
+	/**
+	 * \brief       Thread pool to run the worker jobs in
+	 *
+	 * By default each multithreaded encoder and decoder creates its
+	 * own worker threads. An application that runs many coders at
+	 * the same time may create one thread pool with
+	 * lzma_thread_pool_init() and let all coders share it. Then the
+	 * total number of threads stays fixed no matter how many coders
+	 * there are.
+	 *
+	 * With a thread pool, lzma_mt.threads is still the maximum number
+	 * of Blocks that one coder works on at the same time and thus it
+	 * still determines the memory usage of the coder. A Block is given
+	 * to the pool once all its input is available, so Blocks of all
+	 * coders get queued fairly in the order their input arrives.
+	 * Throughput of a single coder is usually a little lower than with
+	 * its own threads because a Block cannot be compressed or
+	 * decompressed while its input is still being read.
+	 *
+	 * The pool must not be freed with lzma_thread_pool_end() before
+	 * lzma_end() has been called for every coder that uses the pool.
+	 *
+	 * This is read only if LZMA_MT_USE_THREAD_POOL is set in
+	 * lzma_mt.flags. NULL is the same as not setting the flag.
+	 */
+	lzma_thread_pool *thread_pool;
+
+	/**
+	 * \brief       Callback to tell that lzma_code() can make progress
+	 *
+	 * This makes it possible to use the multithreaded encoder and
+	 * decoder from an event loop without blocking in lzma_code() or
+	 * polling it with a short timeout. If notify is non-NULL:
+	 *
+	 *   - lzma_code() never waits for the worker threads. If it
+	 *     cannot consume more input or produce more output, it
+	 *     returns LZMA_OK immediately. lzma_mt.timeout is ignored.
+	 *
+	 *   - notify(notify_opaque) is called from a worker thread when
+	 *     something happens that may allow lzma_code() to make
+	 *     progress: a worker thread finished a Block (which makes
+	 *     output available or frees input capacity), more output of
+	 *     the Block being read became available, LZMA_SYNC_FLUSH was
+	 *     completed by a worker thread, or an error occurred. The
+	 *     application should then call lzma_code() again. Spurious
+	 *     calls are possible.
+	 *
+	 * The callback may be called after lzma_code() has returned and
+	 * also while lzma_code() is running in another thread. It is
+	 * called with an internal mutex locked, so it must return quickly
+	 * and must not call any liblzma functions with the same lzma_stream.
+	 * A typical callback writes to an eventfd or a pipe that the event
+	 * loop of the application is watching. The callback won't be
+	 * called anymore once lzma_end() has returned.
+	 *
+	 * This is read only if LZMA_MT_USE_NOTIFY is set in lzma_mt.flags.
+	 * NULL is the same as not setting the flag.
+	 */
+	void (*notify)(void *notify_opaque);
+
+	/**
+	 * \brief       Pointer passed to lzma_mt.notify
+	 *
+	 * liblzma doesn't use this for anything else.
+	 */
+	void *notify_opaque;
+
+	/**
+	 * \brief       Index of the input file
+	 *
+	 * The multithreaded decoder can decode a Block in a worker thread
+	 * only if the Block Header stores both the Compressed Size and
+	 * the Uncompressed Size. Some encoders omit them, and then the
+	 * decoder falls back to single-threaded decoding for those Blocks.
+	 *
+	 * If the whole input file is available, the application can read
+	 * the Index first with lzma_file_info_decoder() and pass it here.
+	 * Then the sizes of the Blocks are taken from the Index when they
+	 * are missing from the Block Headers, and such Blocks are decoded
+	 * in parallel too. The sizes are still verified when the Blocks
+	 * are decoded and the Index fields of the input are compared
+	 * against the Blocks like without this option. If a Block Header
+	 * disagrees with this Index or the input has more Blocks than
+	 * this Index, decoding fails with LZMA_DATA_ERROR.
+	 *
+	 * The Index must describe the input starting from the first Stream
+	 * given to this decoder. It may describe more Streams than will be
+	 * decoded. It must not be modified or freed until lzma_end() has
+	 * been called or the decoder has been reinitialized.
+	 *
+	 * This is read only if LZMA_MT_USE_INDEX is set in lzma_mt.flags.
+	 * NULL is the same as not setting the flag. The encoder ignores
+	 * this.
+	 */
+	const struct lzma_index_s *index;
+
+} lzma_mt;
+
+
+/**
+ * \brief       Create a pool of worker threads
+ *
+ * The pool can be shared by any number of multithreaded encoders and
+ * decoders, see lzma_mt.thread_pool. The threads are created immediately
+ * and they wait until the coders give them work.
+ *
+ * \param       threads     Number of threads in the pool. This should
+ *                          usually be the same as lzma_cputhreads().
+ * \param       allocator   lzma_allocator for custom allocator
+ *                          functions. Set to NULL to use malloc()
+ *                          and free(). The same allocator must be
+ *                          passed to lzma_thread_pool_end().
+ *
+ * \return      Pointer to a new thread pool, or NULL if threads is zero
+ *              or greater than LZMA_THREADS_MAX, if memory allocation
+ *              fails, or if creating the threads fails.
+ */
+extern LZMA_API(lzma_thread_pool *) lzma_thread_pool_init(
+		uint32_t threads, const lzma_allocator *allocator)
+		lzma_nothrow;
+
+
+/**
+ * \brief       Free a thread pool
+ *
+ * This waits for the threads of the pool to exit. Every coder that uses
+ * the pool must have been ended with lzma_end() before calling this.
+ *
+ * \param       pool        Thread pool to free. If NULL, this does
+ *                          nothing.
+ * \param       allocator   lzma_allocator that was given to
+ *                          lzma_thread_pool_init()
+ */
+extern LZMA_API(void) lzma_thread_pool_end(
+		lzma_thread_pool *pool, const lzma_allocator *allocator)
+		lzma_nothrow;
+
+
+/**
+ * \brief       Statistics of one worker thread of a multithreaded coder
+ *
+ * The times are in microseconds and the counters are totals since
+ * the coder was initialized. The sum of the times is the time that
+ * has passed since the thread was started.
+ *
+ * With a thread pool (lzma_mt.thread_pool), the statistics are kept
+ * per Block slot instead of per thread: busy_usec is the time spent
+ * running jobs of the coder and the rest of the time is idle_usec.
+ *
+ * The decoder ends its worker threads when it switches to single-threaded
+ * mode to decode a Block, for example, because of memlimit_threading or
+ * because the Block Header doesn't store the sizes. The statistics of those
+ * threads are lost then.
+ */
+typedef struct {
+	/** \brief      Time spent encoding or decoding */
+	uint64_t busy_usec;
+
+	/** \brief      Time spent waiting for a new Block to work on */
+	uint64_t idle_usec;
+
+	/**
+	 * \brief       Time spent waiting for more input of the current Block
+	 *
+	 * The main thread gives input to the worker threads as the
+	 * application passes it to lzma_code(). A large value means that
+	 * the application doesn't provide input as fast as the threads
+	 * could process it.
+	 */
+	uint64_t wait_in_usec;
+
+	/**
+	 * \brief       Number of Blocks finished by this thread
+	 *
+	 * When the encoder splits Blocks into parts (lzma_mt.part_size)
+	 * or the decoder decodes parts of Blocks in parallel
+	 * (LZMA_MT_SPLIT_BLOCKS), this counts the parts.
+	 */
+	uint64_t blocks;
+
+	/** \brief      Amount of uncompressed data processed */
+	uint64_t uncompressed_size;
+
+	/** \brief      Amount of compressed data processed */
+	uint64_t compressed_size;
+
 	/** \private     Reserved member. */
-	void *reserved_ptr1;
+	uint64_t reserved_int1;
 
 	/** \private     Reserved member. */
-	void *reserved_ptr2;
+	uint64_t reserved_int2;
 
 	/** \private     Reserved member. */
-	void *reserved_ptr3;
+	uint64_t reserved_int3;
 
 	/** \private     Reserved member. */
-	void *reserved_ptr4;
+	uint64_t reserved_int4;
 
-} lzma_mt;
+} lzma_mt_thread_stats;
+
+
+/**
+ * \brief       Statistics of a multithreaded coder
+ *
+ * The times are in microseconds. They and the counters are totals since
+ * the coder was initialized.
+ */
+typedef struct {
+	/**
+	 * \brief       Number of worker threads
+	 *
+	 * Threads are created only when they are needed, so this can be
+	 * less than lzma_mt.threads. This is also the number of elements
+	 * that lzma_mt_get_stats() can fill in its thread_stats array.
+	 */
+	uint32_t threads;
+
+	/** \brief      Number of buffers in the output queue */
+	uint32_t outq_bufs;
+
+	/**
+	 * \brief       Highest number of buffers in the output queue
+	 *
+	 * If this has reached outq_bufs_limit, the worker threads have
+	 * sometimes been idle because the output queue was full, that is,
+	 * the oldest Block wasn't finished or its output wasn't read.
+	 */
+	uint32_t outq_bufs_peak;
+
+	/** \brief      Maximum number of buffers in the output queue */
+	uint32_t outq_bufs_limit;
+
+	/**
+	 * \brief       Memory used by the buffers in the output queue
+	 *
+	 * This is the size of the buffers that hold output which hasn't
+	 * been read by lzma_code() yet.
+	 */
+	uint64_t outq_mem_in_use;
+
+	/**
+	 * \brief       Memory allocated by the output queue
+	 *
+	 * This includes the cached buffers that are ready to be reused.
+	 */
+	uint64_t outq_mem_allocated;
+
+	/**
+	 * \brief       Time lzma_code() has waited to start a new Block
+	 *
+	 * This is the time spent waiting for a free worker thread and
+	 * a free buffer in the output queue. A large value means that the
+	 * application gives input faster than the threads can process it,
+	 * or that the output queue is full because the application isn't
+	 * reading the output fast enough.
+	 */
+	uint64_t wait_thread_usec;
+
+	/**
+	 * \brief       Time lzma_code() has waited for more output
+	 *
+	 * This is the time spent waiting for the Block at the head of
+	 * the output queue when there was no input that could be given
+	 * to a thread. This is typical when finishing the encoding.
+	 */
+	uint64_t wait_out_usec;
+
+	/**
+	 * \brief       Number of Blocks that waited for memory
+	 *
+	 * Decoder: The number of Blocks whose decoding couldn't be started
+	 * right away because lzma_mt.memlimit_threading would have been
+	 * exceeded even though a thread was available. Such Blocks are
+	 * decoded with fewer threads than requested.
+	 *
+	 * Encoder: Always zero.
+	 */
+	uint64_t memlimit_waits;
+
+	/**
+	 * \brief       Number of Blocks decoded in single-threaded mode
+	 *
+	 * Decoder: The number of Blocks that were decoded in the
+	 * single-threaded mode because decoding them in a worker thread
+	 * would have exceeded lzma_mt.memlimit_threading.
+	 *
+	 * Encoder: Always zero.
+	 */
+	uint64_t memlimit_direct;
+
+	/** \private     Reserved member. */
+	uint64_t reserved_int1;
+
+	/** \private     Reserved member. */
+	uint64_t reserved_int2;
+
+	/** \private     Reserved member. */
+	uint64_t reserved_int3;
+
+	/** \private     Reserved member. */
+	uint64_t reserved_int4;
+
+} lzma_mt_stats;
+
+
+/**
+ * \brief       Get statistics of a multithreaded encoder or decoder
+ *
+ * This can be used to tune lzma_mt.threads, lzma_mt.block_size, and
+ * lzma_mt.memlimit_threading. Like lzma_get_progress(), this may be called
+ * between calls to lzma_code() but not at the same time with it.
+ *
+ * \param       strm            Pointer to lzma_stream that has been
+ *                              initialized with lzma_stream_encoder_mt()
+ *                              or lzma_stream_decoder_mt()
+ * \param[out]  stats           Statistics of the whole coder
+ * \param[out]  thread_stats    Array of thread_stats_count elements for
+ *                              per-thread statistics, or NULL if
+ *                              thread_stats_count is zero. Up to
+ *                              stats->threads elements are filled.
+ * \param       thread_stats_count  Number of elements in thread_stats
+ *
+ * \return      Possible lzma_ret values:
+ *              - LZMA_OK
+ *              - LZMA_PROG_ERROR: strm wasn't initialized with a
+ *                multithreaded coder or the arguments are invalid.
+ */
+extern LZMA_API(lzma_ret) lzma_mt_get_stats(lzma_stream *strm,
+		lzma_mt_stats *stats, lzma_mt_thread_stats *thread_stats,
+		uint32_t thread_stats_count) lzma_nothrow;
 
 
 /**
@@ -398,6 +876,12 @@ extern LZMA_API(lzma_ret) lzma_stream_encoder(lzma_stream *strm,
  * lzma_raw_decoder_memusage(options->filters) to calculate
  * the decompressor memory requirements.
  *
+ * The output buffers of the threads grow as needed. The returned value
+ * assumes that the compressed data is at most about one eighth of the
+ * worst-case size of a Block. If the data compresses poorly, the actual
+ * memory usage can be higher, up to the size of the uncompressed data
+ * of about two Blocks per thread.
+ *
  * \param       options Compression options
  *
  * \return      Number of bytes of memory required for encoding with the
@@ -414,9 +898,21 @@ extern LZMA_API(uint64_t) lzma_stream_encoder_mt_memusage(
  * This provides the functionality of lzma_easy_encoder() and
  * lzma_stream_encoder() as a single function for multithreaded use.
  *
- * The supported actions for lzma_code() are LZMA_RUN, LZMA_FULL_FLUSH,
- * LZMA_FULL_BARRIER, and LZMA_FINISH. Support for LZMA_SYNC_FLUSH might be
- * added in the future.
+ * The supported actions for lzma_code() are LZMA_RUN, LZMA_SYNC_FLUSH,
+ * LZMA_FULL_FLUSH, LZMA_FULL_BARRIER, and LZMA_FINISH.
+ *
+ * With LZMA_SYNC_FLUSH, the Blocks that are still being compressed by
+ * other threads are finished and the Block that got the last input is
+ * flushed in the middle. The Block Header of a Block that has been
+ * flushed this way doesn't contain the Compressed Size and Uncompressed
+ * Size fields, so lzma_stream_decoder_mt() decompresses such Blocks
+ * in single-threaded mode. The filter chain must support LZMA_SYNC_FLUSH.
+ *
+ * A Block cannot be flushed in the middle when Blocks are split into
+ * parts (lzma_mt.part_size) or when a thread pool is used
+ * (lzma_mt.thread_pool). With parts, LZMA_SYNC_FLUSH finishes the current
+ * part instead and the Block continues with the next part. Otherwise
+ * LZMA_SYNC_FLUSH finishes the Block like LZMA_FULL_FLUSH does.
  *
  * \param       strm    Pointer to lzma_stream that is at least initialized
  *                      with LZMA_STREAM_INIT.
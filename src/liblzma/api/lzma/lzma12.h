@@ -99,6 +99,25 @@ typedef enum {
 		 *  - dict_size > 32 MiB: dict_size * 6.5
 		 */
 
+	LZMA_MF_HB4     = 0x24,
+		/**<
+		 * \brief       Hash Buckets with 2-, 3-, and 4-byte hashing
+		 *
+		 * Instead of following a chain through the whole dictionary,
+		 * this keeps the eight most recent positions of every
+		 * 4-byte hash in one 64-byte bucket together with the first
+		 * four bytes of each position. Only the positions whose
+		 * first four bytes match are compared, so this is faster
+		 * than LZMA_MF_HC4, but it finds fewer matches. The
+		 * depth option limits the number of compared positions.
+		 *
+		 * Minimum nice_len: 4
+		 *
+		 * Memory usage:
+		 *  - dict_size <= 32 MiB: dict_size * 9.5
+		 *  - dict_size > 32 MiB: dict_size * 5.5
+		 */
+
 	LZMA_MF_BT2     = 0x12,
 		/**<
 		 * \brief       Binary Tree with 2-byte hashing
@@ -132,11 +151,90 @@ typedef enum {
 } lzma_match_finder;
 
 
+/**
+ * \brief       Flag to run the match finder in a separate thread
+ *
+ * This can be ORed with any of the lzma_match_finder values, for example,
+ * (lzma_match_finder)(LZMA_MF_BT4 | LZMA_MF_THREADED). Then the match
+ * finder runs in its own thread ahead of the encoder, so compressing
+ * a single stream can use two CPU cores even when splitting the input
+ * into independent Blocks isn't acceptable.
+ *
+ * The compressed output is identical with and without this flag. The flag
+ * helps most in LZMA_MODE_NORMAL with binary tree match finders. With
+ * LZMA_MODE_FAST and hash chains the encoder skips most positions, and
+ * running the match finder for every position can be slower than not
+ * using a thread at all.
+ *
+ * Memory usage increases by less than one mebibyte.
+ *
+ * If liblzma was built without threading support, this flag is ignored.
+ */
+#define LZMA_MF_THREADED        UINT32_C(0x100)
+
+
+/**
+ * \brief       Flag to reset the encoder at regular intervals
+ *
+ * This can be ORed with any of the lzma_match_finder values. Then the LZMA2
+ * encoder resets the dictionary, the match finder, and the LZMA state
+ * after every reset_interval bytes of input (see lzma_options_lzma).
+ * The data after a reset doesn't depend on the data before it, so
+ * a decoder can decompress the parts between the resets in parallel.
+ * lzma_stream_decoder_mt() does this with LZMA_MT_SPLIT_BLOCKS for Blocks
+ * that use only the LZMA2 filter. The output is still valid LZMA2 that
+ * all decoders support.
+ *
+ * This flag cannot be used with LZMA_FILTER_LZMA1, LZMA_FILTER_LZMA1EXT,
+ * or LZMA_MF_THREADED. A preset dictionary is used only before the first
+ * reset.
+ */
+#define LZMA_MF_RESET_INTERVAL  UINT32_C(0x200)
+
+
+/**
+ * \brief       Flag to find repeats that are far apart in a big dictionary
+ *
+ * This can be ORed with any of the lzma_match_finder values. Then the
+ * match finder searches only the most recent window_size bytes (see
+ * lzma_options_lzma), and its memory usage depends on window_size instead
+ * of dict_size. Repeats further away, up to dict_size bytes, are found by
+ * a separate long-range match finder:
+ *
+ *  - A rolling hash over 32 bytes marks anchor positions in the input,
+ *    on average one per 256 bytes. Because the anchors depend only on
+ *    the data, the copies of a repeated region get the same anchors.
+ *
+ *  - The most recent position of each anchor hash is kept in a table
+ *    that uses about dict_size / 32 bytes of memory.
+ *
+ *  - At an anchor the earlier position with the same hash is compared
+ *    to the current position. A match of at least 32 bytes is given to
+ *    the encoder if it is longer than the matches from the normal match
+ *    finder. The rest of a long repeat is then encoded with cheap
+ *    repeated matches without running the match finder further.
+ *
+ * The decoder needs the whole dict_size like always, so this is useful
+ * when the decoder can afford a dictionary that is much bigger than what
+ * the normal match finders can afford in the encoder: for example, disk
+ * images and backups with repeats hundreds of mebibytes apart. Only
+ * regions that repeat for at least a few hundred bytes are found this way.
+ *
+ * The encoder needs dict_size * 1.5 bytes for the history buffer,
+ * dict_size / 32 bytes for the anchor table, and the memory usage of
+ * the match finder calculated with window_size as the dictionary size.
+ */
+#define LZMA_MF_LONG_RANGE      UINT32_C(0x400)
+
+
 /**
  * \brief       Test if given match finder is supported
  *
  * It is safe to call this with a value that isn't listed in
  * lzma_match_finder enumeration; the return value will be false.
+ * The flags LZMA_MF_THREADED, LZMA_MF_RESET_INTERVAL, and
+ * LZMA_MF_LONG_RANGE may be ORed into match_finder. The return value is
+ * false if the flags cannot be used together.
  *
  * There is no way to list which match finders are available in this
  * particular liblzma version and build. It would be useless, because
@@ -229,15 +327,22 @@ typedef struct {
 	 *  - Available address space (not a problem on 64-bit systems)
 	 *  - Selected match finder (encoder only)
 	 *
-	 * Currently the maximum dictionary size for encoding is 1.5 GiB
-	 * (i.e. (UINT32_C(1) << 30) + (UINT32_C(1) << 29)) even on 64-bit
-	 * systems for certain match finder implementation reasons. In the
-	 * future, there may be match finders that support bigger
-	 * dictionaries.
-	 *
-	 * Decoder already supports dictionaries up to 4 GiB - 1 B (i.e.
+	 * The maximum dictionary size for encoding is 3.5 GiB (i.e.
+	 * UINT32_C(7) << 29) for certain match finder implementation
+	 * reasons. Older liblzma versions limit it to 1.5 GiB. Big
+	 * dictionaries are usable only on 64-bit systems. The memory usage
+	 * of the encoder is given for each match finder in the
+	 * lzma_match_finder enumeration. Per GiB of dictionary it is
+	 * about 5.5 GiB with LZMA_MF_HC3 and LZMA_MF_HB4, 6.5 GiB with
+	 * LZMA_MF_HC4, and 10.5 GiB with LZMA_MF_BT4. With
+	 * LZMA_MF_LONG_RANGE most of this depends only on window_size.
+	 *
+	 * Decoder supports dictionaries up to 4 GiB - 1 B (i.e.
 	 * UINT32_MAX), so increasing the maximum dictionary size of the
-	 * encoder won't cause problems for old decoders.
+	 * encoder won't cause problems for old decoders. The decoder needs
+	 * only about 1 GiB of memory per GiB of dictionary. Note that
+	 * the LZMA2 properties can only store 3 GiB or 4 GiB - 1 B, so
+	 * a dictionary bigger than 3 GiB needs 4 GiB in the decoder.
 	 *
 	 * Because extremely small dictionaries sizes would have unneeded
 	 * overhead in the decoder, the minimum dictionary size is 4096 bytes.
@@ -481,6 +586,30 @@ typedef struct {
 	 */
 	uint32_t ext_size_high;
 
+	/**
+	 * \brief       For LZMA_FILTER_LZMA2: Bytes of input between resets
+	 *
+	 * This is read only if LZMA_MF_RESET_INTERVAL has been ORed into mf.
+	 * Then this must be at least LZMA_DICT_SIZE_MIN. Each reset costs
+	 * a little compression because the data after the reset cannot
+	 * refer to the data before it, so the interval should be several
+	 * times bigger than dict_size. With a Delta or BCJ filter before
+	 * LZMA2 the interval is counted in the output of that filter.
+	 */
+	uint32_t reset_interval;
+
+	/**
+	 * \brief       Window of the match finder with LZMA_MF_LONG_RANGE
+	 *
+	 * This is read only if LZMA_MF_LONG_RANGE has been ORed into mf.
+	 * The match finder then searches only the most recent window_size
+	 * bytes, and repeats further away are left to the long-range match
+	 * finder. This must be at least LZMA_DICT_SIZE_MIN and at most
+	 * dict_size. The values suitable for dict_size of the presets are
+	 * suitable here too, for example, 8 MiB (1 << 23).
+	 */
+	uint32_t window_size;
+
 	/*
 	 * Reserved space to allow possible future extensions without
 	 * breaking the ABI. You should not touch these, because the names
@@ -489,12 +618,6 @@ typedef struct {
 	 * uninitialized.
 	 */
 
-	/** \private     Reserved member. */
-	uint32_t reserved_int4;
-
-	/** \private     Reserved member. */
-	uint32_t reserved_int5;
-
 	/** \private     Reserved member. */
 	uint32_t reserved_int6;
 
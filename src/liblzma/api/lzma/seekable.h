@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: 0BSD */
+
+/**
+ * \file        lzma/seekable.h
+ * \brief       Random access reading of .xz files
+ * \note        Never include this file directly. Use <lzma.h> instead.
+ *
+ * The seekable decoder reads the Index of an .xz file with
+ * lzma_file_info_decoder() and then decodes only the Block that contains
+ * the requested uncompressed data. Random access is fast only if the file
+ * has been compressed into multiple Blocks, for example, with the
+ * multithreaded encoder or with xz --block-size.
+ *
+ * A file that consists of a single Block, like most files made with
+ * the single-threaded xz, has to be decoded from its beginning to reach
+ * any offset. Such a file can be decoded once to record checkpoints of
+ * the decoder state (see lzma_seekable_options.checkpoint_interval).
+ * The checkpoints can be stored in a separate file and loaded later to
+ * make random access fast.
+ */
+
+#ifndef LZMA_H_INTERNAL
+#	error Never include this file directly. Use <lzma.h> instead.
+#endif
+
+
+/**
+ * \brief       Opaque data type to hold the state of the seekable decoder
+ */
+typedef struct lzma_seekable_s lzma_seekable;
+
+
+/**
+ * \brief       Options for the seekable decoder
+ */
+typedef struct {
+	/**
+	 * \brief       Read callback
+	 *
+	 * This reads exactly size bytes from the absolute position pos
+	 * of the .xz file into buf. The seekable decoder never reads
+	 * beyond lzma_seekable_options.file_size. On success the callback
+	 * must return LZMA_OK. If reading fails, the callback should
+	 * return some other value, for example, LZMA_DATA_ERROR if
+	 * the file is shorter than expected. The value will be returned
+	 * as is by the lzma_seekable function that called the callback.
+	 *
+	 * Without LZMA_SEEKABLE_PREFETCH, the callback is only called
+	 * from lzma_seekable_decoder() and lzma_seekable_read() in the
+	 * thread that called them. With LZMA_SEEKABLE_PREFETCH, the
+	 * callback is called also from a thread created by liblzma,
+	 * possibly at the same time as from the application's thread.
+	 * pread() is an example of a function that is safe to use in
+	 * that case.
+	 */
+	lzma_ret (*read)(void *opaque, uint8_t *buf, size_t size,
+			uint64_t pos);
+
+	/**
+	 * \brief       Pointer passed to lzma_seekable_options.read
+	 *
+	 * liblzma doesn't use this for anything else.
+	 */
+	void *opaque;
+
+	/**
+	 * \brief       Size of the .xz file
+	 */
+	uint64_t file_size;
+
+	/**
+	 * \brief       Memory usage limit
+	 *
+	 * The decoded Index and the Block decoders together may use at
+	 * most this much memory. If the limit is too low for the Index,
+	 * lzma_seekable_decoder() returns LZMA_MEMLIMIT_ERROR. If it is
+	 * too low for a Block, reading from that Block fails with
+	 * LZMA_MEMLIMIT_ERROR. Use UINT64_MAX to effectively disable
+	 * the limiter.
+	 *
+	 * With LZMA_SEEKABLE_PREFETCH, the Block decoder of the prefetch
+	 * thread is counted too. A Block isn't prefetched if its decoder
+	 * doesn't fit within the limit next to the Block decoder used by
+	 * lzma_seekable_read(). If a read needs the memory that
+	 * the prefetch thread is using, it waits for prefetching of
+	 * the current Block to finish.
+	 */
+	uint64_t memlimit;
+
+	/**
+	 * \brief       Flags
+	 *
+	 * Bitwise-or of zero or more of the following decoder flags:
+	 * - LZMA_IGNORE_CHECK
+	 * - LZMA_SEEKABLE_PREFETCH
+	 */
+	uint32_t flags;
+
+	/**
+	 * \brief       Decode the next Block in the background
+	 *
+	 * When a read has been served from the cache, a thread created
+	 * by the seekable decoder decodes the next Block into the cache
+	 * unless it is there already. This speeds up sequential reads.
+	 * The read callback must be thread safe when this flag is used.
+	 *
+	 * This flag has no effect if lzma_seekable_options.cache_size
+	 * is zero or if liblzma was built without threading support.
+	 */
+#	define LZMA_SEEKABLE_PREFETCH UINT32_C(0x100)
+
+	/**
+	 * \brief       Maximum total size of the Block cache
+	 *
+	 * Repeated reads from the same Blocks are fast if the Blocks are
+	 * kept in uncompressed form in memory. This is the maximum total
+	 * uncompressed size of the cached Blocks in bytes. When the cache
+	 * is full, the least recently used Blocks are dropped. Blocks
+	 * that are bigger than this are never cached.
+	 *
+	 * When a Block is cached, the whole Block is decoded on the first
+	 * read from it. The memory used by the cache isn't counted towards
+	 * lzma_seekable_options.memlimit.
+	 *
+	 * Set this to zero to disable the cache.
+	 */
+	uint64_t cache_size;
+
+	/*
+	 * Reserved space to allow possible future extensions without
+	 * breaking the ABI. You should not touch these, because the names
+	 * of these variables may change. These are and will never be used
+	 * with the currently supported options, so it is safe to leave these
+	 * uninitialized.
+	 */
+
+	/** \private     Reserved member. */
+	uint32_t reserved_int1;
+
+	/** \private     Reserved member. */
+	uint32_t reserved_int2;
+
+	/**
+	 * \brief       Distance between new decoder checkpoints
+	 *
+	 * A checkpoint contains the state of the LZMA2 decoder, including
+	 * a copy of its dictionary, at an offset in the middle of a Block.
+	 * Reading from a position after a checkpoint resumes decoding from
+	 * the nearest such checkpoint instead of the beginning of the Block.
+	 *
+	 * When this is non-zero, lzma_seekable_read() saves a checkpoint
+	 * roughly every checkpoint_interval bytes of uncompressed data
+	 * that it decodes. For example, reading the whole file once from
+	 * the beginning to the end creates checkpoints for all of it.
+	 * The checkpoints can be saved with
+	 * lzma_seekable_checkpoints_encode() and loaded into another
+	 * lzma_seekable with lzma_seekable_checkpoints_decode(). Several
+	 * lzma_seekable instances with the same checkpoints can decode
+	 * different parts of a file in parallel.
+	 *
+	 * Checkpoints can be taken only between LZMA2 chunks in Blocks
+	 * whose only filter is LZMA2. A chunk contains at most 2 MiB of
+	 * uncompressed data. Checkpoints aren't used for Blocks that are
+	 * cached (see lzma_seekable_options.cache_size).
+	 *
+	 * Each checkpoint uses about as much memory as the dictionary size
+	 * of the Block (for example, 8 MiB with xz -6) plus 30 KiB. This
+	 * memory isn't counted towards lzma_seekable_options.memlimit.
+	 * A good interval is much bigger than the dictionary size.
+	 *
+	 * Set this to zero to not create new checkpoints.
+	 */
+	uint64_t checkpoint_interval;
+
+	/** \private     Reserved member. */
+	void *reserved_ptr1;
+
+	/** \private     Reserved member. */
+	void *reserved_ptr2;
+
+} lzma_seekable_options;
+
+
+/**
+ * \brief       Initialize a seekable decoder
+ *
+ * The Stream Headers, Stream Footers, and Indexes of the .xz file are
+ * read and validated before this function returns. The Blocks are read
+ * only when lzma_seekable_read() needs them.
+ *
+ * \param[out]  seekable    On success, *seekable is set to point to
+ *                          a new lzma_seekable. Free it with
+ *                          lzma_seekable_end() when it is no longer
+ *                          needed.
+ * \param       options     Read callback and other options. The
+ *                          structure isn't referenced after this
+ *                          function has returned.
+ * \param       allocator   lzma_allocator for custom allocator functions.
+ *                          Set to NULL to use malloc() and free().
+ *                          The same allocator is used until
+ *                          lzma_seekable_end() has been called.
+ *
+ * \return      Possible lzma_ret values:
+ *              - LZMA_OK
+ *              - LZMA_FORMAT_ERROR: The file is not in the .xz format.
+ *              - LZMA_OPTIONS_ERROR: Unsupported flags or Stream Flags
+ *              - LZMA_DATA_ERROR: The file is corrupt.
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_MEMLIMIT_ERROR
+ *              - LZMA_PROG_ERROR
+ *              - An error returned by the read callback
+ */
+extern LZMA_API(lzma_ret) lzma_seekable_decoder(lzma_seekable **seekable,
+		const lzma_seekable_options *options,
+		const lzma_allocator *allocator)
+		lzma_nothrow lzma_attr_warn_unused_result;
+
+
+/**
+ * \brief       Decode uncompressed data from an arbitrary position
+ *
+ * Uncompressed data starting from the offset pos is decoded into
+ * out[*out_pos] and onwards until the output buffer is full or the end
+ * of the uncompressed data is reached. *out_pos is updated to tell how
+ * much output was written. If pos is at or past the end of the
+ * uncompressed data, nothing is written and LZMA_OK is returned.
+ *
+ * Continuing from the position where the previous call stopped doesn't
+ * need to re-decode anything. Otherwise the Block containing pos is
+ * decoded from its beginning, or from the nearest checkpoint before pos,
+ * up to pos. The integrity check of a Block is verified only when the
+ * Block is decoded from its beginning to its end.
+ *
+ * After an error, the next call starts decoding from the beginning
+ * of the Block that contains pos.
+ *
+ * \param       seekable    Pointer to a lzma_seekable from
+ *                          lzma_seekable_decoder()
+ * \param       pos         Uncompressed offset to start reading from
+ * \param[out]  out         Beginning of the output buffer
+ * \param[out]  out_pos     The next byte will be written to out[*out_pos].
+ *                          *out_pos is updated also when an error
+ *                          occurs after some output has been written.
+ * \param       out_size    Size of the out buffer; the first byte into
+ *                          which no data is written to is out[out_size].
+ *
+ * \return      Possible lzma_ret values:
+ *              - LZMA_OK
+ *              - LZMA_OPTIONS_ERROR: The Block uses unsupported options.
+ *              - LZMA_DATA_ERROR: The Block is corrupt.
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_MEMLIMIT_ERROR
+ *              - LZMA_PROG_ERROR
+ *              - An error returned by the read callback
+ */
+extern LZMA_API(lzma_ret) lzma_seekable_read(lzma_seekable *seekable,
+		uint64_t pos, uint8_t *out, size_t *out_pos, size_t out_size)
+		lzma_nothrow lzma_attr_warn_unused_result;
+
+
+/**
+ * \brief       Get the Index of a seekable decoder
+ *
+ * The returned lzma_index contains the combined information of all
+ * Streams in the file. For example, lzma_index_uncompressed_size()
+ * gives the size of the uncompressed data. The lzma_index is owned
+ * by the seekable decoder and must not be modified or freed.
+ *
+ * \param       seekable    Pointer to a lzma_seekable from
+ *                          lzma_seekable_decoder()
+ *
+ * \return      Pointer to the lzma_index of the file
+ */
+extern LZMA_API(const lzma_index *) lzma_seekable_index(
+		const lzma_seekable *seekable)
+		lzma_nothrow lzma_attr_pure;
+
+
+/**
+ * \brief       Free the memory allocated for a seekable decoder
+ *
+ * \param       seekable    Pointer to a lzma_seekable from
+ *                          lzma_seekable_decoder(). If NULL,
+ *                          this does nothing.
+ */
+extern LZMA_API(void) lzma_seekable_end(lzma_seekable *seekable)
+		lzma_nothrow;
+
+
+/**
+ * \brief       Calculate the size of the encoded checkpoints
+ *
+ * \param       seekable    Pointer to a lzma_seekable from
+ *                          lzma_seekable_decoder()
+ *
+ * \return      The number of bytes that lzma_seekable_checkpoints_encode()
+ *              would write
+ */
+extern LZMA_API(uint64_t) lzma_seekable_checkpoints_size(
+		const lzma_seekable *seekable)
+		lzma_nothrow lzma_attr_pure;
+
+
+/**
+ * \brief       Encode the checkpoints of a seekable decoder
+ *
+ * The encoded checkpoints can be stored, for example, in a file next to
+ * the .xz file. They contain the file size and the uncompressed size of
+ * the .xz file so that checkpoints of a wrong file are usually detected
+ * when they are decoded. A CRC32 protects against accidental corruption.
+ *
+ * \param       seekable    Pointer to a lzma_seekable from
+ *                          lzma_seekable_decoder()
+ * \param[out]  out         Beginning of the output buffer
+ * \param[out]  out_pos     The next byte will be written to out[*out_pos].
+ *                          *out_pos is updated only if encoding succeeds.
+ * \param       out_size    Size of the out buffer; the first byte into
+ *                          which no data is written to is out[out_size].
+ *
+ * \return      Possible lzma_ret values:
+ *              - LZMA_OK: Encoding was successful.
+ *              - LZMA_BUF_ERROR: Output buffer is too small. Use
+ *                lzma_seekable_checkpoints_size() to find out how much
+ *                output space is needed.
+ *              - LZMA_PROG_ERROR
+ */
+extern LZMA_API(lzma_ret) lzma_seekable_checkpoints_encode(
+		const lzma_seekable *seekable,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+		lzma_nothrow lzma_attr_warn_unused_result;
+
+
+/**
+ * \brief       Load encoded checkpoints into a seekable decoder
+ *
+ * The checkpoints replace the existing checkpoints of the seekable
+ * decoder. New checkpoints are still created if
+ * lzma_seekable_options.checkpoint_interval is non-zero.
+ *
+ * Only the positions of the checkpoints are validated here. If the
+ * decoder state in a checkpoint is invalid, lzma_seekable_read()
+ * returns LZMA_DATA_ERROR when it tries to use the checkpoint.
+ *
+ * \param       seekable    Pointer to a lzma_seekable from
+ *                          lzma_seekable_decoder()
+ * \param       in          Beginning of the input buffer
+ * \param       in_pos      The next byte will be read from in[*in_pos].
+ *                          *in_pos is updated only if decoding succeeds.
+ * \param       in_size     Size of the input buffer; the first byte that
+ *                          won't be read is in[in_size].
+ *
+ * \return      Possible lzma_ret values:
+ *              - LZMA_OK: Decoding was successful.
+ *              - LZMA_FORMAT_ERROR: The input doesn't begin with the
+ *                magic bytes of encoded checkpoints.
+ *              - LZMA_DATA_ERROR: The input is truncated or corrupt,
+ *                or the checkpoints are for a different file.
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_PROG_ERROR
+ */
+extern LZMA_API(lzma_ret) lzma_seekable_checkpoints_decode(
+		lzma_seekable *seekable,
+		const uint8_t *in, size_t *in_pos, size_t in_size)
+		lzma_nothrow lzma_attr_warn_unused_result;
+
@@ -57,7 +57,7 @@ auto_decode(void *coder_ptr, const lzma_allocator *allocator,
 		if (in[*in_pos] == 0xFD) {
 			return_if_error(lzma_stream_decoder_init(
 					&coder->next, allocator,
-					coder->memlimit, coder->flags));
+					coder->memlimit, coder->flags, false));
 #ifdef HAVE_LZIP_DECODER
 		} else if (in[*in_pos] == 0x4C) {
 			return_if_error(lzma_lzip_decoder_init(
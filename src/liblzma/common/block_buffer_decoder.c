@@ -23,10 +23,11 @@ lzma_block_buffer_decode(lzma_block *block, const lzma_allocator *allocator,
 			|| *out_pos > out_size)
 		return LZMA_PROG_ERROR;
 
-	// Initialize the Block decoder.
+	// Initialize the Block decoder. The whole output is decoded
+	// to out[] in one call, so it can be used as the dictionary.
 	lzma_next_coder block_decoder = LZMA_NEXT_CODER_INIT;
 	lzma_ret ret = lzma_block_decoder_init(
-			&block_decoder, allocator, block);
+			&block_decoder, allocator, block, true);
 
 	if (ret == LZMA_OK) {
 		// Save the positions so that we can restore them in case
@@ -77,3 +78,70 @@ lzma_block_buffer_decode(lzma_block *block, const lzma_allocator *allocator,
 
 	return ret;
 }
+
+
+extern LZMA_API(lzma_ret)
+lzma_block_buffer_decode_inplace(lzma_block *block,
+		const lzma_allocator *allocator, uint8_t *buf,
+		size_t *in_pos, size_t in_size,
+		size_t *out_pos, size_t out_size)
+{
+	if (buf == NULL || in_pos == NULL || *in_pos > in_size
+			|| out_pos == NULL || *out_pos > out_size
+			|| *out_pos > *in_pos)
+		return LZMA_PROG_ERROR;
+
+	// The output is written directly to buf[] so it can be used as
+	// the dictionary like in lzma_block_buffer_decode(). The data
+	// before buf[*in_pos] has been copied into the internal state of
+	// the decoder already.
+	lzma_next_coder block_decoder = LZMA_NEXT_CODER_INIT;
+	lzma_ret ret = lzma_block_decoder_init(
+			&block_decoder, allocator, block, true);
+
+	const size_t in_start = *in_pos;
+	const size_t out_start = *out_pos;
+
+	while (ret == LZMA_OK) {
+		// Never let the output overwrite input that hasn't been
+		// read yet. In each call the output may only go up to
+		// the input position where the call started. Passing
+		// the two parts of the buffer separately keeps them
+		// from overlapping.
+		const size_t in_old = *in_pos;
+		const size_t out_old = *out_pos;
+		size_t in_used = 0;
+
+		ret = block_decoder.code(block_decoder.coder, allocator,
+				buf + in_old, &in_used, in_size - in_old,
+				buf, out_pos, my_min(out_size, in_old),
+				LZMA_FINISH);
+		*in_pos += in_used;
+
+		if (ret == LZMA_OK && in_used == 0 && *out_pos == out_old) {
+			// No progress. If all the input was consumed, the
+			// input is truncated. Otherwise the output buffer
+			// is too small or the output would overwrite the
+			// input that hasn't been decoded yet. See the
+			// comment in lzma_block_buffer_decode().
+			if (*in_pos == in_size)
+				ret = LZMA_DATA_ERROR;
+			else
+				ret = LZMA_BUF_ERROR;
+		}
+	}
+
+	if (ret == LZMA_STREAM_END) {
+		ret = LZMA_OK;
+	} else {
+		// The compressed data may have been overwritten but
+		// the positions are restored like in the other
+		// single-call functions.
+		*in_pos = in_start;
+		*out_pos = out_start;
+	}
+
+	lzma_next_end(&block_decoder, allocator);
+
+	return ret;
+}
@@ -84,6 +84,42 @@ lzma_block_buffer_bound(size_t uncompressed_size)
 }
 
 
+extern LZMA_API(size_t)
+lzma_block_inplace_margin(size_t uncompressed_size)
+{
+	if (uncompressed_size > COMPRESSED_SIZE_MAX)
+		return 0;
+
+	// The output of the in-place decoder gets closest to the input
+	// that hasn't been read yet when the end of the data expands.
+	// The margin must cover the worst case:
+	//
+	//   - The rest of the current LZMA2 chunk doesn't compress at all.
+	//     The compressed part of a chunk is at most LZMA2_CHUNK_MAX
+	//     bytes.
+	//
+	//   - The following chunks add their headers to the size. Each
+	//     chunk except the last one has at least about
+	//     LZMA2_CHUNK_MAX bytes of uncompressed data and the headers
+	//     are at most LZMA2_HEADER_MAX bytes. Using 1/4096 of the
+	//     uncompressed size leaves plenty of room for rounding.
+	//
+	//   - The end marker of LZMA2, Block Padding, and the Check field
+	//     don't produce any output. HEADERS_BOUND is bigger than
+	//     these.
+	const uint64_t margin = (uint64_t)(uncompressed_size) / 4096
+			+ LZMA2_CHUNK_MAX + HEADERS_BOUND;
+
+#if SIZE_MAX < UINT64_MAX
+	// Catch the possible integer overflow on 32-bit systems.
+	if (margin > SIZE_MAX - uncompressed_size)
+		return 0;
+#endif
+
+	return (size_t)margin;
+}
+
+
 static lzma_ret
 block_encode_uncompressed(lzma_block *block, const uint8_t *in, size_t in_size,
 		uint8_t *out, size_t *out_pos, size_t out_size)
@@ -50,6 +50,10 @@ typedef struct {
 
 	/// True if the integrity check won't be calculated and verified.
 	bool ignore_check;
+
+	/// True if the input of the filter chain ends early with an end
+	/// marker added by the caller. See lzma_block_decoder_truncate().
+	bool truncated;
 } lzma_block_coder;
 
 
@@ -132,6 +136,10 @@ block_decode(void *coder_ptr, const lzma_allocator *allocator,
 		if (ret != LZMA_STREAM_END)
 			return ret;
 
+		// The rest of the Block isn't decoded by us.
+		if (coder->truncated)
+			return LZMA_STREAM_END;
+
 		// Compressed and Uncompressed Sizes are now at their final
 		// values. Verify that they match the values given to us.
 		if (!is_size_valid(coder->compressed_size,
@@ -211,7 +219,7 @@ block_decoder_end(void *coder_ptr, const lzma_allocator *allocator)
 
 extern lzma_ret
 lzma_block_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
-		lzma_block *block)
+		lzma_block *block, bool out_as_dict)
 {
 	lzma_next_coder_init(&lzma_block_decoder_init, next, allocator);
 
@@ -268,19 +276,46 @@ lzma_block_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	coder->ignore_check = block->version >= 1
 			? block->ignore_check : false;
 
+	coder->truncated = false;
+
 	// Initialize the filter chain.
 	return lzma_raw_decoder_init(&coder->next, allocator,
-			block->filters);
+			block->filters, out_as_dict);
 }
 
 
 extern LZMA_API(lzma_ret)
 lzma_block_decoder(lzma_stream *strm, lzma_block *block)
 {
-	lzma_next_strm_init(lzma_block_decoder_init, strm, block);
+	lzma_next_strm_init(lzma_block_decoder_init, strm, block, false);
 
 	strm->internal->supported_actions[LZMA_RUN] = true;
 	strm->internal->supported_actions[LZMA_FINISH] = true;
 
 	return LZMA_OK;
 }
+
+
+extern lzma_next_coder *
+lzma_block_decoder_filters(lzma_next_coder *next)
+{
+	lzma_block_coder *coder = next->coder;
+	return &coder->next;
+}
+
+
+extern void
+lzma_block_decoder_truncate(lzma_next_coder *next)
+{
+	lzma_block_coder *coder = next->coder;
+	coder->truncated = true;
+	return;
+}
+
+
+extern const lzma_check_state *
+lzma_block_decoder_check(const lzma_next_coder *next)
+{
+	const lzma_block_coder *coder = next->coder;
+	return &coder->check;
+}
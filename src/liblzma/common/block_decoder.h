@@ -13,9 +13,28 @@
 #define LZMA_BLOCK_DECODER_H
 
 #include "common.h"
+#include "check.h"
 
 
+/// Initialize a Block decoder. See lzma_raw_decoder_init() about
+/// out_as_dict.
 extern lzma_ret lzma_block_decoder_init(lzma_next_coder *next,
-		const lzma_allocator *allocator, lzma_block *block);
+		const lzma_allocator *allocator, lzma_block *block,
+		bool out_as_dict);
+
+/// Get the raw decoder of the filter chain of a Block decoder
+extern lzma_next_coder *lzma_block_decoder_filters(lzma_next_coder *next);
+
+/// Tell the Block decoder that the input of the filter chain ends with
+/// an end marker before the end of the Block. When the filter chain
+/// returns LZMA_STREAM_END, the Block decoder returns it too without
+/// comparing the sizes to the Block Header or reading Block Padding
+/// and Check.
+extern void lzma_block_decoder_truncate(lzma_next_coder *next);
+
+/// Get the integrity check state of the output decoded so far. It hasn't
+/// been finished with lzma_check_finish(), so more data can be added to it.
+extern const lzma_check_state *lzma_block_decoder_check(
+		const lzma_next_coder *next);
 
 #endif
@@ -12,6 +12,12 @@
 #include "common.h"
 
 
+#ifdef MYTHREAD_ATOMIC_MUTEX
+// Only POSIX threads can get here. See mythread.h.
+mythread_mutex lzma_mythread_atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
 /////////////
 // Version //
 /////////////
@@ -431,6 +437,23 @@ lzma_get_check(const lzma_stream *strm)
 }
 
 
+extern LZMA_API(lzma_ret)
+lzma_mt_get_stats(lzma_stream *strm, lzma_mt_stats *stats,
+		lzma_mt_thread_stats *thread_stats,
+		uint32_t thread_stats_count)
+{
+	if (strm == NULL || strm->internal == NULL
+			|| strm->internal->next.get_mt_stats == NULL
+			|| stats == NULL
+			|| (thread_stats == NULL && thread_stats_count != 0))
+		return LZMA_PROG_ERROR;
+
+	strm->internal->next.get_mt_stats(strm->internal->next.coder,
+			stats, thread_stats, thread_stats_count);
+	return LZMA_OK;
+}
+
+
 extern LZMA_API(uint64_t)
 lzma_memusage(const lzma_stream *strm)
 {
@@ -124,6 +124,15 @@
 #	define unlikely(expr) (expr)
 #endif
 
+// Hint the processor to start loading the cache line at the given address.
+// This is only a hint and doesn't change the behavior of the program but
+// the address must still point within an allocated buffer.
+#ifdef __GNUC__
+#	define lzma_prefetch(addr) __builtin_prefetch(addr)
+#else
+#	define lzma_prefetch(addr) ((void)(addr))
+#endif
+
 
 /// Size of temporary buffers needed in some filters
 #define LZMA_BUFFER_SIZE 4096
@@ -215,6 +224,13 @@ struct lzma_filter_info_s {
 
 	/// Pointer to filter's options structure
 	void *options;
+
+	/// Decoder only: True if the output of this filter goes directly
+	/// to a buffer that will hold all of the output, the same buffer
+	/// is given in every call, and the data already written to it
+	/// isn't modified. Then an LZ-based decoder can use the output
+	/// buffer as its dictionary instead of allocating one.
+	bool out_as_dict;
 };
 
 
@@ -270,6 +286,12 @@ struct lzma_next_coder_s {
 	/// seen, LZMA_OK is allowed too.
 	lzma_ret (*set_out_limit)(void *coder, uint64_t *uncomp_size,
 			uint64_t out_limit);
+
+	/// Get statistics of a multithreaded coder. This is NULL in
+	/// other coders.
+	void (*get_mt_stats)(void *coder, lzma_mt_stats *stats,
+			lzma_mt_thread_stats *thread_stats,
+			uint32_t thread_stats_count);
 };
 
 
@@ -286,6 +308,7 @@ struct lzma_next_coder_s {
 		.memconfig = NULL, \
 		.update = NULL, \
 		.set_out_limit = NULL, \
+		.get_mt_stats = NULL, \
 	}
 
 
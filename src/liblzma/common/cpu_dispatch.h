@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       cpu_dispatch.h
+/// \brief      Runtime selection of x86 SIMD code
+///
+/// Some speed-critical functions are built more than once: once for the
+/// instruction set allowed by the compiler flags, once for processors that
+/// support AVX2, BMI1, and BMI2, and possibly once more for processors that
+/// also support AVX-512F and AVX-512BW. The variant to use is selected when
+/// a coder is initialized so that generic binaries can use the faster code.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_CPU_DISPATCH_H
+#define LZMA_CPU_DISPATCH_H
+
+#include "common.h"
+
+// HAVE_USABLE_AVX2 means that the build system checked that the target
+// attribute works with the AVX2 intrinsics and that <cpuid.h> and XGETBV
+// are available. EDG-based compilers can define __GNUC__ but the attribute
+// must not be used with them.
+//
+// NOTE: Build systems check for this too, keep them in sync with this.
+#if defined(HAVE_USABLE_AVX2) && defined(HAVE_CPUID_H) \
+		&& (defined(__GNUC__) || defined(__clang__)) \
+		&& !defined(__EDG__)
+#	define LZMA_AVX2_DISPATCH 1
+
+// The AVX-512BW variants are only built if the AVX2 variants are built too.
+#	ifdef HAVE_USABLE_AVX512BW
+#		define LZMA_AVX512BW_DISPATCH 1
+#	endif
+#endif
+
+
+#ifdef LZMA_AVX2_DISPATCH
+#include <immintrin.h>
+#include <cpuid.h>
+
+#define lzma_attr_avx2 __attribute__((__target__("avx2,bmi,bmi2")))
+
+#ifdef LZMA_AVX512BW_DISPATCH
+#	define lzma_attr_avx512bw __attribute__((__target__( \
+		"avx2,bmi,bmi2,avx512f,avx512bw")))
+#endif
+
+
+/// Returns true if both the processor and the operating system support
+/// AVX2, BMI1, and BMI2.
+///
+/// This runs CPUID every time. It's only called when initializing coders
+/// so caching the result wouldn't be worth the extra code.
+static inline bool
+lzma_avx2_is_supported(void)
+{
+	uint32_t r[4]; // eax, ebx, ecx, edx
+
+	// OSXSAVE (bit 27 in ecx) and AVX (bit 28 in ecx)
+	const uint32_t ecx_mask = (UINT32_C(1) << 27) | (UINT32_C(1) << 28);
+	if (!__get_cpuid(1, &r[0], &r[1], &r[2], &r[3])
+			|| (r[2] & ecx_mask) != ecx_mask)
+		return false;
+
+	// The operating system must save the XMM and YMM registers
+	// (bits 1 and 2 in XCR0) on context switches.
+	uint32_t xcr0;
+	uint32_t xcr0_high;
+	__asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+	if ((xcr0 & 6) != 6)
+		return false;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+
+	// BMI1 (bit 3 in ebx), AVX2 (bit 5 in ebx), and BMI2 (bit 8 in ebx)
+	__cpuid_count(7, 0, r[0], r[1], r[2], r[3]);
+	const uint32_t ebx_mask = (UINT32_C(1) << 3) | (UINT32_C(1) << 5)
+			| (UINT32_C(1) << 8);
+	return (r[1] & ebx_mask) == ebx_mask;
+}
+
+
+#ifdef LZMA_AVX512BW_DISPATCH
+/// Returns true if lzma_avx2_is_supported() is true and both the processor
+/// and the operating system support AVX-512F and AVX-512BW too.
+static inline bool
+lzma_avx512bw_is_supported(void)
+{
+	if (!lzma_avx2_is_supported())
+		return false;
+
+	// The operating system must save the opmask registers and
+	// the upper halves of the ZMM registers (bits 5, 6, and 7 in XCR0).
+	uint32_t xcr0;
+	uint32_t xcr0_high;
+	__asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+	if ((xcr0 & 0xE0) != 0xE0)
+		return false;
+
+	// AVX512F (bit 16 in ebx) and AVX512BW (bit 30 in ebx)
+	uint32_t r[4];
+	__cpuid_count(7, 0, r[0], r[1], r[2], r[3]);
+	const uint32_t ebx_mask = (UINT32_C(1) << 16) | (UINT32_C(1) << 30);
+	return (r[1] & ebx_mask) == ebx_mask;
+}
+#endif
+#endif
+
+#endif
@@ -23,9 +23,12 @@ lzma_raw_buffer_decode(
 			|| out_pos == NULL || *out_pos > out_size)
 		return LZMA_PROG_ERROR;
 
-	// Initialize the decoder.
+	// Initialize the decoder. The output buffer cannot be used as
+	// the dictionary because a different buffer is used below to
+	// check if the output buffer was too small.
 	lzma_next_coder next = LZMA_NEXT_CODER_INIT;
-	return_if_error(lzma_raw_decoder_init(&next, allocator, filters));
+	return_if_error(lzma_raw_decoder_init(&next, allocator, filters,
+			false));
 
 	// Store the positions so that we can restore them if something
 	// goes wrong.
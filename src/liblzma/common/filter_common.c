@@ -297,7 +297,8 @@ lzma_validate_chain(const lzma_filter *filters, size_t *count)
 extern lzma_ret
 lzma_raw_coder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		const lzma_filter *options,
-		lzma_filter_find coder_find, bool is_encoder)
+		lzma_filter_find coder_find, bool is_encoder,
+		bool out_as_dict)
 {
 	// Do some basic validation and get the number of filters.
 	size_t count;
@@ -320,6 +321,7 @@ lzma_raw_coder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 			filters[j].id = options[i].id;
 			filters[j].init = fc->init;
 			filters[j].options = options[i].options;
+			filters[j].out_as_dict = false;
 		}
 	} else {
 		for (size_t i = 0; i < count; ++i) {
@@ -331,6 +333,10 @@ lzma_raw_coder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 			filters[i].id = options[i].id;
 			filters[i].init = fc->init;
 			filters[i].options = options[i].options;
+
+			// Only the first filter writes to the output
+			// buffer of the chain.
+			filters[i].out_as_dict = out_as_dict && i == 0;
 		}
 	}
 
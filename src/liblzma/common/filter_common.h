@@ -40,7 +40,8 @@ extern lzma_ret lzma_validate_chain(const lzma_filter *filters, size_t *count);
 extern lzma_ret lzma_raw_coder_init(
 		lzma_next_coder *next, const lzma_allocator *allocator,
 		const lzma_filter *filters,
-		lzma_filter_find coder_find, bool is_encoder);
+		lzma_filter_find coder_find, bool is_encoder,
+		bool out_as_dict);
 
 
 extern uint64_t lzma_raw_coder_memusage(lzma_filter_find coder_find,
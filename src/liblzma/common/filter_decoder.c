@@ -169,17 +169,50 @@ lzma_filter_decoder_is_supported(lzma_vli id)
 
 extern lzma_ret
 lzma_raw_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
-		const lzma_filter *options)
+		const lzma_filter *options, bool out_as_dict)
 {
 	return lzma_raw_coder_init(next, allocator,
-			options, &coder_find, false);
+			options, &coder_find, false, out_as_dict);
+}
+
+
+extern void
+lzma_raw_decoder_limit_dict(lzma_filter *filters, lzma_vli uncompressed_size)
+{
+	if (uncompressed_size == LZMA_VLI_UNKNOWN)
+		return;
+
+	// LZMA1 and LZMA2 can only be the last filter in the chain and
+	// none of the other filters change the size of the data. Thus
+	// the LZMA decoder never needs a dictionary bigger than the
+	// uncompressed size. The LZ decoder rounds tiny dictionaries
+	// up to LZMA_DICT_SIZE_MIN anyway so don't go below that.
+	const uint32_t limit = uncompressed_size < LZMA_DICT_SIZE_MIN
+			? LZMA_DICT_SIZE_MIN : (uint32_t)my_min(
+				uncompressed_size, UINT32_MAX);
+
+	for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i) {
+		if (filters[i].id != LZMA_FILTER_LZMA1
+				&& filters[i].id != LZMA_FILTER_LZMA1EXT
+				&& filters[i].id != LZMA_FILTER_LZMA2)
+			continue;
+
+		// With a preset dictionary the matches may refer to
+		// data that is before the uncompressed data.
+		lzma_options_lzma *opt = filters[i].options;
+		if (opt != NULL && opt->preset_dict == NULL
+				&& opt->dict_size > limit)
+			opt->dict_size = limit;
+	}
+
+	return;
 }
 
 
 extern LZMA_API(lzma_ret)
 lzma_raw_decoder(lzma_stream *strm, const lzma_filter *options)
 {
-	lzma_next_strm_init(lzma_raw_decoder_init, strm, options);
+	lzma_next_strm_init(lzma_raw_decoder_init, strm, options, false);
 
 	strm->internal->supported_actions[LZMA_RUN] = true;
 	strm->internal->supported_actions[LZMA_FINISH] = true;
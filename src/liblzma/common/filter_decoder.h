@@ -15,8 +15,24 @@
 #include "common.h"
 
 
+/// Initialize a raw decoder. If out_as_dict is true, the caller promises
+/// that the output buffer will hold all of the output, that the same
+/// buffer is given in every call, and that the data already written to
+/// it isn't modified. LZMA1 and LZMA2 decoders can then use the output
+/// buffer as the dictionary.
 extern lzma_ret lzma_raw_decoder_init(
 		lzma_next_coder *next, const lzma_allocator *allocator,
-		const lzma_filter *options);
+		const lzma_filter *options, bool out_as_dict);
+
+/// If uncompressed_size isn't LZMA_VLI_UNKNOWN, reduce the dictionary
+/// size in the LZMA1 and LZMA2 options in the filter chain so that it
+/// isn't bigger than needed to decode uncompressed_size bytes. The filter
+/// options are modified in place so lzma_raw_decoder_memusage() will
+/// return the reduced memory usage too.
+///
+/// The caller must verify that the uncompressed size really is
+/// uncompressed_size, like the Block decoder does.
+extern void lzma_raw_decoder_limit_dict(
+		lzma_filter *filters, lzma_vli uncompressed_size);
 
 #endif
@@ -242,7 +242,7 @@ lzma_raw_encoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		const lzma_filter *filters)
 {
 	return lzma_raw_coder_init(next, allocator,
-			filters, &coder_find, true);
+			filters, &coder_find, true, false);
 }
 
 
@@ -250,7 +250,7 @@ extern LZMA_API(lzma_ret)
 lzma_raw_encoder(lzma_stream *strm, const lzma_filter *filters)
 {
 	lzma_next_strm_init(lzma_raw_coder_init, strm, filters,
-			&coder_find, true);
+			&coder_find, true, false);
 
 	strm->internal->supported_actions[LZMA_RUN] = true;
 	strm->internal->supported_actions[LZMA_SYNC_FLUSH] = true;
@@ -20,5 +20,10 @@ extern lzma_ret lzma_index_decoder_init(lzma_next_coder *next,
 		const lzma_allocator *allocator,
 		lzma_index **i, uint64_t memlimit, uint64_t input_size_max);
 
+extern lzma_ret lzma_file_info_decoder_init(lzma_next_coder *next,
+		const lzma_allocator *allocator, uint64_t *seek_pos,
+		lzma_index **dest_index,
+		uint64_t memlimit, uint64_t file_size);
+
 
 #endif
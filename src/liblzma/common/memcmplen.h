@@ -13,6 +13,7 @@
 #define LZMA_MEMCMPLEN_H
 
 #include "common.h"
+#include "cpu_dispatch.h"
 
 #ifdef HAVE_IMMINTRIN_H
 #	include <immintrin.h>
@@ -48,7 +49,9 @@
 /// \note       LZMA_MEMCMPLEN_EXTRA defines how many extra bytes may be read.
 ///             It's rounded up to 2^n. This extra amount needs to be
 ///             allocated in the buffers being used. It needs to be
-///             initialized too to keep Valgrind quiet.
+///             initialized too to keep Valgrind quiet. The value is
+///             big enough for lzma_memcmplen_avx2() and
+///             lzma_memcmplen_avx512bw() too.
 static lzma_always_inline uint32_t
 lzma_memcmplen(const uint8_t *buf1, const uint8_t *buf2,
 		uint32_t len, uint32_t limit)
@@ -189,4 +192,78 @@ lzma_memcmplen(const uint8_t *buf1, const uint8_t *buf2,
 #endif
 }
 
+
+#ifdef LZMA_AVX2_DISPATCH
+/// AVX2 version of lzma_memcmplen(). This may only be called from
+/// functions that have lzma_attr_avx2 and only when
+/// lzma_avx2_is_supported() has returned true.
+lzma_attr_avx2
+static lzma_always_inline uint32_t
+lzma_memcmplen_avx2(const uint8_t *buf1, const uint8_t *buf2,
+		uint32_t len, uint32_t limit)
+{
+	assert(len <= limit);
+	assert(limit <= UINT32_MAX / 2);
+
+	while (len < limit) {
+		const uint32_t x = ~(uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(buf1 + len)),
+			_mm256_loadu_si256((const __m256i *)(buf2 + len))));
+
+		if (x != 0) {
+			len += ctz32(x);
+			return my_min(len, limit);
+		}
+
+		len += 32;
+	}
+
+	return limit;
+}
+
+// The buffers must have room for the reads done by all versions.
+#	if LZMA_MEMCMPLEN_EXTRA < 32
+#		undef LZMA_MEMCMPLEN_EXTRA
+#		define LZMA_MEMCMPLEN_EXTRA 32
+#	endif
+#endif
+
+
+#ifdef LZMA_AVX512BW_DISPATCH
+/// AVX-512BW version of lzma_memcmplen(). This compares 64 bytes per
+/// iteration which helps when long matches are common, for example,
+/// with highly repetitive input and nice_len = 273. This may only be
+/// called from functions that have lzma_attr_avx512bw and only when
+/// lzma_avx512bw_is_supported() has returned true.
+lzma_attr_avx512bw
+static lzma_always_inline uint32_t
+lzma_memcmplen_avx512bw(const uint8_t *buf1, const uint8_t *buf2,
+		uint32_t len, uint32_t limit)
+{
+	assert(len <= limit);
+	assert(limit <= UINT32_MAX / 2);
+
+	while (len < limit) {
+		const uint64_t x = _mm512_cmpneq_epi8_mask(
+				_mm512_loadu_si512(buf1 + len),
+				_mm512_loadu_si512(buf2 + len));
+
+		if (x != 0) {
+			len += (uint32_t)__builtin_ctzll(x);
+			return my_min(len, limit);
+		}
+
+		len += 64;
+	}
+
+	return limit;
+}
+
+#	if LZMA_MEMCMPLEN_EXTRA < 64
+#		undef LZMA_MEMCMPLEN_EXTRA
+#		define LZMA_MEMCMPLEN_EXTRA 64
+#	endif
+#endif
+
 #endif
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       numa.c
+/// \brief      Spreading worker threads across NUMA nodes
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "numa.h"
+
+// Only the sysfs files and sched_setaffinity() are used so that no extra
+// library like libnuma is needed. Everything is probed at runtime: if
+// the files are missing or unreadable, the threads aren't pinned.
+#if defined(__linux__) && defined(TUKLIB_CPUCORES_SCHED_GETAFFINITY)
+#	include <sched.h>
+#	include <stdio.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+
+/// Maximum number of nodes that are used. If there are more, the rest
+/// are ignored.
+#define NUMA_NODES_MAX 64
+
+/// Maximum size of a sysfs file that is read
+#define SYSFS_BUF_SIZE 4096
+
+
+/// Processors of each node that has at least one processor that
+/// this process may run on
+static cpu_set_t node_cpus[NUMA_NODES_MAX];
+
+/// Number of valid elements in node_cpus
+static uint32_t node_count = 0;
+
+
+/// Read a small sysfs file into buf as a null-terminated string.
+static bool
+read_sysfs(const char *path, char *buf)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return true;
+
+	size_t size = 0;
+	while (size < SYSFS_BUF_SIZE - 1) {
+		const ssize_t amount = read(fd, buf + size,
+				SYSFS_BUF_SIZE - 1 - size);
+		if (amount == -1) {
+			(void)close(fd);
+			return true;
+		}
+
+		if (amount == 0)
+			break;
+
+		size += (size_t)amount;
+	}
+
+	(void)close(fd);
+	buf[size] = '\0';
+	return false;
+}
+
+
+/// Parse a decimal number. Returns false and advances *str on success.
+/// Values that are close to UINT32_MAX are rejected so that the loops
+/// in numa_probe() cannot overflow.
+static bool
+parse_number(const char **str, uint32_t *value)
+{
+	const char *s = *str;
+	if (*s < '0' || *s > '9')
+		return true;
+
+	uint32_t v = 0;
+	do {
+		if (v >= UINT32_MAX / 10)
+			return true;
+
+		v = v * 10 + (uint32_t)(*s++ - '0');
+	} while (*s >= '0' && *s <= '9');
+
+	*str = s;
+	*value = v;
+	return false;
+}
+
+
+/// Get the next range from a sysfs list like "0-15,32-47\n".
+/// Returns false on success and true at the end of the list
+/// or if the list is malformed.
+static bool
+next_range(const char **str, uint32_t *first, uint32_t *last)
+{
+	if (**str == ',')
+		++*str;
+
+	if (parse_number(str, first))
+		return true;
+
+	*last = *first;
+	if (**str == '-') {
+		++*str;
+		if (parse_number(str, last) || *last < *first)
+			return true;
+	}
+
+	return false;
+}
+
+
+static void
+numa_probe(void)
+{
+	char buf[SYSFS_BUF_SIZE];
+
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return;
+
+	if (read_sysfs("/sys/devices/system/node/online", buf))
+		return;
+
+	const char *nodes = buf;
+	uint32_t first;
+	uint32_t last;
+	char cpulist[SYSFS_BUF_SIZE];
+	char path[64];
+
+	while (node_count < NUMA_NODES_MAX
+			&& !next_range(&nodes, &first, &last)) {
+		for (uint32_t node = first; node <= last
+				&& node_count < NUMA_NODES_MAX; ++node) {
+			snprintf(path, sizeof(path), "/sys/devices/system/"
+					"node/node%" PRIu32 "/cpulist", node);
+			if (read_sysfs(path, cpulist))
+				continue;
+
+			cpu_set_t *set = &node_cpus[node_count];
+			CPU_ZERO(set);
+
+			const char *cpus = cpulist;
+			uint32_t cpu_first;
+			uint32_t cpu_last;
+			while (!next_range(&cpus, &cpu_first, &cpu_last))
+				for (uint32_t cpu = cpu_first;
+						cpu <= cpu_last
+						&& cpu < CPU_SETSIZE; ++cpu)
+					if (CPU_ISSET(cpu, &allowed))
+						CPU_SET(cpu, set);
+
+			// Memory-only nodes and nodes whose processors
+			// we aren't allowed to use are skipped.
+			if (CPU_COUNT(set) > 0)
+				++node_count;
+		}
+	}
+
+	// With a single node there is nothing to spread.
+	if (node_count < 2)
+		node_count = 0;
+
+	return;
+}
+
+
+extern void
+lzma_numa_bind_thread(uint32_t index)
+{
+	mythread_once(numa_probe);
+
+	if (node_count == 0)
+		return;
+
+	// If this fails, the thread just runs where the scheduler puts it.
+	(void)sched_setaffinity(0, sizeof(cpu_set_t),
+			&node_cpus[index % node_count]);
+	return;
+}
+
+#else
+
+extern void
+lzma_numa_bind_thread(uint32_t index lzma_attribute((__unused__)))
+{
+	return;
+}
+
+#endif
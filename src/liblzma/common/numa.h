@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       numa.h
+/// \brief      Spreading worker threads across NUMA nodes
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_NUMA_H
+#define LZMA_NUMA_H
+
+#include "common.h"
+
+
+/// \brief      Pin the calling thread to the processors of one NUMA node
+///
+/// The nodes and their processors are read from /sys/devices/system/node
+/// the first time this is called. The node is chosen with index modulo
+/// the number of nodes, so worker threads with consecutive indexes are
+/// spread evenly across the nodes. Memory that the thread allocates and
+/// touches first will be allocated from its own node under the default
+/// memory policy of Linux.
+///
+/// Nothing is done if there is only one node that has usable processors,
+/// if the information isn't available, or on other operating systems.
+extern void lzma_numa_bind_thread(uint32_t index);
+
+#endif
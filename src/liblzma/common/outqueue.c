@@ -38,6 +38,31 @@ lzma_outq_memusage(uint64_t buf_size_max, uint32_t threads)
 }
 
 
+static void
+free_one_cached_seg(lzma_outq *outq, const lzma_allocator *allocator)
+{
+	assert(outq->seg_cache != NULL);
+
+	lzma_outseg *seg = outq->seg_cache;
+	outq->seg_cache = seg->next;
+
+	outq->mem_allocated -= lzma_outq_outseg_memusage(seg->allocated);
+
+	lzma_free(seg, allocator);
+	return;
+}
+
+
+static void
+clear_seg_cache(lzma_outq *outq, const lzma_allocator *allocator)
+{
+	while (outq->seg_cache != NULL)
+		free_one_cached_seg(outq, allocator);
+
+	return;
+}
+
+
 static void
 move_head_to_cache(lzma_outq *outq, const lzma_allocator *allocator)
 {
@@ -59,6 +84,22 @@ move_head_to_cache(lzma_outq *outq, const lzma_allocator *allocator)
 	--outq->bufs_in_use;
 	outq->mem_in_use -= lzma_outq_outbuf_memusage(buf->allocated);
 
+	// Put the segments to their own cache so that other buffers
+	// can use them.
+	while (buf->segs != NULL) {
+		lzma_outseg *seg = buf->segs;
+		buf->segs = seg->next;
+
+		if (outq->seg_cache != NULL && outq->seg_cache->allocated
+				!= seg->allocated)
+			clear_seg_cache(outq, allocator);
+
+		seg->next = outq->seg_cache;
+		outq->seg_cache = seg;
+
+		outq->mem_in_use -= lzma_outq_outseg_memusage(seg->allocated);
+	}
+
 	return;
 }
 
@@ -85,6 +126,7 @@ lzma_outq_clear_cache(lzma_outq *outq, const lzma_allocator *allocator)
 	while (outq->cache != NULL)
 		free_one_cached_buffer(outq, allocator);
 
+	clear_seg_cache(outq, allocator);
 	return;
 }
 
@@ -93,6 +135,8 @@ extern void
 lzma_outq_clear_cache2(lzma_outq *outq, const lzma_allocator *allocator,
 		size_t keep_size)
 {
+	clear_seg_cache(outq, allocator);
+
 	if (outq->cache == NULL)
 		return;
 
@@ -127,7 +171,10 @@ lzma_outq_init(lzma_outq *outq, const lzma_allocator *allocator,
 		free_one_cached_buffer(outq, allocator);
 
 	outq->bufs_limit = bufs_limit;
+	outq->bufs_peak = 0;
 	outq->read_pos = 0;
+	outq->read_seg = NULL;
+	outq->read_seg_start = 0;
 
 	return LZMA_OK;
 }
@@ -170,6 +217,7 @@ lzma_outq_prealloc_buf(lzma_outq *outq, const lzma_allocator *allocator,
 
 	outq->cache->next = NULL;
 	outq->cache->allocated = size;
+	outq->cache->segs = NULL;
 
 	++outq->bufs_allocated;
 	outq->mem_allocated += alloc_size;
@@ -203,8 +251,8 @@ lzma_outq_get_buf(lzma_outq *outq, void *worker)
 	buf->worker = worker;
 	buf->finished = false;
 	buf->finish_ret = LZMA_STREAM_END;
-	buf->pos = 0;
-	buf->decoder_in_pos = 0;
+	mythread_atomic_store(&buf->pos, 0);
+	mythread_atomic_store(&buf->decoder_in_pos, 0);
 
 	buf->unpadded_size = 0;
 	buf->uncompressed_size = 0;
@@ -212,17 +260,51 @@ lzma_outq_get_buf(lzma_outq *outq, void *worker)
 	++outq->bufs_in_use;
 	outq->mem_in_use += lzma_outq_outbuf_memusage(buf->allocated);
 
+	if (outq->bufs_peak < outq->bufs_in_use)
+		outq->bufs_peak = outq->bufs_in_use;
+
 	return buf;
 }
 
 
+extern lzma_outseg *
+lzma_outq_get_seg(lzma_outq *outq, const lzma_allocator *allocator,
+		size_t size)
+{
+	if (outq->seg_cache != NULL && outq->seg_cache->allocated != size)
+		clear_seg_cache(outq, allocator);
+
+	lzma_outseg *seg = outq->seg_cache;
+
+	if (seg != NULL) {
+		outq->seg_cache = seg->next;
+	} else {
+		if (size > SIZE_MAX - sizeof(lzma_outseg))
+			return NULL;
+
+		seg = lzma_alloc(lzma_outq_outseg_memusage(size), allocator);
+		if (seg == NULL)
+			return NULL;
+
+		seg->allocated = size;
+		outq->mem_allocated += lzma_outq_outseg_memusage(size);
+	}
+
+	seg->next = NULL;
+	outq->mem_in_use += lzma_outq_outseg_memusage(size);
+
+	return seg;
+}
+
+
 extern bool
 lzma_outq_is_readable(const lzma_outq *outq)
 {
 	if (outq->head == NULL)
 		return false;
 
-	return outq->read_pos < outq->head->pos || outq->head->finished;
+	return outq->read_pos < mythread_atomic_load(&outq->head->pos)
+			|| outq->head->finished;
 }
 
 
@@ -238,18 +320,52 @@ lzma_outq_read(lzma_outq *restrict outq,
 	if (outq->bufs_in_use == 0)
 		return LZMA_OK;
 
-	// Get the buffer.
+	// Get the buffer. The amount of data available is read only once
+	// since the worker thread may be adding more. If the buffer is
+	// finished, the final value of pos was stored before "finished"
+	// was set under the mutex.
 	lzma_outbuf *buf = outq->head;
+	const size_t buf_pos = mythread_atomic_load(&buf->pos);
 
-	// Copy from the buffer to output.
+	// Copy from the buffer to output. If buf[] has been read
+	// completely, continue from the segments.
 	//
 	// FIXME? In threaded decoder it may be bad to do this copy while
 	// the mutex is being held.
-	lzma_bufcpy(buf->buf, &outq->read_pos, buf->pos,
-			out, out_pos, out_size);
+	while (true) {
+		const uint8_t *data = buf->buf;
+		size_t data_size = buf->allocated;
+		if (outq->read_seg != NULL) {
+			data = outq->read_seg->buf;
+			data_size = outq->read_seg->allocated;
+		}
+
+		assert(buf_pos >= outq->read_seg_start);
+		size_t pos = outq->read_pos - outq->read_seg_start;
+		lzma_bufcpy(data, &pos,
+				my_min(data_size, buf_pos
+					- outq->read_seg_start),
+				out, out_pos, out_size);
+		outq->read_pos = outq->read_seg_start + pos;
+
+		// The segment list may be modified by the worker thread
+		// until the buffer is finished. If this piece has been read
+		// completely and more data is available, the worker has
+		// already linked the next piece before publishing the data.
+		if (pos < data_size || outq->read_pos == buf_pos)
+			break;
+
+		lzma_outseg *next = outq->read_seg == NULL
+				? buf->segs : outq->read_seg->next;
+		if (next == NULL)
+			break;
+
+		outq->read_seg = next;
+		outq->read_seg_start += data_size;
+	}
 
 	// Return if we didn't get all the data from the buffer.
-	if (!buf->finished || outq->read_pos < buf->pos)
+	if (!buf->finished || outq->read_pos < buf_pos)
 		return LZMA_OK;
 
 	// The buffer was finished. Tell the caller its size information.
@@ -265,6 +381,8 @@ lzma_outq_read(lzma_outq *restrict outq,
 	// Free this buffer for further use.
 	move_head_to_cache(outq, allocator);
 	outq->read_pos = 0;
+	outq->read_seg = NULL;
+	outq->read_seg_start = 0;
 
 	return finish_ret;
 }
@@ -15,6 +15,23 @@
 #include "common.h"
 
 
+/// Additional segment of an output buffer. A worker thread that doesn't
+/// know the final size of its output in advance can start with a small
+/// lzma_outbuf and chain segments to it with lzma_outq_get_seg() as needed.
+typedef struct lzma_outseg_s lzma_outseg;
+struct lzma_outseg_s {
+	/// Next segment of the same output buffer or, for cached segments,
+	/// the next segment in the cache
+	lzma_outseg *next;
+
+	/// Amount of memory allocated for buf[]
+	size_t allocated;
+
+	/// Buffer of "allocated" bytes
+	uint8_t buf[];
+};
+
+
 /// Output buffer for a single thread
 typedef struct lzma_outbuf_s lzma_outbuf;
 struct lzma_outbuf_s {
@@ -34,18 +51,20 @@ struct lzma_outbuf_s {
 	/// Writing position in the worker thread or, in other words, the
 	/// amount of finished data written to buf[] which can be copied out
 	///
-	/// \note       This is read by another thread and thus access
-	///             to this variable needs a mutex.
-	size_t pos;
+	/// \note       This is read by another thread. The worker thread
+	///             may update this without a mutex so this must be
+	///             accessed with mythread_atomic_load() and
+	///             mythread_atomic_store(). The data must be written
+	///             to buf[] before it is published here.
+	mythread_atomic_size pos;
 
 	/// Decompression: Position in the input buffer in the worker thread
 	/// that matches the output "pos" above. This is used to detect if
 	/// more output might be possible from the worker thread: if it has
 	/// consumed all its input, then more output isn't possible.
 	///
-	/// \note       This is read by another thread and thus access
-	///             to this variable needs a mutex.
-	size_t decoder_in_pos;
+	/// \note       This is updated after "pos" in the same way as "pos".
+	mythread_atomic_size decoder_in_pos;
 
 	/// True when no more data will be written into this buffer.
 	///
@@ -53,6 +72,14 @@ struct lzma_outbuf_s {
 	///             to this variable needs a mutex.
 	bool finished;
 
+	/// Segments that continue the data after buf[] is full: the byte
+	/// after the last byte of buf[] is the first byte of segs->buf[]
+	/// and so on. This is NULL if no segments have been added. The
+	/// worker thread may add segments until "finished" is set. Thus
+	/// segments cannot be used if data is read from the buffer while
+	/// the worker thread is still writing to it.
+	lzma_outseg *segs;
+
 	/// Return value for lzma_outq_read() when the last byte from
 	/// a finished buffer has been read. Defaults to LZMA_STREAM_END.
 	/// This must *not* be LZMA_OK. The idea is to allow a decoder to
@@ -77,15 +104,27 @@ typedef struct {
 	lzma_outbuf *head;
 	lzma_outbuf *tail;
 
-	/// Number of bytes read from head->buf[] in lzma_outq_read()
+	/// Number of bytes read from head->buf[] and its segments
+	/// in lzma_outq_read()
 	size_t read_pos;
 
+	/// The segment of the head buffer from which the next byte will be
+	/// read, or NULL if reading from head->buf[]
+	lzma_outseg *read_seg;
+
+	/// Position of read_seg->buf[0] in the data of the head buffer
+	size_t read_seg_start;
+
 	/// Linked list of allocated buffers that aren't currently used.
 	/// This way buffers of similar size can be reused and don't
 	/// need to be reallocated every time. For simplicity, all
 	/// cached buffers in the list have the same allocated size.
 	lzma_outbuf *cache;
 
+	/// Linked list of segments that aren't currently used. Like with
+	/// the cached buffers, all cached segments have the same size.
+	lzma_outseg *seg_cache;
+
 	/// Total amount of memory allocated for buffers
 	uint64_t mem_allocated;
 
@@ -102,6 +141,10 @@ typedef struct {
 
 	/// Maximum allowed number of allocated buffers
 	uint32_t bufs_limit;
+
+	/// Highest value of bufs_in_use since lzma_outq_init().
+	/// This is only for statistics.
+	uint32_t bufs_peak;
 } lzma_outq;
 
 
@@ -177,10 +220,28 @@ extern lzma_ret lzma_outq_prealloc_buf(
 extern lzma_outbuf *lzma_outq_get_buf(lzma_outq *outq, void *worker);
 
 
+/// \brief      Get a segment to extend a buffer that is in use
+///
+/// The segment is taken from the cache of free segments or allocated.
+/// The caller sets next = NULL and appends the segment to the segs list
+/// of the buffer. The segment is returned to the cache when the buffer
+/// has been read.
+///
+/// Call to this function must be protected with the same mutex that
+/// is used to protect lzma_outbuf.finished because worker threads call
+/// this while the main thread may be reading other buffers.
+///
+/// \return     Pointer to the segment or NULL if memory allocation failed
+///
+extern lzma_outseg *lzma_outq_get_seg(lzma_outq *outq,
+		const lzma_allocator *allocator, size_t size);
+
+
 /// \brief      Test if there is data ready to be read
 ///
 /// Call to this function must be protected with the same mutex that
-/// is used to protect lzma_outbuf.finished.
+/// is used to protect lzma_outbuf.finished. Note that lzma_outbuf.pos
+/// may still grow while the mutex is held.
 ///
 extern bool lzma_outq_is_readable(const lzma_outq *outq);
 
@@ -203,8 +264,8 @@ extern bool lzma_outq_is_readable(const lzma_outq *outq);
 ///               *unpadded_size and *uncompressed_size were set if they
 ///               were not NULL.
 ///
-/// \note       This reads lzma_outbuf.finished and .pos variables and thus
-///             calls to this function need to be protected with a mutex.
+/// \note       This reads lzma_outbuf.finished and thus calls to this
+///             function need to be protected with a mutex.
 ///
 extern lzma_ret lzma_outq_read(lzma_outq *restrict outq,
 		const lzma_allocator *restrict allocator,
@@ -256,4 +317,13 @@ lzma_outq_outbuf_memusage(size_t buf_size)
 	return sizeof(lzma_outbuf) + buf_size;
 }
 
+
+/// \brief      Get the amount of memory needed for a single lzma_outseg
+static inline uint64_t
+lzma_outq_outseg_memusage(size_t seg_size)
+{
+	assert(seg_size <= SIZE_MAX - sizeof(lzma_outseg));
+	return sizeof(lzma_outseg) + seg_size;
+}
+
 #endif
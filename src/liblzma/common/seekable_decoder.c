@@ -0,0 +1,1332 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       seekable_decoder.c
+/// \brief      Random access reading of .xz files using the Index
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "index_decoder.h"
+#include "block_decoder.h"
+#include "filter_decoder.h"
+#include "lzma2_decoder.h"
+
+
+/// Size of the input buffer. The read callback is called at most this
+/// many bytes at a time.
+#define SEEKABLE_IN_SIZE (1U << 16)
+
+/// Size of the buffer into which the data before the requested position
+/// is decoded and then discarded
+#define SEEKABLE_SKIP_SIZE (1U << 15)
+
+/// Sizes of the fixed-size parts of the encoded checkpoints
+#define CHECKPOINTS_HEADER_SIZE (6 + 3 * 8)
+#define CHECKPOINTS_RECORD_SIZE (4 * 8)
+#define CHECKPOINTS_FOOTER_SIZE 4
+
+/// Magic bytes at the beginning of the encoded checkpoints
+static const uint8_t checkpoints_magic[6]
+		= { 0xFD, 0x37, 0x7A, 0x43, 0x50, 0x00 };
+
+
+/// Block decoder and its input buffer. The main thread and
+/// the prefetch thread have one each.
+typedef struct {
+	/// The Block that block_decoder is decoding. This is valid only
+	/// if active is true.
+	lzma_index_iter iter;
+
+	/// True if block_decoder has been initialized for the Block in
+	/// iter and no error has occurred since then
+	bool active;
+
+	/// True if block_decoder has returned LZMA_STREAM_END, that is,
+	/// the whole Block including its integrity check has been decoded
+	bool done;
+
+	/// True if decoding was resumed from a checkpoint. Then
+	/// block_decoder is a raw LZMA2 decoder which decodes only
+	/// the Compressed Data field, and the integrity check of
+	/// the Block isn't verified.
+	bool resumed;
+
+	/// Block decoder and its options
+	lzma_next_coder block_decoder;
+	lzma_block block_options;
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+
+	/// Memory usage of block_decoder that is counted against
+	/// the memlimit. This is protected by the mutex when the prefetch
+	/// thread exists.
+	uint64_t memusage;
+
+	/// The raw LZMA2 decoder in block_decoder if the Block uses
+	/// only the LZMA2 filter, otherwise NULL
+	lzma_next_coder *lzma2;
+
+	/// A new checkpoint is saved at the first LZMA2 chunk boundary
+	/// at or after this uncompressed offset. This is UINT64_MAX if
+	/// no checkpoints are saved in the current Block.
+	uint64_t checkpoint_next;
+
+	/// Uncompressed offset of the next byte from block_decoder
+	uint64_t out_pos;
+
+	/// Uncompressed offset of the end of the current Block
+	uint64_t block_end;
+
+	/// File offset of the byte after the last byte in in[]
+	uint64_t in_file_pos;
+
+	/// File offset of the end of the current Block
+	uint64_t in_end;
+
+	size_t in_pos;
+	size_t in_size;
+	uint8_t in[SEEKABLE_IN_SIZE];
+} block_coder;
+
+
+/// LZMA2 decoder state at an LZMA2 chunk boundary in the middle of a Block
+typedef struct {
+	/// Number of the Block in the file, starting from one
+	lzma_vli block_number;
+
+	/// Uncompressed offset of the first byte after the checkpoint
+	uint64_t uncompressed_offset;
+
+	/// File offset of the LZMA2 chunk that starts at the checkpoint
+	uint64_t compressed_offset;
+
+	/// State from lzma_lzma2_decoder_save()
+	size_t state_size;
+	uint8_t *state;
+} checkpoint;
+
+
+/// A Block in the cache
+typedef struct cache_entry_s cache_entry;
+struct cache_entry_s {
+	/// Neighbors in the LRU list. prev was used more recently
+	/// than this entry and next less recently.
+	cache_entry *prev;
+	cache_entry *next;
+
+	/// Block number in the file minus one. This is the index of
+	/// this entry in lzma_seekable.cache_table.
+	lzma_vli number;
+
+	/// Uncompressed offset of buf[0]
+	uint64_t uncompressed_offset;
+
+	/// Uncompressed size of the Block
+	size_t size;
+
+	/// Uncompressed data of the whole Block
+	uint8_t buf[];
+};
+
+
+struct lzma_seekable_s {
+	/// Read callback and its argument from lzma_seekable_options
+	lzma_ret (*read)(void *opaque, uint8_t *buf, size_t size,
+			uint64_t pos);
+	void *opaque;
+
+	uint64_t file_size;
+	uint64_t memlimit;
+	bool ignore_check;
+
+	const lzma_allocator *allocator;
+
+	/// Combined Index of all Streams in the file
+	lzma_index *index;
+
+	/// Uncompressed size of the whole file
+	uint64_t uncompressed_size;
+
+	/// Block decoder of the main thread
+	block_coder coder;
+
+	/// Minimum uncompressed distance between new checkpoints.
+	/// New checkpoints aren't saved if this is zero.
+	uint64_t checkpoint_interval;
+
+	/// Checkpoints sorted by uncompressed_offset. They are used only
+	/// by the main thread.
+	checkpoint *checkpoints;
+	size_t checkpoints_count;
+	size_t checkpoints_alloc;
+
+	/// Maximum total uncompressed size of the cached Blocks.
+	/// The cache is disabled if this is zero.
+	uint64_t cache_size;
+
+	/// Total uncompressed size of the cached Blocks
+	uint64_t cache_used;
+
+	/// Cached Blocks indexed by the Block number in the file minus one.
+	/// The elements of the Blocks that aren't cached are NULL.
+	cache_entry **cache_table;
+
+	/// The most and the least recently used cache entries
+	cache_entry *cache_head;
+	cache_entry *cache_tail;
+
+#ifdef MYTHREAD_ENABLED
+	/// True if the prefetch thread has been created. If this is false,
+	/// the mutex and cond haven't been initialized either.
+	bool prefetch;
+
+	/// True when the prefetch thread should exit
+	bool prefetch_exit;
+
+	/// True if the prefetch thread has been asked to decode the Block
+	/// prefetch_number which starts at the uncompressed offset
+	/// prefetch_pos but the thread hasn't started it yet
+	bool prefetch_pending;
+	lzma_vli prefetch_number;
+	uint64_t prefetch_pos;
+
+	/// Number of the Block that the prefetch thread is decoding or
+	/// LZMA_VLI_UNKNOWN if it is idle
+	lzma_vli prefetch_busy;
+
+	/// Block decoder of the prefetch thread
+	block_coder *prefetch_coder;
+
+	/// The cache and the prefetch_* variables (except prefetch and
+	/// prefetch_coder) are protected by the mutex when the prefetch
+	/// thread exists.
+	mythread_mutex mutex;
+	mythread_cond cond;
+	mythread thread_id;
+#endif
+
+	uint8_t skip[SEEKABLE_SKIP_SIZE];
+};
+
+
+/// Read the Index of the file with the file information decoder.
+static lzma_ret
+decode_index(lzma_seekable *s)
+{
+	lzma_next_coder file_info = LZMA_NEXT_CODER_INIT;
+	uint64_t seek_pos = 0;
+
+	lzma_ret ret = lzma_file_info_decoder_init(&file_info, s->allocator,
+			&seek_pos, &s->index, s->memlimit, s->file_size);
+
+	// Next position to read from the file. This is updated after
+	// each read and on LZMA_SEEK_NEEDED.
+	uint64_t file_pos = 0;
+
+	while (ret == LZMA_OK) {
+		// The decoder knows the file size so it shouldn't ask
+		// for more input after the end of the file.
+		if (file_pos >= s->file_size) {
+			ret = LZMA_DATA_ERROR;
+			break;
+		}
+
+		// The decoder mostly needs small pieces of the file
+		// (headers and footers) before seeking elsewhere, so
+		// a smaller buffer than for the Blocks is used here.
+		const size_t size = (size_t)my_min(LZMA_BUFFER_SIZE,
+				s->file_size - file_pos);
+		ret = s->read(s->opaque, s->coder.in, size, file_pos);
+		if (ret != LZMA_OK)
+			break;
+
+		file_pos += size;
+
+		size_t in_pos = 0;
+		size_t out_pos = 0;
+		ret = file_info.code(file_info.coder, s->allocator,
+				s->coder.in, &in_pos, size, NULL, &out_pos, 0,
+				LZMA_RUN);
+
+		if (ret == LZMA_SEEK_NEEDED) {
+			file_pos = seek_pos;
+			ret = LZMA_OK;
+		}
+	}
+
+	lzma_next_end(&file_info, s->allocator);
+
+	if (ret != LZMA_STREAM_END)
+		return ret;
+
+	s->uncompressed_size = lzma_index_uncompressed_size(s->index);
+	return LZMA_OK;
+}
+
+
+/// Read from the file with the callback. Reading beyond the end of
+/// the file is an error because the Index points there.
+static lzma_ret
+read_at(lzma_seekable *s, uint8_t *buf, size_t size, uint64_t pos)
+{
+	if (pos > s->file_size || s->file_size - pos < size)
+		return LZMA_DATA_ERROR;
+
+	return s->read(s->opaque, buf, size, pos);
+}
+
+
+static void
+block_coder_init(block_coder *bc)
+{
+	bc->active = false;
+	bc->done = false;
+	bc->resumed = false;
+	bc->block_decoder = LZMA_NEXT_CODER_INIT;
+	bc->memusage = 0;
+	bc->lzma2 = NULL;
+	bc->checkpoint_next = UINT64_MAX;
+
+	for (size_t i = 0; i <= LZMA_FILTERS_MAX; ++i)
+		bc->filters[i].id = LZMA_VLI_UNKNOWN;
+
+	return;
+}
+
+
+static void
+block_coder_end(block_coder *bc, const lzma_allocator *allocator)
+{
+	lzma_next_end(&bc->block_decoder, allocator);
+	lzma_filters_free(bc->filters, allocator);
+	return;
+}
+
+
+static void
+checkpoints_free(checkpoint *checkpoints, size_t count,
+		const lzma_allocator *allocator)
+{
+	for (size_t i = 0; i < count; ++i)
+		lzma_free(checkpoints[i].state, allocator);
+
+	lzma_free(checkpoints, allocator);
+	return;
+}
+
+
+/// Find the last checkpoint whose uncompressed offset is at or before pos.
+/// Returns SIZE_MAX if there is no such checkpoint in the Block
+/// block_number.
+static size_t
+checkpoint_find(const lzma_seekable *s, lzma_vli block_number, uint64_t pos)
+{
+	size_t left = 0;
+	size_t right = s->checkpoints_count;
+
+	while (left < right) {
+		const size_t mid = left + (right - left) / 2;
+		if (s->checkpoints[mid].uncompressed_offset <= pos)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	if (left == 0 || s->checkpoints[left - 1].block_number
+			!= block_number)
+		return SIZE_MAX;
+
+	return left - 1;
+}
+
+
+/// Save a checkpoint of the LZMA2 decoder in bc which must be stopped
+/// at a chunk boundary. state_size is from lzma_lzma2_decoder_state_size().
+static lzma_ret
+checkpoint_save(lzma_seekable *s, block_coder *bc, size_t state_size)
+{
+	if (s->checkpoints_count == s->checkpoints_alloc) {
+		const size_t alloc = s->checkpoints_alloc == 0
+				? 16 : s->checkpoints_alloc * 2;
+		if (alloc > SIZE_MAX / sizeof(checkpoint))
+			return LZMA_MEM_ERROR;
+
+		checkpoint *checkpoints = lzma_alloc(
+				alloc * sizeof(checkpoint), s->allocator);
+		if (checkpoints == NULL)
+			return LZMA_MEM_ERROR;
+
+		if (s->checkpoints_count > 0)
+			memcpy(checkpoints, s->checkpoints,
+					s->checkpoints_count
+						* sizeof(checkpoint));
+
+		lzma_free(s->checkpoints, s->allocator);
+		s->checkpoints = checkpoints;
+		s->checkpoints_alloc = alloc;
+	}
+
+	uint8_t *state = lzma_alloc(state_size, s->allocator);
+	if (state == NULL)
+		return LZMA_MEM_ERROR;
+
+	lzma_lzma2_decoder_save(bc->lzma2, state);
+	lzma_lzma2_decoder_pause(bc->lzma2, false);
+
+	// The new checkpoint is after the existing checkpoints of this
+	// Block but there may be checkpoints in the later Blocks.
+	size_t i = checkpoint_find(s, bc->iter.block.number_in_file,
+			bc->out_pos);
+	i = i == SIZE_MAX ? 0 : i + 1;
+	while (i < s->checkpoints_count && s->checkpoints[i]
+			.uncompressed_offset < bc->out_pos)
+		++i;
+
+	assert(i == s->checkpoints_count || s->checkpoints[i]
+			.uncompressed_offset > bc->out_pos);
+
+	memmove(s->checkpoints + i + 1, s->checkpoints + i,
+			(s->checkpoints_count - i) * sizeof(checkpoint));
+	++s->checkpoints_count;
+
+	checkpoint *cp = &s->checkpoints[i];
+	cp->block_number = bc->iter.block.number_in_file;
+	cp->uncompressed_offset = bc->out_pos;
+	cp->compressed_offset = bc->in_file_pos - (bc->in_size - bc->in_pos);
+	cp->state_size = state_size;
+	cp->state = state;
+
+	bc->checkpoint_next = bc->out_pos + my_min(s->checkpoint_interval,
+			UINT64_MAX - bc->out_pos);
+	return LZMA_OK;
+}
+
+
+/// Test if there is a checkpoint in the current Block after the current
+/// position but not after pos.
+static bool
+checkpoint_is_closer(const lzma_seekable *s, const block_coder *bc,
+		uint64_t pos)
+{
+	const size_t i = checkpoint_find(s, bc->iter.block.number_in_file,
+			pos);
+	return i != SIZE_MAX
+			&& s->checkpoints[i].uncompressed_offset > bc->out_pos;
+}
+
+
+/// Check that bc->block_decoder may use memusage bytes of memory. The Index
+/// and the Block decoder of the other thread are counted too. If the limit
+/// would be exceeded, the prefetch thread skips the Block and the main
+/// thread waits for the prefetch thread to free its Block decoder.
+static lzma_ret
+block_memusage_reserve(lzma_seekable *s, block_coder *bc, uint64_t memusage)
+{
+	const uint64_t limit = s->memlimit - my_min(s->memlimit,
+			lzma_index_memused(s->index));
+	if (memusage > limit)
+		return LZMA_MEMLIMIT_ERROR;
+
+#ifdef MYTHREAD_ENABLED
+	if (s->prefetch) {
+		lzma_ret ret = LZMA_OK;
+
+		mythread_sync(s->mutex) {
+			if (bc == s->prefetch_coder) {
+				if (memusage > limit - s->coder.memusage)
+					ret = LZMA_MEMLIMIT_ERROR;
+			} else {
+				while (memusage > limit
+						- s->prefetch_coder->memusage)
+					mythread_cond_wait(&s->cond,
+							&s->mutex);
+			}
+
+			if (ret == LZMA_OK)
+				bc->memusage = memusage;
+		}
+
+		return ret;
+	}
+#endif
+
+	bc->memusage = memusage;
+	return LZMA_OK;
+}
+
+
+/// Initialize bc->block_decoder for the Block that contains
+/// the uncompressed offset pos. If use_checkpoints is true, decoding
+/// is resumed from the nearest checkpoint before pos, and new checkpoints
+/// are saved if they were requested.
+static lzma_ret
+block_start(lzma_seekable *s, block_coder *bc, uint64_t pos,
+		bool use_checkpoints)
+{
+	bc->active = false;
+
+	lzma_index_iter_init(&bc->iter, s->index);
+	if (lzma_index_iter_locate(&bc->iter, pos))
+		return LZMA_PROG_ERROR;
+
+	const uint64_t offset = bc->iter.block.compressed_file_offset;
+	const lzma_vli total_size = bc->iter.block.total_size;
+
+	// Read and decode the Block Header.
+	uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+	return_if_error(read_at(s, header, 1, offset));
+
+	// A zero byte would be the Index Indicator. The Index says that
+	// there is a Block here so the file is corrupt.
+	if (header[0] == 0x00)
+		return LZMA_DATA_ERROR;
+
+	bc->block_options.version = 1;
+	bc->block_options.header_size = lzma_block_header_size_decode(
+			header[0]);
+	if (bc->block_options.header_size >= total_size)
+		return LZMA_DATA_ERROR;
+
+	return_if_error(read_at(s, header + 1,
+			bc->block_options.header_size - 1, offset + 1));
+
+	bc->block_options.check = bc->iter.stream.flags->check;
+	bc->block_options.filters = bc->filters;
+	return_if_error(lzma_block_header_decode(&bc->block_options,
+			s->allocator, header));
+
+	// The Block Header doesn't need to contain the sizes but the Index
+	// always does. Use the sizes from the Index so that the Block
+	// decoder can verify them.
+	lzma_ret ret = lzma_block_compressed_size(&bc->block_options,
+			bc->iter.block.unpadded_size);
+
+	if (ret == LZMA_OK && bc->block_options.uncompressed_size
+				!= LZMA_VLI_UNKNOWN
+			&& bc->block_options.uncompressed_size
+				!= bc->iter.block.uncompressed_size)
+		ret = LZMA_DATA_ERROR;
+
+	bc->block_options.uncompressed_size
+			= bc->iter.block.uncompressed_size;
+	bc->block_options.ignore_check = s->ignore_check;
+
+	// The dictionary doesn't need to be bigger than the Block.
+	lzma_raw_decoder_limit_dict(bc->filters,
+			bc->block_options.uncompressed_size);
+
+	// Checkpoints are supported when LZMA2 is the only filter.
+	const bool lzma2_only = bc->filters[0].id == LZMA_FILTER_LZMA2
+			&& bc->filters[1].id == LZMA_VLI_UNKNOWN;
+
+	const checkpoint *cp = NULL;
+	if (use_checkpoints) {
+		const size_t i = checkpoint_find(s,
+				bc->iter.block.number_in_file, pos);
+		if (i != SIZE_MAX) {
+			cp = &s->checkpoints[i];
+
+			// The checkpoints are from a different file.
+			if (ret == LZMA_OK && !lzma2_only)
+				ret = LZMA_DATA_ERROR;
+		}
+	}
+
+	// Check the memory usage limit.
+	if (ret == LZMA_OK) {
+		const uint64_t memusage = lzma_raw_decoder_memusage(
+				bc->filters);
+		if (memusage == UINT64_MAX)
+			ret = LZMA_OPTIONS_ERROR;
+		else
+			ret = block_memusage_reserve(s, bc, memusage);
+	}
+
+	if (ret == LZMA_OK) {
+		if (cp != NULL) {
+			ret = lzma_raw_decoder_init(&bc->block_decoder,
+					s->allocator, bc->filters, false);
+			if (ret == LZMA_OK)
+				ret = lzma_lzma2_decoder_restore(
+						&bc->block_decoder,
+						cp->state, cp->state_size);
+		} else {
+			ret = lzma_block_decoder_init(&bc->block_decoder,
+					s->allocator, &bc->block_options,
+					false);
+		}
+	}
+
+	// The filter options were copied by the decoder.
+	lzma_filters_free(bc->filters, s->allocator);
+	return_if_error(ret);
+
+	bc->block_end = bc->iter.block.uncompressed_file_offset
+			+ bc->iter.block.uncompressed_size;
+	bc->resumed = cp != NULL;
+
+	if (bc->resumed) {
+		// The raw decoder reads only up to the end of
+		// the Compressed Data field.
+		bc->out_pos = cp->uncompressed_offset;
+		bc->in_file_pos = cp->compressed_offset;
+		bc->in_end = offset + bc->block_options.header_size
+				+ bc->block_options.compressed_size;
+		bc->lzma2 = &bc->block_decoder;
+	} else {
+		bc->out_pos = bc->iter.block.uncompressed_file_offset;
+		bc->in_file_pos = offset + bc->block_options.header_size;
+		bc->in_end = offset + total_size;
+		bc->lzma2 = lzma2_only ? lzma_block_decoder_filters(
+				&bc->block_decoder) : NULL;
+	}
+
+	bc->in_pos = 0;
+	bc->in_size = 0;
+
+	// New checkpoints are saved after the existing ones so that
+	// they stay in order.
+	bc->checkpoint_next = UINT64_MAX;
+	if (use_checkpoints && lzma2_only && s->checkpoint_interval != 0) {
+		const size_t i = checkpoint_find(s,
+				bc->iter.block.number_in_file,
+				bc->block_end - 1);
+		const uint64_t last = i == SIZE_MAX
+				? bc->iter.block.uncompressed_file_offset
+				: s->checkpoints[i].uncompressed_offset;
+		bc->checkpoint_next = last + my_min(s->checkpoint_interval,
+				UINT64_MAX - last);
+	}
+
+	bc->active = true;
+	bc->done = false;
+	return LZMA_OK;
+}
+
+
+/// Decode from the current Block into out[*out_pos] until the output
+/// buffer is full. When the last uncompressed byte of the Block has been
+/// decoded, the rest of the Block is decoded too so that the integrity
+/// check gets verified.
+static lzma_ret
+block_decode(lzma_seekable *s, block_coder *bc,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+{
+	// The raw decoder used after resuming from a checkpoint doesn't
+	// know where the Block ends.
+	if (out_size - *out_pos > bc->block_end - bc->out_pos)
+		out_size = *out_pos + (size_t)(bc->block_end - bc->out_pos);
+
+	while (!bc->done) {
+		// Once enough data has been decoded since the previous
+		// checkpoint, make the LZMA2 decoder stop at the next
+		// chunk boundary and save a checkpoint there. There is
+		// no point to save a checkpoint at the end of the Block.
+		if (bc->checkpoint_next <= bc->out_pos) {
+			const size_t state_size
+				= lzma_lzma2_decoder_state_size(bc->lzma2);
+			if (state_size == 0) {
+				lzma_lzma2_decoder_pause(bc->lzma2, true);
+			} else if (bc->out_pos < bc->block_end) {
+				return_if_error(checkpoint_save(
+						s, bc, state_size));
+			} else {
+				lzma_lzma2_decoder_pause(bc->lzma2, false);
+				bc->checkpoint_next = UINT64_MAX;
+			}
+		}
+
+		if (bc->in_pos == bc->in_size
+				&& bc->in_file_pos < bc->in_end) {
+			const size_t size = (size_t)my_min(SEEKABLE_IN_SIZE,
+					bc->in_end - bc->in_file_pos);
+			return_if_error(read_at(s, bc->in, size,
+					bc->in_file_pos));
+
+			bc->in_file_pos += size;
+			bc->in_pos = 0;
+			bc->in_size = size;
+		}
+
+		const size_t in_start = bc->in_pos;
+		const size_t out_start = *out_pos;
+
+		const lzma_ret ret = bc->block_decoder.code(
+				bc->block_decoder.coder, s->allocator,
+				bc->in, &bc->in_pos, bc->in_size,
+				out, out_pos, out_size, LZMA_RUN);
+
+		bc->out_pos += *out_pos - out_start;
+
+		if (ret == LZMA_STREAM_END) {
+			// The Block decoder has verified that the sizes
+			// match the Index. The raw decoder hasn't.
+			if (bc->resumed && (bc->out_pos != bc->block_end
+					|| bc->in_pos != bc->in_size
+					|| bc->in_file_pos != bc->in_end))
+				return LZMA_DATA_ERROR;
+
+			assert(bc->out_pos == bc->block_end);
+			bc->done = true;
+			break;
+		}
+
+		if (ret != LZMA_OK)
+			return ret;
+
+		if (*out_pos == out_size && bc->out_pos < bc->block_end)
+			break;
+
+		// The Block decoder always makes progress when it has
+		// both input and output space. If all the input of
+		// the Block has been used, the Block is truncated.
+		// Reaching a chunk boundary for a checkpoint may not
+		// use any input or produce output.
+		if (bc->in_pos == in_start && *out_pos == out_start
+				&& (bc->checkpoint_next > bc->out_pos
+					|| lzma_lzma2_decoder_state_size(
+						bc->lzma2) == 0))
+			return LZMA_DATA_ERROR;
+	}
+
+	return LZMA_OK;
+}
+
+
+/// Decode the whole Block that contains the uncompressed offset pos
+/// into a new cache entry.
+static lzma_ret
+cache_entry_decode(lzma_seekable *s, block_coder *bc, uint64_t pos,
+		cache_entry **entry)
+{
+	return_if_error(block_start(s, bc, pos, false));
+
+	// The caller has checked that the size fits into cache_size
+	// which fits into size_t.
+	const size_t size = (size_t)bc->iter.block.uncompressed_size;
+
+	cache_entry *e = lzma_alloc(sizeof(cache_entry) + size, s->allocator);
+	if (e == NULL) {
+		bc->active = false;
+		return LZMA_MEM_ERROR;
+	}
+
+	e->number = bc->iter.block.number_in_file - 1;
+	e->uncompressed_offset = bc->iter.block.uncompressed_file_offset;
+	e->size = size;
+
+	size_t e_pos = 0;
+	const lzma_ret ret = block_decode(s, bc, e->buf, &e_pos, size);
+
+	// The Block is never continued with this decoder. The cache entry
+	// is used instead.
+	bc->active = false;
+
+	if (ret != LZMA_OK) {
+		lzma_free(e, s->allocator);
+		return ret;
+	}
+
+	assert(e_pos == size);
+	assert(bc->done);
+
+	*entry = e;
+	return LZMA_OK;
+}
+
+
+static void
+cache_lock(lzma_seekable *s)
+{
+#ifdef MYTHREAD_ENABLED
+	if (s->prefetch)
+		mythread_mutex_lock(&s->mutex);
+#else
+	(void)s;
+#endif
+	return;
+}
+
+
+static void
+cache_unlock(lzma_seekable *s)
+{
+#ifdef MYTHREAD_ENABLED
+	if (s->prefetch)
+		mythread_mutex_unlock(&s->mutex);
+#else
+	(void)s;
+#endif
+	return;
+}
+
+
+/// Remove an entry from the LRU list without freeing it.
+static void
+cache_unlink(lzma_seekable *s, cache_entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		s->cache_head = e->next;
+
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		s->cache_tail = e->prev;
+
+	return;
+}
+
+
+/// Put an entry to the beginning of the LRU list.
+static void
+cache_push(lzma_seekable *s, cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = s->cache_head;
+
+	if (s->cache_head != NULL)
+		s->cache_head->prev = e;
+	else
+		s->cache_tail = e;
+
+	s->cache_head = e;
+	return;
+}
+
+
+/// Add a new entry to the cache. The least recently used entries are
+/// freed to keep the total size within cache_size.
+static void
+cache_insert(lzma_seekable *s, cache_entry *e)
+{
+	assert(e->size <= s->cache_size);
+	assert(s->cache_table[e->number] == NULL);
+
+	while (s->cache_size - s->cache_used < e->size) {
+		cache_entry *old = s->cache_tail;
+		cache_unlink(s, old);
+		s->cache_table[old->number] = NULL;
+		s->cache_used -= old->size;
+		lzma_free(old, s->allocator);
+	}
+
+	cache_push(s, e);
+	s->cache_table[e->number] = e;
+	s->cache_used += e->size;
+	return;
+}
+
+
+/// Ask the prefetch thread to decode the Block that starts at
+/// the uncompressed offset pos unless it is already in the cache.
+/// The cache must be locked.
+static void
+prefetch_request(lzma_seekable *s, uint64_t pos)
+{
+#ifdef MYTHREAD_ENABLED
+	if (!s->prefetch || pos >= s->uncompressed_size)
+		return;
+
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, s->index);
+	if (lzma_index_iter_locate(&iter, pos))
+		return;
+
+	const lzma_vli number = iter.block.number_in_file - 1;
+	if (iter.block.uncompressed_size > s->cache_size
+			|| s->cache_table[number] != NULL
+			|| s->prefetch_busy == number)
+		return;
+
+	s->prefetch_pending = true;
+	s->prefetch_number = number;
+	s->prefetch_pos = pos;
+	mythread_cond_signal(&s->cond);
+#else
+	(void)s;
+	(void)pos;
+#endif
+	return;
+}
+
+
+#ifdef MYTHREAD_ENABLED
+static MYTHREAD_RET_TYPE
+prefetch_thread(void *s_ptr)
+{
+	lzma_seekable *s = s_ptr;
+
+	mythread_mutex_lock(&s->mutex);
+
+	while (!s->prefetch_exit) {
+		if (!s->prefetch_pending) {
+			mythread_cond_wait(&s->cond, &s->mutex);
+			continue;
+		}
+
+		s->prefetch_pending = false;
+		s->prefetch_busy = s->prefetch_number;
+		const uint64_t pos = s->prefetch_pos;
+
+		mythread_mutex_unlock(&s->mutex);
+
+		cache_entry *e;
+		const lzma_ret ret = cache_entry_decode(
+				s, s->prefetch_coder, pos, &e);
+
+		// Free the Block decoder so that its memory is available
+		// to the main thread when the prefetch thread is idle.
+		lzma_next_end(&s->prefetch_coder->block_decoder,
+				s->allocator);
+
+		mythread_mutex_lock(&s->mutex);
+
+		// Errors are ignored. The main thread will get the same
+		// error if the application reads from this Block.
+		if (ret == LZMA_OK)
+			cache_insert(s, e);
+
+		// The main thread may be waiting for this Block or
+		// for the memory used by the Block decoder.
+		s->prefetch_coder->memusage = 0;
+		s->prefetch_busy = LZMA_VLI_UNKNOWN;
+		mythread_cond_signal(&s->cond);
+	}
+
+	mythread_mutex_unlock(&s->mutex);
+	return MYTHREAD_RET_VALUE;
+}
+#endif
+
+
+/// Copy data via the cache from the Block in s->coder.iter which
+/// contains *pos. *pos is advanced past the copied data.
+static lzma_ret
+cache_read(lzma_seekable *s, uint64_t *pos,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+{
+	const lzma_vli number = s->coder.iter.block.number_in_file - 1;
+
+	cache_lock(s);
+
+#ifdef MYTHREAD_ENABLED
+	if (s->prefetch) {
+		// If the prefetch thread hasn't started this Block yet,
+		// it is faster to decode it in this thread. If it has
+		// started, wait for it to finish.
+		if (s->prefetch_pending && s->prefetch_number == number)
+			s->prefetch_pending = false;
+
+		while (s->prefetch_busy == number)
+			mythread_cond_wait(&s->cond, &s->mutex);
+	}
+#endif
+
+	cache_entry *e = s->cache_table[number];
+
+	if (e == NULL) {
+		// The prefetch thread won't start this Block meanwhile
+		// because only this thread makes prefetch requests.
+		cache_unlock(s);
+		return_if_error(cache_entry_decode(s, &s->coder, *pos, &e));
+		cache_lock(s);
+		cache_insert(s, e);
+
+	} else if (e != s->cache_head) {
+		cache_unlink(s, e);
+		cache_push(s, e);
+	}
+
+	const size_t offset = (size_t)(*pos - e->uncompressed_offset);
+	const size_t copy_size = my_min(e->size - offset,
+			out_size - *out_pos);
+	memcpy(out + *out_pos, e->buf + offset, copy_size);
+	*out_pos += copy_size;
+	*pos += copy_size;
+
+	prefetch_request(s, e->uncompressed_offset + e->size);
+
+	cache_unlock(s);
+	return LZMA_OK;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_seekable_decoder(lzma_seekable **seekable,
+		const lzma_seekable_options *options,
+		const lzma_allocator *allocator)
+{
+	if (seekable == NULL || options == NULL || options->read == NULL)
+		return LZMA_PROG_ERROR;
+
+	if (options->flags & ~(LZMA_IGNORE_CHECK | LZMA_SEEKABLE_PREFETCH))
+		return LZMA_OPTIONS_ERROR;
+
+	lzma_seekable *s = lzma_alloc(sizeof(lzma_seekable), allocator);
+	if (s == NULL)
+		return LZMA_MEM_ERROR;
+
+	s->read = options->read;
+	s->opaque = options->opaque;
+	s->file_size = options->file_size;
+	s->memlimit = my_max(1, options->memlimit);
+	s->ignore_check = (options->flags & LZMA_IGNORE_CHECK) != 0;
+	s->allocator = allocator;
+	s->index = NULL;
+	block_coder_init(&s->coder);
+
+	s->checkpoint_interval = options->checkpoint_interval;
+	s->checkpoints = NULL;
+	s->checkpoints_count = 0;
+	s->checkpoints_alloc = 0;
+
+	// A cache bigger than the address space isn't useful. Limiting
+	// it also ensures that a cached Block fits into size_t.
+	s->cache_size = my_min(options->cache_size, SIZE_MAX / 2);
+	s->cache_used = 0;
+	s->cache_table = NULL;
+	s->cache_head = NULL;
+	s->cache_tail = NULL;
+
+#ifdef MYTHREAD_ENABLED
+	s->prefetch = false;
+#endif
+
+	lzma_ret ret = decode_index(s);
+
+	if (ret == LZMA_OK && s->cache_size > 0) {
+		const lzma_vli count = lzma_index_block_count(s->index);
+		if (count > SIZE_MAX / sizeof(cache_entry *)) {
+			ret = LZMA_MEM_ERROR;
+		} else if (count > 0) {
+			s->cache_table = lzma_alloc_zero((size_t)count
+					* sizeof(cache_entry *), allocator);
+			if (s->cache_table == NULL)
+				ret = LZMA_MEM_ERROR;
+		}
+	}
+
+#ifdef MYTHREAD_ENABLED
+	if (ret == LZMA_OK && s->cache_table != NULL
+			&& (options->flags & LZMA_SEEKABLE_PREFETCH)) {
+		s->prefetch_exit = false;
+		s->prefetch_pending = false;
+		s->prefetch_busy = LZMA_VLI_UNKNOWN;
+
+		s->prefetch_coder = lzma_alloc(sizeof(block_coder), allocator);
+		if (s->prefetch_coder == NULL) {
+			ret = LZMA_MEM_ERROR;
+		} else {
+			block_coder_init(s->prefetch_coder);
+
+			if (mythread_mutex_init(&s->mutex)) {
+				ret = LZMA_MEM_ERROR;
+			} else if (mythread_cond_init(&s->cond)) {
+				mythread_mutex_destroy(&s->mutex);
+				ret = LZMA_MEM_ERROR;
+			} else if (mythread_create(&s->thread_id,
+					&prefetch_thread, s)) {
+				mythread_cond_destroy(&s->cond);
+				mythread_mutex_destroy(&s->mutex);
+				ret = LZMA_MEM_ERROR;
+			} else {
+				s->prefetch = true;
+			}
+
+			if (!s->prefetch)
+				lzma_free(s->prefetch_coder, allocator);
+		}
+	}
+#endif
+
+	if (ret != LZMA_OK) {
+		lzma_seekable_end(s);
+		return ret;
+	}
+
+	*seekable = s;
+	return LZMA_OK;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_seekable_read(lzma_seekable *s, uint64_t pos,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+{
+	if (s == NULL || out_pos == NULL || *out_pos > out_size
+			|| (out == NULL && *out_pos != out_size))
+		return LZMA_PROG_ERROR;
+
+	block_coder *bc = &s->coder;
+
+	while (*out_pos < out_size && pos < s->uncompressed_size) {
+		// Continue with the current Block if pos is in it and
+		// hasn't been decoded yet and there is no checkpoint
+		// between. Otherwise use the cache if the Block fits in it,
+		// or else start from the nearest checkpoint or from
+		// the beginning of the Block.
+		if (!bc->active || pos < bc->out_pos
+				|| pos >= bc->block_end
+				|| checkpoint_is_closer(s, bc, pos)) {
+			if (s->cache_table != NULL) {
+				lzma_index_iter_init(&bc->iter, s->index);
+				if (lzma_index_iter_locate(&bc->iter, pos))
+					return LZMA_PROG_ERROR;
+
+				if (bc->iter.block.uncompressed_size
+						<= s->cache_size) {
+					return_if_error(cache_read(s, &pos,
+							out, out_pos,
+							out_size));
+					continue;
+				}
+			}
+
+			return_if_error(block_start(s, bc, pos, true));
+		}
+
+		lzma_ret ret;
+
+		if (bc->out_pos < pos) {
+			// Decode and discard the data before pos.
+			size_t skip_pos = 0;
+			ret = block_decode(s, bc, s->skip, &skip_pos,
+					(size_t)my_min(SEEKABLE_SKIP_SIZE,
+						pos - bc->out_pos));
+		} else {
+			ret = block_decode(s, bc, out, out_pos, out_size);
+			pos = bc->out_pos;
+		}
+
+		if (ret != LZMA_OK) {
+			bc->active = false;
+			return ret;
+		}
+	}
+
+	return LZMA_OK;
+}
+
+
+extern LZMA_API(const lzma_index *)
+lzma_seekable_index(const lzma_seekable *s)
+{
+	return s->index;
+}
+
+
+extern LZMA_API(uint64_t)
+lzma_seekable_checkpoints_size(const lzma_seekable *s)
+{
+	uint64_t size = CHECKPOINTS_HEADER_SIZE + CHECKPOINTS_FOOTER_SIZE;
+
+	for (size_t i = 0; i < s->checkpoints_count; ++i)
+		size += CHECKPOINTS_RECORD_SIZE + s->checkpoints[i].state_size;
+
+	return size;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_seekable_checkpoints_encode(const lzma_seekable *s,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+{
+	if (s == NULL || out == NULL || out_pos == NULL || *out_pos > out_size)
+		return LZMA_PROG_ERROR;
+
+	if (out_size - *out_pos < lzma_seekable_checkpoints_size(s))
+		return LZMA_BUF_ERROR;
+
+	uint8_t *const start = out + *out_pos;
+	uint8_t *p = start;
+
+	memcpy(p, checkpoints_magic, sizeof(checkpoints_magic));
+	write64le(p + 6, s->file_size);
+	write64le(p + 14, s->uncompressed_size);
+	write64le(p + 22, (uint64_t)s->checkpoints_count);
+	p += CHECKPOINTS_HEADER_SIZE;
+
+	for (size_t i = 0; i < s->checkpoints_count; ++i) {
+		const checkpoint *cp = &s->checkpoints[i];
+		write64le(p, cp->block_number);
+		write64le(p + 8, cp->uncompressed_offset);
+		write64le(p + 16, cp->compressed_offset);
+		write64le(p + 24, (uint64_t)cp->state_size);
+		p += CHECKPOINTS_RECORD_SIZE;
+
+		memcpy(p, cp->state, cp->state_size);
+		p += cp->state_size;
+	}
+
+	write32le(p, lzma_crc32(start, (size_t)(p - start), 0));
+	p += CHECKPOINTS_FOOTER_SIZE;
+
+	*out_pos += (size_t)(p - start);
+	return LZMA_OK;
+}
+
+
+/// Check that a decoded checkpoint is in the Block whose number it
+/// claims and that it is after the previous checkpoint.
+static bool
+checkpoint_is_valid(const lzma_seekable *s, const checkpoint *cp,
+		uint64_t prev_offset)
+{
+	if (cp->uncompressed_offset <= prev_offset
+			|| cp->uncompressed_offset >= s->uncompressed_size)
+		return false;
+
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, s->index);
+	if (lzma_index_iter_locate(&iter, cp->uncompressed_offset))
+		return false;
+
+	return iter.block.number_in_file == cp->block_number
+			&& cp->uncompressed_offset
+				> iter.block.uncompressed_file_offset
+			&& cp->compressed_offset
+				> iter.block.compressed_file_offset
+			&& cp->compressed_offset
+				< iter.block.compressed_file_offset
+					+ iter.block.unpadded_size;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_seekable_checkpoints_decode(lzma_seekable *s,
+		const uint8_t *in, size_t *in_pos, size_t in_size)
+{
+	if (s == NULL || in == NULL || in_pos == NULL || *in_pos > in_size)
+		return LZMA_PROG_ERROR;
+
+	const uint8_t *const start = in + *in_pos;
+	const size_t size = in_size - *in_pos;
+
+	if (size < CHECKPOINTS_HEADER_SIZE + CHECKPOINTS_FOOTER_SIZE)
+		return LZMA_DATA_ERROR;
+
+	if (memcmp(start, checkpoints_magic, sizeof(checkpoints_magic)) != 0)
+		return LZMA_FORMAT_ERROR;
+
+	// The checkpoints must have been made from the same file.
+	if (read64le(start + 6) != s->file_size
+			|| read64le(start + 14) != s->uncompressed_size)
+		return LZMA_DATA_ERROR;
+
+	// Each checkpoint takes more than CHECKPOINTS_RECORD_SIZE bytes,
+	// which limits the count to something that can be allocated.
+	const uint64_t count = read64le(start + 22);
+	if (count > (size - CHECKPOINTS_HEADER_SIZE
+				- CHECKPOINTS_FOOTER_SIZE)
+				/ CHECKPOINTS_RECORD_SIZE
+			|| count > SIZE_MAX / sizeof(checkpoint))
+		return LZMA_DATA_ERROR;
+
+	checkpoint *checkpoints = NULL;
+	if (count > 0) {
+		checkpoints = lzma_alloc((size_t)count * sizeof(checkpoint),
+				s->allocator);
+		if (checkpoints == NULL)
+			return LZMA_MEM_ERROR;
+	}
+
+	lzma_ret ret = LZMA_OK;
+	size_t pos = CHECKPOINTS_HEADER_SIZE;
+	uint64_t prev_offset = 0;
+	size_t i = 0;
+
+	while (i < count) {
+		if (size - CHECKPOINTS_FOOTER_SIZE - pos
+				< CHECKPOINTS_RECORD_SIZE) {
+			ret = LZMA_DATA_ERROR;
+			break;
+		}
+
+		checkpoint *cp = &checkpoints[i];
+		cp->block_number = read64le(start + pos);
+		cp->uncompressed_offset = read64le(start + pos + 8);
+		cp->compressed_offset = read64le(start + pos + 16);
+		const uint64_t state_size = read64le(start + pos + 24);
+		pos += CHECKPOINTS_RECORD_SIZE;
+
+		if (state_size > size - CHECKPOINTS_FOOTER_SIZE - pos
+				|| !checkpoint_is_valid(s, cp, prev_offset)) {
+			ret = LZMA_DATA_ERROR;
+			break;
+		}
+
+		cp->state_size = (size_t)state_size;
+		cp->state = lzma_alloc(cp->state_size, s->allocator);
+		if (cp->state == NULL) {
+			ret = LZMA_MEM_ERROR;
+			break;
+		}
+
+		memcpy(cp->state, start + pos, cp->state_size);
+		pos += cp->state_size;
+		prev_offset = cp->uncompressed_offset;
+		++i;
+	}
+
+	// The contents of each state are validated when it is used.
+	if (ret == LZMA_OK && (size - pos < CHECKPOINTS_FOOTER_SIZE
+			|| lzma_crc32(start, pos, 0)
+				!= read32le(start + pos)))
+		ret = LZMA_DATA_ERROR;
+
+	if (ret != LZMA_OK) {
+		checkpoints_free(checkpoints, i, s->allocator);
+		return ret;
+	}
+
+	// Replace the old checkpoints. The current Block has to be
+	// restarted because its next checkpoint position may be wrong.
+	checkpoints_free(s->checkpoints, s->checkpoints_count, s->allocator);
+	s->checkpoints = checkpoints;
+	s->checkpoints_count = (size_t)count;
+	s->checkpoints_alloc = (size_t)count;
+	s->coder.active = false;
+
+	*in_pos += pos + CHECKPOINTS_FOOTER_SIZE;
+	return LZMA_OK;
+}
+
+
+extern LZMA_API(void)
+lzma_seekable_end(lzma_seekable *s)
+{
+	if (s == NULL)
+		return;
+
+#ifdef MYTHREAD_ENABLED
+	if (s->prefetch) {
+		mythread_sync(s->mutex) {
+			s->prefetch_exit = true;
+			mythread_cond_signal(&s->cond);
+		}
+
+		mythread_join(s->thread_id);
+		mythread_cond_destroy(&s->cond);
+		mythread_mutex_destroy(&s->mutex);
+
+		block_coder_end(s->prefetch_coder, s->allocator);
+		lzma_free(s->prefetch_coder, s->allocator);
+	}
+#endif
+
+	while (s->cache_head != NULL) {
+		cache_entry *e = s->cache_head;
+		s->cache_head = e->next;
+		lzma_free(e, s->allocator);
+	}
+
+	lzma_free(s->cache_table, s->allocator);
+
+	checkpoints_free(s->checkpoints, s->checkpoints_count, s->allocator);
+	block_coder_end(&s->coder, s->allocator);
+	lzma_index_end(s->index, s->allocator);
+	lzma_free(s, s->allocator);
+	return;
+}
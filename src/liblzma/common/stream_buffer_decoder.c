@@ -29,12 +29,12 @@ lzma_stream_buffer_decode(uint64_t *memlimit, uint32_t flags,
 	if (flags & LZMA_TELL_ANY_CHECK)
 		return LZMA_PROG_ERROR;
 
-	// Initialize the Stream decoder.
-	// TODO: We need something to tell the decoder that it can use the
-	// output buffer as workspace, and thus save significant amount of RAM.
+	// Initialize the Stream decoder. The whole output is decoded to
+	// out[] in one call, so it can be used as the dictionary. This
+	// saves a significant amount of RAM and a copy of all the data.
 	lzma_next_coder stream_decoder = LZMA_NEXT_CODER_INIT;
 	lzma_ret ret = lzma_stream_decoder_init(
-			&stream_decoder, allocator, *memlimit, flags);
+			&stream_decoder, allocator, *memlimit, flags, true);
 
 	if (ret == LZMA_OK) {
 		// Save the positions so that we can restore them in case
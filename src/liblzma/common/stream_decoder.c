@@ -11,6 +11,7 @@
 
 #include "stream_decoder.h"
 #include "block_decoder.h"
+#include "filter_decoder.h"
 #include "index.h"
 
 
@@ -67,6 +68,10 @@ typedef struct {
 	/// Stream Padding is a multiple of four bytes.
 	bool concatenated;
 
+	/// If true, the Blocks are decoded using the output buffer as
+	/// the dictionary. This is used by lzma_stream_buffer_decode().
+	bool out_as_dict;
+
 	/// When decoding concatenated Streams, this is true as long as we
 	/// are decoding the first Stream. This is needed to avoid misleading
 	/// LZMA_FORMAT_ERROR in case the later Streams don't have valid magic
@@ -213,6 +218,11 @@ stream_decode(void *coder_ptr, const lzma_allocator *allocator,
 		// it always resets this to false.
 		coder->block_options.ignore_check = coder->ignore_check;
 
+		// If the Block Header contains the Uncompressed Size,
+		// a smaller dictionary may be enough.
+		lzma_raw_decoder_limit_dict(filters,
+				coder->block_options.uncompressed_size);
+
 		// Check the memory usage limit.
 		const uint64_t memusage = lzma_raw_decoder_memusage(filters);
 		lzma_ret ret;
@@ -236,7 +246,8 @@ stream_decode(void *coder_ptr, const lzma_allocator *allocator,
 				ret = lzma_block_decoder_init(
 						&coder->block_decoder,
 						allocator,
-						&coder->block_options);
+						&coder->block_options,
+						coder->out_as_dict);
 			}
 		}
 
@@ -420,7 +431,7 @@ stream_decoder_memconfig(void *coder_ptr, uint64_t *memusage,
 extern lzma_ret
 lzma_stream_decoder_init(
 		lzma_next_coder *next, const lzma_allocator *allocator,
-		uint64_t memlimit, uint32_t flags)
+		uint64_t memlimit, uint32_t flags, bool out_as_dict)
 {
 	lzma_next_coder_init(&lzma_stream_decoder_init, next, allocator);
 
@@ -451,6 +462,7 @@ lzma_stream_decoder_init(
 	coder->tell_any_check = (flags & LZMA_TELL_ANY_CHECK) != 0;
 	coder->ignore_check = (flags & LZMA_IGNORE_CHECK) != 0;
 	coder->concatenated = (flags & LZMA_CONCATENATED) != 0;
+	coder->out_as_dict = out_as_dict;
 	coder->first_stream = true;
 
 	return stream_decoder_reset(coder, allocator);
@@ -460,7 +472,8 @@ lzma_stream_decoder_init(
 extern LZMA_API(lzma_ret)
 lzma_stream_decoder(lzma_stream *strm, uint64_t memlimit, uint32_t flags)
 {
-	lzma_next_strm_init(lzma_stream_decoder_init, strm, memlimit, flags);
+	lzma_next_strm_init(lzma_stream_decoder_init, strm, memlimit, flags,
+			false);
 
 	strm->internal->supported_actions[LZMA_RUN] = true;
 	strm->internal->supported_actions[LZMA_FINISH] = true;
@@ -14,8 +14,10 @@
 
 #include "common.h"
 
+/// Initialize a .xz Stream decoder. See lzma_raw_decoder_init() about
+/// out_as_dict.
 extern lzma_ret lzma_stream_decoder_init(
 		lzma_next_coder *next, const lzma_allocator *allocator,
-		uint64_t memlimit, uint32_t flags);
+		uint64_t memlimit, uint32_t flags, bool out_as_dict);
 
 #endif
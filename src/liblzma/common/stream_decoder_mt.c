@@ -12,9 +12,14 @@
 
 #include "common.h"
 #include "block_decoder.h"
+#include "filter_decoder.h"
+#include "check.h"
 #include "stream_decoder.h"
 #include "index.h"
 #include "outqueue.h"
+#include "thread_pool.h"
+#include "numa.h"
+#include "worker_stats.h"
 
 
 typedef enum {
@@ -38,11 +43,26 @@ struct worker_thread {
 	worker_state state;
 
 	/// Input buffer that will contain the whole Block except Block Header.
+	/// When a Block is split, this contains one segment of the
+	/// Compressed Data followed by an LZMA2 end marker. The first
+	/// segment is in a buffer that was allocated for the whole Block.
 	uint8_t *in;
 
-	/// Amount of memory allocated for "in"
+	/// Size of the input in "in"
 	size_t in_size;
 
+	/// Amount of memory allocated for "in"
+	size_t in_allocated;
+
+	/// Number of bytes in "in" that aren't part of the input file.
+	/// This is one if an end marker was added after a segment.
+	size_t in_added;
+
+	/// True if the main thread has ended the input of the Block decoder
+	/// with an end marker after the first segment of a split Block.
+	/// This is protected by our mutex.
+	bool truncated;
+
 	/// Number of bytes written to "in" by the main thread
 	size_t in_filled;
 
@@ -50,13 +70,13 @@ struct worker_thread {
 	size_t in_pos;
 
 	/// Amount of uncompressed data that has been decoded. This local
-	/// copy is needed because updating outbuf->pos requires locking
-	/// the main mutex (coder->mutex).
+	/// copy is needed because outbuf->pos is updated only when
+	/// the main thread is interested in it.
 	size_t out_pos;
 
-	/// Pointer to the main structure is needed to (1) lock the main
-	/// mutex (coder->mutex) when updating outbuf->pos and (2) when
-	/// putting this thread back to the stack of free threads.
+	/// Pointer to the main structure is needed to (1) wake up the main
+	/// thread after updating outbuf->pos and (2) when putting this
+	/// thread back to the stack of free threads.
 	struct lzma_stream_coder *coder;
 
 	/// The allocator is set by the main thread. Since a copy of the
@@ -68,21 +88,20 @@ struct worker_thread {
 	lzma_outbuf *outbuf;
 
 	/// Amount of compressed data that has already been decompressed.
-	/// This is updated from in_pos when our mutex is locked.
+	/// This is updated from in_pos without locking any mutex.
 	/// This is size_t, not uint64_t, because per-thread progress
 	/// is limited to sizes of allocated buffers.
-	size_t progress_in;
+	mythread_atomic_size progress_in;
 
 	/// Like progress_in but for uncompressed data.
-	size_t progress_out;
-
-	/// Updating outbuf->pos requires locking the main mutex
-	/// (coder->mutex). Since the main thread will only read output
-	/// from the oldest outbuf in the queue, only the worker thread
-	/// that is associated with the oldest outbuf needs to update its
-	/// outbuf->pos. This avoids useless mutex contention that would
-	/// happen if all worker threads were frequently locking the main
-	/// mutex to update their outbuf->pos.
+	mythread_atomic_size progress_out;
+
+	/// Updating outbuf->pos may require waking up the main thread.
+	/// Since the main thread will only read output from the oldest
+	/// outbuf in the queue, only the worker thread that is associated
+	/// with the oldest outbuf needs to update its outbuf->pos. This
+	/// avoids useless wake-ups that would happen if all worker threads
+	/// were frequently telling the main thread about their progress.
 	///
 	/// When partial_update_enabled is true, this worker thread will
 	/// update outbuf->pos and outbuf->decoder_in_pos after each call
@@ -114,8 +133,18 @@ struct worker_thread {
 	mythread_cond cond;
 
 	/// The ID of this thread is used to join the thread
-	/// when it's not needed anymore.
+	/// when it's not needed anymore. This isn't used when
+	/// coder->thread_pool != NULL.
 	mythread thread_id;
+
+	/// Job that decodes the Block in a thread of coder->thread_pool.
+	/// The job is submitted once the whole Block has been copied
+	/// to the input buffer.
+	lzma_thread_job job;
+
+	/// Statistics for lzma_mt_get_stats(). This is protected
+	/// by our mutex.
+	lzma_worker_stats stats;
 };
 
 
@@ -126,6 +155,8 @@ struct lzma_stream_coder {
 		SEQ_BLOCK_INIT,
 		SEQ_BLOCK_THR_INIT,
 		SEQ_BLOCK_THR_RUN,
+		SEQ_SPLIT_COPY,
+		SEQ_SPLIT_END,
 		SEQ_BLOCK_DIRECT_INIT,
 		SEQ_BLOCK_DIRECT_RUN,
 		SEQ_INDEX_WAIT_OUTPUT,
@@ -159,11 +190,24 @@ struct lzma_stream_coder {
 	/// with O(1) memory usage.
 	lzma_index_hash *index_hash;
 
+	/// True if lzma_mt.index was given. Then index_iter points to
+	/// the Block whose Block Header was decoded most recently.
+	bool use_index;
+
+	/// Iterator to the Index given in lzma_mt.index. It is used to
+	/// get the sizes of Blocks whose Block Headers don't store them.
+	lzma_index_iter index_iter;
+
 
 	/// Maximum wait time if cannot use all the input and cannot
 	/// fill the output buffer. This is in milliseconds.
 	uint32_t timeout;
 
+	/// If non-NULL, this is called instead of waiting for the worker
+	/// threads. See lzma_mt.notify.
+	void (*notify)(void *notify_opaque);
+	void *notify_opaque;
+
 
 	/// Error code from a worker thread.
 	///
@@ -200,6 +244,20 @@ struct lzma_stream_coder {
 	/// the new input from the application.
 	struct worker_thread *thr;
 
+	/// Thread pool given in lzma_mt.thread_pool or NULL if
+	/// this decoder creates its own threads.
+	lzma_thread_pool *thread_pool;
+
+	/// True if LZMA_MT_NUMA was used and thread_pool == NULL:
+	/// each thread pins itself to a NUMA node when it starts.
+	bool numa;
+
+	/// Number of jobs that have been given to thread_pool but
+	/// haven't completed yet.
+	///
+	/// \note       Use mutex.
+	uint32_t jobs_pending;
+
 	/// Output buffer queue for decompressed data from the worker threads
 	///
 	/// \note       Use mutex with operations that need it.
@@ -247,6 +305,12 @@ struct lzma_stream_coder {
 	uint64_t mem_next_block;
 
 
+	/// This is non-zero when the main thread is in
+	/// read_output_and_wait() and may be waiting for coder->cond.
+	/// Worker threads doing partial updates read this to know if
+	/// they need to lock the mutex to signal the main thread.
+	mythread_atomic_size main_waiting;
+
 	/// Amount of compressed data in Stream Header + Blocks that have
 	/// already been finished.
 	///
@@ -259,6 +323,19 @@ struct lzma_stream_coder {
 	/// \note       Use mutex.
 	uint64_t progress_out;
 
+	/// Time the main thread has waited for a free thread and
+	/// for output. These are used only by the main thread.
+	uint64_t wait_thread_usec;
+	uint64_t wait_out_usec;
+
+	/// Number of Blocks whose decoding had to wait because of
+	/// memlimit_threading, and number of Blocks decoded in direct
+	/// mode because of memlimit_threading. memlimit_waited is set
+	/// when the current Block has been counted in memlimit_waits.
+	uint64_t memlimit_waits;
+	uint64_t memlimit_direct;
+	bool memlimit_waited;
+
 
 	/// If true, LZMA_NO_CHECK is returned if the Stream has
 	/// no integrity check.
@@ -306,7 +383,86 @@ struct lzma_stream_coder {
 	/// decoder to multi-threaded decoder.
 	bool out_was_filled;
 
-	/// Write position in buffer[] and position in Stream Padding
+	/// True if LZMA_MT_SPLIT_BLOCKS was used.
+	bool split_blocks;
+
+	/// True while the chunk headers of the current Block are parsed
+	/// in SEQ_BLOCK_THR_RUN to find the second LZMA2 chunk that resets
+	/// the dictionary. Until then the Block is decoded normally.
+	bool split_scan;
+
+	/// True if the rest of the current Block is decoded in segments
+	/// that start at the LZMA2 chunks that reset the dictionary.
+	bool split;
+
+	/// Options of the LZMA2 filter of the current split Block
+	lzma_options_lzma split_options;
+
+	/// Filter chain of the next segment. Its options point to
+	/// split_seg_options which has a dictionary size that has been
+	/// limited to the size of the segment.
+	lzma_filter split_filters[2];
+	lzma_options_lzma split_seg_options;
+
+	/// State of the LZMA2 chunk header parser
+	enum {
+		SPLIT_CONTROL,
+		SPLIT_HEADER,
+		SPLIT_DATA,
+		SPLIT_END,
+		SPLIT_ERROR,
+	} split_seq;
+
+	/// LZMA2 chunk header and its size
+	uint8_t split_header[6];
+	size_t split_header_pos;
+	size_t split_header_size;
+
+	/// Amount of chunk data left to copy
+	size_t split_data_left;
+
+	/// Compressed and uncompressed sizes of the chunks parsed so far
+	lzma_vli split_in;
+	lzma_vli split_out;
+
+	/// Uncompressed size of the current segment
+	size_t split_seg_out;
+
+	/// Buffer for the input of the current segment. It is handed to
+	/// a worker thread once the whole segment has been copied.
+	/// split_buf_size is counted in mem_in_use.
+	uint8_t *split_buf;
+	size_t split_buf_size;
+	size_t split_filled;
+
+	/// True when the integrity check of a split Block is being
+	/// calculated from the output. Only one Block at a time can be
+	/// split; while this is true, other Blocks aren't split.
+	bool split_check_pending;
+
+	/// True once the Check field of the split Block has been read
+	/// into split_check_field.
+	bool split_check_ready;
+
+	/// Position of the first byte of the second segment of the split
+	/// Block in the uncompressed data and the number of bytes not
+	/// hashed yet. The first segment is hashed by its worker thread.
+	uint64_t split_check_start;
+	uint64_t split_check_left;
+
+	lzma_check split_check_type;
+	lzma_check_state split_check;
+	uint8_t split_check_field[LZMA_CHECK_SIZE_MAX];
+
+	/// Total size of the output buffers that have been added to
+	/// the output queue and the amount of data read from them. These
+	/// tell which part of the output belongs to the split Block.
+	uint64_t out_queued;
+	uint64_t out_read;
+
+	/// Write position in buffer[] and position in Stream Padding.
+	/// This is also the position in the Block Padding and Check fields
+	/// of a split Block.
 	size_t pos;
 
 	/// Buffer to hold Stream Header, Block Header, and Stream Footer.
@@ -329,14 +485,158 @@ worker_enable_partial_update(void *thr_ptr)
 }
 
 
+/// Tell the main thread how far we have got in the current Block.
+/// The positions are stored without locking coder->mutex; the mutex
+/// is locked only if the main thread might be waiting for coder->cond
+/// or if the application wants to be notified.
+static void
+worker_partial_update(struct worker_thread *thr)
+{
+	mythread_atomic_store(&thr->outbuf->pos, thr->out_pos);
+	mythread_atomic_store(&thr->outbuf->decoder_in_pos, thr->in_pos);
+
+	if (thr->coder->notify != NULL) {
+		mythread_sync(thr->coder->mutex) {
+			thr->coder->notify(thr->coder->notify_opaque);
+		}
+	} else if (mythread_atomic_load(&thr->coder->main_waiting) != 0) {
+		mythread_sync(thr->coder->mutex) {
+			mythread_cond_signal(&thr->coder->cond);
+		}
+	}
+
+	return;
+}
+
+
+/// Pass the result of the Block decoder to the main thread once
+/// the Block decoder has returned something else than LZMA_OK.
+static void
+worker_decoder_done(struct worker_thread *thr, lzma_ret ret)
+{
+	// Either we finished successfully (LZMA_STREAM_END) or an error
+	// occurred.
+	//
+	// The sizes are in the Block Header and the Block decoder
+	// checks that they match, thus we know these. The first segment
+	// of a split Block is shorter than the Block.
+	assert(ret != LZMA_STREAM_END || thr->in_pos == thr->in_size);
+	assert(ret != LZMA_STREAM_END || thr->truncated
+		|| thr->out_pos == thr->block_options.uncompressed_size);
+
+	mythread_sync(thr->mutex) {
+		// Block decoder ensures this, but do a sanity check anyway
+		// because thr->in_filled < thr->in_size means that the main
+		// thread is still writing to thr->in.
+		if (ret == LZMA_STREAM_END && thr->in_filled != thr->in_size) {
+			assert(0);
+			ret = LZMA_PROG_ERROR;
+		}
+
+		if (thr->state != THR_EXIT)
+			thr->state = THR_IDLE;
+	}
+
+	// Free the input buffer. Don't update in_allocated as we need
+	// it later to update thr->coder->mem_in_use.
+	//
+	// This step is skipped if an error occurred because the main thread
+	// might still be writing to thr->in. The memory will be freed after
+	// threads_end() sets thr->state = THR_EXIT.
+	if (ret == LZMA_STREAM_END) {
+		lzma_free(thr->in, thr->allocator);
+		thr->in = NULL;
+	}
+
+	// An end marker added by the main thread isn't part of the input.
+	const size_t in_used = ret == LZMA_STREAM_END
+			? thr->in_pos - thr->in_added : thr->in_pos;
+
+	mythread_sync(thr->coder->mutex) {
+		// Move our progress info to the main thread.
+		thr->coder->progress_in += in_used;
+		thr->coder->progress_out += thr->out_pos;
+		mythread_atomic_store(&thr->progress_in, 0);
+		mythread_atomic_store(&thr->progress_out, 0);
+
+		// Move the progress to the statistics too. This is done
+		// while coder->mutex is locked so that
+		// stream_decoder_mt_get_stats() won't count the same
+		// data twice.
+		mythread_sync(thr->mutex) {
+			if (ret == LZMA_STREAM_END)
+				++thr->stats.blocks;
+
+			thr->stats.uncompressed_size += thr->out_pos;
+			thr->stats.compressed_size += in_used;
+			lzma_worker_stats_switch(&thr->stats, WORKER_IDLE);
+		}
+
+		// The main thread continues the integrity check of
+		// a split Block from the state after the first segment.
+		// It doesn't read the state before the outbuf has been
+		// marked as finished.
+		if (ret == LZMA_STREAM_END && thr->truncated)
+			thr->coder->split_check = *lzma_block_decoder_check(
+					&thr->block_decoder);
+
+		// Mark the outbuf as finished.
+		mythread_atomic_store(&thr->outbuf->pos, thr->out_pos);
+		mythread_atomic_store(&thr->outbuf->decoder_in_pos,
+				thr->in_pos);
+		thr->outbuf->finished = true;
+		thr->outbuf->finish_ret = ret;
+		thr->outbuf = NULL;
+
+		// If an error occurred, tell it to the main thread.
+		if (ret != LZMA_STREAM_END
+				&& thr->coder->thread_error == LZMA_OK)
+			thr->coder->thread_error = ret;
+
+		// Return the worker thread to the stack of available
+		// threads only if no errors occurred.
+		if (ret == LZMA_STREAM_END) {
+			// Update memory usage counters.
+			thr->coder->mem_in_use -= thr->in_allocated;
+			thr->coder->mem_in_use -= thr->mem_filters;
+			thr->coder->mem_cached += thr->mem_filters;
+
+			// Put this thread to the stack of free threads.
+			thr->next = thr->coder->threads_free;
+			thr->coder->threads_free = thr;
+		}
+
+		// The main thread may free *thr once the job count has
+		// dropped to zero, so this must be the last thing done
+		// with *thr.
+		if (thr->coder->thread_pool != NULL)
+			--thr->coder->jobs_pending;
+
+		mythread_cond_signal(&thr->coder->cond);
+
+		if (thr->coder->notify != NULL)
+			thr->coder->notify(thr->coder->notify_opaque);
+	}
+
+	return;
+}
+
+
 static MYTHREAD_RET_TYPE
 worker_decoder(void *thr_ptr)
 {
 	struct worker_thread *thr = thr_ptr;
 	size_t in_filled;
 	bool partial_update_enabled;
+	bool truncated;
 	lzma_ret ret;
 
+	// The dictionary buffer is allocated by the main thread but it is
+	// touched first in this thread, so with the default memory policy
+	// its pages come from the node of this thread.
+	if (thr->coder->numa)
+		lzma_numa_bind_thread((uint32_t)(thr - thr->coder->threads));
+
 next_loop_lock:
 
 	mythread_mutex_lock(&thr->mutex);
@@ -362,8 +662,8 @@ next_loop_unlocked:
 	assert(thr->state == THR_RUN);
 
 	// Update progress info for get_progress().
-	thr->progress_in = thr->in_pos;
-	thr->progress_out = thr->out_pos;
+	mythread_atomic_store(&thr->progress_in, thr->in_pos);
+	mythread_atomic_store(&thr->progress_out, thr->out_pos);
 
 	// If we don't have any new input, wait for a signal from the main
 	// thread except if partial output has just been enabled
@@ -373,13 +673,16 @@ next_loop_unlocked:
 	// is useless but harmless as it can occur only once per Block.
 	in_filled = thr->in_filled;
 	partial_update_enabled = thr->partial_update_enabled;
+	truncated = thr->truncated;
 
 	if (in_filled == thr->in_pos && !(partial_update_enabled
 			&& !thr->partial_update_started)) {
+		lzma_worker_stats_switch(&thr->stats, WORKER_WAIT_IN);
 		mythread_cond_wait(&thr->cond, &thr->mutex);
 		goto next_loop_unlocked;
 	}
 
+	lzma_worker_stats_switch(&thr->stats, WORKER_BUSY);
 	mythread_mutex_unlock(&thr->mutex);
 
 	// Pass the input in small chunks to the Block decoder.
@@ -390,6 +693,9 @@ next_loop_unlocked:
 	if ((in_filled - thr->in_pos) > chunk_size)
 		in_filled = thr->in_pos + chunk_size;
 
+	if (truncated)
+		lzma_block_decoder_truncate(&thr->block_decoder);
+
 	ret = thr->block_decoder.code(
 			thr->block_decoder.coder, thr->allocator,
 			thr->in, &thr->in_pos, in_filled,
@@ -412,111 +718,78 @@ next_loop_unlocked:
 			// in_pos has changed. If thr->partial_update_started
 			// was false, it is possible that neither in_pos nor
 			// out_pos has changed.
-			mythread_sync(thr->coder->mutex) {
-				thr->outbuf->pos = thr->out_pos;
-				thr->outbuf->decoder_in_pos = thr->in_pos;
-				mythread_cond_signal(&thr->coder->cond);
-			}
+			worker_partial_update(thr);
 		}
 
 		goto next_loop_lock;
 	}
 
-	// Either we finished successfully (LZMA_STREAM_END) or an error
-	// occurred.
-	//
-	// The sizes are in the Block Header and the Block decoder
-	// checks that they match, thus we know these:
-	assert(ret != LZMA_STREAM_END || thr->in_pos == thr->in_size);
-	assert(ret != LZMA_STREAM_END
-		|| thr->out_pos == thr->block_options.uncompressed_size);
-
-	mythread_sync(thr->mutex) {
-		// Block decoder ensures this, but do a sanity check anyway
-		// because thr->in_filled < thr->in_size means that the main
-		// thread is still writing to thr->in.
-		if (ret == LZMA_STREAM_END && thr->in_filled != thr->in_size) {
-			assert(0);
-			ret = LZMA_PROG_ERROR;
-		}
-
-		if (thr->state != THR_EXIT)
-			thr->state = THR_IDLE;
-	}
-
-	// Free the input buffer. Don't update in_size as we need
-	// it later to update thr->coder->mem_in_use.
-	//
-	// This step is skipped if an error occurred because the main thread
-	// might still be writing to thr->in. The memory will be freed after
-	// threads_end() sets thr->state = THR_EXIT.
-	if (ret == LZMA_STREAM_END) {
-		lzma_free(thr->in, thr->allocator);
-		thr->in = NULL;
-	}
+	worker_decoder_done(thr, ret);
+	goto next_loop_lock;
+}
 
-	mythread_sync(thr->coder->mutex) {
-		// Move our progress info to the main thread.
-		thr->coder->progress_in += thr->in_pos;
-		thr->coder->progress_out += thr->out_pos;
-		thr->progress_in = 0;
-		thr->progress_out = 0;
 
-		// Mark the outbuf as finished.
-		thr->outbuf->pos = thr->out_pos;
-		thr->outbuf->decoder_in_pos = thr->in_pos;
-		thr->outbuf->finished = true;
-		thr->outbuf->finish_ret = ret;
-		thr->outbuf = NULL;
+/// Decodes a Block in a thread of coder->thread_pool. The whole Block
+/// is in thr->in already so this never waits for the main thread.
+static void
+worker_decoder_job(void *thr_ptr)
+{
+	struct worker_thread *thr = thr_ptr;
+	lzma_ret ret;
 
-		// If an error occurred, tell it to the main thread.
-		if (ret != LZMA_STREAM_END
-				&& thr->coder->thread_error == LZMA_OK)
-			thr->coder->thread_error = ret;
+	do {
+		bool partial_update_enabled = false;
+		bool truncated = false;
+		bool stopped = false;
 
-		// Return the worker thread to the stack of available
-		// threads only if no errors occurred.
-		if (ret == LZMA_STREAM_END) {
-			// Update memory usage counters.
-			thr->coder->mem_in_use -= thr->in_size;
-			thr->coder->mem_in_use -= thr->mem_filters;
-			thr->coder->mem_cached += thr->mem_filters;
+		// Update progress info for get_progress().
+		mythread_atomic_store(&thr->progress_in, thr->in_pos);
+		mythread_atomic_store(&thr->progress_out, thr->out_pos);
 
-			// Put this thread to the stack of free threads.
-			thr->next = thr->coder->threads_free;
-			thr->coder->threads_free = thr;
+		mythread_sync(thr->mutex) {
+			partial_update_enabled = thr->partial_update_enabled;
+			truncated = thr->truncated;
+			stopped = thr->state != THR_RUN;
+			lzma_worker_stats_switch(&thr->stats, WORKER_BUSY);
 		}
 
-		mythread_cond_signal(&thr->coder->cond);
-	}
-
-	goto next_loop_lock;
-}
+		if (stopped) {
+			// threads_stop() was called. The main thread
+			// will free the resources.
+			mythread_sync(thr->coder->mutex) {
+				mythread_sync(thr->mutex) {
+					lzma_worker_stats_switch(&thr->stats,
+							WORKER_IDLE);
+				}
 
+				--thr->coder->jobs_pending;
+				mythread_cond_signal(&thr->coder->cond);
+			}
 
-/// Tells the worker threads to exit and waits for them to terminate.
-static void
-threads_end(struct lzma_stream_coder *coder, const lzma_allocator *allocator)
-{
-	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
-		mythread_sync(coder->threads[i].mutex) {
-			coder->threads[i].state = THR_EXIT;
-			mythread_cond_signal(&coder->threads[i].cond);
+			return;
 		}
-	}
 
-	for (uint32_t i = 0; i < coder->threads_initialized; ++i)
-		mythread_join(coder->threads[i].thread_id);
+		// Use small chunks for the same reasons as
+		// in worker_decoder().
+		const size_t chunk_size = 16384;
+		size_t in_filled = thr->in_filled;
+		if ((in_filled - thr->in_pos) > chunk_size)
+			in_filled = thr->in_pos + chunk_size;
 
-	lzma_free(coder->threads, allocator);
-	coder->threads_initialized = 0;
-	coder->threads = NULL;
-	coder->threads_free = NULL;
+		if (truncated)
+			lzma_block_decoder_truncate(&thr->block_decoder);
 
-	// The threads don't update these when they exit. Do it here.
-	coder->mem_in_use = 0;
-	coder->mem_cached = 0;
+		ret = thr->block_decoder.code(
+				thr->block_decoder.coder, thr->allocator,
+				thr->in, &thr->in_pos, in_filled,
+				thr->outbuf->buf, &thr->out_pos,
+				thr->outbuf->allocated, LZMA_RUN);
+
+		if (ret == LZMA_OK && partial_update_enabled)
+			worker_partial_update(thr);
+	} while (ret == LZMA_OK);
 
+	worker_decoder_done(thr, ret);
 	return;
 }
 
@@ -535,8 +808,24 @@ threads_stop(struct lzma_stream_coder *coder)
 		// The threads that are in the THR_RUN state will stop
 		// when they check the state the next time. There's no
 		// need to signal coder->threads[i].cond.
+		//
+		// With a thread pool, the jobs that haven't started
+		// are removed from the queue.
+		bool cancelled = false;
+
 		mythread_sync(coder->threads[i].mutex) {
 			coder->threads[i].state = THR_IDLE;
+
+			if (coder->thread_pool != NULL)
+				cancelled = lzma_thread_pool_cancel(
+						coder->thread_pool,
+						&coder->threads[i].job);
+		}
+
+		if (cancelled) {
+			mythread_sync(coder->mutex) {
+				--coder->jobs_pending;
+			}
 		}
 	}
 
@@ -544,6 +833,56 @@ threads_stop(struct lzma_stream_coder *coder)
 }
 
 
+/// Tells the worker threads to exit and waits for them to terminate.
+static void
+threads_end(struct lzma_stream_coder *coder, const lzma_allocator *allocator)
+{
+	if (coder->thread_pool != NULL) {
+		// Wait for the jobs to complete and then free the resources
+		// like worker_decoder() does when exiting.
+		threads_stop(coder);
+
+		mythread_sync(coder->mutex) {
+			while (coder->jobs_pending > 0)
+				mythread_cond_wait(&coder->cond,
+						&coder->mutex);
+		}
+
+		for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
+			struct worker_thread *thr = &coder->threads[i];
+
+			lzma_free(thr->in, thr->allocator);
+			lzma_next_end(&thr->block_decoder, thr->allocator);
+
+			mythread_mutex_destroy(&thr->mutex);
+			mythread_cond_destroy(&thr->cond);
+		}
+	} else {
+		for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
+			mythread_sync(coder->threads[i].mutex) {
+				coder->threads[i].state = THR_EXIT;
+				mythread_cond_signal(
+						&coder->threads[i].cond);
+			}
+		}
+
+		for (uint32_t i = 0; i < coder->threads_initialized; ++i)
+			mythread_join(coder->threads[i].thread_id);
+	}
+
+	lzma_free(coder->threads, allocator);
+	coder->threads_initialized = 0;
+	coder->threads = NULL;
+	coder->threads_free = NULL;
+
+	// The threads don't update these when they exit. Do it here.
+	coder->mem_in_use = 0;
+	coder->mem_cached = 0;
+
+	return;
+}
+
+
 /// Initialize a new worker_thread structure and create a new thread.
 static lzma_ret
 initialize_new_thread(struct lzma_stream_coder *coder,
@@ -576,13 +915,19 @@ initialize_new_thread(struct lzma_stream_coder *coder,
 	thr->state = THR_IDLE;
 	thr->in = NULL;
 	thr->in_size = 0;
+	thr->in_allocated = 0;
+	thr->in_added = 0;
 	thr->allocator = allocator;
 	thr->coder = coder;
 	thr->outbuf = NULL;
 	thr->block_decoder = LZMA_NEXT_CODER_INIT;
 	thr->mem_filters = 0;
+	thr->job.func = &worker_decoder_job;
+	thr->job.arg = thr;
+	lzma_worker_stats_init(&thr->stats);
 
-	if (mythread_create(&thr->thread_id, worker_decoder, thr))
+	if (coder->thread_pool == NULL && mythread_create(
+			&thr->thread_id, worker_decoder, thr))
 		goto error_thread;
 
 	++coder->threads_initialized;
@@ -627,11 +972,13 @@ get_thread(struct lzma_stream_coder *coder, const lzma_allocator *allocator)
 	}
 
 	coder->thr->in_filled = 0;
+	coder->thr->in_added = 0;
+	coder->thr->truncated = false;
 	coder->thr->in_pos = 0;
 	coder->thr->out_pos = 0;
 
-	coder->thr->progress_in = 0;
-	coder->thr->progress_out = 0;
+	mythread_atomic_store(&coder->thr->progress_in, 0);
+	mythread_atomic_store(&coder->thr->progress_out, 0);
 
 	coder->thr->partial_update_enabled = false;
 	coder->thr->partial_update_started = false;
@@ -640,6 +987,61 @@ get_thread(struct lzma_stream_coder *coder, const lzma_allocator *allocator)
 }
 
 
+/// Compare the integrity check of the split Block to its Check field.
+static lzma_ret
+split_check_verify(struct lzma_stream_coder *coder)
+{
+	assert(coder->split_check_pending);
+	assert(coder->split_check_ready);
+	assert(coder->split_check_left == 0);
+
+	coder->split_check_pending = false;
+	lzma_check_finish(&coder->split_check, coder->split_check_type);
+
+	if (memcmp(coder->split_check.buffer.u8, coder->split_check_field,
+			lzma_check_size(coder->split_check_type)) != 0)
+		return LZMA_DATA_ERROR;
+
+	return LZMA_OK;
+}
+
+
+/// Update the integrity check of the split Block with the output that was
+/// just read from the output queue. The output of other Blocks is skipped.
+/// If the Check field has been read already, it is verified once the
+/// whole Block has been hashed.
+static lzma_ret
+split_check_update(struct lzma_stream_coder *coder,
+		const uint8_t *buf, size_t size)
+{
+	const uint64_t pos = coder->out_read;
+	coder->out_read += size;
+
+	if (!coder->split_check_pending || coder->split_check_left == 0)
+		return LZMA_OK;
+
+	if (pos < coder->split_check_start) {
+		const uint64_t skip = my_min(size,
+				coder->split_check_start - pos);
+		buf += skip;
+		size -= (size_t)skip;
+	}
+
+	size = (size_t)my_min(size, coder->split_check_left);
+	if (size == 0)
+		return LZMA_OK;
+
+	lzma_check_update(&coder->split_check, coder->split_check_type,
+			buf, size);
+	coder->split_check_left -= size;
+
+	if (coder->split_check_left == 0 && coder->split_check_ready)
+		return split_check_verify(coder);
+
+	return LZMA_OK;
+}
+
+
 static lzma_ret
 read_output_and_wait(struct lzma_stream_coder *coder,
 		const lzma_allocator *allocator,
@@ -652,15 +1054,36 @@ read_output_and_wait(struct lzma_stream_coder *coder,
 	lzma_ret ret = LZMA_OK;
 
 	mythread_sync(coder->mutex) {
+		// Tell the worker threads doing partial updates that
+		// they need to signal coder->cond. This is set while
+		// the mutex is held so that a worker thread either sees
+		// this or its update is seen by the checks below.
+		mythread_atomic_store(&coder->main_waiting, 1);
+
 		do {
 			// Get as much output from the queue as is possible
 			// without blocking.
 			const size_t out_start = *out_pos;
 			do {
+				const size_t out_prev = *out_pos;
 				ret = lzma_outq_read(&coder->outq, allocator,
 						out, out_pos, out_size,
 						NULL, NULL);
 
+				// If the integrity check of a split Block
+				// doesn't match, the error is returned right
+				// after the last byte of that Block.
+				if (*out_pos > out_prev) {
+					const lzma_ret check_ret
+						= split_check_update(coder,
+							out + out_prev,
+							*out_pos - out_prev);
+					if (check_ret != LZMA_OK) {
+						ret = check_ret;
+						break;
+					}
+				}
+
 				// If a Block was finished, tell the worker
 				// thread of the next Block (if it is still
 				// running) to start telling the main thread
@@ -769,13 +1192,16 @@ read_output_and_wait(struct lzma_stream_coder *coder,
 			// providing any new output. We know that this is not
 			// the case because in the beginning of this loop we
 			// tried to read as much as possible even when we had
-			// no output space left and the mutex has been locked
-			// all the time (so worker threads cannot have changed
-			// anything). Thus there must be actual pending output
-			// in the queue.
+			// no output space left and a finished Block cannot
+			// appear while the mutex is locked. However, a worker
+			// thread doing partial updates may have made more
+			// output available without the mutex. If there is
+			// output space left, go back to read it.
 			if (lzma_outq_is_readable(&coder->outq)) {
-				assert(*out_pos == out_size);
-				break;
+				if (*out_pos == out_size)
+					break;
+
+				continue;
 			}
 
 			// If the application stops providing more input
@@ -805,22 +1231,61 @@ read_output_and_wait(struct lzma_stream_coder *coder,
 			// keeps calling lzma_code() without providing more
 			// input, it will eventually get LZMA_BUF_ERROR.
 			//
+			// With a thread pool, the job of coder->thr isn't
+			// submitted until the whole Block has been copied, so
+			// in that case there is nothing to wait for.
+			//
 			// NOTE: We can read partial_update_enabled and
 			// in_filled without thr->mutex as only the main thread
-			// modifies these variables. decoder_in_pos requires
-			// coder->mutex which we are already holding.
+			// modifies these variables. decoder_in_pos is
+			// an atomic variable. If it changes after this check,
+			// the worker thread will signal coder->cond.
 			if (coder->thr != NULL &&
 					coder->thr->partial_update_enabled) {
 				// There is exactly one outbuf in the queue.
 				assert(coder->thr->outbuf == coder->outq.head);
 				assert(coder->thr->outbuf == coder->outq.tail);
 
-				if (coder->thr->outbuf->decoder_in_pos
-						== coder->thr->in_filled)
+				if (coder->thread_pool != NULL) {
+					if (coder->thr->in_filled
+							< coder->thr->in_size)
+						break;
+				} else if (mythread_atomic_load(&coder->thr
+							->outbuf->decoder_in_pos)
+						== coder->thr->in_filled) {
 					break;
+				}
+			}
+
+			// With a notification callback the application
+			// will call us again when there is something to do.
+			if (coder->notify != NULL) {
+				ret = LZMA_TIMED_OUT;
+				break;
+			}
+
+			// If the next Block could be started if it didn't
+			// need so much memory, count it in memlimit_waits.
+			if (input_is_possible != NULL
+					&& !coder->memlimit_waited
+					&& lzma_outq_has_buf(&coder->outq)
+					&& (coder->threads_initialized
+							< coder->threads_max
+						|| coder->threads_free
+							!= NULL)) {
+				++coder->memlimit_waits;
+				coder->memlimit_waited = true;
 			}
 
 			// Wait for input or output to become possible.
+			// If the next Block is waiting to be started, the
+			// wait is for a free thread. Otherwise it is for
+			// more output.
+			uint64_t *wait_usec = input_is_possible != NULL
+					? &coder->wait_thread_usec
+					: &coder->wait_out_usec;
+			const uint64_t wait_start = mythread_time_usec();
+
 			if (coder->timeout != 0) {
 				// See the comment in stream_encoder_mt.c
 				// about why mythread_condtime_set() is used
@@ -838,15 +1303,17 @@ read_output_and_wait(struct lzma_stream_coder *coder,
 
 				if (mythread_cond_timedwait(&coder->cond,
 						&coder->mutex,
-						wait_abs) != 0) {
+						wait_abs) != 0)
 					ret = LZMA_TIMED_OUT;
-					break;
-				}
 			} else {
 				mythread_cond_wait(&coder->cond,
 						&coder->mutex);
 			}
+
+			*wait_usec += mythread_time_usec() - wait_start;
 		} while (ret == LZMA_OK);
+
+		mythread_atomic_store(&coder->main_waiting, 0);
 	}
 
 	// If we are returning an error, then the application cannot get
@@ -859,6 +1326,33 @@ read_output_and_wait(struct lzma_stream_coder *coder,
 }
 
 
+/// Take the next Block from lzma_mt.index and use its sizes for the Block
+/// whose Block Header was just decoded. The sizes stored in the Block
+/// Header must match the Index. The Block decoder and index_hash verify
+/// the sizes against the actual input, so a wrong Index can only make
+/// decoding fail, not produce wrong output.
+static lzma_ret
+block_sizes_from_index(struct lzma_stream_coder *coder)
+{
+	if (lzma_index_iter_next(&coder->index_iter, LZMA_INDEX_ITER_BLOCK))
+		return LZMA_DATA_ERROR;
+
+	// This fills in the Compressed Size or verifies it if the Block
+	// Header has it. It also validates the Unpadded Size.
+	return_if_error(lzma_block_compressed_size(&coder->block_options,
+			coder->index_iter.block.unpadded_size));
+
+	if (coder->block_options.uncompressed_size == LZMA_VLI_UNKNOWN)
+		coder->block_options.uncompressed_size
+				= coder->index_iter.block.uncompressed_size;
+	else if (coder->block_options.uncompressed_size
+			!= coder->index_iter.block.uncompressed_size)
+		return LZMA_DATA_ERROR;
+
+	return LZMA_OK;
+}
+
+
 static lzma_ret
 decode_block_header(struct lzma_stream_coder *coder,
 		const lzma_allocator *allocator, const uint8_t *restrict in,
@@ -906,6 +1400,16 @@ decode_block_header(struct lzma_stream_coder *coder,
 	// it always resets this to false.
 	coder->block_options.ignore_check = coder->ignore_check;
 
+	// Fill in the sizes that are missing from the Block Header.
+	if (coder->use_index)
+		return_if_error(block_sizes_from_index(coder));
+
+	// If the Uncompressed Size is known, a smaller dictionary may be
+	// enough. This also reduces the memory usage that is compared
+	// against the memory usage limits.
+	lzma_raw_decoder_limit_dict(coder->filters,
+			coder->block_options.uncompressed_size);
+
 	// coder->block_options is ready now.
 	return LZMA_STREAM_END;
 }
@@ -931,6 +1435,267 @@ is_direct_mode_needed(lzma_vli size)
 }
 
 
+/// Returns true if the current Block should be decoded in segments.
+static bool
+split_is_possible(const struct lzma_stream_coder *coder)
+{
+	return coder->split_blocks && !coder->split_check_pending
+			&& coder->threads_max > 1
+			&& coder->filters[0].id == LZMA_FILTER_LZMA2
+			&& coder->filters[1].id == LZMA_VLI_UNKNOWN;
+}
+
+
+/// Get the size of split_buf that makes room for at least one more byte.
+/// The buffer is never made bigger than what the rest of the Compressed
+/// Data and an end marker need. Since the first segment isn't copied to
+/// split_buf, this is never more than the Compressed Size of the Block.
+static size_t
+split_buf_next_size(const struct lzma_stream_coder *coder)
+{
+	// At least 1 MiB is allocated at a time unless the rest of
+	// the Block is smaller.
+	const size_t size_min = (size_t)1 << 20;
+
+	const size_t limit = coder->split_filled + 1 + (size_t)(
+			coder->block_options.compressed_size
+			- coder->split_in);
+
+	const size_t size = my_min(my_max(size_min,
+			coder->split_buf_size * 2), limit);
+	assert(size > coder->split_filled);
+	return size;
+}
+
+
+/// Add the growth of split_buf to mem_in_use if it fits
+/// in memlimit_threading.
+static bool
+split_buf_reserve(struct lzma_stream_coder *coder, size_t size)
+{
+	bool ret = false;
+
+	mythread_sync(coder->mutex) {
+		if (coder->memlimit_threading - coder->mem_in_use
+				- coder->outq.mem_in_use
+				>= size - coder->split_buf_size) {
+			coder->mem_in_use += size - coder->split_buf_size;
+			ret = true;
+		}
+	}
+
+	return ret;
+}
+
+
+/// Resize split_buf to size bytes. The memory must have been reserved
+/// with split_buf_reserve().
+static lzma_ret
+split_buf_grow(struct lzma_stream_coder *coder,
+		const lzma_allocator *allocator, size_t size)
+{
+	uint8_t *buf = lzma_alloc(size, allocator);
+	if (buf == NULL)
+		return LZMA_MEM_ERROR;
+
+	if (coder->split_filled > 0)
+		memcpy(buf, coder->split_buf, coder->split_filled);
+
+	lzma_free(coder->split_buf, allocator);
+	coder->split_buf = buf;
+	coder->split_buf_size = size;
+
+	return LZMA_OK;
+}
+
+
+/// Copy LZMA2 chunks of a split Block to buf and parse the chunk headers.
+/// buf is the input buffer of the worker thread for the first segment and
+/// split_buf for the rest. The sizes in the chunk headers are compared
+/// against the sizes of the Block so that the segments can be given to
+/// worker threads without knowing yet if the rest of the Block is valid.
+///
+/// \return     - LZMA_OK: More input or space in buf is needed.
+///             - LZMA_STREAM_END: The segment is complete. split_seq is
+///               SPLIT_CONTROL if the next chunk resets the dictionary,
+///               SPLIT_END if the end marker was copied, and SPLIT_ERROR
+///               if the chunk being copied is invalid.
+static lzma_ret
+split_copy(struct lzma_stream_coder *coder, const uint8_t *restrict in,
+		size_t *restrict in_pos, size_t in_size,
+		uint8_t *restrict buf, size_t *restrict buf_pos,
+		size_t buf_size)
+{
+	const lzma_vli compressed_size = coder->block_options.compressed_size;
+	const lzma_vli uncompressed_size
+			= coder->block_options.uncompressed_size;
+
+	if (coder->split_seq == SPLIT_END || coder->split_seq == SPLIT_ERROR)
+		return LZMA_STREAM_END;
+
+	while (*in_pos < in_size && *buf_pos < buf_size)
+	switch (coder->split_seq) {
+	case SPLIT_CONTROL: {
+		const uint8_t control = in[*in_pos];
+
+		// The header of an invalid chunk isn't copied. The sizes
+		// were checked when parsing the earlier chunks so that
+		// there is still room for at least the end marker.
+		coder->split_header_pos = 0;
+
+		if (control == 0x00) {
+			// End marker
+			if (coder->split_in + 1 != compressed_size
+					|| coder->split_out
+						!= uncompressed_size) {
+				coder->split_seq = SPLIT_ERROR;
+				return LZMA_STREAM_END;
+			}
+
+			buf[(*buf_pos)++] = 0x00;
+			++*in_pos;
+			++coder->split_in;
+			coder->split_seq = SPLIT_END;
+			return LZMA_STREAM_END;
+		}
+
+		// A chunk that resets the dictionary starts a new segment
+		// unless it is the first chunk of the current segment.
+		if ((control == 0x01 || control >= 0xE0) && *buf_pos > 0)
+			return LZMA_STREAM_END;
+
+		if (control >= 0x03 && control <= 0x7F) {
+			coder->split_seq = SPLIT_ERROR;
+			return LZMA_STREAM_END;
+		}
+
+		// Uncompressed chunks have a three-byte header. LZMA chunks
+		// have two more bytes, and one more if they have properties.
+		coder->split_header_size = control < 0x80 ? 3
+				: control < 0xC0 ? 5 : 6;
+
+		// There must be room for the header and the end marker.
+		if (compressed_size - coder->split_in
+				<= coder->split_header_size) {
+			coder->split_seq = SPLIT_ERROR;
+			return LZMA_STREAM_END;
+		}
+
+		coder->split_seq = SPLIT_HEADER;
+		FALLTHROUGH;
+	}
+
+	case SPLIT_HEADER: {
+		size_t size = coder->split_header_size
+				- coder->split_header_pos;
+		size = my_min(size, in_size - *in_pos);
+		size = my_min(size, buf_size - *buf_pos);
+
+		memcpy(coder->split_header + coder->split_header_pos,
+				in + *in_pos, size);
+		memcpy(buf + *buf_pos, in + *in_pos, size);
+		*in_pos += size;
+		coder->split_header_pos += size;
+		*buf_pos += size;
+		coder->split_in += size;
+
+		if (coder->split_header_pos < coder->split_header_size)
+			break;
+
+		const uint8_t *h = coder->split_header;
+		size_t comp_size;
+		size_t uncomp_size;
+
+		if (h[0] < 0x80) {
+			uncomp_size = ((size_t)(h[1]) << 8) + h[2] + 1;
+			comp_size = uncomp_size;
+		} else {
+			uncomp_size = ((size_t)(h[0] & 0x1F) << 16)
+					+ ((size_t)(h[1]) << 8) + h[2] + 1;
+			comp_size = ((size_t)(h[3]) << 8) + h[4] + 1;
+		}
+
+		// There must be room for the chunk and the end marker.
+		if (compressed_size - coder->split_in <= comp_size
+				|| uncompressed_size - coder->split_out
+					< uncomp_size) {
+			coder->split_seq = SPLIT_ERROR;
+			return LZMA_STREAM_END;
+		}
+
+		coder->split_out += uncomp_size;
+		coder->split_seg_out += uncomp_size;
+		coder->split_data_left = comp_size;
+		coder->split_seq = SPLIT_DATA;
+		FALLTHROUGH;
+	}
+
+	case SPLIT_DATA: {
+		const size_t in_limit = in_size - *in_pos
+					> coder->split_data_left
+				? *in_pos + coder->split_data_left : in_size;
+		const size_t copied = lzma_bufcpy(in, in_pos, in_limit,
+				buf, buf_pos, buf_size);
+		coder->split_in += copied;
+		coder->split_data_left -= copied;
+
+		if (coder->split_data_left == 0)
+			coder->split_seq = SPLIT_CONTROL;
+
+		break;
+	}
+
+	default:
+		assert(0);
+		return LZMA_PROG_ERROR;
+	}
+
+	return LZMA_OK;
+}
+
+
+/// Terminate the segment in split_buf so that a raw LZMA2 decoder can
+/// decode it, and prepare the filter chain for it. split_buf must have
+/// room for one more byte.
+static void
+split_terminate(struct lzma_stream_coder *coder)
+{
+	assert(coder->split_filled < coder->split_buf_size);
+
+	switch (coder->split_seq) {
+	case SPLIT_END:
+		// The end marker of the Block was copied already.
+		break;
+
+	case SPLIT_CONTROL:
+		// The next chunk resets the dictionary. Add an end marker.
+		coder->split_buf[coder->split_filled++] = 0x00;
+		break;
+
+	default:
+		// Replace the header of the invalid chunk with an invalid
+		// control byte. The worker thread decodes the chunks before
+		// it and then fails with LZMA_DATA_ERROR. This way the output
+		// before the error is the same as without splitting.
+		assert(coder->split_seq == SPLIT_ERROR);
+		coder->split_filled -= coder->split_header_pos;
+		coder->split_buf[coder->split_filled++] = 0x03;
+		break;
+	}
+
+	// The dictionary doesn't need to be bigger than the segment.
+	coder->split_seg_options = coder->split_options;
+	coder->split_filters[0].id = LZMA_FILTER_LZMA2;
+	coder->split_filters[0].options = &coder->split_seg_options;
+	coder->split_filters[1].id = LZMA_VLI_UNKNOWN;
+	coder->split_filters[1].options = NULL;
+	lzma_raw_decoder_limit_dict(coder->split_filters,
+			coder->split_seg_out);
+
+	return;
+}
+
+
 static lzma_ret
 stream_decoder_reset(struct lzma_stream_coder *coder,
 		const lzma_allocator *allocator)
@@ -1262,10 +2027,13 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 		// If this alone would exceed memlimit_threading, then we must
 		// use the single-threaded direct mode.
 		if (coder->mem_next_block > coder->memlimit_threading) {
+			++coder->memlimit_direct;
 			coder->sequence = SEQ_BLOCK_DIRECT_INIT;
 			break;
 		}
 
+		coder->memlimit_waited = false;
+
 		// Use the threaded mode. Free the direct mode decoder in
 		// case it has been initialized.
 		lzma_next_end(&coder->block_decoder, allocator);
@@ -1284,6 +2052,23 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			break;
 		}
 
+		// The Block is decoded normally until SEQ_BLOCK_THR_RUN
+		// finds a second chunk that resets the dictionary. Most
+		// Blocks have only one so they are never split.
+		coder->split_scan = split_is_possible(coder);
+		if (coder->split_scan) {
+			// The filter chain is initialized separately for
+			// each segment so only the LZMA2 options are needed.
+			coder->split_options = *(const lzma_options_lzma *)(
+					coder->filters[0].options);
+
+			coder->split_seq = SPLIT_CONTROL;
+			coder->split_in = 0;
+			coder->split_out = 0;
+			coder->split_seg_out = 0;
+			coder->split_filled = 0;
+		}
+
 		coder->sequence = SEQ_BLOCK_THR_INIT;
 		FALLTHROUGH;
 	}
@@ -1350,6 +2135,12 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			thr = coder->threads_free;
 		}
 
+		// Size of the output buffer of this Block or, if the Block
+		// is split, of this segment
+		const size_t outbuf_size = coder->split
+				? coder->split_seg_out
+				: (size_t)(coder->block_options.uncompressed_size);
+
 		// The maximum amount of memory that can be held by other
 		// threads and cached buffers while allowing us to start
 		// decoding the next Block.
@@ -1370,7 +2161,7 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			// don't free and almost immediately reallocate
 			// an identical buffer.
 			lzma_outq_clear_cache2(&coder->outq, allocator,
-				coder->block_options.uncompressed_size);
+					outbuf_size);
 		}
 
 		// If there is at least one worker_thread in the cache and
@@ -1412,7 +2203,8 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 
 			// Memory needed for the filters and the input buffer.
 			// The output queue takes care of its own counter so
-			// we don't touch it here.
+			// we don't touch it here. split_buf is counted
+			// already so mem_next_in is zero for a segment.
 			//
 			// NOTE: After this, coder->mem_in_use +
 			// coder->mem_cached might count the same thing twice.
@@ -1425,8 +2217,7 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 
 		// Allocate memory for the output buffer in the output queue.
 		lzma_ret ret = lzma_outq_prealloc_buf(
-				&coder->outq, allocator,
-				coder->block_options.uncompressed_size);
+				&coder->outq, allocator, outbuf_size);
 		if (ret != LZMA_OK) {
 			threads_stop(coder);
 			return ret;
@@ -1444,10 +2235,22 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 		coder->thr->mem_filters = coder->mem_next_filters;
 
 		// Initialize the Block decoder.
+		// The worker thread decodes the whole Block to its own
+		// output buffer, so that can be used as the dictionary.
+		// A segment of a split Block is decoded with a raw LZMA2
+		// decoder; the main thread handles the rest of the Block.
 		coder->thr->block_options = coder->block_options;
-		ret = lzma_block_decoder_init(
+		if (coder->split) {
+			coder->thr->block_options.uncompressed_size
+					= outbuf_size;
+			ret = lzma_raw_decoder_init(
+					&coder->thr->block_decoder, allocator,
+					coder->split_filters, true);
+		} else {
+			ret = lzma_block_decoder_init(
 					&coder->thr->block_decoder, allocator,
-					&coder->thr->block_options);
+					&coder->thr->block_options, true);
+		}
 
 		// Free the allocated filter options since they are needed
 		// only to initialize the Block decoder.
@@ -1462,17 +2265,35 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			break;
 		}
 
-		// Allocate the input buffer.
-		coder->thr->in_size = coder->mem_next_in;
-		coder->thr->in = lzma_alloc(coder->thr->in_size, allocator);
-		if (coder->thr->in == NULL) {
-			threads_stop(coder);
-			return LZMA_MEM_ERROR;
+		if (coder->split) {
+			// The whole segment has been copied already.
+			// The worker thread takes split_buf.
+			coder->thr->in = coder->split_buf;
+			coder->thr->in_size = coder->split_filled;
+			coder->thr->in_allocated = coder->split_buf_size;
+			coder->thr->in_filled = coder->split_filled;
+			coder->thr->in_added
+					= coder->split_seq == SPLIT_CONTROL;
+
+			coder->split_buf = NULL;
+			coder->split_buf_size = 0;
+			coder->split_filled = 0;
+		} else {
+			// Allocate the input buffer.
+			coder->thr->in_size = coder->mem_next_in;
+			coder->thr->in_allocated = coder->mem_next_in;
+			coder->thr->in = lzma_alloc(coder->thr->in_size,
+					allocator);
+			if (coder->thr->in == NULL) {
+				threads_stop(coder);
+				return LZMA_MEM_ERROR;
+			}
 		}
 
 		// Get the preallocated output buffer.
 		coder->thr->outbuf = lzma_outq_get_buf(
 				&coder->outq, coder->thr);
+		coder->out_queued += outbuf_size;
 
 		// Start the decoder.
 		mythread_sync(coder->thr->mutex) {
@@ -1488,6 +2309,34 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 					&worker_enable_partial_update);
 		}
 
+		if (coder->split) {
+			// The segment doesn't need more input from us.
+			if (coder->thread_pool != NULL) {
+				mythread_sync(coder->mutex) {
+					++coder->jobs_pending;
+				}
+
+				lzma_thread_pool_submit(coder->thread_pool,
+						&coder->thr->job);
+			}
+
+			coder->thr = NULL;
+			coder->split_seg_out = 0;
+
+			if (coder->split_seq == SPLIT_END) {
+				coder->sequence = SEQ_SPLIT_END;
+			} else if (coder->split_seq == SPLIT_ERROR) {
+				// The worker thread will return the error
+				// once it reaches the invalid chunk.
+				coder->pending_error = LZMA_DATA_ERROR;
+				coder->sequence = SEQ_ERROR;
+			} else {
+				coder->sequence = SEQ_SPLIT_COPY;
+			}
+
+			break;
+		}
+
 		coder->sequence = SEQ_BLOCK_THR_RUN;
 		FALLTHROUGH;
 	}
@@ -1509,14 +2358,73 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 		}
 
 		// Copy input to the worker thread.
-		size_t cur_in_filled = coder->thr->in_filled;
-		lzma_bufcpy(in, in_pos, in_size, coder->thr->in,
-				&cur_in_filled, coder->thr->in_size);
+		const size_t old_in_filled = coder->thr->in_filled;
+		size_t cur_in_filled = old_in_filled;
+		bool segment_end = false;
+
+		if (coder->split_scan) {
+			// Copy the chunks until the next one resets the
+			// dictionary. After the end marker or an invalid
+			// chunk, the rest of the Block is copied as is and
+			// the Block decoder handles it.
+			const lzma_ret ret = split_copy(coder, in, in_pos,
+					in_size, coder->thr->in,
+					&cur_in_filled, coder->thr->in_size);
+			if (ret == LZMA_STREAM_END) {
+				coder->split_scan = false;
+				segment_end = coder->split_seq
+						== SPLIT_CONTROL;
+			} else if (ret != LZMA_OK) {
+				threads_stop(coder);
+				return ret;
+			}
+		}
+
+		if (segment_end) {
+			// End the first segment. split_copy() left room
+			// for the end marker.
+			coder->thr->in[cur_in_filled++] = 0x00;
+
+			// The output buffer was allocated for the whole Block
+			// but only the first segment is decoded to it.
+			coder->out_queued -= coder->block_options
+					.uncompressed_size - coder->split_out;
+
+			// The output of the other segments is hashed in
+			// read_output_and_wait() when it is read from the
+			// output queue. The worker thread gives the state
+			// after the first segment to split_check so this
+			// must be done before the end marker is passed to it.
+			coder->split_check_type = coder->stream_flags.check;
+			if (!coder->ignore_check && lzma_check_is_supported(
+					coder->split_check_type)) {
+				coder->split_check_pending = true;
+				coder->split_check_ready = false;
+				coder->split_check_start = coder->out_queued;
+				coder->split_check_left = coder->block_options
+						.uncompressed_size
+						- coder->split_out;
+				lzma_check_init(&coder->split_check,
+						coder->split_check_type);
+			}
+
+			coder->split_seg_out = 0;
+			coder->split = true;
+		} else if (!coder->split_scan) {
+			lzma_bufcpy(in, in_pos, in_size, coder->thr->in,
+					&cur_in_filled, coder->thr->in_size);
+		}
 
 		// Tell the thread how much we copied.
 		mythread_sync(coder->thr->mutex) {
 			coder->thr->in_filled = cur_in_filled;
 
+			if (segment_end) {
+				coder->thr->in_size = cur_in_filled;
+				coder->thr->in_added = 1;
+				coder->thr->truncated = true;
+			}
+
 			// NOTE: Most of the time we are copying input faster
 			// than the thread can decode so most of the time
 			// calling mythread_cond_signal() is useless but
@@ -1526,6 +2434,21 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			mythread_cond_signal(&coder->thr->cond);
 		}
 
+		// With a thread pool, give the Block to the pool once all
+		// of it has been copied. Comparing to old_in_filled avoids
+		// submitting the job twice if we return LZMA_TIMED_OUT
+		// below and get called again.
+		if (coder->thread_pool != NULL
+				&& old_in_filled < coder->thr->in_size
+				&& cur_in_filled == coder->thr->in_size) {
+			mythread_sync(coder->mutex) {
+				++coder->jobs_pending;
+			}
+
+			lzma_thread_pool_submit(coder->thread_pool,
+					&coder->thr->job);
+		}
+
 		// Read output from the output queue. Just like in
 		// SEQ_BLOCK_HEADER, we wait to fill the output buffer
 		// only if waiting_allowed was set to true in the beginning
@@ -1557,9 +2480,194 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			return LZMA_OK;
 		}
 
-		// The whole Block has been copied to the thread-specific
-		// buffer. Continue from the next Block Header or Index.
+		// The whole Block or its first segment has been copied to
+		// the thread-specific buffer. Continue from the next segment,
+		// Block Header, or Index.
 		coder->thr = NULL;
+		coder->sequence = coder->split
+				? SEQ_SPLIT_COPY : SEQ_BLOCK_HEADER;
+		break;
+	}
+
+	case SEQ_SPLIT_COPY: {
+		// Copy the next segment of a split Block to split_buf.
+		lzma_ret ret = LZMA_OK;
+		bool grow_is_possible = true;
+
+		while (true) {
+			if (coder->split_filled == coder->split_buf_size) {
+				const size_t split_buf_size
+						= split_buf_next_size(coder);
+				if (!split_buf_reserve(coder,
+						split_buf_size)) {
+					coder->mem_next_block = split_buf_size
+						- coder->split_buf_size;
+					grow_is_possible = false;
+					break;
+				}
+
+				ret = split_buf_grow(coder, allocator,
+						split_buf_size);
+				if (ret != LZMA_OK) {
+					threads_stop(coder);
+					return ret;
+				}
+			}
+
+			if (ret == LZMA_STREAM_END)
+				break;
+
+			ret = split_copy(coder, in, in_pos, in_size,
+					coder->split_buf, &coder->split_filled,
+					coder->split_buf_size);
+			if (ret == LZMA_OK && *in_pos == in_size)
+				break;
+
+			if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+				threads_stop(coder);
+				return ret;
+			}
+		}
+
+		if (!grow_is_possible) {
+			// Growing split_buf would exceed memlimit_threading.
+			// Wait for the worker threads like in
+			// SEQ_BLOCK_THR_INIT. A segment never needs more
+			// memory than the whole Block which fitted in
+			// memlimit_threading in SEQ_BLOCK_INIT, so this is
+			// possible at the latest when the output queue
+			// is empty.
+			return_if_error(read_output_and_wait(coder, allocator,
+					out, out_pos, out_size,
+					&grow_is_possible, true,
+					&wait_abs, &has_blocked));
+
+			if (coder->pending_error != LZMA_OK) {
+				coder->sequence = SEQ_ERROR;
+				break;
+			}
+
+			if (!grow_is_possible) {
+				assert(*out_pos == out_size);
+				assert(!lzma_outq_is_empty(&coder->outq));
+				return LZMA_OK;
+			}
+
+			break;
+		}
+
+		if (ret == LZMA_OK) {
+			// The segment isn't complete. Read output from the
+			// output queue like in SEQ_BLOCK_HEADER.
+			if (action == LZMA_FINISH && coder->fail_fast) {
+				threads_stop(coder);
+				return LZMA_DATA_ERROR;
+			}
+
+			return_if_error(read_output_and_wait(coder, allocator,
+				out, out_pos, out_size,
+				NULL, waiting_allowed,
+				&wait_abs, &has_blocked));
+
+			if (coder->pending_error != LZMA_OK) {
+				coder->sequence = SEQ_ERROR;
+				break;
+			}
+
+			return LZMA_OK;
+		}
+
+		// The loop above made room for the end marker.
+		split_terminate(coder);
+
+		// split_buf is in mem_in_use already. The rest is less than
+		// what the whole Block needed in SEQ_BLOCK_INIT.
+		coder->mem_next_filters = lzma_raw_decoder_memusage(
+				coder->split_filters);
+		coder->mem_next_in = 0;
+		coder->mem_next_block = coder->mem_next_filters
+				+ lzma_outq_outbuf_memusage(
+					coder->split_seg_out);
+
+		coder->memlimit_waited = false;
+		coder->sequence = SEQ_BLOCK_THR_INIT;
+		break;
+	}
+
+	case SEQ_SPLIT_END: {
+		// Block Padding and Check of a split Block. The Check field
+		// is compared to the integrity check of the output in
+		// split_check_update() or below, whichever happens last.
+		const size_t padding_size = (size_t)(vli_ceil4(
+				coder->block_options.compressed_size)
+				- coder->block_options.compressed_size);
+		const size_t end_size = padding_size
+				+ lzma_check_size(coder->stream_flags.check);
+
+		const size_t in_old = *in_pos;
+		bool padding_error = false;
+
+		while (coder->pos < end_size && *in_pos < in_size) {
+			const uint8_t b = in[(*in_pos)++];
+
+			if (coder->pos < padding_size) {
+				if (b != 0x00) {
+					padding_error = true;
+					break;
+				}
+			} else {
+				coder->split_check_field[
+					coder->pos - padding_size] = b;
+			}
+
+			++coder->pos;
+		}
+
+		mythread_sync(coder->mutex) {
+			coder->progress_in += *in_pos - in_old;
+		}
+
+		if (padding_error) {
+			coder->pos = 0;
+			coder->pending_error = LZMA_DATA_ERROR;
+			coder->sequence = SEQ_ERROR;
+			break;
+		}
+
+		if (coder->pos < end_size) {
+			if (action == LZMA_FINISH && coder->fail_fast) {
+				threads_stop(coder);
+				return LZMA_DATA_ERROR;
+			}
+
+			return_if_error(read_output_and_wait(coder, allocator,
+				out, out_pos, out_size,
+				NULL, waiting_allowed,
+				&wait_abs, &has_blocked));
+
+			if (coder->pending_error != LZMA_OK) {
+				coder->sequence = SEQ_ERROR;
+				break;
+			}
+
+			return LZMA_OK;
+		}
+
+		coder->pos = 0;
+		coder->split = false;
+
+		if (coder->split_check_pending) {
+			coder->split_check_ready = true;
+
+			if (coder->split_check_left == 0
+					&& split_check_verify(coder)
+						!= LZMA_OK) {
+				coder->pending_error = LZMA_DATA_ERROR;
+				coder->sequence = SEQ_ERROR;
+				break;
+			}
+		}
+
 		coder->sequence = SEQ_BLOCK_HEADER;
 		break;
 	}
@@ -1589,7 +2697,7 @@ stream_decode_mt(void *coder_ptr, const lzma_allocator *allocator,
 		// Initialize the Block decoder.
 		const lzma_ret ret = lzma_block_decoder_init(
 				&coder->block_decoder, allocator,
-				&coder->block_options);
+				&coder->block_options, false);
 
 		// Free the allocated filter options since they are needed
 		// only to initialize the Block decoder.
@@ -1790,6 +2898,7 @@ stream_decoder_mt_end(void *coder_ptr, const lzma_allocator *allocator)
 	lzma_next_end(&coder->block_decoder, allocator);
 	lzma_filters_free(coder->filters, allocator);
 	lzma_index_hash_end(coder->index_hash, allocator);
+	lzma_free(coder->split_buf, allocator);
 
 	lzma_free(coder, allocator);
 	return;
@@ -1864,11 +2973,57 @@ stream_decoder_mt_get_progress(void *coder_ptr,
 		*progress_out = coder->progress_out;
 
 		for (size_t i = 0; i < coder->threads_initialized; ++i) {
-			mythread_sync(coder->threads[i].mutex) {
-				*progress_in += coder->threads[i].progress_in;
-				*progress_out += coder->threads[i]
-						.progress_out;
+			*progress_in += mythread_atomic_load(
+					&coder->threads[i].progress_in);
+			*progress_out += mythread_atomic_load(
+					&coder->threads[i].progress_out);
+		}
+	}
+
+	return;
+}
+
+
+static void
+stream_decoder_mt_get_stats(void *coder_ptr, lzma_mt_stats *stats,
+		lzma_mt_thread_stats *thread_stats,
+		uint32_t thread_stats_count)
+{
+	struct lzma_stream_coder *coder = coder_ptr;
+
+	const uint32_t count = my_min(thread_stats_count,
+			coder->threads_initialized);
+
+	// Like in stream_decoder_mt_get_progress(), coder->mutex
+	// prevents finishing threads from moving their progress info
+	// to their statistics while we are reading them.
+	mythread_sync(coder->mutex) {
+		*stats = (lzma_mt_stats){
+			.threads = coder->threads_initialized,
+			.outq_bufs = coder->outq.bufs_in_use,
+			.outq_bufs_peak = coder->outq.bufs_peak,
+			.outq_bufs_limit = coder->outq.bufs_limit,
+			.outq_mem_in_use = coder->outq.mem_in_use,
+			.outq_mem_allocated = coder->outq.mem_allocated,
+			.wait_thread_usec = coder->wait_thread_usec,
+			.wait_out_usec = coder->wait_out_usec,
+			.memlimit_waits = coder->memlimit_waits,
+			.memlimit_direct = coder->memlimit_direct,
+		};
+
+		for (uint32_t i = 0; i < count; ++i) {
+			struct worker_thread *thr = &coder->threads[i];
+
+			mythread_sync(thr->mutex) {
+				lzma_worker_stats_get(&thr->stats,
+						&thread_stats[i]);
 			}
+
+			// Include the Block that is being decoded.
+			thread_stats[i].uncompressed_size
+				+= mythread_atomic_load(&thr->progress_out);
+			thread_stats[i].compressed_size
+				+= mythread_atomic_load(&thr->progress_in);
 		}
 	}
 
@@ -1885,7 +3040,12 @@ stream_decoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	if (options->threads == 0 || options->threads > LZMA_THREADS_MAX)
 		return LZMA_OPTIONS_ERROR;
 
-	if (options->flags & ~LZMA_SUPPORTED_FLAGS)
+	if (options->flags & ~(LZMA_SUPPORTED_FLAGS
+			| LZMA_MT_USE_THREAD_POOL
+			| LZMA_MT_USE_NOTIFY
+			| LZMA_MT_NUMA
+			| LZMA_MT_USE_INDEX
+			| LZMA_MT_SPLIT_BLOCKS))
 		return LZMA_OPTIONS_ERROR;
 
 	lzma_next_coder_init(&stream_decoder_mt_init, next, allocator);
@@ -1914,6 +3074,7 @@ stream_decoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		next->get_check = &stream_decoder_mt_get_check;
 		next->memconfig = &stream_decoder_mt_memconfig;
 		next->get_progress = &stream_decoder_mt_get_progress;
+		next->get_mt_stats = &stream_decoder_mt_get_stats;
 
 		coder->filters[0].id = LZMA_VLI_UNKNOWN;
 		memzero(&coder->outq, sizeof(coder->outq));
@@ -1925,6 +3086,9 @@ stream_decoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		coder->threads = NULL;
 		coder->threads_free = NULL;
 		coder->threads_initialized = 0;
+		coder->thread_pool = NULL;
+		coder->jobs_pending = 0;
+		coder->split_buf = NULL;
 	}
 
 	// Cleanup old filter chain if one remains after unfinished decoding
@@ -1946,6 +3110,11 @@ stream_decoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	// It will be reused or freed as needed in the main loop.
 	threads_end(coder, allocator);
 
+	coder->thread_pool = (options->flags & LZMA_MT_USE_THREAD_POOL) != 0
+			? options->thread_pool : NULL;
+	coder->numa = coder->thread_pool == NULL
+			&& (options->flags & LZMA_MT_NUMA) != 0;
+
 	// All memusage counters start at 0 (including mem_direct_mode).
 	// The little extra that is needed for the structs in this file
 	// get accounted well enough by the filter chain memory usage
@@ -1958,14 +3127,46 @@ stream_decoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 
 	coder->progress_in = 0;
 	coder->progress_out = 0;
+	mythread_atomic_store(&coder->main_waiting, 0);
+
+	coder->wait_thread_usec = 0;
+	coder->wait_out_usec = 0;
+	coder->memlimit_waits = 0;
+	coder->memlimit_direct = 0;
+	coder->memlimit_waited = false;
 
 	coder->sequence = SEQ_STREAM_HEADER;
 	coder->thread_error = LZMA_OK;
 	coder->pending_error = LZMA_OK;
 	coder->thr = NULL;
 
+	// A segment of an unfinished split Block may remain from
+	// the previous use of the decoder.
+	lzma_free(coder->split_buf, allocator);
+	coder->split_buf = NULL;
+	coder->split_buf_size = 0;
+	coder->split_filled = 0;
+	coder->split_scan = false;
+	coder->split = false;
+	coder->split_check_pending = false;
+	coder->out_queued = 0;
+	coder->out_read = 0;
+
 	coder->timeout = options->timeout;
 
+	if ((options->flags & LZMA_MT_USE_NOTIFY) != 0) {
+		coder->notify = options->notify;
+		coder->notify_opaque = options->notify_opaque;
+	} else {
+		coder->notify = NULL;
+		coder->notify_opaque = NULL;
+	}
+
+	coder->use_index = (options->flags & LZMA_MT_USE_INDEX) != 0
+			&& options->index != NULL;
+	if (coder->use_index)
+		lzma_index_iter_init(&coder->index_iter, options->index);
+
 	coder->memlimit_threading = my_max(1, options->memlimit_threading);
 	coder->memlimit_stop = my_max(1, options->memlimit_stop);
 	if (coder->memlimit_threading > coder->memlimit_stop)
@@ -1978,6 +3179,7 @@ stream_decoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	coder->ignore_check = (options->flags & LZMA_IGNORE_CHECK) != 0;
 	coder->concatenated = (options->flags & LZMA_CONCATENATED) != 0;
 	coder->fail_fast = (options->flags & LZMA_FAIL_FAST) != 0;
+	coder->split_blocks = (options->flags & LZMA_MT_SPLIT_BLOCKS) != 0;
 
 	coder->first_stream = true;
 	coder->out_was_filled = false;
@@ -15,12 +15,34 @@
 #include "block_buffer_encoder.h"
 #include "index_encoder.h"
 #include "outqueue.h"
+#include "thread_pool.h"
+#include "numa.h"
+#include "worker_stats.h"
+#include "lzma2_encoder.h"
+#include "check.h"
 
 
 /// Maximum supported block size. This makes it simpler to prevent integer
 /// overflows if we are given unusually large block size.
 #define BLOCK_SIZE_MAX (UINT64_MAX / LZMA_THREADS_MAX)
 
+/// When a Block is split into parts, every part except the last one of
+/// the Block ends with this many bytes stored in uncompressed LZMA2 chunks.
+/// By choosing how these bytes are split into chunks, the encoded size of
+/// the part can be made a multiple of four bytes. This way the Block Padding
+/// can be calculated when the last part is encoded even though the sizes
+/// of the earlier parts of the same Block aren't known yet.
+#define PART_TAIL_SIZE 4
+
+/// Maximum number of bytes needed after the LZMA2 data of a part: the tail
+/// chunks (at most four one-byte chunks), Block Padding, and Check.
+#define PART_TRAILER_MAX (4 * (LZMA2_HEADER_UNCOMPRESSED + 1) \
+		+ 3 + LZMA_CHECK_SIZE_MAX)
+
+/// Minimum size of the output buffer segments. The output buffer of
+/// a thread starts with one segment and more are added when needed.
+#define OUTBUF_SEG_SIZE_MIN (UINT32_C(64) << 10)
+
 
 typedef enum {
 	/// Waiting for work.
@@ -49,20 +71,70 @@ typedef struct worker_thread_s worker_thread;
 struct worker_thread_s {
 	worker_state state;
 
-	/// Input buffer of coder->block_size bytes. The main thread will
-	/// put new input into this and update in_size accordingly. Once
-	/// no more input is coming, state will be set to THR_FINISH.
-	uint8_t *in;
+	/// Input data of this thread. The main thread will put new input
+	/// here and update in_size accordingly. Once no more input is
+	/// coming, state will be set to THR_FINISH.
+	///
+	/// This points to in_buf or, with LZMA_MT_DIRECT_INPUT, to the
+	/// input buffer of the application. The main thread changes this
+	/// only while holding the mutex, and the old data stays valid
+	/// when this is changed.
+	const uint8_t *in;
+
+	/// Input buffer of coder->in_buf_size bytes. This is allocated
+	/// when it is needed the first time, which with
+	/// LZMA_MT_DIRECT_INPUT happens only if the input isn't contiguous.
+	uint8_t *in_buf;
 
 	/// Amount of data available in the input buffer. This is modified
 	/// only by the main thread.
 	size_t in_size;
 
+	/// When encoding a part of a Block, in[] begins with this many
+	/// bytes of history from the earlier parts of the same Block.
+	/// The history is used as a preset dictionary and it isn't encoded
+	/// again. This is zero when encoding whole Blocks and for the first
+	/// part of every Block. This is modified only by the main thread.
+	size_t in_start;
+
+	/// True if this part is the first part of a Block. The Block Header
+	/// is written in front of the first part.
+	bool part_first;
+
+	/// True if this part is the last part of a Block. This is set by
+	/// the main thread before the state is set to THR_FINISH.
+	bool part_last;
+
+	/// Uncompressed Size of the whole Block and the Check calculated
+	/// by the main thread. These are set together with part_last.
+	uint64_t block_uncompressed_size;
+	uint8_t check[LZMA_CHECK_SIZE_MAX];
+
+	/// Amount of input in "in" that the main thread wants to be
+	/// flushed with LZMA_SYNC_FLUSH. This is modified only by
+	/// the main thread.
+	size_t flush_size;
+
+	/// Amount of input that has been flushed and whose compressed
+	/// data has been made available via outbuf->pos. This is protected
+	/// by coder->mutex.
+	size_t flushed_size;
+
 	/// Output buffer for this thread. This is set by the main
 	/// thread every time a new Block is started with this thread
 	/// structure.
 	lzma_outbuf *outbuf;
 
+	/// The piece of the output buffer that the worker thread is
+	/// writing: out[] is outbuf->buf[] if out_seg is NULL and
+	/// out_seg->buf[] otherwise. out_start is the position of out[0]
+	/// in the whole output of this thread and out_size is the size
+	/// of out[]. These are used only by the worker thread.
+	uint8_t *out;
+	lzma_outseg *out_seg;
+	size_t out_start;
+	size_t out_size;
+
 	/// Pointer to the main structure is needed when putting this
 	/// thread back to the stack of free threads.
 	lzma_stream_coder *coder;
@@ -73,12 +145,13 @@ struct worker_thread_s {
 	const lzma_allocator *allocator;
 
 	/// Amount of uncompressed data that has already been compressed.
-	uint64_t progress_in;
+	/// This is written by the worker thread without holding a mutex.
+	mythread_atomic_size progress_in;
 
-	/// Amount of compressed data that is ready.
-	uint64_t progress_out;
+	/// Amount of compressed data that is ready
+	mythread_atomic_size progress_out;
 
-	/// Block encoder
+	/// Block encoder, or the raw LZMA2 encoder when encoding parts
 	lzma_next_coder block_encoder;
 
 	/// Compression options for this Block
@@ -96,8 +169,19 @@ struct worker_thread_s {
 	mythread_cond cond;
 
 	/// The ID of this thread is used to join the thread
-	/// when it's not needed anymore.
+	/// when it's not needed anymore. This isn't used when
+	/// coder->thread_pool != NULL.
 	mythread thread_id;
+
+	/// Job that encodes the input of this structure in a thread of
+	/// coder->thread_pool. With a thread pool, there is no thread
+	/// per structure and the job is submitted once all the input
+	/// has been copied, that is, when the state becomes THR_FINISH.
+	lzma_thread_job job;
+
+	/// Statistics for lzma_mt_get_stats(). This is protected
+	/// by the mutex of this structure.
+	lzma_worker_stats stats;
 };
 
 
@@ -113,6 +197,43 @@ struct lzma_stream_coder_s {
 	/// LZMA_FULL_FLUSH or LZMA_FULL_BARRIER is used earlier.
 	size_t block_size;
 
+	/// If non-zero, Blocks are split into parts of this many bytes
+	/// which are encoded by different threads. See lzma_mt.part_size.
+	size_t part_size;
+
+	/// Maximum amount of history that may be put in front of the input
+	/// of a part. This is the LZMA2 dictionary size at initialization.
+	size_t part_history_max;
+
+	/// Size of the input buffer of each thread
+	size_t in_buf_size;
+
+	/// True if LZMA_MT_DIRECT_INPUT was used: The threads read
+	/// the input from the application's buffer when possible.
+	bool direct_input;
+
+	/// True if LZMA_MT_NUMA was used and thread_pool == NULL:
+	/// each thread pins itself to a NUMA node when it starts.
+	bool numa;
+
+	/// Amount of uncompressed data in the current Block that has been
+	/// given to the threads. This is used only when encoding parts.
+	size_t block_in;
+
+	/// Integrity check of the current Block. When encoding parts, the
+	/// main thread calculates the Check since it sees all the data of
+	/// the Block in order.
+	lzma_check_state block_check;
+
+	/// Sum of the sizes of the already-read parts of the current Block.
+	/// The Unpadded Size is known once the last part has been read.
+	lzma_vli block_unpadded_size;
+
+	/// The thread that got the previous part of the current Block.
+	/// The history for the next part is copied from its input buffer.
+	/// This is NULL at the beginning of a Block.
+	worker_thread *part_prev;
+
 	/// The filter chain to use for the next Block.
 	/// This can be updated using lzma_filters_update()
 	/// after LZMA_FULL_BARRIER or LZMA_FULL_FLUSH.
@@ -150,14 +271,24 @@ struct lzma_stream_coder_s {
 	/// Output buffer queue for compressed data
 	lzma_outq outq;
 
-	/// How much memory to allocate for each lzma_outbuf.buf
+	/// Maximum amount of output that a single thread may produce.
+	/// The output buffers grow up to this size as needed.
 	size_t outbuf_alloc_size;
 
+	/// How much memory to allocate for each lzma_outbuf.buf and
+	/// for each segment that is added to it when it becomes full
+	size_t outbuf_seg_size;
+
 
 	/// Maximum wait time if cannot use all the input and cannot
 	/// fill the output buffer. This is in milliseconds.
 	uint32_t timeout;
 
+	/// If non-NULL, this is called instead of waiting for the worker
+	/// threads. See lzma_mt.notify.
+	void (*notify)(void *notify_opaque);
+	void *notify_opaque;
+
 
 	/// Error code from a worker thread
 	lzma_ret thread_error;
@@ -182,6 +313,14 @@ struct lzma_stream_coder_s {
 	/// the new input from the application.
 	worker_thread *thr;
 
+	/// Thread pool given in lzma_mt.thread_pool or NULL if
+	/// this encoder creates its own threads.
+	lzma_thread_pool *thread_pool;
+
+	/// Number of jobs that have been given to thread_pool but
+	/// haven't completed yet. This is protected by the mutex.
+	uint32_t jobs_pending;
+
 
 	/// Amount of uncompressed data in Blocks that have already
 	/// been finished.
@@ -191,12 +330,31 @@ struct lzma_stream_coder_s {
 	/// have already been finished.
 	uint64_t progress_out;
 
+	/// Time the main thread has waited for a free thread and
+	/// for output. These are used only by the main thread.
+	uint64_t wait_thread_usec;
+	uint64_t wait_out_usec;
+
 
 	mythread_mutex mutex;
 	mythread_cond cond;
 };
 
 
+/// Wake up the main thread and notify the application. This must be
+/// called with coder->mutex locked.
+static void
+worker_wake_main(lzma_stream_coder *coder)
+{
+	mythread_cond_signal(&coder->cond);
+
+	if (coder->notify != NULL)
+		coder->notify(coder->notify_opaque);
+
+	return;
+}
+
+
 /// Tell the main thread that something has gone wrong.
 static void
 worker_error(worker_thread *thr, lzma_ret ret)
@@ -208,24 +366,309 @@ worker_error(worker_thread *thr, lzma_ret ret)
 		if (thr->coder->thread_error == LZMA_OK)
 			thr->coder->thread_error = ret;
 
-		mythread_cond_signal(&thr->coder->cond);
+		worker_wake_main(thr->coder);
+	}
+
+	return;
+}
+
+
+/// Wait for more input or a change of the state. The time is charged
+/// to WORKER_WAIT_IN. This must be called with thr->mutex locked.
+static void
+worker_wait_input(worker_thread *thr)
+{
+	lzma_worker_stats_switch(&thr->stats, WORKER_WAIT_IN);
+	mythread_cond_wait(&thr->cond, &thr->mutex);
+	lzma_worker_stats_switch(&thr->stats, WORKER_BUSY);
+	return;
+}
+
+
+/// Set the writing position to the beginning of the output buffer.
+static void
+worker_out_rewind(worker_thread *thr)
+{
+	thr->out = thr->outbuf->buf;
+	thr->out_seg = NULL;
+	thr->out_start = 0;
+	thr->out_size = thr->outbuf->allocated;
+	return;
+}
+
+
+/// Move the writing position to the beginning of the next segment of
+/// the output buffer. The segment must exist already.
+static void
+worker_out_next(worker_thread *thr)
+{
+	lzma_outseg *seg = thr->out_seg == NULL
+			? thr->outbuf->segs : thr->out_seg->next;
+	assert(seg != NULL);
+
+	thr->out = seg->buf;
+	thr->out_seg = seg;
+	thr->out_start += thr->out_size;
+	thr->out_size = seg->allocated;
+	return;
+}
+
+
+/// Make sure that the output buffer can hold at least size bytes
+/// by adding segments to it if needed.
+static lzma_ret
+worker_out_reserve(worker_thread *thr, size_t size)
+{
+	lzma_outseg *last = thr->out_seg;
+	size_t avail = thr->out_start + thr->out_size;
+
+	lzma_outseg *seg = last == NULL ? thr->outbuf->segs : last->next;
+	while (seg != NULL) {
+		avail += seg->allocated;
+		last = seg;
+		seg = seg->next;
+	}
+
+	while (avail < size) {
+		mythread_sync(thr->coder->mutex) {
+			seg = lzma_outq_get_seg(&thr->coder->outq,
+					thr->allocator,
+					thr->coder->outbuf_seg_size);
+		}
+
+		if (seg == NULL)
+			return LZMA_MEM_ERROR;
+
+		if (last == NULL)
+			thr->outbuf->segs = seg;
+		else
+			last->next = seg;
+
+		avail += seg->allocated;
+		last = seg;
+	}
+
+	return LZMA_OK;
+}
+
+
+/// Copy buf[0...size - 1] to the output at *out_pos. The caller must
+/// have reserved enough space with worker_out_reserve().
+static void
+worker_out_write(worker_thread *thr, const uint8_t *buf, size_t size,
+		size_t *out_pos)
+{
+	while (size > 0) {
+		if (*out_pos == thr->out_start + thr->out_size)
+			worker_out_next(thr);
+
+		const size_t pos = *out_pos - thr->out_start;
+		const size_t copy_size = my_min(size, thr->out_size - pos);
+		memcpy(thr->out + pos, buf, copy_size);
+
+		buf += copy_size;
+		size -= copy_size;
+		*out_pos += copy_size;
+	}
+
+	return;
+}
+
+
+/// Run thr->block_encoder until the input is consumed or the total
+/// amount of output reaches out_limit. Segments are added to the
+/// output buffer as needed.
+static lzma_ret
+worker_out_code(worker_thread *thr, const uint8_t *in, size_t *in_pos,
+		size_t in_size, size_t *out_pos, size_t out_limit,
+		lzma_action action)
+{
+	lzma_ret ret;
+
+	do {
+		if (*out_pos == thr->out_start + thr->out_size) {
+			ret = worker_out_reserve(thr, *out_pos + 1);
+			if (ret != LZMA_OK)
+				return ret;
+
+			worker_out_next(thr);
+		}
+
+		size_t pos = *out_pos - thr->out_start;
+		ret = thr->block_encoder.code(
+				thr->block_encoder.coder, thr->allocator,
+				in, in_pos, in_size, thr->out, &pos,
+				my_min(thr->out_size,
+					out_limit - thr->out_start),
+				action);
+		*out_pos = thr->out_start + pos;
+	} while (ret == LZMA_OK && *out_pos < out_limit
+			&& *out_pos == thr->out_start + thr->out_size);
+
+	return ret;
+}
+
+
+/// Write in[0...in_size - 1] as uncompressed LZMA2 chunks. The caller
+/// must have reserved enough space in the output buffer.
+static void
+write_uncompressed(worker_thread *thr, const uint8_t *in, size_t in_size,
+		size_t chunk_max, bool dict_reset, size_t *out_pos)
+{
+	size_t in_pos = 0;
+
+	while (in_pos < in_size) {
+		const size_t copy_size = my_min(in_size - in_pos, chunk_max);
+
+		const uint8_t header[LZMA2_HEADER_UNCOMPRESSED] = {
+			dict_reset ? 0x01 : 0x02,
+			(uint8_t)((copy_size - 1) >> 8),
+			(copy_size - 1) & 0xFF,
+		};
+
+		worker_out_write(thr, header, sizeof(header), out_pos);
+		worker_out_write(thr, in + in_pos, copy_size, out_pos);
+		in_pos += copy_size;
+
+		dict_reset = false;
 	}
 
 	return;
 }
 
 
+/// Write the last PART_TAIL_SIZE bytes of a part (other than the last part
+/// of the Block) as uncompressed LZMA2 chunks so that *out_pos becomes
+/// a multiple of four.
+static void
+part_write_tail(worker_thread *thr, const uint8_t *in, size_t *out_pos)
+{
+	// An uncompressed chunk of n bytes takes n + 3 bytes. The rows
+	// are the chunk sizes to use when the encoded tail needs to
+	// be 0, 1, 2, or 3 (mod 4) bytes: 16, 13, 10, and 7 bytes.
+	static const uint8_t chunks[4][PART_TAIL_SIZE] = {
+		{ 1, 1, 1, 1 },
+		{ 2, 1, 1, 0 },
+		{ 2, 2, 0, 0 },
+		{ 4, 0, 0, 0 },
+	};
+
+	const uint8_t *sizes = chunks[(0U - *out_pos) & 3];
+
+	for (size_t i = 0; i < PART_TAIL_SIZE && sizes[i] != 0; ++i) {
+		write_uncompressed(thr, in, sizes[i], sizes[i], false,
+				out_pos);
+		in += sizes[i];
+	}
+
+	assert((*out_pos & 3) == 0);
+	return;
+}
+
+
+/// Store in[0...in_size - 1] as a Block that uses uncompressed LZMA2
+/// chunks. This produces the same output as lzma_block_uncomp_encode()
+/// but the output may continue in the segments of the output buffer.
+static lzma_ret
+worker_encode_uncomp(worker_thread *thr, const uint8_t *in, size_t in_size,
+		size_t *out_pos)
+{
+	// Like lzma_block_uncomp_encode(), use the minimum dictionary
+	// size in the Block Header to minimize memory usage of the decoder.
+	lzma_options_lzma lzma2 = {
+		.dict_size = LZMA_DICT_SIZE_MIN,
+	};
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &lzma2 },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	thr->block_options.filters = filters;
+	thr->block_options.uncompressed_size = in_size;
+	thr->block_options.compressed_size = in_size
+			+ (in_size + LZMA2_CHUNK_MAX - 1) / LZMA2_CHUNK_MAX
+				* LZMA2_HEADER_UNCOMPRESSED
+			+ 1;
+
+	uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+	lzma_ret ret = lzma_block_header_size(&thr->block_options);
+	if (ret == LZMA_OK)
+		ret = lzma_block_header_encode(&thr->block_options, header);
+
+	thr->block_options.filters = thr->filters;
+	if (ret != LZMA_OK)
+		return LZMA_PROG_ERROR;
+
+	worker_out_rewind(thr);
+	return_if_error(worker_out_reserve(thr, thr->coder->outbuf_alloc_size));
+
+	*out_pos = 0;
+	worker_out_write(thr, header, thr->block_options.header_size,
+			out_pos);
+	write_uncompressed(thr, in, in_size, LZMA2_CHUNK_MAX, true, out_pos);
+
+	// End marker and Block Padding
+	static const uint8_t zeros[4] = { 0x00, 0x00, 0x00, 0x00 };
+	worker_out_write(thr, zeros, 1, out_pos);
+	worker_out_write(thr, zeros, (0U - *out_pos) & 3, out_pos);
+
+	lzma_check_state check;
+	lzma_check_init(&check, thr->block_options.check);
+	lzma_check_update(&check, thr->block_options.check, in, in_size);
+	lzma_check_finish(&check, thr->block_options.check);
+
+	const uint32_t check_size = lzma_check_size(thr->block_options.check);
+	memcpy(thr->block_options.raw_check, check.buffer.u8, check_size);
+	worker_out_write(thr, check.buffer.u8, check_size, out_pos);
+
+	assert(*out_pos <= thr->coder->outbuf_alloc_size);
+	return LZMA_OK;
+}
+
+
+/// Make the output up to out_pos available to the main thread after
+/// the first flush_size bytes of input have been flushed with
+/// LZMA_SYNC_FLUSH. On the first flush of the Block, the Block Header is
+/// written first. Its size was reserved for the Compressed Size and
+/// Uncompressed Size fields, but those aren't known yet, so they are
+/// omitted and the space is filled with Header Padding.
+static lzma_ret
+worker_flush_done(worker_thread *thr, size_t flush_size, size_t out_pos,
+		bool write_header)
+{
+	if (write_header) {
+		lzma_block block_options = thr->block_options;
+		block_options.compressed_size = LZMA_VLI_UNKNOWN;
+		block_options.uncompressed_size = LZMA_VLI_UNKNOWN;
+
+		const lzma_ret ret = lzma_block_header_encode(
+				&block_options, thr->outbuf->buf);
+		if (ret != LZMA_OK)
+			return ret;
+	}
+
+	mythread_sync(thr->coder->mutex) {
+		mythread_atomic_store(&thr->outbuf->pos, out_pos);
+		thr->flushed_size = flush_size;
+		worker_wake_main(thr->coder);
+	}
+
+	return LZMA_OK;
+}
+
+
 static worker_state
 worker_encode(worker_thread *thr, size_t *out_pos, worker_state state)
 {
-	assert(thr->progress_in == 0);
-	assert(thr->progress_out == 0);
+	assert(mythread_atomic_load(&thr->progress_in) == 0);
+	assert(mythread_atomic_load(&thr->progress_out) == 0);
 
 	// Set the Block options.
 	thr->block_options = (lzma_block){
 		.version = 0,
 		.check = thr->coder->stream_flags.check,
-		.compressed_size = thr->outbuf->allocated,
+		.compressed_size = thr->coder->outbuf_alloc_size,
 		.uncompressed_size = thr->coder->block_size,
 		.filters = thr->filters,
 	};
@@ -248,30 +691,43 @@ worker_encode(worker_thread *thr, size_t *out_pos, worker_state state)
 		return THR_STOP;
 	}
 
+	const uint8_t *in = NULL;
 	size_t in_pos = 0;
 	size_t in_size = 0;
 
+	// Amount of input to flush with LZMA_SYNC_FLUSH and the amount
+	// that has been flushed already
+	size_t flush_size = 0;
+	size_t flushed_size = 0;
+
+	// The output buffer grows as needed up to this size. After the
+	// first sync flush the output cannot be rewritten anymore, so
+	// the limit is removed, see worker_flush_done().
+	worker_out_rewind(thr);
 	*out_pos = thr->block_options.header_size;
-	const size_t out_size = thr->outbuf->allocated;
+	size_t out_limit = thr->coder->outbuf_alloc_size;
 
 	do {
-		mythread_sync(thr->mutex) {
-			// Store in_pos and *out_pos into *thr so that
-			// an application may read them via
-			// lzma_get_progress() to get progress information.
-			//
-			// NOTE: These aren't updated when the encoding
-			// finishes. Instead, the final values are taken
-			// later from thr->outbuf.
-			thr->progress_in = in_pos;
-			thr->progress_out = *out_pos;
+		// Store in_pos and *out_pos into *thr so that
+		// an application may read them via
+		// lzma_get_progress() to get progress information.
+		//
+		// NOTE: These aren't updated when the encoding
+		// finishes. Instead, the final values are taken
+		// later from thr->outbuf.
+		mythread_atomic_store(&thr->progress_in, in_pos);
+		mythread_atomic_store(&thr->progress_out, *out_pos);
 
+		mythread_sync(thr->mutex) {
 			while (in_size == thr->in_size
+					&& flushed_size == thr->flush_size
 					&& thr->state == THR_RUN)
-				mythread_cond_wait(&thr->cond, &thr->mutex);
+				worker_wait_input(thr);
 
 			state = thr->state;
+			in = thr->in;
 			in_size = thr->in_size;
+			flush_size = thr->flush_size;
 		}
 
 		// Return if we were asked to stop or exit.
@@ -280,28 +736,47 @@ worker_encode(worker_thread *thr, size_t *out_pos, worker_state state)
 
 		lzma_action action = state == THR_FINISH
 				? LZMA_FINISH : LZMA_RUN;
+		size_t in_end = in_size;
+
+		// The main thread doesn't give more input before the flush
+		// has been completed, but stop at flush_size anyway.
+		if (state == THR_RUN && flush_size != flushed_size) {
+			action = LZMA_SYNC_FLUSH;
+			in_end = flush_size;
+		}
 
 		// Limit the amount of input given to the Block encoder
 		// at once. This way this thread can react fairly quickly
 		// if the main thread wants us to stop or exit.
 		static const size_t in_chunk_max = 16384;
-		size_t in_limit = in_size;
-		if (in_size - in_pos > in_chunk_max) {
+		size_t in_limit = in_end;
+		if (in_end - in_pos > in_chunk_max) {
 			in_limit = in_pos + in_chunk_max;
 			action = LZMA_RUN;
 		}
 
-		ret = thr->block_encoder.code(
-				thr->block_encoder.coder, thr->allocator,
-				thr->in, &in_pos, in_limit, thr->outbuf->buf,
-				out_pos, out_size, action);
-	} while (ret == LZMA_OK && *out_pos < out_size);
+		ret = worker_out_code(thr, in, &in_pos, in_limit,
+				out_pos, out_limit, action);
+
+		if (ret == LZMA_STREAM_END && action == LZMA_SYNC_FLUSH) {
+			ret = worker_flush_done(thr, flush_size, *out_pos,
+					flushed_size == 0);
+			flushed_size = flush_size;
+			out_limit = SIZE_MAX;
+		}
+	} while (ret == LZMA_OK && *out_pos < out_limit);
 
 	switch (ret) {
 	case LZMA_STREAM_END:
 		assert(state == THR_FINISH);
 
-		// Encode the Block Header. By doing it after
+		// If a sync flush was done, the Block Header has been
+		// written already.
+		if (flushed_size != 0)
+			break;
+
+		// Encode the Block Header. It fits in outbuf->buf[] since
+		// the buffer is always bigger than the Block Header. By doing it after
 		// the compression, we can store the Compressed Size
 		// and Uncompressed Size fields.
 		ret = lzma_block_header_encode(&thr->block_options,
@@ -315,29 +790,49 @@ worker_encode(worker_thread *thr, size_t *out_pos, worker_state state)
 
 	case LZMA_OK:
 		// The data was incompressible. Encode it using uncompressed
-		// LZMA2 chunks.
-		//
+		// LZMA2 chunks. This cannot happen after a sync flush
+		// since out_limit was removed.
+		assert(flushed_size == 0);
+
 		// First wait that we have gotten all the input.
-		mythread_sync(thr->mutex) {
-			while (thr->state == THR_RUN)
-				mythread_cond_wait(&thr->cond, &thr->mutex);
+		//
+		// LZMA2 output cannot reach out_limit before the end of
+		// the Block, so a sync flush shouldn't be requested here.
+		// If it still happens, nothing can be made available
+		// before the whole Block has been encoded. Tell the main
+		// thread that the flush is done so that it won't wait
+		// for it indefinitely.
+		while (true) {
+			mythread_sync(thr->mutex) {
+				while (thr->state == THR_RUN
+						&& thr->flush_size
+							== flushed_size)
+					worker_wait_input(thr);
 
-			state = thr->state;
-			in_size = thr->in_size;
+				state = thr->state;
+				in = thr->in;
+				in_size = thr->in_size;
+				flush_size = thr->flush_size;
+			}
+
+			if (state != THR_RUN)
+				break;
+
+			mythread_sync(thr->coder->mutex) {
+				thr->flushed_size = flush_size;
+				worker_wake_main(thr->coder);
+			}
+
+			flushed_size = flush_size;
 		}
 
 		if (state >= THR_STOP)
 			return state;
 
 		// Do the encoding. This takes care of the Block Header too.
-		*out_pos = 0;
-		ret = lzma_block_uncomp_encode(&thr->block_options,
-				thr->in, in_size, thr->outbuf->buf,
-				out_pos, out_size);
-
-		// It shouldn't fail.
+		ret = worker_encode_uncomp(thr, in, in_size, out_pos);
 		if (ret != LZMA_OK) {
-			worker_error(thr, LZMA_PROG_ERROR);
+			worker_error(thr, ret);
 			return THR_STOP;
 		}
 
@@ -359,12 +854,358 @@ worker_encode(worker_thread *thr, size_t *out_pos, worker_state state)
 }
 
 
+/// Encode a part of a Block. Unlike worker_encode(), this uses the raw
+/// LZMA2 encoder and the Block Header, Block Padding, and Check are
+/// handled here. Only the first part has the Block Header and only the
+/// last part has the Block Padding and Check.
+static worker_state
+worker_encode_part(worker_thread *thr, size_t *out_pos, worker_state state)
+{
+	assert(mythread_atomic_load(&thr->progress_in) == 0);
+	assert(mythread_atomic_load(&thr->progress_out) == 0);
+	assert(thr->filters[0].id == LZMA_FILTER_LZMA2);
+	assert(thr->filters[1].id == LZMA_VLI_UNKNOWN);
+
+	const uint8_t *in = NULL;
+	mythread_sync(thr->mutex) {
+		in = thr->in;
+	}
+
+	// Prime the match finder with the history from the earlier parts.
+	// thr->filters is our own copy so it's fine to modify it.
+	lzma_options_lzma *opt = thr->filters[0].options;
+	opt->preset_dict = thr->in_start > 0 ? in : NULL;
+	opt->preset_dict_size = (uint32_t)(thr->in_start);
+
+	thr->block_options = (lzma_block){
+		.version = 0,
+		.check = thr->coder->stream_flags.check,
+		.compressed_size = thr->coder->outbuf_alloc_size,
+		.uncompressed_size = thr->coder->block_size,
+		.filters = thr->filters,
+	};
+
+	// The space for the Block Header is reserved in the same way as
+	// in worker_encode().
+	lzma_ret ret = LZMA_OK;
+	if (thr->part_first) {
+		ret = lzma_block_header_size(&thr->block_options);
+		if (ret != LZMA_OK) {
+			worker_error(thr, ret);
+			return THR_STOP;
+		}
+	} else {
+		thr->block_options.header_size = 0;
+	}
+
+	ret = lzma_raw_encoder_init(&thr->block_encoder, thr->allocator,
+			thr->filters);
+	if (ret != LZMA_OK) {
+		worker_error(thr, ret);
+		return THR_STOP;
+	}
+
+	size_t in_pos = thr->in_start;
+	size_t in_size = in_pos;
+	bool last = false;
+
+	worker_out_rewind(thr);
+	*out_pos = thr->block_options.header_size;
+
+	// Leave room for the data that is written after the LZMA2 data.
+	const size_t out_limit = thr->coder->outbuf_alloc_size
+			- PART_TRAILER_MAX;
+
+	do {
+		mythread_atomic_store(&thr->progress_in,
+				in_pos - thr->in_start);
+		mythread_atomic_store(&thr->progress_out, *out_pos);
+
+		mythread_sync(thr->mutex) {
+			while (in_size == thr->in_size
+					&& thr->state == THR_RUN)
+				worker_wait_input(thr);
+
+			state = thr->state;
+			in = thr->in;
+			in_size = thr->in_size;
+			last = thr->part_last;
+		}
+
+		if (state >= THR_STOP)
+			return state;
+
+		// The last PART_TAIL_SIZE bytes of the input are kept
+		// unencoded until it is known if this is the last part
+		// of the Block. Parts other than the last one are at least
+		// LZMA_DICT_SIZE_MIN bytes so the tail always exists.
+		lzma_action action = LZMA_RUN;
+		size_t in_end = in_size;
+
+		if (state == THR_FINISH && last) {
+			action = LZMA_FINISH;
+		} else {
+			if (state == THR_FINISH)
+				action = LZMA_SYNC_FLUSH;
+
+			if (in_end - thr->in_start >= PART_TAIL_SIZE)
+				in_end -= PART_TAIL_SIZE;
+			else
+				in_end = thr->in_start;
+		}
+
+		static const size_t in_chunk_max = 16384;
+		size_t in_limit = in_end;
+		if (in_end - in_pos > in_chunk_max) {
+			in_limit = in_pos + in_chunk_max;
+			action = LZMA_RUN;
+		}
+
+		ret = worker_out_code(thr, in, &in_pos, in_limit,
+				out_pos, out_limit, action);
+	} while (ret == LZMA_OK && *out_pos < out_limit);
+
+	switch (ret) {
+	case LZMA_STREAM_END:
+		assert(state == THR_FINISH);
+
+		ret = worker_out_reserve(thr, *out_pos + PART_TRAILER_MAX);
+		if (ret != LZMA_OK) {
+			worker_error(thr, ret);
+			return THR_STOP;
+		}
+
+		if (!last)
+			part_write_tail(thr, in + in_size - PART_TAIL_SIZE,
+					out_pos);
+
+		break;
+
+	case LZMA_OK:
+		// The data was incompressible. Wait for the rest of the input
+		// and then store the part using uncompressed LZMA2 chunks.
+		mythread_sync(thr->mutex) {
+			while (thr->state == THR_RUN)
+				worker_wait_input(thr);
+
+			state = thr->state;
+			in = thr->in;
+			in_size = thr->in_size;
+			last = thr->part_last;
+		}
+
+		if (state >= THR_STOP)
+			return state;
+
+		if (thr->part_first && last) {
+			// The Block has only one part so it can be
+			// encoded like in worker_encode().
+			ret = worker_encode_uncomp(thr, in, in_size, out_pos);
+			if (ret != LZMA_OK) {
+				worker_error(thr, ret);
+				return THR_STOP;
+			}
+
+			thr->outbuf->unpadded_size = lzma_block_unpadded_size(
+					&thr->block_options);
+			thr->outbuf->uncompressed_size = in_size;
+			return THR_FINISH;
+		}
+
+		worker_out_rewind(thr);
+		ret = worker_out_reserve(thr, thr->coder->outbuf_alloc_size);
+		if (ret != LZMA_OK) {
+			worker_error(thr, ret);
+			return THR_STOP;
+		}
+
+		*out_pos = thr->block_options.header_size;
+		write_uncompressed(thr, in + thr->in_start,
+				in_size - thr->in_start
+					- (last ? 0 : PART_TAIL_SIZE),
+				LZMA2_CHUNK_MAX, thr->part_first, out_pos);
+
+		if (last) {
+			static const uint8_t end_marker = 0x00;
+			worker_out_write(thr, &end_marker, 1, out_pos);
+		} else {
+			part_write_tail(thr, in + in_size - PART_TAIL_SIZE,
+					out_pos);
+		}
+
+		break;
+
+	default:
+		worker_error(thr, ret);
+		return THR_STOP;
+	}
+
+	// Size of the data that counts towards the Unpadded Size
+	size_t unpadded_size = *out_pos;
+
+	if (last) {
+		// Block Padding: All the earlier parts of this Block
+		// are a multiple of four bytes.
+		static const uint8_t zeros[3] = { 0x00, 0x00, 0x00 };
+		worker_out_write(thr, zeros, (0U - *out_pos) & 3, out_pos);
+
+		const uint32_t check_size = lzma_check_size(
+				thr->block_options.check);
+		worker_out_write(thr, thr->check, check_size, out_pos);
+		unpadded_size += check_size;
+	}
+
+	if (thr->part_first) {
+		// If the whole Block is in this part, the size fields can
+		// be stored in the Block Header like worker_encode() does.
+		if (last) {
+			thr->block_options.compressed_size = unpadded_size
+					- thr->block_options.header_size
+					- lzma_check_size(
+						thr->block_options.check);
+			thr->block_options.uncompressed_size
+					= in_size - thr->in_start;
+		} else {
+			thr->block_options.compressed_size = LZMA_VLI_UNKNOWN;
+			thr->block_options.uncompressed_size
+					= LZMA_VLI_UNKNOWN;
+		}
+
+		ret = lzma_block_header_encode(&thr->block_options,
+				thr->outbuf->buf);
+		if (ret != LZMA_OK) {
+			worker_error(thr, ret);
+			return THR_STOP;
+		}
+	}
+
+	// The main thread sums the sizes of the parts. A non-zero
+	// uncompressed_size marks the last part of the Block.
+	thr->outbuf->unpadded_size = unpadded_size;
+	thr->outbuf->uncompressed_size
+			= last ? thr->block_uncompressed_size : 0;
+
+	return THR_FINISH;
+}
+
+
+/// Make the result of the encoding available to the main thread and
+/// put the worker_thread structure back to the stack of free threads.
+static void
+worker_done(worker_thread *thr, worker_state state, size_t out_pos)
+{
+	// Mark the thread as idle unless the main thread has
+	// told us to exit. Signal is needed for the case
+	// where the main thread is waiting for the threads to stop.
+	mythread_sync(thr->mutex) {
+		if (thr->state != THR_EXIT) {
+			thr->state = THR_IDLE;
+			mythread_cond_signal(&thr->cond);
+		}
+	}
+
+	mythread_sync(thr->coder->mutex) {
+		lzma_stream_coder *coder = thr->coder;
+
+		// The main thread only needs to be woken up if this
+		// changes something it may be waiting for: the first
+		// buffer in the output queue became readable, a free
+		// thread became available when there were none, or
+		// all jobs in the thread pool have finished. With many
+		// threads this avoids waking the main thread just to
+		// find out that it still cannot do anything.
+		bool wake = state != THR_FINISH
+				|| thr->outbuf == coder->outq.head
+				|| coder->threads_free == NULL;
+
+		// If no errors occurred, make the encoded data
+		// available to be copied out.
+		if (state == THR_FINISH) {
+			mythread_atomic_store(&thr->outbuf->pos, out_pos);
+			thr->outbuf->finished = true;
+		}
+
+		// Update the main progress info. When encoding parts,
+		// outbuf->uncompressed_size isn't the size of
+		// the input of this thread.
+		if (state == THR_FINISH)
+			coder->progress_in += thr->in_size - thr->in_start;
+
+		coder->progress_out += out_pos;
+		mythread_atomic_store(&thr->progress_in, 0);
+		mythread_atomic_store(&thr->progress_out, 0);
+
+		// Move the progress to the statistics too. This is done
+		// while coder->mutex is locked so that get_mt_stats()
+		// won't count the same data twice.
+		mythread_sync(thr->mutex) {
+			if (state == THR_FINISH) {
+				++thr->stats.blocks;
+				thr->stats.uncompressed_size
+					+= thr->in_size - thr->in_start;
+				thr->stats.compressed_size += out_pos;
+			}
+
+			lzma_worker_stats_switch(&thr->stats, WORKER_IDLE);
+		}
+
+		// Return this thread to the stack of free threads.
+		thr->next = coder->threads_free;
+		coder->threads_free = thr;
+
+		// The main thread may free *thr once the job count
+		// has dropped to zero, so this must be the last thing
+		// done with *thr.
+		if (coder->thread_pool != NULL && --coder->jobs_pending == 0)
+			wake = true;
+
+		if (wake)
+			worker_wake_main(coder);
+	}
+
+	return;
+}
+
+
+/// Encode the input of thr in a thread of coder->thread_pool. All the
+/// input is available already, so the encoder never waits for the main
+/// thread. If the main thread has stopped the encoding before the job
+/// started, only the bookkeeping is done.
+static void
+worker_job(void *thr_ptr)
+{
+	worker_thread *thr = thr_ptr;
+	worker_state state = THR_IDLE; // Init to silence a warning
+
+	mythread_sync(thr->mutex) {
+		state = thr->state;
+		lzma_worker_stats_switch(&thr->stats, WORKER_BUSY);
+	}
+
+	size_t out_pos = 0;
+
+	if (state == THR_FINISH)
+		state = thr->coder->part_size != 0
+			? worker_encode_part(thr, &out_pos, state)
+			: worker_encode(thr, &out_pos, state);
+
+	worker_done(thr, state, out_pos);
+	return;
+}
+
+
 static MYTHREAD_RET_TYPE
 worker_start(void *thr_ptr)
 {
 	worker_thread *thr = thr_ptr;
 	worker_state state = THR_IDLE; // Init to silence a warning
 
+	// This is done before the first Block so that the encoder state,
+	// which worker_encode() allocates and initializes in this thread,
+	// gets its memory from the node of this thread.
+	if (thr->coder->numa)
+		lzma_numa_bind_thread((uint32_t)(thr - thr->coder->threads));
+
 	while (true) {
 		// Wait for work.
 		mythread_sync(thr->mutex) {
@@ -382,6 +1223,8 @@ worker_start(void *thr_ptr)
 
 				mythread_cond_wait(&thr->cond, &thr->mutex);
 			}
+
+			lzma_worker_stats_switch(&thr->stats, WORKER_BUSY);
 		}
 
 		size_t out_pos = 0;
@@ -390,42 +1233,14 @@ worker_start(void *thr_ptr)
 		assert(state != THR_STOP);
 
 		if (state <= THR_FINISH)
-			state = worker_encode(thr, &out_pos, state);
+			state = thr->coder->part_size != 0
+				? worker_encode_part(thr, &out_pos, state)
+				: worker_encode(thr, &out_pos, state);
 
 		if (state == THR_EXIT)
 			break;
 
-		// Mark the thread as idle unless the main thread has
-		// told us to exit. Signal is needed for the case
-		// where the main thread is waiting for the threads to stop.
-		mythread_sync(thr->mutex) {
-			if (thr->state != THR_EXIT) {
-				thr->state = THR_IDLE;
-				mythread_cond_signal(&thr->cond);
-			}
-		}
-
-		mythread_sync(thr->coder->mutex) {
-			// If no errors occurred, make the encoded data
-			// available to be copied out.
-			if (state == THR_FINISH) {
-				thr->outbuf->pos = out_pos;
-				thr->outbuf->finished = true;
-			}
-
-			// Update the main progress info.
-			thr->coder->progress_in
-					+= thr->outbuf->uncompressed_size;
-			thr->coder->progress_out += out_pos;
-			thr->progress_in = 0;
-			thr->progress_out = 0;
-
-			// Return this thread to the stack of free threads.
-			thr->next = thr->coder->threads_free;
-			thr->coder->threads_free = thr;
-
-			mythread_cond_signal(&thr->coder->cond);
-		}
+		worker_done(thr, state, out_pos);
 	}
 
 	// Exiting, free the resources.
@@ -435,15 +1250,67 @@ worker_start(void *thr_ptr)
 	mythread_cond_destroy(&thr->cond);
 
 	lzma_next_end(&thr->block_encoder, thr->allocator);
-	lzma_free(thr->in, thr->allocator);
+	lzma_free(thr->in_buf, thr->allocator);
 	return MYTHREAD_RET_VALUE;
 }
 
 
+/// threads_stop() when using a thread pool: Jobs that are running are told
+/// to stop. The structures whose jobs haven't been started are finished
+/// in this thread.
+static void
+threads_stop_pool(lzma_stream_coder *coder, bool wait_for_jobs)
+{
+	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
+		worker_thread *thr = &coder->threads[i];
+		worker_state state = THR_IDLE; // Init to silence a warning
+		bool cancelled = false;
+
+		mythread_sync(thr->mutex) {
+			state = thr->state;
+
+			if (state == THR_FINISH)
+				cancelled = lzma_thread_pool_cancel(
+						coder->thread_pool, &thr->job);
+
+			if (state == THR_RUN || state == THR_FINISH)
+				thr->state = THR_STOP;
+		}
+
+		// In the THR_RUN state the main thread was still copying
+		// input and no job has been submitted. Count it as a job
+		// because worker_done() decrements the count.
+		if (state == THR_RUN) {
+			mythread_sync(coder->mutex) {
+				++coder->jobs_pending;
+			}
+		}
+
+		if (state == THR_RUN || cancelled)
+			worker_job(thr);
+	}
+
+	if (!wait_for_jobs)
+		return;
+
+	mythread_sync(coder->mutex) {
+		while (coder->jobs_pending > 0)
+			mythread_cond_wait(&coder->cond, &coder->mutex);
+	}
+
+	return;
+}
+
+
 /// Make the threads stop but not exit. Optionally wait for them to stop.
 static void
 threads_stop(lzma_stream_coder *coder, bool wait_for_threads)
 {
+	if (coder->thread_pool != NULL) {
+		threads_stop_pool(coder, wait_for_threads);
+		return;
+	}
+
 	// Tell the threads to stop.
 	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
 		mythread_sync(coder->threads[i].mutex) {
@@ -473,6 +1340,27 @@ threads_stop(lzma_stream_coder *coder, bool wait_for_threads)
 static void
 threads_end(lzma_stream_coder *coder, const lzma_allocator *allocator)
 {
+	if (coder->thread_pool != NULL) {
+		// Once the jobs have completed, the resources can be
+		// freed here like worker_start() does when exiting.
+		threads_stop_pool(coder, true);
+
+		for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
+			worker_thread *thr = &coder->threads[i];
+
+			lzma_filters_free(thr->filters, thr->allocator);
+
+			mythread_mutex_destroy(&thr->mutex);
+			mythread_cond_destroy(&thr->cond);
+
+			lzma_next_end(&thr->block_encoder, thr->allocator);
+			lzma_free(thr->in_buf, thr->allocator);
+		}
+
+		lzma_free(coder->threads, allocator);
+		return;
+	}
+
 	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
 		mythread_sync(coder->threads[i].mutex) {
 			coder->threads[i].state = THR_EXIT;
@@ -492,18 +1380,15 @@ threads_end(lzma_stream_coder *coder, const lzma_allocator *allocator)
 
 
 /// Initialize a new worker_thread structure and create a new thread.
+/// The input buffer is allocated later when it is needed.
 static lzma_ret
 initialize_new_thread(lzma_stream_coder *coder,
 		const lzma_allocator *allocator)
 {
 	worker_thread *thr = &coder->threads[coder->threads_initialized];
 
-	thr->in = lzma_alloc(coder->block_size, allocator);
-	if (thr->in == NULL)
-		return LZMA_MEM_ERROR;
-
 	if (mythread_mutex_init(&thr->mutex))
-		goto error_mutex;
+		return LZMA_MEM_ERROR;
 
 	if (mythread_cond_init(&thr->cond))
 		goto error_cond;
@@ -511,12 +1396,20 @@ initialize_new_thread(lzma_stream_coder *coder,
 	thr->state = THR_IDLE;
 	thr->allocator = allocator;
 	thr->coder = coder;
-	thr->progress_in = 0;
-	thr->progress_out = 0;
+	thr->in = NULL;
+	thr->in_buf = NULL;
+	thr->in_size = 0;
+	thr->in_start = 0;
+	mythread_atomic_store(&thr->progress_in, 0);
+	mythread_atomic_store(&thr->progress_out, 0);
 	thr->block_encoder = LZMA_NEXT_CODER_INIT;
 	thr->filters[0].id = LZMA_VLI_UNKNOWN;
+	thr->job.func = &worker_job;
+	thr->job.arg = thr;
+	lzma_worker_stats_init(&thr->stats);
 
-	if (mythread_create(&thr->thread_id, &worker_start, thr))
+	if (coder->thread_pool == NULL && mythread_create(
+			&thr->thread_id, &worker_start, thr))
 		goto error_thread;
 
 	++coder->threads_initialized;
@@ -529,9 +1422,6 @@ error_thread:
 
 error_cond:
 	mythread_mutex_destroy(&thr->mutex);
-
-error_mutex:
-	lzma_free(thr->in, allocator);
 	return LZMA_MEM_ERROR;
 }
 
@@ -545,9 +1435,16 @@ get_thread(lzma_stream_coder *coder, const lzma_allocator *allocator)
 		return LZMA_OK;
 
 	// That's also true if we cannot allocate memory for the output
-	// buffer in the output queue.
-	return_if_error(lzma_outq_prealloc_buf(&coder->outq, allocator,
-			coder->outbuf_alloc_size));
+	// buffer in the output queue. The mutex is needed because the
+	// worker threads may add segments to their output buffers, which
+	// updates the memory usage counters of the queue.
+	lzma_ret ret = LZMA_OK;
+	mythread_sync(coder->mutex) {
+		ret = lzma_outq_prealloc_buf(&coder->outq, allocator,
+				coder->outbuf_seg_size);
+	}
+
+	return_if_error(ret);
 
 	// Make a thread-specific copy of the filter chain. Put it in
 	// the cache array first so that if we cannot get a new thread yet,
@@ -573,12 +1470,75 @@ get_thread(lzma_stream_coder *coder, const lzma_allocator *allocator)
 		return_if_error(initialize_new_thread(coder, allocator));
 	}
 
+	// When encoding a part of a Block, the history comes from the input
+	// of the previous part. If the previous part was read directly from
+	// the application's buffer, the history can be read from there too.
+	// Otherwise copy it from the input buffer of the previous part. The
+	// thread of the previous part cannot have been given new work since
+	// then, but it may be the same thread that we got now, thus memmove().
+	//
+	// The amount of history is adjusted so that it is congruent with
+	// the position of the part in the Block modulo 16. Then the LZMA2
+	// encoder sees the same position bits (pb and lp) as the decoder.
+	const worker_thread *prev = coder->part_prev;
+	const uint8_t *thr_in = NULL;
+	size_t history = 0;
+	if (coder->block_in > 0) {
+		const lzma_options_lzma *opt = coder->filters_cache[0].options;
+		history = my_min(my_min(coder->block_in, opt->dict_size),
+				coder->part_history_max);
+		history -= (history - coder->block_in) & 15;
+
+		assert(prev != NULL);
+		assert(prev->in_size >= history);
+		if (prev->in != prev->in_buf)
+			thr_in = prev->in + prev->in_size - history;
+	}
+
+	// With LZMA_MT_DIRECT_INPUT the input buffer is allocated only
+	// when the input isn't contiguous, see stream_encode_in().
+	if (thr_in == NULL && (!coder->direct_input || history > 0)) {
+		if (coder->thr->in_buf == NULL) {
+			coder->thr->in_buf = lzma_alloc(
+					coder->in_buf_size, allocator);
+			if (coder->thr->in_buf == NULL) {
+				// Put the structure back to the stack so
+				// that it will be found when trying again.
+				mythread_sync(coder->mutex) {
+					coder->thr->next = coder->threads_free;
+					coder->threads_free = coder->thr;
+				}
+
+				coder->thr = NULL;
+				return LZMA_MEM_ERROR;
+			}
+		}
+
+		if (history > 0)
+			memmove(coder->thr->in_buf,
+					prev->in + prev->in_size - history,
+					history);
+
+		thr_in = coder->thr->in_buf;
+	}
+
+	lzma_outbuf *outbuf = NULL;
+	mythread_sync(coder->mutex) {
+		outbuf = lzma_outq_get_buf(&coder->outq, NULL);
+	}
+
 	// Reset the parts of the thread state that have to be done
 	// in the main thread.
 	mythread_sync(coder->thr->mutex) {
 		coder->thr->state = THR_RUN;
-		coder->thr->in_size = 0;
-		coder->thr->outbuf = lzma_outq_get_buf(&coder->outq, NULL);
+		coder->thr->in = thr_in;
+		coder->thr->in_size = history;
+		coder->thr->in_start = history;
+		coder->thr->part_first = coder->block_in == 0;
+		coder->thr->part_last = false;
+		coder->thr->flush_size = 0;
+		coder->thr->flushed_size = 0;
+		coder->thr->outbuf = outbuf;
 
 		// Free the old thread-specific filter options and replace
 		// them with the already-allocated new options from
@@ -600,8 +1560,20 @@ stream_encode_in(lzma_stream_coder *coder, const lzma_allocator *allocator,
 		const uint8_t *restrict in, size_t *restrict in_pos,
 		size_t in_size, lzma_action action)
 {
+	// LZMA_SYNC_FLUSH can be done in the middle of a Block only when
+	// whole Blocks are encoded by our own threads. Otherwise the part
+	// or the Block is finished, see below.
+	const bool flush_in_place = action == LZMA_SYNC_FLUSH
+			&& coder->part_size == 0 && coder->thread_pool == NULL;
+
+	// When encoding parts, the previous part may have been finished
+	// by LZMA_SYNC_FLUSH without knowing if it was the last part of
+	// the Block. If the Block needs to be finished now, an empty last
+	// part is encoded.
 	while (*in_pos < in_size
-			|| (coder->thr != NULL && action != LZMA_RUN)) {
+			|| (coder->thr != NULL && action != LZMA_RUN)
+			|| (coder->block_in > 0 && action != LZMA_RUN
+				&& action != LZMA_SYNC_FLUSH)) {
 		if (coder->thr == NULL) {
 			// Get a new thread.
 			const lzma_ret ret = get_thread(coder, allocator);
@@ -609,19 +1581,117 @@ stream_encode_in(lzma_stream_coder *coder, const lzma_allocator *allocator,
 				return ret;
 		}
 
-		// Copy the input data to thread's buffer.
+		// Give the input data to the thread.
+		const uint8_t *thr_in = coder->thr->in;
 		size_t thr_in_size = coder->thr->in_size;
-		lzma_bufcpy(in, in_pos, in_size, coder->thr->in,
-				&thr_in_size, coder->block_size);
+		size_t thr_in_limit = coder->block_size;
+		if (coder->part_size != 0)
+			thr_in_limit = coder->thr->in_start + my_min(
+					coder->part_size, coder->block_size
+						- coder->block_in
+						+ (thr_in_size
+						- coder->thr->in_start));
+
+		const size_t in_start = *in_pos;
+		if (*in_pos == in_size) {
+			// No new input
+		} else if (coder->direct_input && (thr_in == NULL
+				|| thr_in + thr_in_size == in + *in_pos)) {
+			// The new input continues where the earlier input
+			// of the thread ended in the application's buffer.
+			// The thread can read it from there.
+			if (thr_in == NULL)
+				thr_in = in + *in_pos;
+
+			const size_t amount = my_min(in_size - *in_pos,
+					thr_in_limit - thr_in_size);
+			*in_pos += amount;
+			thr_in_size += amount;
+		} else {
+			// If the thread has been reading the application's
+			// buffer, the earlier input has to be copied to
+			// the input buffer of the thread first. The old
+			// data stays valid so the thread can continue
+			// reading it until we update coder->thr->in below.
+			if (thr_in != coder->thr->in_buf) {
+				if (coder->thr->in_buf == NULL) {
+					coder->thr->in_buf = lzma_alloc(
+						coder->in_buf_size,
+						allocator);
+					if (coder->thr->in_buf == NULL)
+						return LZMA_MEM_ERROR;
+				}
+
+				memcpy(coder->thr->in_buf, thr_in,
+						thr_in_size);
+				thr_in = coder->thr->in_buf;
+			}
+
+			lzma_bufcpy(in, in_pos, in_size, coder->thr->in_buf,
+					&thr_in_size, thr_in_limit);
+		}
 
 		// Tell the Block encoder to finish if
 		//  - it has got block_size bytes of input; or
 		//  - all input was used and LZMA_FINISH, LZMA_FULL_FLUSH,
-		//    or LZMA_FULL_BARRIER was used.
+		//    or LZMA_FULL_BARRIER was used; or
+		//  - all input was used and LZMA_SYNC_FLUSH was used but
+		//    it cannot be done in the middle of the Block.
+		//
+		// Otherwise, if all input was used with LZMA_SYNC_FLUSH,
+		// ask the thread to flush.
+		bool finish = thr_in_size == thr_in_limit
+				|| (*in_pos == in_size && action != LZMA_RUN
+					&& !flush_in_place);
+		const bool flush = !finish && *in_pos == in_size
+				&& flush_in_place;
+
+		if (coder->part_size != 0 && *in_pos > in_start) {
+			if (coder->block_in == 0)
+				lzma_check_init(&coder->block_check,
+						coder->stream_flags.check);
+
+			lzma_check_update(&coder->block_check,
+					coder->stream_flags.check,
+					in + in_start, *in_pos - in_start);
+			coder->block_in += *in_pos - in_start;
+		}
+
+		// When encoding parts, a full part is finished only when
+		// it is known if it is the last part of the Block: either
+		// the Block is full, the application wants to end the Block,
+		// or there is more input for the next part. Otherwise the
+		// next call might be LZMA_FINISH without any new input, and
+		// the Block would need an empty part to end it.
 		//
-		// TODO: LZMA_SYNC_FLUSH and LZMA_SYNC_BARRIER.
-		const bool finish = thr_in_size == coder->block_size
-				|| (*in_pos == in_size && action != LZMA_RUN);
+		// LZMA_SYNC_FLUSH finishes the part without ending the Block.
+		// A part that doesn't end the Block needs PART_TAIL_SIZE
+		// bytes of its own input. If there are fewer, the Block
+		// is ended instead.
+		bool block_end = finish;
+		if (coder->part_size != 0) {
+			const bool flush_part = *in_pos == in_size
+					&& action == LZMA_SYNC_FLUSH;
+
+			block_end = coder->block_in == coder->block_size
+				|| (*in_pos == in_size && action != LZMA_RUN
+					&& !flush_part)
+				|| (flush_part && thr_in_size
+						- coder->thr->in_start
+						< PART_TAIL_SIZE);
+
+			if (!block_end && *in_pos == in_size && !flush_part)
+				finish = false;
+		}
+
+		if (coder->part_size != 0 && block_end) {
+			lzma_check_finish(&coder->block_check,
+					coder->stream_flags.check);
+			memcpy(coder->thr->check, coder->block_check.buffer.u8,
+					lzma_check_size(
+						coder->stream_flags.check));
+			coder->thr->block_uncompressed_size = coder->block_in;
+		}
 
 		bool block_error = false;
 
@@ -634,15 +1704,31 @@ stream_encode_in(lzma_stream_coder *coder, const lzma_allocator *allocator,
 			} else {
 				// Tell the Block encoder its new amount
 				// of input and update the state if needed.
+				coder->thr->in = thr_in;
 				coder->thr->in_size = thr_in_size;
 
-				if (finish)
+				if (finish) {
 					coder->thr->state = THR_FINISH;
+					coder->thr->part_last = block_end;
+				} else if (flush) {
+					coder->thr->flush_size = thr_in_size;
+				}
 
 				mythread_cond_signal(&coder->thr->cond);
 			}
 		}
 
+		// With a thread pool, the Block or part is encoded only
+		// after all its input has been copied.
+		if (!block_error && finish && coder->thread_pool != NULL) {
+			mythread_sync(coder->mutex) {
+				++coder->jobs_pending;
+			}
+
+			lzma_thread_pool_submit(coder->thread_pool,
+					&coder->thr->job);
+		}
+
 		if (block_error) {
 			lzma_ret ret = LZMA_OK; // Init to silence a warning.
 
@@ -653,21 +1739,52 @@ stream_encode_in(lzma_stream_coder *coder, const lzma_allocator *allocator,
 			return ret;
 		}
 
-		if (finish)
+		if (finish) {
+			if (coder->part_size != 0) {
+				if (block_end) {
+					coder->block_in = 0;
+					coder->part_prev = NULL;
+				} else {
+					coder->part_prev = coder->thr;
+				}
+			}
+
 			coder->thr = NULL;
+		}
+
+		// The flush has been requested. The thread continues
+		// with the same Block when it gets more input.
+		if (flush)
+			break;
 	}
 
 	return LZMA_OK;
 }
 
 
+/// Check if LZMA_SYNC_FLUSH has been completed: all input has been
+/// compressed and the output has been read from the output queue.
+/// This must be called with coder->mutex locked.
+static bool
+sync_flush_done(const lzma_stream_coder *coder)
+{
+	if (coder->thr == NULL)
+		return lzma_outq_is_empty(&coder->outq);
+
+	return coder->thr->outbuf == coder->outq.head
+			&& coder->thr->flushed_size == coder->thr->flush_size
+			&& coder->thr->flush_size == coder->thr->in_size
+			&& !lzma_outq_is_readable(&coder->outq);
+}
+
+
 /// Wait until more input can be consumed, more output can be read, or
 /// an optional timeout is reached.
 static bool
 wait_for_work(lzma_stream_coder *coder, mythread_condtime *wait_abs,
-		bool *has_blocked, bool has_input)
+		bool *has_blocked, bool has_input, bool flushing)
 {
-	if (coder->timeout != 0 && !*has_blocked) {
+	if (coder->timeout != 0 && coder->notify == NULL && !*has_blocked) {
 		// Every time when stream_encode_mt() is called via
 		// lzma_code(), *has_blocked starts as false. We set it
 		// to true here and calculate the absolute time when
@@ -686,19 +1803,36 @@ wait_for_work(lzma_stream_coder *coder, mythread_condtime *wait_abs,
 
 	bool timed_out = false;
 
+	// If there is input left, the wait is for a free thread.
+	// Otherwise it is for more output.
+	uint64_t *wait_usec = has_input
+			? &coder->wait_thread_usec : &coder->wait_out_usec;
+
 	mythread_sync(coder->mutex) {
-		// There are four things that we wait. If one of them
+		// There are five things that we wait. If one of them
 		// becomes possible, we return.
 		//  - If there is input left, we need to get a free
 		//    worker thread and an output buffer for it.
 		//  - Data ready to be read from the output queue.
+		//  - LZMA_SYNC_FLUSH has been completed.
 		//  - A worker thread indicates an error.
 		//  - Time out occurs.
+		//
+		// With a notification callback the application will call
+		// us again when there is something to do so we never wait.
 		while ((!has_input || coder->threads_free == NULL
 					|| !lzma_outq_has_buf(&coder->outq))
 				&& !lzma_outq_is_readable(&coder->outq)
+				&& !(flushing && sync_flush_done(coder))
 				&& coder->thread_error == LZMA_OK
 				&& !timed_out) {
+			if (coder->notify != NULL) {
+				timed_out = true;
+				break;
+			}
+
+			const uint64_t wait_start = mythread_time_usec();
+
 			if (coder->timeout != 0)
 				timed_out = mythread_cond_timedwait(
 						&coder->cond, &coder->mutex,
@@ -706,6 +1840,8 @@ wait_for_work(lzma_stream_coder *coder, mythread_condtime *wait_abs,
 			else
 				mythread_cond_wait(&coder->cond,
 						&coder->mutex);
+
+			*wait_usec += mythread_time_usec() - wait_start;
 		}
 	}
 
@@ -759,6 +1895,24 @@ stream_encode_mt(void *coder_ptr, const lzma_allocator *allocator,
 						&uncompressed_size);
 			}
 
+			if (ret == LZMA_STREAM_END && coder->part_size != 0) {
+				// A part of a Block was read. Sum the sizes
+				// until the last part of the Block has been
+				// read. Only the last part has a non-zero
+				// uncompressed_size.
+				coder->block_unpadded_size += unpadded_size;
+
+				if (uncompressed_size == 0) {
+					ret = LZMA_OK;
+					if (*out_pos < out_size)
+						continue;
+				} else {
+					unpadded_size
+						= coder->block_unpadded_size;
+					coder->block_unpadded_size = 0;
+				}
+			}
+
 			if (ret == LZMA_STREAM_END) {
 				// End of Block. Add it to the Index.
 				ret = lzma_index_append(coder->index,
@@ -791,8 +1945,6 @@ stream_encode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			}
 
 			// See if we should wait or return.
-			//
-			// TODO: LZMA_SYNC_FLUSH and LZMA_SYNC_BARRIER.
 			if (*in_pos == in_size) {
 				// LZMA_RUN: More data is probably coming
 				// so return to let the caller fill the
@@ -806,6 +1958,19 @@ stream_encode_mt(void *coder_ptr, const lzma_allocator *allocator,
 				if (action == LZMA_FULL_BARRIER)
 					return LZMA_STREAM_END;
 
+				// LZMA_SYNC_FLUSH: The data may still be in
+				// the middle of a Block that hasn't been
+				// finished.
+				if (action == LZMA_SYNC_FLUSH) {
+					bool done;
+					mythread_sync(coder->mutex) {
+						done = sync_flush_done(coder);
+					}
+
+					if (done)
+						return LZMA_STREAM_END;
+				}
+
 				// Finishing or flushing isn't completed until
 				// all input data has been encoded and copied
 				// to the output buffer.
@@ -833,7 +1998,8 @@ stream_encode_mt(void *coder_ptr, const lzma_allocator *allocator,
 			// Neither in nor out has been used completely.
 			// Wait until there's something we can do.
 			if (wait_for_work(coder, &wait_abs, &has_blocked,
-					*in_pos < in_size))
+					*in_pos < in_size,
+					action == LZMA_SYNC_FLUSH))
 				return LZMA_TIMED_OUT;
 		}
 
@@ -926,7 +2092,7 @@ stream_encoder_mt_update(void *coder_ptr, const lzma_allocator *allocator,
 
 	// For now the threaded encoder doesn't support changing
 	// the options in the middle of a Block.
-	if (coder->thr != NULL)
+	if (coder->thr != NULL || coder->block_in != 0)
 		return LZMA_PROG_ERROR;
 
 	// Check if the filter chain seems mostly valid. See the comment
@@ -934,6 +2100,12 @@ stream_encoder_mt_update(void *coder_ptr, const lzma_allocator *allocator,
 	if (lzma_raw_encoder_memusage(filters) == UINT64_MAX)
 		return LZMA_OPTIONS_ERROR;
 
+	// Parts can be encoded only with LZMA2. A bigger dictionary is
+	// fine; only the amount of history is limited by part_history_max.
+	if (coder->part_size != 0 && (filters[0].id != LZMA_FILTER_LZMA2
+			|| filters[1].id != LZMA_VLI_UNKNOWN))
+		return LZMA_OPTIONS_ERROR;
+
 	// Make a copy to a temporary buffer first. This way the encoder
 	// state stays unchanged if an error occurs in lzma_filters_copy().
 	lzma_filter temp[LZMA_FILTERS_MAX + 1];
@@ -955,13 +2127,19 @@ stream_encoder_mt_update(void *coder_ptr, const lzma_allocator *allocator,
 static lzma_ret
 get_options(const lzma_mt *options, lzma_options_easy *opt_easy,
 		const lzma_filter **filters, uint64_t *block_size,
+		uint64_t *part_size, uint64_t *part_history_max,
 		uint64_t *outbuf_size_max)
 {
 	// Validate some of the options.
 	if (options == NULL)
 		return LZMA_PROG_ERROR;
 
-	if (options->flags != 0 || options->threads == 0
+	if ((options->flags & ~(LZMA_MT_USE_PART_SIZE
+				| LZMA_MT_USE_THREAD_POOL
+				| LZMA_MT_DIRECT_INPUT
+				| LZMA_MT_USE_NOTIFY
+				| LZMA_MT_NUMA)) != 0
+			|| options->threads == 0
 			|| options->threads > LZMA_THREADS_MAX)
 		return LZMA_OPTIONS_ERROR;
 
@@ -989,6 +2167,36 @@ get_options(const lzma_mt *options, lzma_options_easy *opt_easy,
 	if (*block_size > BLOCK_SIZE_MAX || *block_size == UINT64_MAX)
 		return LZMA_OPTIONS_ERROR;
 
+	// Splitting Blocks into parts is pointless if a part would
+	// be at least as big as a Block.
+	*part_size = 0;
+	*part_history_max = 0;
+
+	if ((options->flags & LZMA_MT_USE_PART_SIZE)
+			&& options->part_size != 0
+			&& options->part_size < *block_size) {
+		if (options->part_size < LZMA_DICT_SIZE_MIN
+				|| (*filters)[0].id != LZMA_FILTER_LZMA2
+				|| (*filters)[1].id != LZMA_VLI_UNKNOWN
+				|| (*filters)[0].options == NULL)
+			return LZMA_OPTIONS_ERROR;
+
+		const lzma_options_lzma *opt = (*filters)[0].options;
+		*part_size = options->part_size;
+		*part_history_max = my_min(opt->dict_size, *block_size);
+
+		// Calculate the maximum amount output that a single output
+		// buffer may need to hold. This is the same as the maximum
+		// total size of a Block whose size is part_size plus the
+		// extra space for the tail of the part.
+		*outbuf_size_max = lzma_block_buffer_bound64(*part_size);
+		if (*outbuf_size_max == 0)
+			return LZMA_MEM_ERROR;
+
+		*outbuf_size_max += PART_TRAILER_MAX;
+		return LZMA_OK;
+	}
+
 	// Calculate the maximum amount output that a single output buffer
 	// may need to hold. This is the same as the maximum total size of
 	// a Block.
@@ -1000,6 +2208,19 @@ get_options(const lzma_mt *options, lzma_options_easy *opt_easy,
 }
 
 
+/// Get the size of the initial output buffer of a thread and of the
+/// segments that are added to it. Most data compresses well, so it would
+/// be a waste to allocate the worst-case size of outbuf_size_max for
+/// every buffer. Using an eighth of it keeps the number of segments
+/// small even if the data doesn't compress.
+static uint64_t
+get_outbuf_seg_size(uint64_t outbuf_size_max)
+{
+	return my_min(outbuf_size_max,
+			my_max(outbuf_size_max / 8, OUTBUF_SEG_SIZE_MIN));
+}
+
+
 static void
 get_progress(void *coder_ptr, uint64_t *progress_in, uint64_t *progress_out)
 {
@@ -1007,16 +2228,64 @@ get_progress(void *coder_ptr, uint64_t *progress_in, uint64_t *progress_out)
 
 	// Lock coder->mutex to prevent finishing threads from moving their
 	// progress info from the worker_thread structure to lzma_stream_coder.
+	// The per-thread values are updated without a mutex so that
+	// the workers don't need to contend with this function.
 	mythread_sync(coder->mutex) {
 		*progress_in = coder->progress_in;
 		*progress_out = coder->progress_out;
 
 		for (size_t i = 0; i < coder->threads_initialized; ++i) {
-			mythread_sync(coder->threads[i].mutex) {
-				*progress_in += coder->threads[i].progress_in;
-				*progress_out += coder->threads[i]
-						.progress_out;
+			*progress_in += mythread_atomic_load(
+					&coder->threads[i].progress_in);
+			*progress_out += mythread_atomic_load(
+					&coder->threads[i].progress_out);
+		}
+	}
+
+	return;
+}
+
+
+static void
+get_mt_stats(void *coder_ptr, lzma_mt_stats *stats,
+		lzma_mt_thread_stats *thread_stats,
+		uint32_t thread_stats_count)
+{
+	lzma_stream_coder *coder = coder_ptr;
+
+	const uint32_t count = my_min(thread_stats_count,
+			coder->threads_initialized);
+
+	// The output queue counters are updated by the worker threads
+	// when they add segments to their output buffers. Like in
+	// get_progress(), coder->mutex also prevents worker_done() from
+	// moving the progress of a thread to its statistics while we
+	// are reading them.
+	mythread_sync(coder->mutex) {
+		*stats = (lzma_mt_stats){
+			.threads = coder->threads_initialized,
+			.outq_bufs = coder->outq.bufs_in_use,
+			.outq_bufs_peak = coder->outq.bufs_peak,
+			.outq_bufs_limit = coder->outq.bufs_limit,
+			.outq_mem_in_use = coder->outq.mem_in_use,
+			.outq_mem_allocated = coder->outq.mem_allocated,
+			.wait_thread_usec = coder->wait_thread_usec,
+			.wait_out_usec = coder->wait_out_usec,
+		};
+
+		for (uint32_t i = 0; i < count; ++i) {
+			worker_thread *thr = &coder->threads[i];
+
+			mythread_sync(thr->mutex) {
+				lzma_worker_stats_get(&thr->stats,
+						&thread_stats[i]);
 			}
+
+			// Include the Block that is being encoded.
+			thread_stats[i].uncompressed_size
+				+= mythread_atomic_load(&thr->progress_in);
+			thread_stats[i].compressed_size
+				+= mythread_atomic_load(&thr->progress_out);
 		}
 	}
 
@@ -1034,12 +2303,20 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	lzma_options_easy easy;
 	const lzma_filter *filters;
 	uint64_t block_size;
+	uint64_t part_size;
+	uint64_t part_history_max;
 	uint64_t outbuf_size_max;
 	return_if_error(get_options(options, &easy, &filters,
-			&block_size, &outbuf_size_max));
+			&block_size, &part_size, &part_history_max,
+			&outbuf_size_max));
+
+	// Size of the input buffer of each thread
+	const uint64_t in_buf_size = part_size != 0
+			? part_history_max + part_size : block_size;
 
 #if SIZE_MAX < UINT64_MAX
-	if (block_size > SIZE_MAX || outbuf_size_max > SIZE_MAX)
+	if (block_size > SIZE_MAX || in_buf_size > SIZE_MAX
+			|| outbuf_size_max > SIZE_MAX)
 		return LZMA_MEM_ERROR;
 #endif
 
@@ -1089,6 +2366,7 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		next->end = &stream_encoder_mt_end;
 		next->get_progress = &get_progress;
 		next->update = &stream_encoder_mt_update;
+		next->get_mt_stats = &get_mt_stats;
 
 		coder->filters[0].id = LZMA_VLI_UNKNOWN;
 		coder->filters_cache[0].id = LZMA_VLI_UNKNOWN;
@@ -1098,19 +2376,52 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		coder->threads = NULL;
 		coder->threads_max = 0;
 		coder->threads_initialized = 0;
+		coder->in_buf_size = 0;
+		coder->thread_pool = NULL;
+		coder->numa = false;
+		coder->jobs_pending = 0;
 	}
 
+	// If the coder is being reinitialized, tell the running threads
+	// to stop and wait until they have stopped. This has to be done
+	// before changing the options below because the threads read
+	// some of them, for example, part_size.
+	threads_stop(coder, true);
+
 	// Basic initializations
 	coder->sequence = SEQ_STREAM_HEADER;
 	coder->block_size = (size_t)(block_size);
+	coder->part_size = (size_t)(part_size);
+	coder->part_history_max = (size_t)(part_history_max);
+	coder->block_in = 0;
+	coder->block_unpadded_size = 0;
+	coder->part_prev = NULL;
 	coder->outbuf_alloc_size = (size_t)(outbuf_size_max);
+	coder->outbuf_seg_size = (size_t)(get_outbuf_seg_size(
+			outbuf_size_max));
 	coder->thread_error = LZMA_OK;
 	coder->thr = NULL;
-
-	// Allocate the thread-specific base structures.
+	coder->direct_input = (options->flags & LZMA_MT_DIRECT_INPUT) != 0;
+
+	lzma_thread_pool *thread_pool
+			= (options->flags & LZMA_MT_USE_THREAD_POOL) != 0
+				? options->thread_pool : NULL;
+	const bool numa = thread_pool == NULL
+			&& (options->flags & LZMA_MT_NUMA) != 0;
+
+	// Allocate the thread-specific base structures. The threads
+	// cannot be reused if their input buffers have a different size,
+	// if the threads come from a different pool now, or if their
+	// NUMA placement would differ. Otherwise the old structures and
+	// threads are reused.
 	assert(options->threads > 0);
-	if (coder->threads_max != options->threads) {
+	if (coder->threads_max != options->threads
+			|| coder->in_buf_size != in_buf_size
+			|| coder->thread_pool != thread_pool
+			|| coder->numa != numa) {
 		threads_end(coder, allocator);
+		coder->thread_pool = thread_pool;
+		coder->numa = numa;
 
 		coder->threads = NULL;
 		coder->threads_max = 0;
@@ -1125,10 +2436,7 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 			return LZMA_MEM_ERROR;
 
 		coder->threads_max = options->threads;
-	} else {
-		// Reuse the old structures and threads. Tell the running
-		// threads to stop and wait until they have stopped.
-		threads_stop(coder, true);
+		coder->in_buf_size = (size_t)(in_buf_size);
 	}
 
 	// Output queue
@@ -1138,6 +2446,14 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	// Timeout
 	coder->timeout = options->timeout;
 
+	if ((options->flags & LZMA_MT_USE_NOTIFY) != 0) {
+		coder->notify = options->notify;
+		coder->notify_opaque = options->notify_opaque;
+	} else {
+		coder->notify = NULL;
+		coder->notify_opaque = NULL;
+	}
+
 	// Free the old filter chain and the cache.
 	lzma_filters_free(coder->filters, allocator);
 	lzma_filters_free(coder->filters_cache, allocator);
@@ -1164,6 +2480,16 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	coder->progress_in = 0;
 	coder->progress_out = LZMA_STREAM_HEADER_SIZE;
 
+	// Statistics. The threads have been stopped above so the old
+	// structures are idle.
+	coder->wait_thread_usec = 0;
+	coder->wait_out_usec = 0;
+
+	for (uint32_t i = 0; i < coder->threads_initialized; ++i)
+		mythread_sync(coder->threads[i].mutex) {
+			lzma_worker_stats_init(&coder->threads[i].stats);
+		}
+
 	return LZMA_OK;
 }
 
@@ -1199,7 +2525,7 @@ lzma_stream_encoder_mt(lzma_stream *strm, const lzma_mt *options)
 	lzma_next_strm_init(stream_encoder_mt_init, strm, options);
 
 	strm->internal->supported_actions[LZMA_RUN] = true;
-// 	strm->internal->supported_actions[LZMA_SYNC_FLUSH] = true;
+	strm->internal->supported_actions[LZMA_SYNC_FLUSH] = true;
 	strm->internal->supported_actions[LZMA_FULL_FLUSH] = true;
 	strm->internal->supported_actions[LZMA_FULL_BARRIER] = true;
 	strm->internal->supported_actions[LZMA_FINISH] = true;
@@ -1234,14 +2560,22 @@ lzma_stream_encoder_mt_memusage(const lzma_mt *options)
 	lzma_options_easy easy;
 	const lzma_filter *filters;
 	uint64_t block_size;
+	uint64_t part_size;
+	uint64_t part_history_max;
 	uint64_t outbuf_size_max;
 
 	if (get_options(options, &easy, &filters, &block_size,
+			&part_size, &part_history_max,
 			&outbuf_size_max) != LZMA_OK)
 		return UINT64_MAX;
 
-	// Memory usage of the input buffers
-	const uint64_t inbuf_memusage = options->threads * block_size;
+	// Memory usage of the input buffers. With LZMA_MT_DIRECT_INPUT
+	// they are allocated only if the input isn't contiguous, so they
+	// aren't counted here.
+	const uint64_t inbuf_memusage
+			= (options->flags & LZMA_MT_DIRECT_INPUT) != 0 ? 0
+			: options->threads * (part_size != 0
+				? part_history_max + part_size : block_size);
 
 	// Memory usage of the filter encoders
 	uint64_t filters_memusage = lzma_raw_encoder_memusage(filters);
@@ -1251,8 +2585,12 @@ lzma_stream_encoder_mt_memusage(const lzma_mt *options)
 	filters_memusage *= options->threads;
 
 	// Memory usage of the output queue
+	// Memory usage of the output queue. The output buffers grow
+	// beyond their initial size only if the data doesn't compress
+	// well, thus only the initial size is counted here.
 	const uint64_t outq_memusage = lzma_outq_memusage(
-			outbuf_size_max, options->threads);
+			get_outbuf_seg_size(outbuf_size_max),
+			options->threads);
 	if (outq_memusage == UINT64_MAX)
 		return UINT64_MAX;
 
@@ -371,6 +371,7 @@ static const name_value_map lzma12_mode_map[] = {
 static const name_value_map lzma12_mf_map[] = {
 	{ "hc3", LZMA_MF_HC3 },
 	{ "hc4", LZMA_MF_HC4 },
+	{ "hb4", LZMA_MF_HB4 },
 	{ "bt2", LZMA_MF_BT2 },
 	{ "bt3", LZMA_MF_BT3 },
 	{ "bt4", LZMA_MF_BT4 },
@@ -388,8 +389,9 @@ static const option_map lzma12_optmap[] = {
 		.offset = offsetof(lzma_options_lzma, dict_size),
 		.u.range.min = LZMA_DICT_SIZE_MIN,
 		// FIXME? The max is really max for encoding but decoding
-		// would allow 4 GiB - 1 B.
-		.u.range.max = (UINT32_C(1) << 30) + (UINT32_C(1) << 29),
+		// would allow 4 GiB - 1 B. See LZ_ENC_DICT_SIZE_MAX
+		// in lz_encoder.h.
+		.u.range.max = UINT32_C(7) << 29,
 	}, {
 		.name = "lc",
 		.offset = offsetof(lzma_options_lzma, lc),
@@ -1085,7 +1087,9 @@ strfy_filter(lzma_str *dest, const char *delimiter,
 				break;
 
 			case OPTMAP_TYPE_LZMA_MATCH_FINDER:
-				v = *(const lzma_match_finder *)ptr;
+				// Flags like LZMA_MF_LONG_RANGE that may be
+				// ORed with the match finder aren't shown.
+				v = *(const lzma_match_finder *)ptr & 0xFF;
 				break;
 
 			default:
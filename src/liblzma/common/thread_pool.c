@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       thread_pool.c
+/// \brief      Pool of worker threads shared by multithreaded coders
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "thread_pool.h"
+
+
+// The coders submit a job only when all the input of the job is available,
+// for example, a whole Block. Thus a job never waits for the application
+// or for other jobs and a single FIFO queue is enough to keep the threads
+// busy. The number of threads limits the total parallelism no matter how
+// many coders share the pool.
+
+
+struct lzma_thread_pool_s {
+	/// The oldest job in the queue or NULL if the queue is empty
+	lzma_thread_job *head;
+
+	/// The newest job in the queue. This is valid only if
+	/// head != NULL.
+	lzma_thread_job *tail;
+
+	/// True when the threads should exit
+	bool exit;
+
+	/// Number of threads that have been created
+	uint32_t threads_count;
+
+	/// IDs of the threads are needed to join them in
+	/// lzma_thread_pool_end().
+	mythread *thread_ids;
+
+	mythread_mutex mutex;
+	mythread_cond cond;
+};
+
+
+static MYTHREAD_RET_TYPE
+pool_thread_start(void *pool_ptr)
+{
+	lzma_thread_pool *pool = pool_ptr;
+
+	mythread_mutex_lock(&pool->mutex);
+
+	while (!pool->exit) {
+		if (pool->head == NULL) {
+			mythread_cond_wait(&pool->cond, &pool->mutex);
+			continue;
+		}
+
+		lzma_thread_job *job = pool->head;
+		pool->head = job->next;
+
+		// Every signal wakes up at most one thread. If more jobs
+		// are waiting, pass the wake-up to the next idle thread.
+		if (pool->head != NULL)
+			mythread_cond_signal(&pool->cond);
+
+		mythread_mutex_unlock(&pool->mutex);
+
+		job->func(job->arg);
+
+		mythread_mutex_lock(&pool->mutex);
+	}
+
+	// Let the next thread see that it has to exit too.
+	mythread_cond_signal(&pool->cond);
+	mythread_mutex_unlock(&pool->mutex);
+
+	return MYTHREAD_RET_VALUE;
+}
+
+
+/// Tell the threads to exit and wait for them to terminate.
+static void
+threads_end(lzma_thread_pool *pool)
+{
+	mythread_sync(pool->mutex) {
+		pool->exit = true;
+		mythread_cond_signal(&pool->cond);
+	}
+
+	for (uint32_t i = 0; i < pool->threads_count; ++i) {
+		int ret = mythread_join(pool->thread_ids[i]);
+		assert(ret == 0);
+		(void)ret;
+	}
+
+	return;
+}
+
+
+extern LZMA_API(lzma_thread_pool *)
+lzma_thread_pool_init(uint32_t threads, const lzma_allocator *allocator)
+{
+	if (threads == 0 || threads > LZMA_THREADS_MAX)
+		return NULL;
+
+	lzma_thread_pool *pool = lzma_alloc(sizeof(lzma_thread_pool),
+			allocator);
+	if (pool == NULL)
+		return NULL;
+
+	pool->thread_ids = lzma_alloc(threads * sizeof(mythread), allocator);
+	if (pool->thread_ids == NULL)
+		goto error_ids;
+
+	if (mythread_mutex_init(&pool->mutex))
+		goto error_mutex;
+
+	if (mythread_cond_init(&pool->cond))
+		goto error_cond;
+
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->exit = false;
+	pool->threads_count = 0;
+
+	while (pool->threads_count < threads) {
+		if (mythread_create(&pool->thread_ids[pool->threads_count],
+				&pool_thread_start, pool))
+			goto error_thread;
+
+		++pool->threads_count;
+	}
+
+	return pool;
+
+error_thread:
+	threads_end(pool);
+	mythread_cond_destroy(&pool->cond);
+
+error_cond:
+	mythread_mutex_destroy(&pool->mutex);
+
+error_mutex:
+	lzma_free(pool->thread_ids, allocator);
+
+error_ids:
+	lzma_free(pool, allocator);
+	return NULL;
+}
+
+
+extern LZMA_API(void)
+lzma_thread_pool_end(lzma_thread_pool *pool, const lzma_allocator *allocator)
+{
+	if (pool == NULL)
+		return;
+
+	// All coders using the pool must have been ended already.
+	assert(pool->head == NULL);
+
+	threads_end(pool);
+
+	mythread_cond_destroy(&pool->cond);
+	mythread_mutex_destroy(&pool->mutex);
+
+	lzma_free(pool->thread_ids, allocator);
+	lzma_free(pool, allocator);
+	return;
+}
+
+
+extern void
+lzma_thread_pool_submit(lzma_thread_pool *pool, lzma_thread_job *job)
+{
+	job->next = NULL;
+
+	mythread_sync(pool->mutex) {
+		if (pool->head == NULL)
+			pool->head = job;
+		else
+			pool->tail->next = job;
+
+		pool->tail = job;
+		mythread_cond_signal(&pool->cond);
+	}
+
+	return;
+}
+
+
+extern bool
+lzma_thread_pool_cancel(lzma_thread_pool *pool, lzma_thread_job *job)
+{
+	bool found = false;
+
+	mythread_sync(pool->mutex) {
+		lzma_thread_job *prev = NULL;
+		lzma_thread_job *cur = pool->head;
+
+		while (cur != NULL && cur != job) {
+			prev = cur;
+			cur = cur->next;
+		}
+
+		if (cur != NULL) {
+			if (prev == NULL)
+				pool->head = cur->next;
+			else
+				prev->next = cur->next;
+
+			if (pool->tail == cur)
+				pool->tail = prev;
+
+			found = true;
+		}
+	}
+
+	return found;
+}
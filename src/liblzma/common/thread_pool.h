@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       thread_pool.h
+/// \brief      Pool of worker threads shared by multithreaded coders
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_THREAD_POOL_H
+#define LZMA_THREAD_POOL_H
+
+#include "common.h"
+
+
+/// A unit of work that is run by one of the threads in a pool. The owner
+/// of the job initializes func and arg. The pool uses next while the job
+/// is waiting in the queue.
+///
+/// The pool doesn't access the job after calling func. Thus func may
+/// reuse the job structure or allow it to be freed as its last action.
+/// The owner has to track the completion of its jobs itself.
+typedef struct lzma_thread_job_s lzma_thread_job;
+struct lzma_thread_job_s {
+	/// Function to run in a thread of the pool
+	void (*func)(void *arg);
+
+	/// Argument for func
+	void *arg;
+
+	/// Next job in the queue of the pool
+	lzma_thread_job *next;
+};
+
+
+/// \brief      Add a job to the end of the queue of the pool
+///
+/// The job must not already be in the queue. A job must never wait for
+/// something that requires another job of the same pool to make progress
+/// because all threads of the pool might be busy.
+extern void lzma_thread_pool_submit(
+		lzma_thread_pool *pool, lzma_thread_job *job);
+
+/// \brief      Remove a job from the queue if it hasn't been started
+///
+/// \return     True if the job was removed from the queue and thus
+///             func won't be called. False if the job isn't in the queue,
+///             that is, a thread of the pool has already taken it.
+extern bool lzma_thread_pool_cancel(
+		lzma_thread_pool *pool, lzma_thread_job *job);
+
+#endif
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       worker_stats.h
+/// \brief      Time accounting for the worker threads of MT coders
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_WORKER_STATS_H
+#define LZMA_WORKER_STATS_H
+
+#include "common.h"
+
+
+/// What a worker thread is doing
+typedef enum {
+	WORKER_BUSY,
+	WORKER_IDLE,
+	WORKER_WAIT_IN,
+} lzma_worker_activity;
+
+
+/// Statistics of a worker thread. The time is charged to the current
+/// activity when the activity changes or when the statistics are read.
+/// The structure must be protected by a mutex of the worker thread.
+typedef struct {
+	/// Time spent in each lzma_worker_activity
+	uint64_t usec[3];
+
+	/// The current activity and the time when it started
+	lzma_worker_activity activity;
+	uint64_t activity_start;
+
+	/// Counters for lzma_mt_thread_stats
+	uint64_t blocks;
+	uint64_t uncompressed_size;
+	uint64_t compressed_size;
+} lzma_worker_stats;
+
+
+/// Reset the statistics. The worker starts as idle.
+static inline void
+lzma_worker_stats_init(lzma_worker_stats *ws)
+{
+	memzero(ws, sizeof(*ws));
+	ws->activity = WORKER_IDLE;
+	ws->activity_start = mythread_time_usec();
+	return;
+}
+
+
+/// Charge the time since the previous change to the current activity
+/// and then switch to the given activity. This does nothing if the
+/// activity doesn't change, so this may be called often.
+static inline void
+lzma_worker_stats_switch(lzma_worker_stats *ws, lzma_worker_activity activity)
+{
+	if (ws->activity == activity)
+		return;
+
+	const uint64_t now = mythread_time_usec();
+	ws->usec[ws->activity] += now - ws->activity_start;
+	ws->activity = activity;
+	ws->activity_start = now;
+	return;
+}
+
+
+/// Convert the statistics to the public structure. The time of
+/// the current activity is included.
+static inline void
+lzma_worker_stats_get(const lzma_worker_stats *ws, lzma_mt_thread_stats *out)
+{
+	uint64_t usec[3];
+	memcpy(usec, ws->usec, sizeof(usec));
+	usec[ws->activity] += mythread_time_usec() - ws->activity_start;
+
+	*out = (lzma_mt_thread_stats){
+		.busy_usec = usec[WORKER_BUSY],
+		.idle_usec = usec[WORKER_IDLE],
+		.wait_in_usec = usec[WORKER_WAIT_IN],
+		.blocks = ws->blocks,
+		.uncompressed_size = ws->uncompressed_size,
+		.compressed_size = ws->compressed_size,
+	};
+	return;
+}
+
+#endif
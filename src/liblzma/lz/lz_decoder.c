@@ -19,6 +19,11 @@
 #include "lz_decoder.h"
 
 
+/// Position of the first byte in lzma_coder.first[]. It must be a multiple
+/// of 16 because LZMA uses the lowest bits of the position.
+#define LZ_DICT_FIRST_POS 16
+
+
 typedef struct {
 	/// Dictionary (history buffer)
 	lzma_dict dict;
@@ -38,6 +43,19 @@ typedef struct {
 	/// marker. This may become true before next_finished becomes true.
 	bool this_finished;
 
+	/// True if the output buffer is used as the dictionary. Then
+	/// dict.buf points to out[] or to first[] and isn't allocated.
+	bool out_as_dict;
+
+	/// Dictionary size rounded up to a multiple of 16. This is used
+	/// only if out_as_dict is true.
+	size_t dict_size;
+
+	/// When the output buffer is used as the dictionary, the first byte
+	/// after a dictionary reset is decoded here. dict_get0() needs
+	/// a zero byte before it, which out[] cannot provide.
+	uint8_t first[2 * LZ_DICT_FIRST_POS + LZ_DICT_EXTRA];
+
 	/// Temporary buffer needed when the LZ-based filter is not the last
 	/// filter in the chain. The output of the next filter is first
 	/// decoded into buffer[], which is then used as input for the actual
@@ -53,9 +71,17 @@ typedef struct {
 static void
 lz_decoder_reset(lzma_coder *coder)
 {
-	coder->dict.pos = LZ_DICT_INIT_POS;
+	if (coder->out_as_dict) {
+		coder->dict.buf = coder->first;
+		coder->dict.pos = LZ_DICT_FIRST_POS;
+		coder->dict.size = LZ_DICT_FIRST_POS + 1;
+	} else {
+		coder->dict.pos = LZ_DICT_INIT_POS;
+	}
+
+	coder->dict.init_pos = coder->dict.pos;
 	coder->dict.full = 0;
-	coder->dict.buf[LZ_DICT_INIT_POS - 1] = '\0';
+	coder->dict.buf[coder->dict.pos - 1] = '\0';
 	coder->dict.has_wrapped = false;
 	coder->dict.need_reset = false;
 	return;
@@ -137,6 +163,86 @@ decode_buffer(lzma_coder *coder,
 }
 
 
+/// Like decode_buffer() but the output buffer is used as the dictionary.
+/// This requires that out[] is the same in every call, that the data
+/// already written to out[] isn't modified, and that there is enough
+/// space for all the output. Then the history is always in out[], and
+/// copying the data and wrapping the dictionary aren't needed.
+static lzma_ret
+decode_out(lzma_coder *coder,
+		const uint8_t *restrict in, size_t *restrict in_pos,
+		size_t in_size, uint8_t *restrict out,
+		size_t *restrict out_pos, size_t out_size)
+{
+	while (true) {
+		const size_t out_start = *out_pos;
+		const bool is_first = coder->dict.buf == coder->first;
+
+		if (is_first) {
+			// The dictionary is empty. Decode one byte to first[].
+			coder->dict.limit = coder->dict.pos
+					+ my_min(out_size - *out_pos, 1);
+		} else {
+			// buf[pos] is out[*out_pos]. Let the LZ decoder write
+			// up to the end of out[]. There are no extra bytes
+			// after it for dict_repeat(). See lzma_dict.size.
+			assert(coder->dict.buf + coder->dict.pos
+					== out + *out_pos);
+			coder->dict.limit = coder->dict.pos
+					+ (out_size - *out_pos);
+			coder->dict.size = coder->dict.limit > LZ_DICT_EXTRA
+					? coder->dict.limit - LZ_DICT_EXTRA : 0;
+
+			// Stop where decode_buffer() would wrap the dictionary
+			// so that match distances are limited to the dictionary
+			// size in the same way after that point.
+			if (!coder->dict.has_wrapped && coder->dict.limit
+					> coder->dict_size)
+				coder->dict.limit = coder->dict_size;
+		}
+
+		const size_t dict_start = coder->dict.pos;
+		const lzma_ret ret = coder->lz.code(
+				coder->lz.coder, &coder->dict,
+				in, in_pos, in_size);
+		*out_pos += coder->dict.pos - dict_start;
+
+		// Continue if the LZ decoder stopped only because of
+		// the limits set above or because of a dictionary reset.
+		bool again = true;
+
+		if (coder->dict.need_reset) {
+			lz_decoder_reset(coder);
+
+		} else if (is_first) {
+			if (coder->dict.pos == dict_start) {
+				again = false;
+			} else {
+				// Continue in out[] after the first byte. Its
+				// position in the uncompressed data is zero,
+				// which keeps the lowest bits of pos right.
+				out[out_start] = coder->first[
+						LZ_DICT_FIRST_POS];
+				coder->dict.buf = out + out_start;
+				coder->dict.pos = 1;
+				coder->dict.init_pos = 0;
+				coder->dict.full = 1;
+			}
+
+		} else if (!coder->dict.has_wrapped
+				&& coder->dict.full == coder->dict_size) {
+			coder->dict.has_wrapped = true;
+
+		} else {
+			again = false;
+		}
+
+		if (!again || ret != LZMA_OK || *out_pos == out_size)
+			return ret;
+	}
+}
+
+
 static lzma_ret
 lz_decode(void *coder_ptr, const lzma_allocator *allocator,
 		const uint8_t *restrict in, size_t *restrict in_pos,
@@ -146,6 +252,10 @@ lz_decode(void *coder_ptr, const lzma_allocator *allocator,
 {
 	lzma_coder *coder = coder_ptr;
 
+	if (coder->out_as_dict)
+		return decode_out(coder, in, in_pos, in_size,
+				out, out_pos, out_size);
+
 	if (coder->next.code == NULL)
 		return decode_buffer(coder, in, in_pos, in_size,
 				out, out_pos, out_size);
@@ -203,7 +313,9 @@ lz_decoder_end(void *coder_ptr, const lzma_allocator *allocator)
 	lzma_coder *coder = coder_ptr;
 
 	lzma_next_end(&coder->next, allocator);
-	lzma_free(coder->dict.buf, allocator);
+
+	if (!coder->out_as_dict)
+		lzma_free(coder->dict.buf, allocator);
 
 	if (coder->lz.end != NULL)
 		coder->lz.end(coder->lz.coder, allocator);
@@ -238,6 +350,7 @@ lzma_lz_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		coder->dict.size = 0;
 		coder->lz = LZMA_LZ_DECODER_INIT;
 		coder->next = LZMA_NEXT_CODER_INIT;
+		coder->out_as_dict = false;
 	}
 
 	// Allocate and initialize the LZ-based decoder. It will also give
@@ -276,9 +389,27 @@ lzma_lz_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	const size_t alloc_size
 			= lz_options.dict_size + 2 * LZ_DICT_REPEAT_MAX;
 
+	// The output buffer can be used as the dictionary only if this
+	// filter writes to it directly and no preset dictionary is used.
+	const bool out_as_dict = filters[0].out_as_dict
+			&& filters[1].init == NULL
+			&& (lz_options.preset_dict == NULL
+				|| lz_options.preset_dict_size == 0);
+
+	if (out_as_dict) {
+		// Free the dictionary of a previous use of this coder.
+		if (!coder->out_as_dict)
+			lzma_free(coder->dict.buf, allocator);
+
+		coder->out_as_dict = true;
+		coder->dict_size = lz_options.dict_size;
+
 	// Allocate and initialize the dictionary.
-	if (coder->dict.size != alloc_size) {
-		lzma_free(coder->dict.buf, allocator);
+	} else if (coder->out_as_dict || coder->dict.size != alloc_size) {
+		if (!coder->out_as_dict)
+			lzma_free(coder->dict.buf, allocator);
+
+		coder->out_as_dict = false;
 
 		// The LZ_DICT_EXTRA bytes at the end of the buffer aren't
 		// included in alloc_size. These extra bytes allow
@@ -331,3 +462,70 @@ lzma_lz_decoder_memusage(size_t dictionary_size)
 	return sizeof(lzma_coder) + (uint64_t)(dictionary_size)
 			+ 2 * LZ_DICT_REPEAT_MAX + LZ_DICT_EXTRA;
 }
+
+
+extern void *
+lzma_lz_decoder_get(lzma_next_coder *next, lzma_dict **dict)
+{
+	lzma_coder *coder = next->coder;
+	assert(coder->next.code == NULL);
+
+	*dict = &coder->dict;
+	return coder->lz.coder;
+}
+
+
+extern void
+lzma_dict_window_get(const lzma_dict *dict, uint8_t *out)
+{
+	// See dict_get(): the bytes older than buf[0] are at the end of
+	// the circular buffer.
+	size_t size = dict->full;
+	if (size > dict->pos) {
+		const size_t tail = size - dict->pos;
+		memcpy(out, dict->buf + dict->size - LZ_DICT_REPEAT_MAX - tail,
+				tail);
+		out += tail;
+		size = dict->pos;
+	}
+
+	memcpy(out, dict->buf + dict->pos - size, size);
+	return;
+}
+
+
+extern bool
+lzma_dict_window_set(lzma_dict *dict,
+		const uint8_t *in, size_t size, uint32_t align)
+{
+	// This is the same limit that applies to dict->full.
+	const size_t dict_size = dict->size - 2 * LZ_DICT_REPEAT_MAX;
+	if (size > dict_size)
+		return true;
+
+	// LZMA uses the lowest four bits of dict->pos as the position
+	// in the uncompressed data. Keep them the same as in the
+	// dictionary from which the data was taken.
+	size_t pos = LZ_DICT_INIT_POS + size + ((align - size) & 15);
+
+	// The padding bytes are never valid match sources in a valid
+	// file but they must not be uninitialized either.
+	memzero(dict->buf, dict->size);
+
+	if (pos - LZ_DICT_INIT_POS <= dict_size) {
+		dict->full = size;
+		dict->has_wrapped = false;
+	} else {
+		// The padding doesn't fit before the end of the buffer.
+		// Put the data 16 bytes earlier and mark the dictionary
+		// full like it would be after wrapping around.
+		pos -= 16;
+		dict->full = dict_size;
+		dict->has_wrapped = true;
+	}
+
+	memcpy(dict->buf + pos - size, in, size);
+	dict->pos = pos;
+	dict->need_reset = false;
+	return false;
+}
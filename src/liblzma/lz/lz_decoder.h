@@ -91,6 +91,11 @@ typedef struct {
 	/// read beyond the beginning of the dictionary.
 	size_t full;
 
+	/// Value of pos when the dictionary is empty. Until the dictionary
+	/// has wrapped, full == pos - init_pos. This is LZ_DICT_INIT_POS
+	/// except when the output buffer is used as the dictionary.
+	size_t init_pos;
+
 	/// Write limit
 	size_t limit;
 
@@ -98,6 +103,11 @@ typedef struct {
 	/// larger than the actual dictionary size. This is enforced by
 	/// how the value for "full" is set; it can be at most
 	/// "size - 2 * LZ_DICT_REPEAT_MAX".
+	///
+	/// When the output buffer is used as the dictionary, buf doesn't
+	/// wrap and there may be no LZ_DICT_EXTRA bytes after buf[size].
+	/// Then size is LZ_DICT_EXTRA bytes less than the usable space
+	/// and dict_repeat() doesn't copy extra bytes past buf[size].
 	size_t size;
 
 	/// True once the dictionary has become full and the writing position
@@ -159,6 +169,21 @@ extern lzma_ret lzma_lz_decoder_init(lzma_next_coder *next,
 
 extern uint64_t lzma_lz_decoder_memusage(size_t dictionary_size);
 
+/// Get the LZ-based decoder (e.g. LZMA2) and the dictionary of a decoder
+/// that was initialized with lzma_lz_decoder_init(). The LZ-based filter
+/// must be the only filter in the chain. This is used to save and restore
+/// the decoder state.
+extern void *lzma_lz_decoder_get(lzma_next_coder *next, lzma_dict **dict);
+
+/// Copy the dict->full most recent bytes of the dictionary to out[].
+extern void lzma_dict_window_get(const lzma_dict *dict, uint8_t *out);
+
+/// Replace the contents of the dictionary with the size bytes in in[].
+/// align is the value of (dict->pos & 15) in the dictionary from which
+/// in[] was taken. Returns true if the data doesn't fit.
+extern bool lzma_dict_window_set(lzma_dict *dict,
+		const uint8_t *in, size_t size, uint32_t align);
+
 
 //////////////////////
 // Inline functions //
@@ -198,6 +223,20 @@ dict_is_distance_valid(const lzma_dict *const dict, const size_t distance)
 }
 
 
+/// Start loading the history buffer at distance into the CPU cache.
+/// With a big dictionary a long-distance match is usually a cache miss;
+/// the miss can overlap with range decoding if this is called as soon as
+/// the distance is known. The distance must be valid.
+static inline void
+dict_prefetch(const lzma_dict *const dict, const uint32_t distance)
+{
+	assert(dict_is_distance_valid(dict, distance));
+	lzma_prefetch(dict->buf + dict->pos - distance - 1
+			+ (distance < dict->pos
+				? 0 : dict->size - LZ_DICT_REPEAT_MAX));
+}
+
+
 /// Repeat *len bytes at distance.
 static inline bool
 dict_repeat(lzma_dict *restrict dict,
@@ -229,6 +268,14 @@ dict_repeat(lzma_dict *restrict dict,
 		do {
 			dict->buf[dict->pos++] = dict->buf[back++];
 		} while (--left > 0);
+#	if LZMA_LZ_DECODER_CONFIG >= 2
+	} else if (unlikely(dict->pos + left > dict->size)) {
+		// This is possible only when the output buffer is used
+		// as the dictionary. There may be no room for the extra
+		// bytes that the optimized method would copy.
+		memcpy(dict->buf + dict->pos, dict->buf + back, left);
+		dict->pos += left;
+#	endif
 	} else {
 #	if LZMA_LZ_DECODER_CONFIG == 1
 		memcpy(dict->buf + dict->pos, dict->buf + back, left);
@@ -260,7 +307,7 @@ dict_repeat(lzma_dict *restrict dict,
 
 	// Update how full the dictionary is.
 	if (!dict->has_wrapped)
-		dict->full = dict->pos - LZ_DICT_INIT_POS;
+		dict->full = dict->pos - dict->init_pos;
 
 	return *len != 0;
 }
@@ -272,7 +319,7 @@ dict_put(lzma_dict *restrict dict, uint8_t byte)
 	dict->buf[dict->pos++] = byte;
 
 	if (!dict->has_wrapped)
-		dict->full = dict->pos - LZ_DICT_INIT_POS;
+		dict->full = dict->pos - dict->init_pos;
 }
 
 
@@ -309,7 +356,7 @@ dict_write(lzma_dict *restrict dict, const uint8_t *restrict in,
 			dict->buf, &dict->pos, dict->limit);
 
 	if (!dict->has_wrapped)
-		dict->full = dict->pos - LZ_DICT_INIT_POS;
+		dict->full = dict->pos - dict->init_pos;
 
 	return;
 }
@@ -31,6 +31,18 @@ typedef struct {
 
 	/// Next coder in the chain
 	lzma_next_coder next;
+
+	/// Number of bytes between resets or zero if periodic resets
+	/// aren't used. See lzma_lz_options.reset_interval.
+	uint32_t reset_interval;
+
+	/// Number of bytes that may still be written to mf.buffer
+	/// before the next reset
+	uint32_t reset_left;
+
+	/// True if mf.action was set to LZMA_SYNC_FLUSH because the reset
+	/// point was reached, not because the application asked for it
+	bool reset_flush;
 } lzma_coder;
 
 
@@ -57,6 +69,14 @@ move_window(lzma_mf *mf)
 
 	assert(move_offset + move_size <= mf->size);
 
+#ifdef MYTHREAD_ENABLED
+	// The match finder thread is ahead of the encoder but it needs
+	// only the history that is kept here. It must not read the buffer
+	// while it is being moved.
+	if (mf->thread != NULL)
+		lzma_mf_thread_pause(mf->thread);
+#endif
+
 	memmove(mf->buffer, mf->buffer + move_offset, move_size);
 
 	mf->offset += move_offset;
@@ -64,6 +84,25 @@ move_window(lzma_mf *mf)
 	mf->read_limit -= move_offset;
 	mf->write_pos -= move_offset;
 
+	if (mf->lr_table != NULL) {
+		// The long-range match finder is behind read_pos by
+		// at most a few hundred bytes, except when a big preset
+		// dictionary was skipped. Then start hashing again from
+		// the beginning of the buffer.
+		if (mf->lr_pos < move_offset) {
+			mf->lr_pos = move_offset;
+			mf->lr_start = move_offset + mf->lr_offset;
+		}
+
+		mf->lr_offset += move_offset;
+		mf->lr_pos -= move_offset;
+	}
+
+#ifdef MYTHREAD_ENABLED
+	if (mf->thread != NULL)
+		lzma_mf_thread_resume(mf->thread, move_offset);
+#endif
+
 	return;
 }
 
@@ -91,11 +130,18 @@ fill_window(lzma_coder *coder, const lzma_allocator *allocator,
 	// (which I find cleanest), but we need size_t here when filling
 	// the history window.
 	size_t write_pos = coder->mf.write_pos;
+
+	// With periodic resets, don't write past the next reset point.
+	size_t write_limit = coder->mf.size;
+	if (coder->reset_interval != 0
+			&& write_limit - write_pos > coder->reset_left)
+		write_limit = write_pos + coder->reset_left;
+
 	lzma_ret ret;
 	if (coder->next.code == NULL) {
 		// Not using a filter, simply memcpy() as much as possible.
 		lzma_bufcpy(in, in_pos, in_size, coder->mf.buffer,
-				&write_pos, coder->mf.size);
+				&write_pos, write_limit);
 
 		ret = action != LZMA_RUN && *in_pos == in_size
 				? LZMA_STREAM_END : LZMA_OK;
@@ -104,9 +150,13 @@ fill_window(lzma_coder *coder, const lzma_allocator *allocator,
 		ret = coder->next.code(coder->next.coder, allocator,
 				in, in_pos, in_size,
 				coder->mf.buffer, &write_pos,
-				coder->mf.size, action);
+				write_limit, action);
 	}
 
+	if (coder->reset_interval != 0)
+		coder->reset_left -= (uint32_t)(write_pos
+				- coder->mf.write_pos);
+
 	coder->mf.write_pos = write_pos;
 
 	// Silence Valgrind. lzma_memcmplen() can read extra bytes
@@ -125,6 +175,14 @@ fill_window(lzma_coder *coder, const lzma_allocator *allocator,
 		coder->mf.action = action;
 		coder->mf.read_limit = coder->mf.write_pos;
 
+	} else if (coder->reset_interval != 0 && coder->reset_left == 0) {
+		// The reset point was reached. Encode everything before it
+		// like with LZMA_SYNC_FLUSH. lz_encode() does the reset
+		// once the flushing has been completed.
+		coder->mf.action = LZMA_SYNC_FLUSH;
+		coder->mf.read_limit = coder->mf.write_pos;
+		coder->reset_flush = true;
+
 	} else if (coder->mf.write_pos > coder->mf.keep_size_after) {
 		// This needs to be done conditionally, because if we got
 		// only little new input, there may be too little input
@@ -133,6 +191,16 @@ fill_window(lzma_coder *coder, const lzma_allocator *allocator,
 				- coder->mf.keep_size_after;
 	}
 
+#ifdef MYTHREAD_ENABLED
+	// Tell the match finder thread about the new input. If flushing
+	// or finishing, it may now process all the input. The thread
+	// takes care of restarting itself after LZMA_SYNC_FLUSH so
+	// coder->mf.pending stays zero.
+	if (coder->mf.thread != NULL)
+		lzma_mf_thread_update(coder->mf.thread,
+				coder->mf.write_pos, coder->mf.action);
+#endif
+
 	// Restart the match finder after finished LZMA_SYNC_FLUSH.
 	if (coder->mf.pending > 0
 			&& coder->mf.read_pos < coder->mf.read_limit) {
@@ -155,6 +223,44 @@ fill_window(lzma_coder *coder, const lzma_allocator *allocator,
 }
 
 
+/// Forget the data before the current position so that the data after it
+/// can be decoded independently. This is called when the reset point has
+/// been reached and everything before it has been encoded.
+static void
+lz_encoder_reset(lzma_coder *coder)
+{
+	assert(coder->mf.read_pos == coder->mf.write_pos);
+	assert(coder->mf.read_ahead == 0);
+
+	// Since EMPTY_HASH_VALUE is zero, the match finder won't find
+	// the old positions anymore. mf.son doesn't need to be cleared
+	// because the old entries can only be reached via mf.hash, except
+	// when mf.son is a hash table itself.
+	memzero(coder->mf.hash, coder->mf.hash_count * sizeof(uint32_t));
+
+	if (coder->mf.son_is_hash)
+		memzero(coder->mf.son,
+				coder->mf.sons_count * sizeof(uint32_t));
+
+	// The long-range match finder must not add anchors whose hash
+	// includes bytes from before the reset point.
+	if (coder->mf.lr_table != NULL) {
+		memzero(coder->mf.lr_table, ((size_t)(1)
+				<< (32 - coder->mf.lr_shift)) * sizeof(uint32_t));
+		coder->mf.lr_start = coder->mf.write_pos
+				+ coder->mf.lr_offset;
+	}
+
+	// The bytes that the match finder didn't hash before the flushing
+	// are before the reset point so they must not be hashed anymore.
+	coder->mf.pending = 0;
+
+	coder->lz.reset(coder->lz.coder);
+	coder->reset_left = coder->reset_interval;
+	return;
+}
+
+
 static lzma_ret
 lz_encode(void *coder_ptr, const lzma_allocator *allocator,
 		const uint8_t *restrict in, size_t *restrict in_pos,
@@ -180,7 +286,20 @@ lz_encode(void *coder_ptr, const lzma_allocator *allocator,
 			// flushing. It doesn't matter when finishing or if
 			// an error occurred.
 			coder->mf.action = LZMA_RUN;
-			return ret;
+
+			if (ret != LZMA_STREAM_END || coder->reset_interval == 0
+					|| coder->reset_left != 0)
+				return ret;
+
+			// Everything before the reset point has been encoded.
+			lz_encoder_reset(coder);
+
+			// If the flushing was done only because of the reset,
+			// the application doesn't need to know about it.
+			if (!coder->reset_flush)
+				return ret;
+
+			coder->reset_flush = false;
 		}
 	}
 
@@ -192,9 +311,7 @@ static bool
 lz_encoder_prepare(lzma_mf *mf, const lzma_allocator *allocator,
 		const lzma_lz_options *lz_options)
 {
-	// For now, the dictionary size is limited to 1.5 GiB. This may grow
-	// in the future if needed, but it needs a little more work than just
-	// changing this check.
+	// See LZ_ENC_DICT_SIZE_MAX in lz_encoder.h.
 	if (!IS_ENC_DICT_SIZE_VALID(lz_options->dict_size)
 			|| lz_options->nice_len > lz_options->match_len_max)
 		return true;
@@ -209,12 +326,11 @@ lz_encoder_prepare(lzma_mf *mf, const lzma_allocator *allocator,
 	// increases, we reserve more space when a large dictionary is
 	// used to make the memmove() calls rarer.
 	//
-	// This works with dictionaries up to about 3 GiB. If bigger
-	// dictionary is wanted, some extra work is needed:
-	//   - Several variables in lzma_mf have to be changed from uint32_t
-	//     to size_t.
-	//   - Memory usage calculation needs something too, e.g. use uint64_t
-	//     for mf->size.
+	// The positions in the buffer are 32-bit, so with dictionaries
+	// bigger than about 3.2 GiB the reserve has to be made smaller to
+	// keep the whole buffer and the few extra bytes needed by
+	// lzma_memcmplen() below 4 GiB. With LZ_ENC_DICT_SIZE_MAX the
+	// reserve is still almost 512 MiB.
 	uint32_t reserve = lz_options->dict_size / 2;
 	if (reserve > (UINT32_C(1) << 30))
 		reserve /= 2;
@@ -222,6 +338,14 @@ lz_encoder_prepare(lzma_mf *mf, const lzma_allocator *allocator,
 	reserve += (lz_options->before_size + lz_options->match_len_max
 			+ lz_options->after_size) / 2 + (UINT32_C(1) << 19);
 
+	const uint32_t reserve_max = UINT32_MAX - LZMA_MEMCMPLEN_EXTRA
+			- (uint32_t)(lz_options->before_size
+				+ lz_options->dict_size
+				+ lz_options->after_size
+				+ lz_options->match_len_max);
+	if (reserve > reserve_max)
+		reserve = reserve_max;
+
 	const uint32_t old_size = mf->size;
 	mf->size = mf->keep_size_before + reserve + mf->keep_size_after;
 
@@ -236,53 +360,102 @@ lz_encoder_prepare(lzma_mf *mf, const lzma_allocator *allocator,
 	mf->match_len_max = lz_options->match_len_max;
 	mf->nice_len = lz_options->nice_len;
 
-	// cyclic_size has to stay smaller than 2 Gi. Note that this doesn't
-	// mean limiting dictionary size to less than 2 GiB. With a match
-	// finder that uses multibyte resolution (hashes start at e.g. every
-	// fourth byte), cyclic_size would stay below 2 Gi even when
-	// dictionary size is greater than 2 GiB.
+	// cyclic_size is at most LZ_ENC_DICT_SIZE_MAX + 1, so it fits in
+	// uint32_t, but the binary trees have two or more elements per
+	// position. Thus the indexes of mf->son and the element counts are
+	// calculated with size_t.
 	//
-	// It would be possible to allow cyclic_size >= 2 Gi, but then we
-	// would need to be careful to use 64-bit types in various places
-	// (size_t could do since we would need bigger than 32-bit address
-	// space anyway). It would also require either zeroing a multigigabyte
-	// buffer at initialization (waste of time and RAM) or allow
-	// normalization in lz_encoder_mf.c to access uninitialized
-	// memory to keep the code simpler. The current way is simple and
-	// still allows pretty big dictionaries, so I don't expect these
-	// limits to change.
-	mf->cyclic_size = lz_options->dict_size + 1;
+	// With LZMA_MF_LONG_RANGE the match finder searches only window_size
+	// bytes. The long-range match finder covers the whole dictionary.
+	uint32_t mf_dict_size = lz_options->dict_size;
+	const uint32_t old_lr_shift = mf->lr_shift;
+	mf->lr_shift = 0;
+	mf->lr_dict_size = lz_options->dict_size;
+
+	if (lz_options->match_finder & LZMA_MF_LONG_RANGE) {
+		if (lz_options->window_size < LZMA_DICT_SIZE_MIN
+				|| lz_options->window_size
+					> lz_options->dict_size)
+			return true;
+
+		mf_dict_size = lz_options->window_size;
+
+		// Round the table size up to a power of two.
+		uint32_t bits = 8;
+		while (bits < 30 && (UINT32_C(1) << bits)
+				< lz_options->dict_size / MF_LR_TABLE_RATIO)
+			++bits;
+
+		mf->lr_shift = 32 - bits;
+	}
+
+	// Deallocate the old anchor table if it has wrong size or
+	// isn't needed anymore.
+	if (mf->lr_table != NULL && old_lr_shift != mf->lr_shift) {
+		lzma_free(mf->lr_table, allocator);
+		mf->lr_table = NULL;
+	}
+
+	mf->cyclic_size = mf_dict_size + 1;
 
 	// Validate the match finder ID and setup the function pointers.
-	switch (lz_options->match_finder) {
+	// The possible match finder thread is set up in lzma_lz_encoder_init().
+	//
+	// If the AVX2 and possibly the AVX-512BW versions of the match finders
+	// have been built, select the version now.
+#if defined(LZMA_AVX512BW_DISPATCH)
+	const bool avx512bw = lzma_avx512bw_is_supported();
+	const bool avx2 = avx512bw || lzma_avx2_is_supported();
+#	define mf_func(name) (avx512bw ? &name ## _avx512bw \
+		: avx2 ? &name ## _avx2 : &name)
+#elif defined(LZMA_AVX2_DISPATCH)
+	const bool avx2 = lzma_avx2_is_supported();
+#	define mf_func(name) (avx2 ? &name ## _avx2 : &name)
+#else
+#	define mf_func(name) (&name)
+#endif
+
+	switch (lz_options->match_finder & ~MF_FLAGS) {
 #ifdef HAVE_MF_HC3
 	case LZMA_MF_HC3:
-		mf->find = &lzma_mf_hc3_find;
-		mf->skip = &lzma_mf_hc3_skip;
+		mf->find = mf_func(lzma_mf_hc3_find);
+		mf->skip = mf_func(lzma_mf_hc3_skip);
 		break;
 #endif
 #ifdef HAVE_MF_HC4
 	case LZMA_MF_HC4:
-		mf->find = &lzma_mf_hc4_find;
-		mf->skip = &lzma_mf_hc4_skip;
+		mf->find = mf_func(lzma_mf_hc4_find);
+		mf->skip = mf_func(lzma_mf_hc4_skip);
+		break;
+#endif
+#ifdef HAVE_MF_HB4
+	case LZMA_MF_HB4:
+		mf->find = mf_func(lzma_mf_hb4_find);
+		mf->skip = mf_func(lzma_mf_hb4_skip);
 		break;
 #endif
 #ifdef HAVE_MF_BT2
 	case LZMA_MF_BT2:
-		mf->find = &lzma_mf_bt2_find;
-		mf->skip = &lzma_mf_bt2_skip;
+		mf->find = mf_func(lzma_mf_bt2_find);
+		mf->skip = mf_func(lzma_mf_bt2_skip);
 		break;
 #endif
 #ifdef HAVE_MF_BT3
 	case LZMA_MF_BT3:
-		mf->find = &lzma_mf_bt3_find;
-		mf->skip = &lzma_mf_bt3_skip;
+		mf->find = mf_func(lzma_mf_bt3_find);
+		mf->skip = mf_func(lzma_mf_bt3_skip);
 		break;
 #endif
 #ifdef HAVE_MF_BT4
 	case LZMA_MF_BT4:
-		mf->find = &lzma_mf_bt4_find;
-		mf->skip = &lzma_mf_bt4_skip;
+		mf->find = mf_func(lzma_mf_bt4_find);
+		mf->skip = mf_func(lzma_mf_bt4_skip);
+		break;
+#endif
+#ifdef HAVE_MF_BT4X
+	case LZMA_MF_BT4X:
+		mf->find = mf_func(lzma_mf_bt4x_find);
+		mf->skip = mf_func(lzma_mf_bt4x_skip);
 		break;
 #endif
 
@@ -290,6 +463,8 @@ lz_encoder_prepare(lzma_mf *mf, const lzma_allocator *allocator,
 		return true;
 	}
 
+#undef mf_func
+
 	// Calculate the sizes of mf->hash and mf->son.
 	//
 	// NOTE: Since 5.3.5beta the LZMA encoder ensures that nice_len
@@ -308,7 +483,7 @@ lz_encoder_prepare(lzma_mf *mf, const lzma_allocator *allocator,
 	} else {
 		// Round dictionary size up to the next 2^n - 1 so it can
 		// be used as a hash mask.
-		hs = lz_options->dict_size - 1;
+		hs = mf_dict_size - 1;
 		hs |= hs >> 1;
 		hs |= hs >> 2;
 		hs |= hs >> 4;
@@ -337,12 +512,57 @@ lz_encoder_prepare(lzma_mf *mf, const lzma_allocator *allocator,
 		hs += HASH_4_SIZE;
 */
 
-	const uint32_t old_hash_count = mf->hash_count;
-	const uint32_t old_sons_count = mf->sons_count;
+	const size_t old_hash_count = mf->hash_count;
+	const size_t old_sons_count = mf->sons_count;
+	uint64_t sons = mf->cyclic_size;
 	mf->hash_count = hs;
-	mf->sons_count = mf->cyclic_size;
-	if (is_bt)
-		mf->sons_count *= 2;
+	mf->son_offset = 0;
+	mf->son_node_size = 1;
+	mf->son_node_links = 1;
+	mf->son_is_hash = false;
+
+	switch (lz_options->match_finder & ~MF_FLAGS) {
+	case LZMA_MF_BT4X:
+		sons *= MF_BTX_NODE_SIZE;
+		mf->son_node_size = MF_BTX_NODE_SIZE;
+		mf->son_node_links = 2;
+		break;
+
+	case LZMA_MF_HB4: {
+		// hash[] has only the two- and three-byte hashes. The
+		// four-byte hash selects a bucket in son[]. Use a quarter
+		// of the number of hash chain heads that LZMA_MF_HC4 would
+		// use so that the buckets can hold about as many positions
+		// as the dictionary has. One extra bucket minus one element
+		// is allocated so that the buckets can be aligned to
+		// 64 bytes in lz_encoder_init().
+		const uint32_t buckets = mf->hash_mask / 4 + 1;
+		mf->hash_mask = buckets - 1;
+		mf->hash_count = FIX_4_HASH_SIZE;
+		sons = (uint64_t)(buckets) * MF_HB_NODE_SIZE
+				+ MF_HB_NODE_SIZE - 1;
+		mf->son_node_size = MF_HB_NODE_SIZE;
+		mf->son_node_links = MF_HB_BUCKET_SIZE;
+		mf->son_is_hash = true;
+		break;
+	}
+
+	default:
+		if (is_bt)
+			sons *= 2;
+
+		break;
+	}
+
+#if SIZE_MAX < UINT64_MAX
+	// son[] cannot be allocated on 32-bit systems if this doesn't
+	// fit in size_t. lz_encoder_init() will fail but the memory usage
+	// is still reported as more than the address space.
+	if (sons > SIZE_MAX)
+		sons = SIZE_MAX;
+#endif
+
+	mf->sons_count = (size_t)(sons);
 
 	// Deallocate the old hash array if it exists and has different size
 	// than what is needed now.
@@ -399,13 +619,11 @@ lz_encoder_init(lzma_mf *mf, const lzma_allocator *allocator,
 	mf->write_pos = 0;
 	mf->pending = 0;
 
-#if UINT32_MAX >= SIZE_MAX / 4
 	// Check for integer overflow. (Huge dictionaries are not
 	// possible on 32-bit CPU.)
 	if (mf->hash_count > SIZE_MAX / sizeof(uint32_t)
 			|| mf->sons_count > SIZE_MAX / sizeof(uint32_t))
 		return true;
-#endif
 
 	// Allocate and initialize the hash table. Since EMPTY_HASH_VALUE
 	// is zero, we can use lzma_alloc_zero() or memzero() for mf->hash.
@@ -440,6 +658,31 @@ lz_encoder_init(lzma_mf *mf, const lzma_allocator *allocator,
 		memzero(mf->hash, mf->hash_count * sizeof(uint32_t));
 	}
 
+	// With LZMA_MF_HB4 son[] is the main hash table, so it has to be
+	// cleared. The first bucket starts at the first 64-byte boundary.
+	// lzma_alloc() returns memory that is aligned at least for uint32_t.
+	if (mf->son_is_hash) {
+		mf->son_offset = (uint32_t)((0 - (uintptr_t)mf->son) & 63)
+				/ sizeof(uint32_t);
+		memzero(mf->son, mf->sons_count * sizeof(uint32_t));
+	}
+
+	// The table of the long-range match finder is small compared to
+	// the dictionary, so it is simply cleared.
+	if (mf->lr_shift != 0) {
+		const size_t lr_table_size = ((size_t)(1) << (32 - mf->lr_shift))
+				* sizeof(uint32_t);
+
+		if (mf->lr_table == NULL) {
+			mf->lr_table = lzma_alloc_zero(lr_table_size,
+					allocator);
+			if (mf->lr_table == NULL)
+				return true;
+		} else {
+			memzero(mf->lr_table, lr_table_size);
+		}
+	}
+
 	mf->cyclic_pos = 0;
 
 	// Handle preset dictionary.
@@ -455,6 +698,16 @@ lz_encoder_init(lzma_mf *mf, const lzma_allocator *allocator,
 		mf->skip(mf, mf->write_pos);
 	}
 
+	// Like with mf->offset, an empty element (zero) in lr_table[] has
+	// to be too far away from every position that is searched. The
+	// preset dictionary is hashed when the first match is searched.
+	if (mf->lr_table != NULL) {
+		mf->lr_offset = mf->lr_dict_size + 1 - mf->read_pos;
+		mf->lr_start = mf->lr_offset;
+		mf->lr_pos = 0;
+		mf->lr_hash = 0;
+	}
+
 	mf->action = LZMA_RUN;
 
 	return false;
@@ -471,6 +724,8 @@ lzma_lz_encoder_memusage(const lzma_lz_options *lz_options)
 		.son = NULL,
 		.hash_count = 0,
 		.sons_count = 0,
+		.lr_table = NULL,
+		.lr_shift = 0,
 	};
 
 	// Setup the size information into mf.
@@ -478,8 +733,20 @@ lzma_lz_encoder_memusage(const lzma_lz_options *lz_options)
 		return UINT64_MAX;
 
 	// Calculate the memory usage.
-	return ((uint64_t)(mf.hash_count) + mf.sons_count) * sizeof(uint32_t)
+	uint64_t memusage = ((uint64_t)(mf.hash_count) + mf.sons_count)
+				* sizeof(uint32_t)
 			+ mf.size + sizeof(lzma_coder);
+
+	if (mf.lr_shift != 0)
+		memusage += (UINT64_C(1) << (32 - mf.lr_shift))
+				* sizeof(uint32_t);
+
+#ifdef MYTHREAD_ENABLED
+	if (lz_options->match_finder & LZMA_MF_THREADED)
+		memusage += lzma_mf_thread_memusage();
+#endif
+
+	return memusage;
 }
 
 
@@ -490,6 +757,12 @@ lz_encoder_end(void *coder_ptr, const lzma_allocator *allocator)
 
 	lzma_next_end(&coder->next, allocator);
 
+#ifdef MYTHREAD_ENABLED
+	if (coder->mf.thread != NULL)
+		lzma_mf_thread_end(coder->mf.thread, allocator);
+#endif
+
+	lzma_free(coder->mf.lr_table, allocator);
 	lzma_free(coder->mf.son, allocator);
 	lzma_free(coder->mf.hash, allocator);
 	lzma_free(coder->mf.buffer, allocator);
@@ -568,6 +841,7 @@ lzma_lz_encoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		coder->lz.end = NULL;
 		coder->lz.options_update = NULL;
 		coder->lz.set_out_limit = NULL;
+		coder->lz.reset = NULL;
 
 		// mf.size is initialized to silence Valgrind
 		// when used on optimized binaries (GCC may reorder
@@ -578,15 +852,43 @@ lzma_lz_encoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		coder->mf.son = NULL;
 		coder->mf.hash_count = 0;
 		coder->mf.sons_count = 0;
+		coder->mf.thread = NULL;
+		coder->mf.lr_table = NULL;
+		coder->mf.lr_shift = 0;
 
 		coder->next = LZMA_NEXT_CODER_INIT;
 	}
 
 	// Initialize the LZ-based encoder.
 	lzma_lz_options lz_options;
+	lz_options.reset_interval = 0;
+	lz_options.window_size = 0;
 	return_if_error(lz_init(&coder->lz, allocator,
 			filters[0].id, filters[0].options, &lz_options));
 
+	// Periodic resets need support from the LZ-based encoder, and
+	// the match finder thread would be ahead of the reset point.
+	if (lz_options.reset_interval != 0 && (coder->lz.reset == NULL
+			|| (lz_options.match_finder & LZMA_MF_THREADED)))
+		return LZMA_OPTIONS_ERROR;
+
+	coder->reset_interval = lz_options.reset_interval;
+	coder->reset_left = lz_options.reset_interval;
+	coder->reset_flush = false;
+
+#ifdef MYTHREAD_ENABLED
+	// The match finder thread from the previous initialization must
+	// not touch the buffers while they are reset or reallocated.
+	if (coder->mf.thread != NULL) {
+		lzma_mf_thread_pause(coder->mf.thread);
+
+		if (!(lz_options.match_finder & LZMA_MF_THREADED)) {
+			lzma_mf_thread_end(coder->mf.thread, allocator);
+			coder->mf.thread = NULL;
+		}
+	}
+#endif
+
 	// Setup the size information into coder->mf and deallocate
 	// old buffers if they have wrong size.
 	if (lz_encoder_prepare(&coder->mf, allocator, &lz_options))
@@ -597,6 +899,14 @@ lzma_lz_encoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	if (lz_encoder_init(&coder->mf, allocator, &lz_options))
 		return LZMA_MEM_ERROR;
 
+#ifdef MYTHREAD_ENABLED
+	// Hand the initialized match finder over to a separate thread.
+	// Without threading support LZMA_MF_THREADED is ignored; the
+	// output is the same either way.
+	if (lz_options.match_finder & LZMA_MF_THREADED)
+		return_if_error(lzma_mf_thread_init(&coder->mf, allocator));
+#endif
+
 	// Initialize the next filter in the chain, if any.
 	return lzma_next_filter_init(&coder->next, allocator, filters + 1);
 }
@@ -605,7 +915,11 @@ lzma_lz_encoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 extern LZMA_API(lzma_bool)
 lzma_mf_is_supported(lzma_match_finder mf)
 {
-	switch (mf) {
+	// lzma_lz_encoder_init() rejects this combination.
+	if ((mf & LZMA_MF_THREADED) && (mf & LZMA_MF_RESET_INTERVAL))
+		return false;
+
+	switch (mf & ~MF_FLAGS) {
 #ifdef HAVE_MF_HC3
 	case LZMA_MF_HC3:
 		return true;
@@ -614,6 +928,10 @@ lzma_mf_is_supported(lzma_match_finder mf)
 	case LZMA_MF_HC4:
 		return true;
 #endif
+#ifdef HAVE_MF_HB4
+	case LZMA_MF_HB4:
+		return true;
+#endif
 #ifdef HAVE_MF_BT2
 	case LZMA_MF_BT2:
 		return true;
@@ -625,6 +943,10 @@ lzma_mf_is_supported(lzma_match_finder mf)
 #ifdef HAVE_MF_BT4
 	case LZMA_MF_BT4:
 		return true;
+#endif
+#ifdef HAVE_MF_BT4X
+	case LZMA_MF_BT4X:
+		return true;
 #endif
 	default:
 		return false;
@@ -14,14 +14,58 @@
 #define LZMA_LZ_ENCODER_H
 
 #include "common.h"
+#include "cpu_dispatch.h"
 
 
-// For now, the dictionary size is limited to 1.5 GiB. This may grow
-// in the future if needed, but it needs a little more work than just
-// changing this check.
+// The match finders store positions as 32-bit integers which have to be
+// normalized (see normalize() in lz_encoder_mf.c) after every
+// 4 GiB - dict_size bytes of input. Limiting the dictionary size to 3.5 GiB
+// keeps the normalization interval at least 512 MiB and makes the history
+// buffer fit in 32-bit indexes.
+#define LZ_ENC_DICT_SIZE_MAX (UINT32_C(7) << 29)
+
 #define IS_ENC_DICT_SIZE_VALID(size) \
-	((size) >= LZMA_DICT_SIZE_MIN \
-		&& (size) <= (UINT32_C(1) << 30) + (UINT32_C(1) << 29))
+	((size) >= LZMA_DICT_SIZE_MIN && (size) <= LZ_ENC_DICT_SIZE_MAX)
+
+
+/// Binary Tree with 2-, 3-, and 4-byte hashing and cached bytes in the
+/// tree nodes. It finds the same matches as LZMA_MF_BT4 but needs eight
+/// more bytes of memory per dictionary byte. It can only be faster than
+/// LZMA_MF_BT4 when the tree is much bigger than the CPU cache, so it isn't
+/// in the public API until that has been measured. The encoder accepts
+/// this value for tests and benchmarks.
+#define LZMA_MF_BT4X ((lzma_match_finder)0x34)
+
+/// LZMA_MF_BT4X stores each binary tree node in MF_BTX_NODE_SIZE elements
+/// of lzma_mf.son: the positions of the two children followed by the first
+/// MF_BTX_CACHE_SIZE bytes of the match candidate. Near the root of the tree
+/// the candidates can then be compared without reading the history buffer.
+#define MF_BTX_NODE_SIZE 4
+#define MF_BTX_CACHE_SIZE 8
+
+
+/// LZMA_MF_HB4 keeps its hash table in lzma_mf.son. Each bucket has
+/// MF_HB_NODE_SIZE elements: the positions of the MF_HB_BUCKET_SIZE most
+/// recent occurrences of the hash, newest first, followed by the first four
+/// bytes of each of them. A bucket is 64 bytes and aligned to 64 bytes so
+/// that looking up a hash touches only one cache line.
+#define MF_HB_BUCKET_SIZE 8
+#define MF_HB_NODE_SIZE (2 * MF_HB_BUCKET_SIZE)
+
+
+/// The long-range match finder (LZMA_MF_LONG_RANGE) calculates a rolling
+/// hash of MF_LR_HASH_BYTES bytes at every position. A position is an anchor
+/// if the highest MF_LR_ANCHOR_BITS bits of the hash are zero, which happens
+/// once per 2^MF_LR_ANCHOR_BITS bytes on average. lr_table[] gets one element
+/// per MF_LR_TABLE_RATIO bytes of the dictionary.
+#define MF_LR_HASH_BYTES 32
+#define MF_LR_ANCHOR_BITS 8
+#define MF_LR_TABLE_RATIO 128
+
+
+/// The flags that can be ORed with a lzma_match_finder value
+#define MF_FLAGS \
+	(LZMA_MF_THREADED | LZMA_MF_RESET_INTERVAL | LZMA_MF_LONG_RANGE)
 
 
 /// A table of these is used by the LZ-based encoder to hold
@@ -32,6 +76,8 @@ typedef struct {
 } lzma_match;
 
 
+typedef struct lzma_mf_thread_s lzma_mf_thread;
+
 typedef struct lzma_mf_s lzma_mf;
 struct lzma_mf_s {
 	///////////////
@@ -106,7 +152,7 @@ struct lzma_mf_s {
 	uint32_t *hash;
 	uint32_t *son;
 	uint32_t cyclic_pos;
-	uint32_t cyclic_size; // Must be dictionary size + 1.
+	uint32_t cyclic_size; // Must be dictionary or window size + 1.
 	uint32_t hash_mask;
 
 	/// Maximum number of loops in the match finder
@@ -126,10 +172,55 @@ struct lzma_mf_s {
 	lzma_action action;
 
 	/// Number of elements in hash[]
-	uint32_t hash_count;
+	size_t hash_count;
 
 	/// Number of elements in son[]
-	uint32_t sons_count;
+	size_t sons_count;
+
+	/// The nodes in son[] start at son[son_offset] and have
+	/// son_node_size elements each. Only the first son_node_links
+	/// elements of a node are positions; the rest are cached bytes
+	/// of the input that normalize() must not modify.
+	uint32_t son_offset;
+	uint32_t son_node_size;
+	uint32_t son_node_links;
+
+	/// True if son[] is a hash table (LZMA_MF_HB4) which has to be
+	/// cleared together with hash[].
+	bool son_is_hash;
+
+	/// Match finder thread or NULL if the match finder is run in
+	/// the same thread as the LZ-based encoder. See lz_encoder_mt.c.
+	lzma_mf_thread *thread;
+
+	/////////////////////////////
+	// Long-range match finder //
+	/////////////////////////////
+
+	/// Table of the most recent anchor position of each anchor hash
+	/// or NULL if LZMA_MF_LONG_RANGE isn't used. The positions are
+	/// indexes in buffer[] plus lr_offset.
+	uint32_t *lr_table;
+
+	/// Number of elements in lr_table[] is 2^(32 - lr_shift).
+	uint32_t lr_shift;
+
+	/// Offset of the positions in lr_table[]
+	uint32_t lr_offset;
+
+	/// buffer[lr_pos] is the next byte to be added to lr_hash.
+	uint32_t lr_pos;
+
+	/// Rolling hash of the 32 bytes before buffer[lr_pos]
+	uint32_t lr_hash;
+
+	/// Anchors before this position (buffer index plus lr_offset) are
+	/// not added to lr_table[]. This is the start of the input or
+	/// the most recent reset.
+	uint32_t lr_start;
+
+	/// Maximum distance of the long-range matches
+	uint32_t lr_dict_size;
 };
 
 
@@ -169,6 +260,17 @@ typedef struct {
 	/// the dict_size sized tail of the preset_dict will be used.
 	uint32_t preset_dict_size;
 
+	/// If non-zero, lzma_lz_encoder.reset is called after every
+	/// reset_interval bytes of input. The input up to the reset point
+	/// is encoded first like with LZMA_SYNC_FLUSH, and the match finder
+	/// forgets everything before the reset point.
+	uint32_t reset_interval;
+
+	/// If match_finder has LZMA_MF_LONG_RANGE, the match finder searches
+	/// only window_size bytes and the long-range match finder searches
+	/// the rest of the dictionary.
+	uint32_t window_size;
+
 } lzma_lz_options;
 
 
@@ -219,6 +321,10 @@ typedef struct {
 	lzma_ret (*set_out_limit)(void *coder, uint64_t *uncomp_size,
 			uint64_t out_limit);
 
+	/// Start encoding independently of the earlier data. This is
+	/// needed if lzma_lz_options.reset_interval is non-zero.
+	void (*reset)(void *coder);
+
 } lzma_lz_encoder;
 
 
@@ -334,12 +440,33 @@ extern uint64_t lzma_lz_encoder_memusage(const lzma_lz_options *lz_options);
 extern uint32_t lzma_mf_find(
 		lzma_mf *mf, uint32_t *count, lzma_match *matches);
 
+#ifdef MYTHREAD_ENABLED
+extern uint64_t lzma_mf_thread_memusage(void);
+
+extern lzma_ret lzma_mf_thread_init(
+		lzma_mf *mf, const lzma_allocator *allocator);
+
+extern void lzma_mf_thread_update(lzma_mf_thread *thr,
+		uint32_t write_pos, lzma_action action);
+
+extern void lzma_mf_thread_pause(lzma_mf_thread *thr);
+
+extern void lzma_mf_thread_resume(
+		lzma_mf_thread *thr, uint32_t move_offset);
+
+extern void lzma_mf_thread_end(
+		lzma_mf_thread *thr, const lzma_allocator *allocator);
+#endif
+
 extern uint32_t lzma_mf_hc3_find(lzma_mf *dict, lzma_match *matches);
 extern void lzma_mf_hc3_skip(lzma_mf *dict, uint32_t amount);
 
 extern uint32_t lzma_mf_hc4_find(lzma_mf *dict, lzma_match *matches);
 extern void lzma_mf_hc4_skip(lzma_mf *dict, uint32_t amount);
 
+extern uint32_t lzma_mf_hb4_find(lzma_mf *dict, lzma_match *matches);
+extern void lzma_mf_hb4_skip(lzma_mf *dict, uint32_t amount);
+
 extern uint32_t lzma_mf_bt2_find(lzma_mf *dict, lzma_match *matches);
 extern void lzma_mf_bt2_skip(lzma_mf *dict, uint32_t amount);
 
@@ -348,5 +475,83 @@ extern void lzma_mf_bt3_skip(lzma_mf *dict, uint32_t amount);
 
 extern uint32_t lzma_mf_bt4_find(lzma_mf *dict, lzma_match *matches);
 extern void lzma_mf_bt4_skip(lzma_mf *dict, uint32_t amount);
+extern uint32_t lzma_mf_bt4x_find(lzma_mf *dict, lzma_match *matches);
+extern void lzma_mf_bt4x_skip(lzma_mf *dict, uint32_t amount);
+
+#ifdef LZMA_AVX2_DISPATCH
+// These are in lz_encoder_mf_avx2.c.
+lzma_attr_avx2 extern uint32_t lzma_mf_hc3_find_avx2(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx2 extern void lzma_mf_hc3_skip_avx2(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx2 extern uint32_t lzma_mf_hc4_find_avx2(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx2 extern void lzma_mf_hc4_skip_avx2(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx2 extern uint32_t lzma_mf_hb4_find_avx2(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx2 extern void lzma_mf_hb4_skip_avx2(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx2 extern uint32_t lzma_mf_bt2_find_avx2(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx2 extern void lzma_mf_bt2_skip_avx2(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx2 extern uint32_t lzma_mf_bt3_find_avx2(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx2 extern void lzma_mf_bt3_skip_avx2(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx2 extern uint32_t lzma_mf_bt4_find_avx2(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx2 extern void lzma_mf_bt4_skip_avx2(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx2 extern uint32_t lzma_mf_bt4x_find_avx2(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx2 extern void lzma_mf_bt4x_skip_avx2(
+		lzma_mf *dict, uint32_t amount);
+#endif
+
+#ifdef LZMA_AVX512BW_DISPATCH
+// These are in lz_encoder_mf_avx512bw.c.
+lzma_attr_avx512bw extern uint32_t lzma_mf_hc3_find_avx512bw(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx512bw extern void lzma_mf_hc3_skip_avx512bw(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx512bw extern uint32_t lzma_mf_hc4_find_avx512bw(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx512bw extern void lzma_mf_hc4_skip_avx512bw(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx512bw extern uint32_t lzma_mf_hb4_find_avx512bw(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx512bw extern void lzma_mf_hb4_skip_avx512bw(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx512bw extern uint32_t lzma_mf_bt2_find_avx512bw(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx512bw extern void lzma_mf_bt2_skip_avx512bw(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx512bw extern uint32_t lzma_mf_bt3_find_avx512bw(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx512bw extern void lzma_mf_bt3_skip_avx512bw(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx512bw extern uint32_t lzma_mf_bt4_find_avx512bw(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx512bw extern void lzma_mf_bt4_skip_avx512bw(
+		lzma_mf *dict, uint32_t amount);
+
+lzma_attr_avx512bw extern uint32_t lzma_mf_bt4x_find_avx512bw(
+		lzma_mf *dict, lzma_match *matches);
+lzma_attr_avx512bw extern void lzma_mf_bt4x_skip_avx512bw(
+		lzma_mf *dict, uint32_t amount);
+#endif
 
 #endif
@@ -15,6 +15,152 @@
 #include "memcmplen.h"
 
 
+// lz_encoder_mf_avx2.c and lz_encoder_mf_avx512bw.c include this file
+// to build the match finders again for processors that support AVX2 or
+// AVX-512BW. lz_encoder.c selects the variant at runtime. Only the function
+// names, the target attributes, and the lzma_memcmplen() variant differ.
+#if defined(LZ_ENCODER_MF_AVX512BW)
+#	define LZ_ENCODER_MF_VARIANT 1
+#	define mf_name(name) name ## _avx512bw
+#	define mf_attr lzma_attr_avx512bw
+#	define mf_memcmplen lzma_memcmplen_avx512bw
+#elif defined(LZ_ENCODER_MF_AVX2)
+#	define LZ_ENCODER_MF_VARIANT 1
+#	define mf_name(name) name ## _avx2
+#	define mf_attr lzma_attr_avx2
+#	define mf_memcmplen lzma_memcmplen_avx2
+#else
+#	define mf_name(name) name
+#	define mf_attr
+#	define mf_memcmplen lzma_memcmplen
+#endif
+
+
+#ifndef LZ_ENCODER_MF_VARIANT
+/// Normalize the positions in lr_table[] so that the positions plus
+/// lr_offset don't overflow. This is like normalize() below: afterwards
+/// cur_pos + lr_offset == lr_dict_size + 1. With big dictionaries
+/// lr_offset wraps around, which is fine since only the sums are used.
+static void
+lr_normalize(lzma_mf *mf, uint32_t cur_pos)
+{
+	const uint32_t subvalue = cur_pos + mf->lr_offset
+			- mf->lr_dict_size - 1;
+	const uint32_t count = UINT32_C(1) << (32 - mf->lr_shift);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		if (mf->lr_table[i] <= subvalue)
+			mf->lr_table[i] = 0;
+		else
+			mf->lr_table[i] -= subvalue;
+	}
+
+	mf->lr_offset -= subvalue;
+	mf->lr_start = mf->lr_start <= subvalue ? 0 : mf->lr_start - subvalue;
+	return;
+}
+
+
+/// \brief      Find a long-range match at the position that was just
+///             run through the match finder
+///
+/// The rolling hash is updated up to MF_LR_HASH_BYTES bytes past the
+/// position, and the anchors that are found are added to lr_table[]. If
+/// the position itself is an anchor, the previous position with the same
+/// hash is compared to it. If the match is longer than *len_best, it is
+/// added to matches[] and *len_best is updated.
+static void
+lr_find(lzma_mf *mf, lzma_match *matches, uint32_t *count,
+		uint32_t *len_best)
+{
+	const uint32_t cur_pos = mf->read_pos - 1;
+	const uint32_t hash_end = cur_pos + my_min(MF_LR_HASH_BYTES,
+			mf->write_pos - cur_pos);
+
+	// cur_pos + lr_offset is always greater than lr_dict_size so that
+	// an empty element (zero) is always too far away. Between the calls
+	// of this function, mf_skip() advances read_pos by less than
+	// match_len_max bytes, so normalizing a little before the sum
+	// gets close to UINT32_MAX prevents it from overflowing.
+	if (unlikely(cur_pos + mf->lr_offset
+			> UINT32_MAX - (UINT32_C(1) << 16)))
+		lr_normalize(mf, cur_pos);
+
+	// If mf_skip() was used for a long time, which happens when
+	// a preset dictionary is used, continue hashing from the oldest
+	// position that is still close enough. This also keeps the positions
+	// in lr_table[] from underflowing. The anchors whose hash would
+	// include bytes before the new lr_pos aren't added.
+	if (mf->lr_pos < cur_pos && cur_pos - mf->lr_pos
+			> mf->lr_dict_size - MF_LR_HASH_BYTES) {
+		mf->lr_pos = cur_pos - mf->lr_dict_size + MF_LR_HASH_BYTES;
+		mf->lr_start = mf->lr_pos + mf->lr_offset;
+	}
+
+	uint32_t hash = mf->lr_hash;
+	uint32_t candidate = 0;
+	bool is_anchor = false;
+
+	while (mf->lr_pos < hash_end) {
+		// Each byte is shifted one bit higher for every following
+		// byte, so the hash depends only on the last 32 bytes.
+		hash = (hash << 1) + hash_table[mf->buffer[mf->lr_pos++]];
+
+		// The anchor is at the first of the hashed bytes. The
+		// position plus lr_offset is positive because lr_pos is
+		// at most lr_dict_size - MF_LR_HASH_BYTES bytes before
+		// cur_pos.
+		if ((hash >> (32 - MF_LR_ANCHOR_BITS)) == 0
+				&& mf->lr_pos + mf->lr_offset
+					- MF_LR_HASH_BYTES >= mf->lr_start) {
+			const uint32_t pos = mf->lr_pos - MF_LR_HASH_BYTES;
+			uint32_t *slot = mf->lr_table
+					+ ((hash * UINT32_C(0x9E3779B1))
+						>> mf->lr_shift);
+
+			if (pos == cur_pos) {
+				candidate = *slot;
+				is_anchor = true;
+			}
+
+			*slot = pos + mf->lr_offset;
+		}
+	}
+
+	mf->lr_hash = hash;
+
+	if (!is_anchor)
+		return;
+
+	// An empty element is zero, which is always too far away.
+	const uint32_t delta = cur_pos + mf->lr_offset - candidate;
+	if (delta > mf->lr_dict_size)
+		return;
+
+	const uint32_t limit = my_min(mf->write_pos - cur_pos,
+			mf->match_len_max);
+	const uint8_t *cur = mf->buffer + cur_pos;
+	const uint32_t len = lzma_memcmplen(cur - delta, cur, 0, limit);
+
+	// Short matches are left to the normal match finder. They would
+	// rarely pay off with the long distances.
+	if (len < MF_LR_HASH_BYTES || len <= *len_best)
+		return;
+
+	// The lengths in matches[] must increase and be at most nice_len.
+	// If the longest match has been extended beyond nice_len already,
+	// replace it.
+	if (*count > 0 && matches[*count - 1].len == mf->nice_len)
+		--*count;
+
+	matches[*count].len = my_min(len, mf->nice_len);
+	matches[*count].dist = delta - 1;
+	++*count;
+	*len_best = len;
+	return;
+}
+
+
 /// \brief      Find matches starting from the current byte
 ///
 /// \return     The length of the longest match found
@@ -24,7 +170,7 @@ lzma_mf_find(lzma_mf *mf, uint32_t *count_ptr, lzma_match *matches)
 	// Call the match finder. It returns the number of length-distance
 	// pairs found.
 	// FIXME: Minimum count is zero, what _exactly_ is the maximum?
-	const uint32_t count = mf->find(mf, matches);
+	uint32_t count = mf->find(mf, matches);
 
 	// Length of the longest match; assume that no matches were found
 	// and thus the maximum length is zero.
@@ -69,6 +215,9 @@ lzma_mf_find(lzma_mf *mf, uint32_t *count_ptr, lzma_match *matches)
 		}
 	}
 
+	if (mf->lr_table != NULL)
+		lr_find(mf, matches, &count, &len_best);
+
 	*count_ptr = count;
 
 	// Finally update the read position to indicate that match finder was
@@ -77,6 +226,7 @@ lzma_mf_find(lzma_mf *mf, uint32_t *count_ptr, lzma_match *matches)
 
 	return len_best;
 }
+#endif
 
 
 /// Hash value to indicate unused element in the hash. Since we start the
@@ -114,7 +264,7 @@ normalize(lzma_mf *mf)
 			= (MUST_NORMALIZE_POS - mf->cyclic_size);
 				// & ~((UINT32_C(1) << 10) - 1);
 
-	for (uint32_t i = 0; i < mf->hash_count; ++i) {
+	for (size_t i = 0; i < mf->hash_count; ++i) {
 		// If the distance is greater than the dictionary size,
 		// we can simply mark the hash element as empty.
 		if (mf->hash[i] <= subvalue)
@@ -123,18 +273,24 @@ normalize(lzma_mf *mf)
 			mf->hash[i] -= subvalue;
 	}
 
-	for (uint32_t i = 0; i < mf->sons_count; ++i) {
-		// Do the same for mf->son.
-		//
-		// NOTE: There may be uninitialized elements in mf->son.
-		// Valgrind may complain that the "if" below depends on
-		// an uninitialized value. In this case it is safe to ignore
-		// the warning. See also the comments in lz_encoder_init()
-		// in lz_encoder.c.
-		if (mf->son[i] <= subvalue)
-			mf->son[i] = EMPTY_HASH_VALUE;
-		else
-			mf->son[i] -= subvalue;
+	// With LZMA_MF_BT4X and LZMA_MF_HB4 only a part of every node
+	// in mf->son contains positions. The rest are cached bytes.
+	for (size_t i = mf->son_offset;
+			i + mf->son_node_size <= mf->sons_count;
+			i += mf->son_node_size) {
+		for (size_t j = i; j < i + mf->son_node_links; ++j) {
+			// Do the same for mf->son.
+			//
+			// NOTE: There may be uninitialized elements in
+			// mf->son. Valgrind may complain that the "if" below
+			// depends on an uninitialized value. In this case it
+			// is safe to ignore the warning. See also the
+			// comments in lz_encoder_init() in lz_encoder.c.
+			if (mf->son[j] <= subvalue)
+				mf->son[j] = EMPTY_HASH_VALUE;
+			else
+				mf->son[j] -= subvalue;
+		}
 	}
 
 	// Update offset to match the new locations.
@@ -246,6 +402,7 @@ do { \
 /// \param      cyclic_size     lzma_mf_cyclic_size
 /// \param      matches         Array to hold the matches.
 /// \param      len_best        The length of the longest match found so far.
+mf_attr
 static lzma_match *
 hc_find_func(
 		const uint32_t len_limit,
@@ -271,7 +428,7 @@ hc_find_func(
 				+ (delta > cyclic_pos ? cyclic_size : 0)];
 
 		if (pb[len_best] == cur[len_best] && pb[0] == cur[0]) {
-			uint32_t len = lzma_memcmplen(pb, cur, 1, len_limit);
+			uint32_t len = mf_memcmplen(pb, cur, 1, len_limit);
 
 			if (len_best < len) {
 				len_best = len;
@@ -301,8 +458,9 @@ do { \
 
 
 #ifdef HAVE_MF_HC3
+mf_attr
 extern uint32_t
-lzma_mf_hc3_find(lzma_mf *mf, lzma_match *matches)
+mf_name(lzma_mf_hc3_find)(lzma_mf *mf, lzma_match *matches)
 {
 	header_find(false, 3);
 
@@ -317,7 +475,7 @@ lzma_mf_hc3_find(lzma_mf *mf, lzma_match *matches)
 	uint32_t len_best = 2;
 
 	if (delta2 < mf->cyclic_size && *(cur - delta2) == *cur) {
-		len_best = lzma_memcmplen(cur - delta2, cur,
+		len_best = mf_memcmplen(cur - delta2, cur,
 				len_best, len_limit);
 
 		matches[0].len = len_best;
@@ -334,8 +492,9 @@ lzma_mf_hc3_find(lzma_mf *mf, lzma_match *matches)
 }
 
 
+mf_attr
 extern void
-lzma_mf_hc3_skip(lzma_mf *mf, uint32_t amount)
+mf_name(lzma_mf_hc3_skip)(lzma_mf *mf, uint32_t amount)
 {
 	do {
 		if (mf_avail(mf) < 3) {
@@ -362,8 +521,9 @@ lzma_mf_hc3_skip(lzma_mf *mf, uint32_t amount)
 
 
 #ifdef HAVE_MF_HC4
+mf_attr
 extern uint32_t
-lzma_mf_hc4_find(lzma_mf *mf, lzma_match *matches)
+mf_name(lzma_mf_hc4_find)(lzma_mf *mf, lzma_match *matches)
 {
 	header_find(false, 4);
 
@@ -395,7 +555,7 @@ lzma_mf_hc4_find(lzma_mf *mf, lzma_match *matches)
 	}
 
 	if (matches_count != 0) {
-		len_best = lzma_memcmplen(cur - delta2, cur,
+		len_best = mf_memcmplen(cur - delta2, cur,
 				len_best, len_limit);
 
 		matches[matches_count - 1].len = len_best;
@@ -413,8 +573,9 @@ lzma_mf_hc4_find(lzma_mf *mf, lzma_match *matches)
 }
 
 
+mf_attr
 extern void
-lzma_mf_hc4_skip(lzma_mf *mf, uint32_t amount)
+mf_name(lzma_mf_hc4_skip)(lzma_mf *mf, uint32_t amount)
 {
 	do {
 		if (mf_avail(mf) < 4) {
@@ -441,11 +602,228 @@ lzma_mf_hc4_skip(lzma_mf *mf, uint32_t amount)
 #endif
 
 
+/////////////////
+// Hash Bucket //
+/////////////////
+
+#ifdef HAVE_MF_HB4
+#if MF_HB_BUCKET_SIZE != 8
+#	error The tag comparison in hb_tag_mask() assumes eight positions.
+#endif
+
+/// Get a pointer to the bucket of the given hash value.
+#define hb_bucket(mf, hash_value) \
+	((mf)->son + (mf)->son_offset + (size_t)(hash_value) * MF_HB_NODE_SIZE)
+
+
+/// \brief      Find which positions of a bucket may start with tag
+///
+/// \param      tags    The tags of the bucket, MF_HB_BUCKET_SIZE elements
+/// \param      tag     The first four bytes at the current position
+///
+/// \return     A bitmask where bit i is set if tags[i] equals tag
+mf_attr
+static inline uint32_t
+hb_tag_mask(const uint32_t *tags, uint32_t tag)
+{
+#if defined(LZ_ENCODER_MF_AVX2) || defined(LZ_ENCODER_MF_AVX512BW)
+	// All eight tags fit in one 256-bit register.
+	const __m256i cmp = _mm256_cmpeq_epi32(
+			_mm256_loadu_si256((const __m256i *)tags),
+			_mm256_set1_epi32((int)tag));
+	return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+
+#elif defined(HAVE__MM_MOVEMASK_EPI8) \
+		&& (defined(__SSE2__) \
+			|| (defined(_MSC_VER) && defined(_M_IX86_FP) \
+				&& _M_IX86_FP >= 2))
+	// Compare four tags at a time and pack the results so that
+	// each tag gets one byte before taking the mask.
+	const __m128i t = _mm_set1_epi32((int)tag);
+	const __m128i a = _mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i *)tags), t);
+	const __m128i b = _mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i *)tags + 1), t);
+	const __m128i c = _mm_packs_epi16(_mm_packs_epi32(a, b),
+			_mm_setzero_si128());
+	return (uint32_t)_mm_movemask_epi8(c);
+
+#else
+	uint32_t mask = 0;
+
+	for (uint32_t i = 0; i < MF_HB_BUCKET_SIZE; ++i)
+		mask |= (uint32_t)(tags[i] == tag) << i;
+
+	return mask;
+#endif
+}
+
+
+/// Add the current position as the newest one in the bucket. The oldest
+/// position is dropped.
+static inline void
+hb_insert(uint32_t *bucket, uint32_t pos, uint32_t tag)
+{
+	memmove(bucket + 1, bucket,
+			(MF_HB_BUCKET_SIZE - 1) * sizeof(uint32_t));
+	memmove(bucket + MF_HB_BUCKET_SIZE + 1, bucket + MF_HB_BUCKET_SIZE,
+			(MF_HB_BUCKET_SIZE - 1) * sizeof(uint32_t));
+	bucket[0] = pos;
+	bucket[MF_HB_BUCKET_SIZE] = tag;
+	return;
+}
+
+
+/// Like hc_find_func() but the candidates come from one bucket. Only the
+/// candidates whose tag matches the first four bytes at cur are compared
+/// so looking at them doesn't need to touch the history buffer.
+///
+/// \param      len_limit       Don't look for matches longer than len_limit.
+/// \param      pos             lzma_mf.read_pos + lzma_mf.offset
+/// \param      cur             Pointer to current byte (mf_ptr(mf))
+/// \param      tag             The first four bytes at cur
+/// \param      bucket          The bucket of the current position
+/// \param      depth           Maximum number of candidates to compare
+/// \param      cyclic_size     lzma_mf_cyclic_size
+/// \param      matches         Array to hold the matches.
+/// \param      len_best        The length of the longest match found so far.
+mf_attr
+static lzma_match *
+hb_find_func(
+		const uint32_t len_limit,
+		const uint32_t pos,
+		const uint8_t *const cur,
+		const uint32_t tag,
+		const uint32_t *const bucket,
+		uint32_t depth,
+		const uint32_t cyclic_size,
+		lzma_match *matches,
+		uint32_t len_best)
+{
+	uint32_t mask = hb_tag_mask(bucket + MF_HB_BUCKET_SIZE, tag);
+
+	// The positions are newest first, so the first one that is
+	// too far away ends the search.
+	while (mask != 0) {
+		const uint32_t delta = pos - bucket[ctz32(mask)];
+		if (depth-- == 0 || delta >= cyclic_size)
+			return matches;
+
+		mask &= mask - 1;
+
+		const uint8_t *const pb = cur - delta;
+		if (pb[len_best] == cur[len_best]) {
+			const uint32_t len = mf_memcmplen(pb, cur, 4,
+					len_limit);
+
+			if (len_best < len) {
+				len_best = len;
+				matches->len = len;
+				matches->dist = delta - 1;
+				++matches;
+
+				if (len == len_limit)
+					return matches;
+			}
+		}
+	}
+
+	return matches;
+}
+
+
+mf_attr
+extern uint32_t
+mf_name(lzma_mf_hb4_find)(lzma_mf *mf, lzma_match *matches)
+{
+	header_find(false, 4);
+
+	hash_4_calc();
+
+	uint32_t delta2 = pos - mf->hash[hash_2_value];
+	const uint32_t delta3
+			= pos - mf->hash[FIX_3_HASH_SIZE + hash_3_value];
+
+	mf->hash[hash_2_value] = pos;
+	mf->hash[FIX_3_HASH_SIZE + hash_3_value] = pos;
+
+	uint32_t *const bucket = hb_bucket(mf, hash_value);
+	const uint32_t tag = read32ne(cur);
+
+	uint32_t len_best = 1;
+
+	if (delta2 < mf->cyclic_size && *(cur - delta2) == *cur) {
+		len_best = 2;
+		matches[0].len = 2;
+		matches[0].dist = delta2 - 1;
+		matches_count = 1;
+	}
+
+	if (delta2 != delta3 && delta3 < mf->cyclic_size
+			&& *(cur - delta3) == *cur) {
+		len_best = 3;
+		matches[matches_count++].dist = delta3 - 1;
+		delta2 = delta3;
+	}
+
+	if (matches_count != 0) {
+		len_best = mf_memcmplen(cur - delta2, cur,
+				len_best, len_limit);
+
+		matches[matches_count - 1].len = len_best;
+
+		if (len_best == len_limit) {
+			hb_insert(bucket, pos, tag);
+			move_pos(mf);
+			return matches_count;
+		}
+	}
+
+	if (len_best < 3)
+		len_best = 3;
+
+	matches_count = (uint32_t)(hb_find_func(len_limit, pos, cur, tag,
+				bucket, mf->depth, mf->cyclic_size,
+				matches + matches_count, len_best)
+			- matches);
+	hb_insert(bucket, pos, tag);
+	move_pos(mf);
+	return matches_count;
+}
+
+
+mf_attr
+extern void
+mf_name(lzma_mf_hb4_skip)(lzma_mf *mf, uint32_t amount)
+{
+	do {
+		if (mf_avail(mf) < 4) {
+			move_pending(mf);
+			continue;
+		}
+
+		const uint8_t *cur = mf_ptr(mf);
+		const uint32_t pos = mf->read_pos + mf->offset;
+
+		hash_4_calc();
+
+		mf->hash[hash_2_value] = pos;
+		mf->hash[FIX_3_HASH_SIZE + hash_3_value] = pos;
+
+		hb_insert(hb_bucket(mf, hash_value), pos, read32ne(cur));
+		move_pos(mf);
+
+	} while (--amount != 0);
+}
+#endif
+
+
 /////////////////
 // Binary Tree //
 /////////////////
 
 #if defined(HAVE_MF_BT2) || defined(HAVE_MF_BT3) || defined(HAVE_MF_BT4)
+mf_attr
 static lzma_match *
 bt_find_func(
 		const uint32_t len_limit,
@@ -459,8 +837,8 @@ bt_find_func(
 		lzma_match *matches,
 		uint32_t len_best)
 {
-	uint32_t *ptr0 = son + (cyclic_pos << 1) + 1;
-	uint32_t *ptr1 = son + (cyclic_pos << 1);
+	uint32_t *ptr0 = son + ((size_t)(cyclic_pos) << 1) + 1;
+	uint32_t *ptr1 = son + ((size_t)(cyclic_pos) << 1);
 
 	uint32_t len0 = 0;
 	uint32_t len1 = 0;
@@ -473,7 +851,7 @@ bt_find_func(
 			return matches;
 		}
 
-		uint32_t *const pair = son + ((cyclic_pos - delta
+		uint32_t *const pair = son + ((size_t)(cyclic_pos - delta
 				+ (delta > cyclic_pos ? cyclic_size : 0))
 				<< 1);
 
@@ -481,7 +859,7 @@ bt_find_func(
 		uint32_t len = my_min(len0, len1);
 
 		if (pb[len] == cur[len]) {
-			len = lzma_memcmplen(pb, cur, len + 1, len_limit);
+			len = mf_memcmplen(pb, cur, len + 1, len_limit);
 
 			if (len_best < len) {
 				len_best = len;
@@ -512,6 +890,7 @@ bt_find_func(
 }
 
 
+mf_attr
 static void
 bt_skip_func(
 		const uint32_t len_limit,
@@ -523,8 +902,8 @@ bt_skip_func(
 		const uint32_t cyclic_pos,
 		const uint32_t cyclic_size)
 {
-	uint32_t *ptr0 = son + (cyclic_pos << 1) + 1;
-	uint32_t *ptr1 = son + (cyclic_pos << 1);
+	uint32_t *ptr0 = son + ((size_t)(cyclic_pos) << 1) + 1;
+	uint32_t *ptr1 = son + ((size_t)(cyclic_pos) << 1);
 
 	uint32_t len0 = 0;
 	uint32_t len1 = 0;
@@ -537,14 +916,14 @@ bt_skip_func(
 			return;
 		}
 
-		uint32_t *pair = son + ((cyclic_pos - delta
+		uint32_t *pair = son + ((size_t)(cyclic_pos - delta
 				+ (delta > cyclic_pos ? cyclic_size : 0))
 				<< 1);
 		const uint8_t *pb = cur - delta;
 		uint32_t len = my_min(len0, len1);
 
 		if (pb[len] == cur[len]) {
-			len = lzma_memcmplen(pb, cur, len + 1, len_limit);
+			len = mf_memcmplen(pb, cur, len + 1, len_limit);
 
 			if (len == len_limit) {
 				*ptr1 = pair[0];
@@ -583,8 +962,9 @@ do { \
 
 
 #ifdef HAVE_MF_BT2
+mf_attr
 extern uint32_t
-lzma_mf_bt2_find(lzma_mf *mf, lzma_match *matches)
+mf_name(lzma_mf_bt2_find)(lzma_mf *mf, lzma_match *matches)
 {
 	header_find(true, 2);
 
@@ -597,8 +977,9 @@ lzma_mf_bt2_find(lzma_mf *mf, lzma_match *matches)
 }
 
 
+mf_attr
 extern void
-lzma_mf_bt2_skip(lzma_mf *mf, uint32_t amount)
+mf_name(lzma_mf_bt2_skip)(lzma_mf *mf, uint32_t amount)
 {
 	do {
 		header_skip(true, 2);
@@ -616,8 +997,9 @@ lzma_mf_bt2_skip(lzma_mf *mf, uint32_t amount)
 
 
 #ifdef HAVE_MF_BT3
+mf_attr
 extern uint32_t
-lzma_mf_bt3_find(lzma_mf *mf, lzma_match *matches)
+mf_name(lzma_mf_bt3_find)(lzma_mf *mf, lzma_match *matches)
 {
 	header_find(true, 3);
 
@@ -632,7 +1014,7 @@ lzma_mf_bt3_find(lzma_mf *mf, lzma_match *matches)
 	uint32_t len_best = 2;
 
 	if (delta2 < mf->cyclic_size && *(cur - delta2) == *cur) {
-		len_best = lzma_memcmplen(
+		len_best = mf_memcmplen(
 				cur, cur - delta2, len_best, len_limit);
 
 		matches[0].len = len_best;
@@ -649,8 +1031,9 @@ lzma_mf_bt3_find(lzma_mf *mf, lzma_match *matches)
 }
 
 
+mf_attr
 extern void
-lzma_mf_bt3_skip(lzma_mf *mf, uint32_t amount)
+mf_name(lzma_mf_bt3_skip)(lzma_mf *mf, uint32_t amount)
 {
 	do {
 		header_skip(true, 3);
@@ -671,8 +1054,9 @@ lzma_mf_bt3_skip(lzma_mf *mf, uint32_t amount)
 
 
 #ifdef HAVE_MF_BT4
+mf_attr
 extern uint32_t
-lzma_mf_bt4_find(lzma_mf *mf, lzma_match *matches)
+mf_name(lzma_mf_bt4_find)(lzma_mf *mf, lzma_match *matches)
 {
 	header_find(true, 4);
 
@@ -704,7 +1088,7 @@ lzma_mf_bt4_find(lzma_mf *mf, lzma_match *matches)
 	}
 
 	if (matches_count != 0) {
-		len_best = lzma_memcmplen(
+		len_best = mf_memcmplen(
 				cur, cur - delta2, len_best, len_limit);
 
 		matches[matches_count - 1].len = len_best;
@@ -722,8 +1106,9 @@ lzma_mf_bt4_find(lzma_mf *mf, lzma_match *matches)
 }
 
 
+mf_attr
 extern void
-lzma_mf_bt4_skip(lzma_mf *mf, uint32_t amount)
+mf_name(lzma_mf_bt4_skip)(lzma_mf *mf, uint32_t amount)
 {
 	do {
 		header_skip(true, 4);
@@ -742,3 +1127,359 @@ lzma_mf_bt4_skip(lzma_mf *mf, uint32_t amount)
 	} while (--amount != 0);
 }
 #endif
+
+
+///////////////////////////////////
+// Binary Tree with cached bytes //
+///////////////////////////////////
+
+#ifdef HAVE_MF_BT4X
+/// Get the first MF_BTX_CACHE_SIZE bytes at cur as an integer whose least
+/// significant byte is cur[0]. Bytes past the end of the input are zero.
+static inline uint64_t
+btx_head(const uint8_t *cur, uint32_t avail)
+{
+	if (avail >= MF_BTX_CACHE_SIZE)
+		return read64le(cur);
+
+	uint64_t head = 0;
+	for (uint32_t i = 0; i < avail; ++i)
+		head |= (uint64_t)cur[i] << (i * 8);
+
+	return head;
+}
+
+
+/// Get the bytes cached in a node by btx_head().
+static inline uint64_t
+btx_node_head(const uint32_t *node)
+{
+	return node[2] | ((uint64_t)node[3] << 32);
+}
+
+
+/// Get the index of the lowest non-zero byte in diff. diff must be non-zero.
+static inline uint32_t
+btx_first_diff(uint64_t diff)
+{
+	const uint32_t low = (uint32_t)diff;
+	if (low != 0)
+		return ctz32(low) >> 3;
+
+	return 4 + (ctz32((uint32_t)(diff >> 32)) >> 3);
+}
+
+
+/// Get the node of the match candidate at the given position.
+static inline uint32_t *
+btx_node(uint32_t *son, uint32_t cyclic_pos, uint32_t cyclic_size,
+		uint32_t delta)
+{
+	return son + ((size_t)(cyclic_pos - delta
+			+ (delta > cyclic_pos ? cyclic_size : 0))
+			* MF_BTX_NODE_SIZE);
+}
+
+
+/// Start loading the nodes of both children of a node while the match
+/// candidate of the node is being compared. One of them is visited next.
+static inline void
+btx_prefetch_children(uint32_t *son, const uint32_t *node, uint32_t pos,
+		uint32_t cyclic_pos, uint32_t cyclic_size)
+{
+	const uint32_t delta0 = pos - node[0];
+	const uint32_t delta1 = pos - node[1];
+
+	if (delta0 < cyclic_size)
+		lzma_prefetch(btx_node(son, cyclic_pos, cyclic_size, delta0));
+
+	if (delta1 < cyclic_size)
+		lzma_prefetch(btx_node(son, cyclic_pos, cyclic_size, delta1));
+
+	return;
+}
+
+
+/// Compare the match candidate of a node to the current position. This is
+/// like the comparison in bt_find_func() and bt_skip_func() but as long as
+/// the candidate is known to match fewer than MF_BTX_CACHE_SIZE bytes,
+/// the bytes cached in the node are used instead of the history buffer.
+///
+/// \return     The length of the match. If it is less than len_limit,
+///             *is_less tells if the candidate sorts before the current
+///             position.
+mf_attr
+static inline uint32_t
+btx_compare(const uint32_t *node, const uint8_t *pb, const uint8_t *cur,
+		uint64_t cur_head, uint32_t len, uint32_t len_limit,
+		bool *is_less)
+{
+	if (len < MF_BTX_CACHE_SIZE) {
+		const uint64_t node_head = btx_node_head(node);
+		const uint64_t diff = (node_head ^ cur_head) >> (len * 8);
+
+		len = diff != 0 ? len + btx_first_diff(diff)
+				: MF_BTX_CACHE_SIZE;
+
+		if (len >= len_limit)
+			return len_limit;
+
+		if (len < MF_BTX_CACHE_SIZE) {
+			*is_less = (uint8_t)(node_head >> (len * 8)) < cur[len];
+			return len;
+		}
+
+		len = mf_memcmplen(pb, cur, len, len_limit);
+	} else if (pb[len] == cur[len]) {
+		len = mf_memcmplen(pb, cur, len + 1, len_limit);
+	}
+
+	if (len < len_limit)
+		*is_less = pb[len] < cur[len];
+
+	return len;
+}
+
+
+/// Like bt_find_func() but with the node layout of LZMA_MF_BT4X.
+/// cur_head is btx_head() of cur.
+mf_attr
+static lzma_match *
+btx_find_func(
+		const uint32_t len_limit,
+		const uint32_t pos,
+		const uint8_t *const cur,
+		const uint64_t cur_head,
+		uint32_t cur_match,
+		uint32_t depth,
+		uint32_t *const son,
+		const uint32_t cyclic_pos,
+		const uint32_t cyclic_size,
+		lzma_match *matches,
+		uint32_t len_best)
+{
+	uint32_t *const node_cur = btx_node(son, cyclic_pos, cyclic_size, 0);
+	node_cur[2] = (uint32_t)cur_head;
+	node_cur[3] = (uint32_t)(cur_head >> 32);
+
+	uint32_t *ptr0 = node_cur + 1;
+	uint32_t *ptr1 = node_cur;
+
+	uint32_t len0 = 0;
+	uint32_t len1 = 0;
+
+	while (true) {
+		const uint32_t delta = pos - cur_match;
+		if (depth-- == 0 || delta >= cyclic_size) {
+			*ptr0 = EMPTY_HASH_VALUE;
+			*ptr1 = EMPTY_HASH_VALUE;
+			return matches;
+		}
+
+		uint32_t *const node = btx_node(
+				son, cyclic_pos, cyclic_size, delta);
+		btx_prefetch_children(son, node, pos, cyclic_pos, cyclic_size);
+
+		bool is_less = false;
+		const uint32_t len = btx_compare(node, cur - delta, cur,
+				cur_head, my_min(len0, len1), len_limit,
+				&is_less);
+
+		if (len_best < len) {
+			len_best = len;
+			matches->len = len;
+			matches->dist = delta - 1;
+			++matches;
+
+			if (len == len_limit) {
+				*ptr1 = node[0];
+				*ptr0 = node[1];
+				return matches;
+			}
+		}
+
+		if (is_less) {
+			*ptr1 = cur_match;
+			ptr1 = node + 1;
+			cur_match = *ptr1;
+			len1 = len;
+		} else {
+			*ptr0 = cur_match;
+			ptr0 = node;
+			cur_match = *ptr0;
+			len0 = len;
+		}
+	}
+}
+
+
+/// Like bt_skip_func() but with the node layout of LZMA_MF_BT4X.
+mf_attr
+static void
+btx_skip_func(
+		const uint32_t len_limit,
+		const uint32_t pos,
+		const uint8_t *const cur,
+		const uint64_t cur_head,
+		uint32_t cur_match,
+		uint32_t depth,
+		uint32_t *const son,
+		const uint32_t cyclic_pos,
+		const uint32_t cyclic_size)
+{
+	uint32_t *const node_cur = btx_node(son, cyclic_pos, cyclic_size, 0);
+	node_cur[2] = (uint32_t)cur_head;
+	node_cur[3] = (uint32_t)(cur_head >> 32);
+
+	uint32_t *ptr0 = node_cur + 1;
+	uint32_t *ptr1 = node_cur;
+
+	uint32_t len0 = 0;
+	uint32_t len1 = 0;
+
+	while (true) {
+		const uint32_t delta = pos - cur_match;
+		if (depth-- == 0 || delta >= cyclic_size) {
+			*ptr0 = EMPTY_HASH_VALUE;
+			*ptr1 = EMPTY_HASH_VALUE;
+			return;
+		}
+
+		uint32_t *const node = btx_node(
+				son, cyclic_pos, cyclic_size, delta);
+		btx_prefetch_children(son, node, pos, cyclic_pos, cyclic_size);
+
+		bool is_less = false;
+		const uint32_t len = btx_compare(node, cur - delta, cur,
+				cur_head, my_min(len0, len1), len_limit,
+				&is_less);
+
+		if (len == len_limit) {
+			*ptr1 = node[0];
+			*ptr0 = node[1];
+			return;
+		}
+
+		if (is_less) {
+			*ptr1 = cur_match;
+			ptr1 = node + 1;
+			cur_match = *ptr1;
+			len1 = len;
+		} else {
+			*ptr0 = cur_match;
+			ptr0 = node;
+			cur_match = *ptr0;
+			len0 = len;
+		}
+	}
+}
+
+
+/// The bytes cached in a node must never change afterwards. When flushing
+/// with nice_len < MF_BTX_CACHE_SIZE, the end of the input could be less
+/// than MF_BTX_CACHE_SIZE bytes away and more input could be appended later.
+/// Treat such positions as pending like bt_find_func() does with less than
+/// nice_len bytes. With LZMA_FINISH no input is appended anymore.
+#define btx_header(ret_op) \
+	if (mf_avail(mf) < MF_BTX_CACHE_SIZE && mf->action != LZMA_FINISH) { \
+		assert(mf->action != LZMA_RUN); \
+		move_pending(mf); \
+		ret_op; \
+	} \
+	const uint64_t cur_head = btx_head(mf_ptr(mf), mf_avail(mf))
+
+
+#define btx_find(len_best) \
+do { \
+	matches_count = (uint32_t)(btx_find_func(len_limit, pos, cur, \
+				cur_head, cur_match, mf->depth, mf->son, \
+				mf->cyclic_pos, mf->cyclic_size, \
+				matches + matches_count, len_best) \
+			- matches); \
+	move_pos(mf); \
+	return matches_count; \
+} while (0)
+
+#define btx_skip() \
+do { \
+	btx_skip_func(len_limit, pos, cur, cur_head, cur_match, mf->depth, \
+			mf->son, mf->cyclic_pos, mf->cyclic_size); \
+	move_pos(mf); \
+} while (0)
+
+
+mf_attr
+extern uint32_t
+mf_name(lzma_mf_bt4x_find)(lzma_mf *mf, lzma_match *matches)
+{
+	btx_header(return 0);
+	header_find(true, 4);
+
+	hash_4_calc();
+
+	uint32_t delta2 = pos - mf->hash[hash_2_value];
+	const uint32_t delta3
+			= pos - mf->hash[FIX_3_HASH_SIZE + hash_3_value];
+	const uint32_t cur_match = mf->hash[FIX_4_HASH_SIZE + hash_value];
+
+	mf->hash[hash_2_value] = pos;
+	mf->hash[FIX_3_HASH_SIZE + hash_3_value] = pos;
+	mf->hash[FIX_4_HASH_SIZE + hash_value] = pos;
+
+	uint32_t len_best = 1;
+
+	if (delta2 < mf->cyclic_size && *(cur - delta2) == *cur) {
+		len_best = 2;
+		matches[0].len = 2;
+		matches[0].dist = delta2 - 1;
+		matches_count = 1;
+	}
+
+	if (delta2 != delta3 && delta3 < mf->cyclic_size
+			&& *(cur - delta3) == *cur) {
+		len_best = 3;
+		matches[matches_count++].dist = delta3 - 1;
+		delta2 = delta3;
+	}
+
+	if (matches_count != 0) {
+		len_best = mf_memcmplen(
+				cur, cur - delta2, len_best, len_limit);
+
+		matches[matches_count - 1].len = len_best;
+
+		if (len_best == len_limit) {
+			btx_skip();
+			return matches_count;
+		}
+	}
+
+	if (len_best < 3)
+		len_best = 3;
+
+	btx_find(len_best);
+}
+
+
+mf_attr
+extern void
+mf_name(lzma_mf_bt4x_skip)(lzma_mf *mf, uint32_t amount)
+{
+	do {
+		btx_header(continue);
+		header_skip(true, 4);
+
+		hash_4_calc();
+
+		const uint32_t cur_match
+				= mf->hash[FIX_4_HASH_SIZE + hash_value];
+
+		mf->hash[hash_2_value] = pos;
+		mf->hash[FIX_3_HASH_SIZE + hash_3_value] = pos;
+		mf->hash[FIX_4_HASH_SIZE + hash_value] = pos;
+
+		btx_skip();
+
+	} while (--amount != 0);
+}
+#endif
@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       lz_encoder_mf_avx2.c
+/// \brief      Match finders for x86 processors that support AVX2
+///
+/// This builds lz_encoder_mf.c a second time so that the functions get
+/// the AVX2 target attribute and use lzma_memcmplen_avx2(). If the build
+/// doesn't support runtime selection of AVX2 code, this file is empty.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "lz_encoder.h"
+
+#ifdef LZMA_AVX2_DISPATCH
+#	define LZ_ENCODER_MF_AVX2 1
+#	include "lz_encoder_mf.c"
+#endif
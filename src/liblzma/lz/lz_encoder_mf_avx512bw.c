@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       lz_encoder_mf_avx512bw.c
+/// \brief      Match finders for x86 processors that support AVX-512BW
+///
+/// This builds lz_encoder_mf.c a third time so that the functions get
+/// the AVX-512BW target attribute and use lzma_memcmplen_avx512bw().
+/// If the build doesn't support runtime selection of AVX-512BW code,
+/// this file is empty.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "lz_encoder.h"
+
+#ifdef LZMA_AVX512BW_DISPATCH
+#	define LZ_ENCODER_MF_AVX512BW 1
+#	include "lz_encoder_mf.c"
+#endif
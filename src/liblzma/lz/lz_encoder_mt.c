@@ -0,0 +1,467 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       lz_encoder_mt.c
+/// \brief      Running the match finder in a separate thread
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "lz_encoder.h"
+#include "memcmplen.h"
+
+
+// The match finder thread runs the real match finder over the input that
+// has been copied to the history buffer and stores the results in batches.
+// The LZ-based encoder consumes the results via the find() and skip()
+// functions in lzma_mf, which now only read the batches.
+//
+// The thread has to run the match finder for every position since it
+// cannot know which positions the encoder will skip. Skipping isn't much
+// cheaper than finding with binary trees, so this costs relatively little
+// and lets the match finder and the encoder use different CPU cores.
+//
+// The results don't depend on how far ahead the thread is because
+// len_limit equals nice_len whenever at least nice_len bytes are available.
+// When flushing or finishing, the thread processes the rest of the input
+// only after it has been told the action, exactly like the match finder
+// does in single-threaded mode. Thus the compressed output is identical
+// with and without the thread.
+//
+// The encoder keeps copying new input to the end of the history buffer
+// while the thread is running. lzma_memcmplen() in the thread may read
+// up to LZMA_MEMCMPLEN_EXTRA bytes past the thread's copy of write_pos,
+// so with LZMA_RUN the thread is told a write_pos that is that much
+// smaller than the real one (see thread_write_pos()). Thus the thread
+// never reads bytes that the encoder may be writing. When flushing or
+// finishing, the encoder doesn't write to the buffer until the thread
+// has processed all the input, so then the thread gets the real
+// write_pos. Moving the window requires pausing the thread.
+//
+// The ring of batches is protected by a mutex. It is locked once per
+// batch of up to BATCH_POS_MAX positions, so the locking costs little
+// compared to the match finder itself, and the condition variables
+// are needed anyway to let the threads sleep when the other one is
+// behind. A lock-free ring wouldn't make a measurable difference.
+
+
+/// Maximum number of positions in one batch
+#define BATCH_POS_MAX 4096
+
+/// Size of the lzma_match array in a batch. Finding matches for one
+/// position may produce at most nice_len matches. A batch is passed to
+/// the encoder early if there might not be enough space for the next
+/// position.
+#define BATCH_MATCHES_MAX (4 * BATCH_POS_MAX)
+
+/// Number of batches. The encoder holds one batch while reading from it
+/// and the rest can be filled by the match finder thread.
+#define BATCH_COUNT 4
+
+
+typedef struct {
+	/// Number of positions in this batch
+	uint32_t pos_count;
+
+	/// The matches of the position i are in
+	/// matches[ends[i - 1]] to matches[ends[i] - 1], inclusive,
+	/// where ends[-1] is taken to be zero.
+	uint32_t ends[BATCH_POS_MAX];
+
+	/// Matches found by the match finder
+	lzma_match matches[BATCH_MATCHES_MAX];
+} mf_batch;
+
+
+struct lzma_mf_thread_s {
+	/// Match finder state used by the thread. The history buffer and
+	/// the hash tables are the same as in the lzma_mf of the encoder
+	/// but the positions are separate: the thread is usually ahead of
+	/// the encoder.
+	lzma_mf mf;
+
+	/// Ring of batches of match finder results
+	mf_batch *batches;
+
+	/// Index of the oldest batch in batches[]
+	uint32_t batches_first;
+
+	/// Number of batches that have been filled but not released
+	/// by the encoder yet
+	uint32_t batches_ready;
+
+	/// The batch that is being read by the encoder or NULL if the
+	/// encoder hasn't taken a batch since the last reset. This and
+	/// batch_pos are used only by the encoder thread.
+	const mf_batch *batch;
+
+	/// Index of the next position in *batch
+	uint32_t batch_pos;
+
+	/// Write position in the history buffer that the thread may use.
+	/// The thread copies this to mf.write_pos.
+	uint32_t write_pos;
+
+	/// Action that the thread copies to mf.action
+	lzma_action action;
+
+	/// True when the thread must not start a new batch. This is set
+	/// when the encoder needs to modify the history buffer or the
+	/// match finder state.
+	bool paused;
+
+	/// True when the thread is running the match finder and thus
+	/// reading the history buffer without holding the mutex
+	bool busy;
+
+	/// True when the thread should exit
+	bool exit;
+
+	/// The thread waits on this
+	mythread_cond cond;
+
+	/// The encoder waits on this
+	mythread_cond cond_encoder;
+
+	mythread_mutex mutex;
+
+	mythread thread_id;
+};
+
+
+/// Get the write_pos that the thread may use. See the comment at the
+/// beginning of this file.
+static uint32_t
+thread_write_pos(uint32_t write_pos, lzma_action action)
+{
+	if (action != LZMA_RUN)
+		return write_pos;
+
+	return write_pos > LZMA_MEMCMPLEN_EXTRA
+			? write_pos - LZMA_MEMCMPLEN_EXTRA : 0;
+}
+
+
+/// Get the position up to which the thread may run the match finder.
+static uint32_t
+get_limit(const lzma_mf_thread *thr)
+{
+	if (thr->action != LZMA_RUN)
+		return thr->write_pos;
+
+	// Without flushing or finishing, the match finder must have
+	// nice_len bytes available to get the same results as it would
+	// get with more input. LZMA_MF_BT4X caches MF_BTX_CACHE_SIZE bytes
+	// of every position so it needs at least that many. With the other
+	// match finders waiting for a few more bytes doesn't affect
+	// the results.
+	const uint32_t needed = my_max(thr->mf.nice_len, MF_BTX_CACHE_SIZE);
+
+	return thr->write_pos >= needed ? thr->write_pos - needed + 1 : 0;
+}
+
+
+/// Run the match finder until the batch is full or limit is reached.
+static void
+fill_batch(lzma_mf *mf, mf_batch *batch, uint32_t limit)
+{
+	// Restart the match finder after finished LZMA_SYNC_FLUSH. This is
+	// the same as in fill_window() in lz_encoder.c. The positions that
+	// are hashed here were already passed to the encoder with no matches.
+	if (mf->pending > 0) {
+		const uint32_t pending = mf->pending;
+		mf->pending = 0;
+
+		assert(mf->read_pos >= pending);
+		mf->read_pos -= pending;
+		mf->skip(mf, pending);
+	}
+
+	uint32_t pos_count = 0;
+	uint32_t matches_count = 0;
+
+	do {
+		const uint32_t count = mf->find(mf,
+				batch->matches + matches_count);
+		assert(count <= mf->nice_len);
+
+		matches_count += count;
+		batch->ends[pos_count++] = matches_count;
+	} while (mf->read_pos < limit && pos_count < BATCH_POS_MAX
+			&& BATCH_MATCHES_MAX - matches_count >= mf->nice_len);
+
+	batch->pos_count = pos_count;
+	return;
+}
+
+
+static MYTHREAD_RET_TYPE
+mf_thread_start(void *thr_ptr)
+{
+	lzma_mf_thread *thr = thr_ptr;
+
+	mythread_mutex_lock(&thr->mutex);
+
+	while (!thr->exit) {
+		if (thr->paused || thr->batches_ready == BATCH_COUNT
+				|| thr->mf.read_pos >= get_limit(thr)) {
+			mythread_cond_wait(&thr->cond, &thr->mutex);
+			continue;
+		}
+
+		const uint32_t limit = get_limit(thr);
+
+		mf_batch *batch = &thr->batches[(thr->batches_first
+				+ thr->batches_ready) % BATCH_COUNT];
+
+		thr->mf.write_pos = thr->write_pos;
+		thr->mf.action = thr->action;
+		thr->busy = true;
+		mythread_mutex_unlock(&thr->mutex);
+
+		fill_batch(&thr->mf, batch, limit);
+
+		mythread_mutex_lock(&thr->mutex);
+		thr->busy = false;
+		++thr->batches_ready;
+		mythread_cond_signal(&thr->cond_encoder);
+	}
+
+	mythread_mutex_unlock(&thr->mutex);
+
+	return MYTHREAD_RET_VALUE;
+}
+
+
+/// Release the batch that the encoder has read and wait for the next one.
+static void
+next_batch(lzma_mf_thread *thr)
+{
+	mythread_sync(thr->mutex) {
+		if (thr->batch != NULL) {
+			thr->batches_first = (thr->batches_first + 1)
+					% BATCH_COUNT;
+			--thr->batches_ready;
+			mythread_cond_signal(&thr->cond);
+		}
+
+		while (thr->batches_ready == 0)
+			mythread_cond_wait(&thr->cond_encoder, &thr->mutex);
+	}
+
+	thr->batch = &thr->batches[thr->batches_first];
+	thr->batch_pos = 0;
+	return;
+}
+
+
+static uint32_t
+mf_thread_find(lzma_mf *mf, lzma_match *matches)
+{
+	lzma_mf_thread *thr = mf->thread;
+
+	if (thr->batch == NULL || thr->batch_pos == thr->batch->pos_count)
+		next_batch(thr);
+
+	const uint32_t i = thr->batch_pos++;
+	const uint32_t first = i == 0 ? 0 : thr->batch->ends[i - 1];
+	const uint32_t count = thr->batch->ends[i] - first;
+
+	memcpy(matches, thr->batch->matches + first,
+			count * sizeof(lzma_match));
+
+	++mf->read_pos;
+	assert(mf->read_pos <= mf->write_pos);
+
+	return count;
+}
+
+
+static void
+mf_thread_skip(lzma_mf *mf, uint32_t amount)
+{
+	lzma_mf_thread *thr = mf->thread;
+
+	mf->read_pos += amount;
+	assert(mf->read_pos <= mf->write_pos);
+
+	while (true) {
+		if (thr->batch == NULL
+				|| thr->batch_pos == thr->batch->pos_count)
+			next_batch(thr);
+
+		const uint32_t avail = thr->batch->pos_count
+				- thr->batch_pos;
+		if (amount <= avail) {
+			thr->batch_pos += amount;
+			break;
+		}
+
+		thr->batch_pos += avail;
+		amount -= avail;
+	}
+
+	return;
+}
+
+
+extern uint64_t
+lzma_mf_thread_memusage(void)
+{
+	return sizeof(lzma_mf_thread) + BATCH_COUNT * sizeof(mf_batch);
+}
+
+
+extern lzma_ret
+lzma_mf_thread_init(lzma_mf *mf, const lzma_allocator *allocator)
+{
+	lzma_mf_thread *thr = mf->thread;
+
+	if (thr == NULL) {
+		thr = lzma_alloc(sizeof(lzma_mf_thread), allocator);
+		if (thr == NULL)
+			return LZMA_MEM_ERROR;
+
+		thr->batches = lzma_alloc(BATCH_COUNT * sizeof(mf_batch),
+				allocator);
+		if (thr->batches == NULL)
+			goto error_batches;
+
+		if (mythread_mutex_init(&thr->mutex))
+			goto error_mutex;
+
+		if (mythread_cond_init(&thr->cond))
+			goto error_cond;
+
+		if (mythread_cond_init(&thr->cond_encoder))
+			goto error_cond_encoder;
+
+		// The thread will wait until it gets input.
+		thr->mf.read_pos = 0;
+		thr->write_pos = 0;
+		thr->action = LZMA_RUN;
+		thr->batches_ready = 0;
+		thr->paused = true;
+		thr->busy = false;
+		thr->exit = false;
+
+		if (mythread_create(&thr->thread_id, &mf_thread_start, thr))
+			goto error_thread;
+
+		mf->thread = thr;
+	}
+
+	// The match finder state and the history buffer were initialized
+	// by the caller. Since the thread was paused, it cannot be reading
+	// them. Let the thread continue from the same state.
+	mythread_sync(thr->mutex) {
+		assert(thr->paused);
+		assert(!thr->busy);
+
+		thr->mf = *mf;
+		thr->mf.thread = NULL;
+
+		// The thread restarts the match finder itself if some
+		// bytes of the preset dictionary weren't hashed yet.
+		mf->pending = 0;
+
+		thr->batches_first = 0;
+		thr->batches_ready = 0;
+		thr->batch = NULL;
+		thr->batch_pos = 0;
+
+		thr->write_pos = thread_write_pos(mf->write_pos, mf->action);
+		thr->action = mf->action;
+		thr->paused = false;
+
+		mythread_cond_signal(&thr->cond);
+	}
+
+	mf->find = &mf_thread_find;
+	mf->skip = &mf_thread_skip;
+
+	return LZMA_OK;
+
+error_thread:
+	mythread_cond_destroy(&thr->cond_encoder);
+
+error_cond_encoder:
+	mythread_cond_destroy(&thr->cond);
+
+error_cond:
+	mythread_mutex_destroy(&thr->mutex);
+
+error_mutex:
+	lzma_free(thr->batches, allocator);
+
+error_batches:
+	lzma_free(thr, allocator);
+	return LZMA_MEM_ERROR;
+}
+
+
+extern void
+lzma_mf_thread_update(lzma_mf_thread *thr, uint32_t write_pos,
+		lzma_action action)
+{
+	mythread_sync(thr->mutex) {
+		thr->write_pos = thread_write_pos(write_pos, action);
+		thr->action = action;
+		mythread_cond_signal(&thr->cond);
+	}
+
+	return;
+}
+
+
+extern void
+lzma_mf_thread_pause(lzma_mf_thread *thr)
+{
+	mythread_sync(thr->mutex) {
+		thr->paused = true;
+
+		while (thr->busy)
+			mythread_cond_wait(&thr->cond_encoder, &thr->mutex);
+	}
+
+	return;
+}
+
+
+extern void
+lzma_mf_thread_resume(lzma_mf_thread *thr, uint32_t move_offset)
+{
+	mythread_sync(thr->mutex) {
+		assert(thr->paused);
+
+		thr->mf.offset += move_offset;
+		thr->mf.read_pos -= move_offset;
+		thr->mf.write_pos -= move_offset;
+		thr->write_pos -= move_offset;
+
+		thr->paused = false;
+		mythread_cond_signal(&thr->cond);
+	}
+
+	return;
+}
+
+
+extern void
+lzma_mf_thread_end(lzma_mf_thread *thr, const lzma_allocator *allocator)
+{
+	mythread_sync(thr->mutex) {
+		thr->exit = true;
+		mythread_cond_signal(&thr->cond);
+	}
+
+	mythread_join(thr->thread_id);
+
+	mythread_cond_destroy(&thr->cond_encoder);
+	mythread_cond_destroy(&thr->cond);
+	mythread_mutex_destroy(&thr->mutex);
+
+	lzma_free(thr->batches, allocator);
+	lzma_free(thr, allocator);
+	return;
+}
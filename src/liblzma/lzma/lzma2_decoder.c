@@ -48,6 +48,10 @@ typedef struct {
 	/// first chunk (LZMA or uncompressed).
 	bool need_dictionary_reset;
 
+	/// True if lzma2_decode() should stop before the next chunk
+	/// so that the state can be saved with lzma_lzma2_decoder_save().
+	bool pause;
+
 	lzma_options_lzma options;
 } lzma_lzma2_coder;
 
@@ -65,6 +69,14 @@ lzma2_decode(void *coder_ptr, lzma_dict *restrict dict,
 	while (*in_pos < in_size || coder->sequence == SEQ_LZMA)
 	switch (coder->sequence) {
 	case SEQ_CONTROL: {
+		// Don't stop before the end marker. The Block decoder
+		// would see all output produced without LZMA_STREAM_END
+		// and treat it as an error.
+		if (coder->pause && !coder->need_properties
+				&& !coder->need_dictionary_reset
+				&& in[*in_pos] != 0x00)
+			return LZMA_OK;
+
 		const uint32_t control = in[*in_pos];
 		++*in_pos;
 
@@ -268,6 +280,7 @@ lzma2_decoder_init(lzma_lz_decoder *lz, const lzma_allocator *allocator,
 	coder->need_properties = true;
 	coder->need_dictionary_reset = options->preset_dict == NULL
 			|| options->preset_dict_size == 0;
+	coder->pause = false;
 
 	return lzma_lzma_decoder_create(&coder->lzma,
 			allocator, options, lz_options);
@@ -329,3 +342,100 @@ lzma_lzma2_props_decode(void **options, const lzma_allocator *allocator,
 
 	return LZMA_OK;
 }
+
+
+/// Get the LZMA2 decoder from a raw decoder that has LZMA2
+/// as the only filter.
+static lzma_lzma2_coder *
+get_coder(lzma_next_coder *next, lzma_dict **dict)
+{
+	assert(next->id == LZMA_FILTER_LZMA2);
+	return lzma_lz_decoder_get(next, dict);
+}
+
+
+extern void
+lzma_lzma2_decoder_pause(lzma_next_coder *next, bool pause)
+{
+	lzma_dict *dict;
+	get_coder(next, &dict)->pause = pause;
+	return;
+}
+
+
+extern size_t
+lzma_lzma2_decoder_state_size(lzma_next_coder *next)
+{
+	lzma_dict *dict;
+	lzma_lzma2_coder *coder = get_coder(next, &dict);
+
+	// Between chunks the LZMA decoder has no partially decoded
+	// symbol and the range decoder will be reinitialized. Before
+	// the first LZMA chunk there would be nothing useful to save.
+	if (coder->sequence != SEQ_CONTROL || coder->need_properties
+			|| coder->need_dictionary_reset)
+		return 0;
+
+	return 2 + lzma_lzma_decoder_state_size(&coder->options)
+			+ dict->full;
+}
+
+
+extern void
+lzma_lzma2_decoder_save(lzma_next_coder *next, uint8_t *buf)
+{
+	lzma_dict *dict;
+	lzma_lzma2_coder *coder = get_coder(next, &dict);
+	assert(lzma_lzma2_decoder_state_size(next) != 0);
+
+	// lc/lp/pb are stored like in the LZMA2 properties byte.
+	buf[0] = (uint8_t)((coder->options.pb * 5 + coder->options.lp) * 9
+			+ coder->options.lc);
+	buf[1] = (uint8_t)(dict->pos & 15);
+	buf += 2;
+
+	lzma_lzma_decoder_save(coder->lzma.coder, &coder->options, buf);
+	buf += lzma_lzma_decoder_state_size(&coder->options);
+
+	lzma_dict_window_get(dict, buf);
+	return;
+}
+
+
+extern lzma_ret
+lzma_lzma2_decoder_restore(lzma_next_coder *next,
+		const uint8_t *buf, size_t size)
+{
+	lzma_dict *dict;
+	lzma_lzma2_coder *coder = get_coder(next, &dict);
+
+	if (size < 2 || lzma_lzma_lclppb_decode(&coder->options, buf[0])
+			|| buf[1] > 15)
+		return LZMA_DATA_ERROR;
+
+	const size_t state_size = lzma_lzma_decoder_state_size(
+			&coder->options);
+	if (size - 2 < state_size
+			|| lzma_lzma_decoder_restore(coder->lzma.coder,
+				&coder->options, buf + 2)
+			|| lzma_dict_window_set(dict, buf + 2 + state_size,
+				size - 2 - state_size, buf[1]))
+		return LZMA_DATA_ERROR;
+
+	// The LZMA decoder assumes that the distances rep0-rep3 are valid
+	// in the dictionary. They are zero until the first match so zero
+	// is fine even with an empty dictionary.
+	for (size_t i = 0; i < 4; ++i) {
+		const uint32_t rep = read32le(buf + 3 + 4 * i);
+		if (rep != 0 && !dict_is_distance_valid(dict, rep))
+			return LZMA_DATA_ERROR;
+	}
+
+	// The next byte of input is the control byte of a chunk that
+	// doesn't reset the dictionary.
+	coder->sequence = SEQ_CONTROL;
+	coder->need_properties = false;
+	coder->need_dictionary_reset = false;
+	coder->pause = false;
+	return LZMA_OK;
+}
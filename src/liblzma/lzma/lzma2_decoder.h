@@ -25,4 +25,24 @@ extern lzma_ret lzma_lzma2_props_decode(
 		void **options, const lzma_allocator *allocator,
 		const uint8_t *props, size_t props_size);
 
+// The following functions are used to save and restore the decoder state
+// between LZMA2 chunks. next must be a raw decoder whose only filter is
+// LZMA2. The saved state includes the dictionary.
+
+/// Make the decoder stop before the next chunk boundary where the state
+/// can be saved, or allow it to continue if pause is false.
+extern void lzma_lzma2_decoder_pause(lzma_next_coder *next, bool pause);
+
+/// Get the size of the state that lzma_lzma2_decoder_save() would write
+/// now. This is zero if the decoder isn't at a chunk boundary.
+extern size_t lzma_lzma2_decoder_state_size(lzma_next_coder *next);
+
+extern void lzma_lzma2_decoder_save(lzma_next_coder *next, uint8_t *buf);
+
+/// Restore the state saved with lzma_lzma2_decoder_save() into a decoder
+/// that has been initialized with the same dictionary size. The input
+/// must continue from the next chunk.
+extern lzma_ret lzma_lzma2_decoder_restore(lzma_next_coder *next,
+		const uint8_t *buf, size_t size);
+
 #endif
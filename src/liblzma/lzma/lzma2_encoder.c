@@ -304,6 +304,24 @@ lzma2_encoder_options_update(void *coder_ptr, const lzma_filter *filter)
 }
 
 
+static void
+lzma2_encoder_reset(void *coder_ptr)
+{
+	lzma_lzma2_coder *coder = coder_ptr;
+
+	// This is called by the LZ encoder when the previous chunk has been
+	// finished. The next chunk will reset the dictionary and the state,
+	// and the LZMA chunk after a dictionary reset must set the properties.
+	assert(coder->sequence == SEQ_INIT);
+	coder->need_properties = true;
+	coder->need_state_reset = true;
+	coder->need_dictionary_reset = true;
+
+	lzma_lzma_encoder_dict_reset(coder->lzma);
+	return;
+}
+
+
 static lzma_ret
 lzma2_encoder_init(lzma_lz_encoder *lz, const lzma_allocator *allocator,
 		lzma_vli id lzma_attribute((__unused__)), const void *options,
@@ -322,6 +340,7 @@ lzma2_encoder_init(lzma_lz_encoder *lz, const lzma_allocator *allocator,
 		lz->code = &lzma2_encode;
 		lz->end = &lzma2_encoder_end;
 		lz->options_update = &lzma2_encoder_options_update;
+		lz->reset = &lzma2_encoder_reset;
 
 		coder->lzma = NULL;
 	}
@@ -108,9 +108,6 @@ typedef struct {
 	// Probabilities //
 	///////////////////
 
-	/// Literals; see comments in lzma_common.h.
-	probability literal[LITERAL_CODERS_MAX * LITERAL_CODER_SIZE];
-
 	/// If 1, it's a match. Otherwise it's a single 8-bit literal.
 	probability is_match[STATES][POS_STATES_MAX];
 
@@ -228,6 +225,14 @@ typedef struct {
 	/// If decoding a literal: match byte.
 	/// If decoding a match: length of the match.
 	uint32_t len;
+
+	/// Literals; see comments in lzma_common.h.
+	///
+	/// This is the last member because it is much bigger than the
+	/// other probabilities and usually only the beginning of it is
+	/// used (lc + lp < 4). This way the rest of the probabilities
+	/// and the decoder state fit in fewer cache lines and pages.
+	probability literal[LITERAL_CODERS_MAX * LITERAL_CODER_SIZE];
 } lzma_lzma1_decoder;
 
 
@@ -503,6 +508,17 @@ lzma_decode(void *coder_ptr, lzma_dict *restrict dictptr,
 					// Decode the lowest four bits using
 					// probabilities.
 					rep0 <<= ALIGN_BITS;
+
+					// The distance is now known within
+					// ALIGN_MASK bytes. Long distances
+					// are likely to be cache misses so
+					// start loading the match source
+					// while the last bits are decoded.
+					if (dict_is_distance_valid(&dict,
+							rep0 + ALIGN_MASK))
+						dict_prefetch(&dict,
+							rep0 + ALIGN_MASK);
+
 					rc_bittree_rev4(coder->pos_align);
 					rep0 += symbol;
 
@@ -623,6 +639,11 @@ lzma_decode(void *coder_ptr, lzma_dict *restrict dictptr,
 
 			update_long_rep(state);
 
+			// The distances in rep0-rep3 have been validated
+			// already. Load the match source while the length
+			// is being decoded.
+			dict_prefetch(&dict, rep0);
+
 			// Decode the length of the repeated match.
 			len_decode_fast(len, coder->rep_len_decoder,
 					pos_state);
@@ -1261,3 +1282,144 @@ error:
 	lzma_free(opt, allocator);
 	return LZMA_OPTIONS_ERROR;
 }
+
+
+/// Copy count probabilities to out[*pos] if out isn't NULL, or else from
+/// in[*pos]. *pos is advanced. Returns true if an invalid probability
+/// was read.
+static bool
+probs_copy(probability *probs, size_t count,
+		const uint8_t *in, uint8_t *out, size_t *pos)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (out != NULL) {
+			write16le(out + *pos, probs[i]);
+		} else {
+			// Probabilities are always in the range
+			// [1, RC_BIT_MODEL_TOTAL - 1]. Other values could
+			// make the range decoder misbehave.
+			probs[i] = read16le(in + *pos);
+			if (probs[i] == 0 || probs[i] >= RC_BIT_MODEL_TOTAL)
+				return true;
+		}
+
+		*pos += 2;
+	}
+
+	return false;
+}
+
+
+/// Copy the probabilities that are used with the given lc/lp/pb.
+/// The others are uninitialized. See lzma_decoder_reset().
+static bool
+state_probs_copy(lzma_lzma1_decoder *coder, const lzma_options_lzma *options,
+		const uint8_t *in, uint8_t *out)
+{
+	const size_t pos_states = 1U << options->pb;
+	size_t pos = 0;
+	bool error = probs_copy(coder->literal,
+			LITERAL_CODER_SIZE << (options->lc + options->lp),
+			in, out, &pos);
+
+	for (uint32_t i = 0; i < STATES; ++i) {
+		error |= probs_copy(coder->is_match[i], pos_states,
+				in, out, &pos);
+		error |= probs_copy(coder->is_rep0_long[i], pos_states,
+				in, out, &pos);
+	}
+
+	error |= probs_copy(coder->is_rep, STATES, in, out, &pos);
+	error |= probs_copy(coder->is_rep0, STATES, in, out, &pos);
+	error |= probs_copy(coder->is_rep1, STATES, in, out, &pos);
+	error |= probs_copy(coder->is_rep2, STATES, in, out, &pos);
+
+	for (uint32_t i = 0; i < DIST_STATES; ++i)
+		error |= probs_copy(coder->dist_slot[i], DIST_SLOTS,
+				in, out, &pos);
+
+	error |= probs_copy(coder->pos_special,
+			FULL_DISTANCES - DIST_MODEL_END, in, out, &pos);
+	error |= probs_copy(coder->pos_align, ALIGN_SIZE, in, out, &pos);
+
+	lzma_length_decoder *const lens[2] = {
+		&coder->match_len_decoder,
+		&coder->rep_len_decoder,
+	};
+
+	for (size_t i = 0; i < 2; ++i) {
+		error |= probs_copy(&lens[i]->choice, 1, in, out, &pos);
+		error |= probs_copy(&lens[i]->choice2, 1, in, out, &pos);
+
+		for (size_t j = 0; j < pos_states; ++j) {
+			error |= probs_copy(lens[i]->low[j], LEN_LOW_SYMBOLS,
+					in, out, &pos);
+			error |= probs_copy(lens[i]->mid[j], LEN_MID_SYMBOLS,
+					in, out, &pos);
+		}
+
+		error |= probs_copy(lens[i]->high, LEN_HIGH_SYMBOLS,
+				in, out, &pos);
+	}
+
+	return error;
+}
+
+
+extern size_t
+lzma_lzma_decoder_state_size(const lzma_options_lzma *options)
+{
+	const size_t pos_states = 1U << options->pb;
+	const size_t probs = (LITERAL_CODER_SIZE
+				<< (options->lc + options->lp))
+			+ 2 * STATES * pos_states + 4 * STATES
+			+ DIST_STATES * DIST_SLOTS
+			+ FULL_DISTANCES - DIST_MODEL_END + ALIGN_SIZE
+			+ 2 * (2 + pos_states * (LEN_LOW_SYMBOLS
+					+ LEN_MID_SYMBOLS)
+				+ LEN_HIGH_SYMBOLS);
+
+	// state, rep0-3, and the probabilities
+	return 1 + 4 * 4 + 2 * probs;
+}
+
+
+extern void
+lzma_lzma_decoder_save(void *coder_ptr,
+		const lzma_options_lzma *options, uint8_t *buf)
+{
+	lzma_lzma1_decoder *coder = coder_ptr;
+	assert(coder->sequence == SEQ_IS_MATCH);
+
+	buf[0] = (uint8_t)coder->state;
+	write32le(buf + 1, coder->rep0);
+	write32le(buf + 5, coder->rep1);
+	write32le(buf + 9, coder->rep2);
+	write32le(buf + 13, coder->rep3);
+
+	(void)state_probs_copy(coder, options, NULL, buf + 17);
+	return;
+}
+
+
+extern bool
+lzma_lzma_decoder_restore(void *coder_ptr,
+		const lzma_options_lzma *options, const uint8_t *buf)
+{
+	lzma_lzma1_decoder *coder = coder_ptr;
+
+	if (buf[0] >= STATES)
+		return true;
+
+	// This sets pos_mask and the literal variables and resets
+	// the range decoder for the next chunk.
+	lzma_decoder_reset(coder, options);
+
+	coder->state = (lzma_lzma_state)(buf[0]);
+	coder->rep0 = read32le(buf + 1);
+	coder->rep1 = read32le(buf + 5);
+	coder->rep2 = read32le(buf + 9);
+	coder->rep3 = read32le(buf + 13);
+
+	return state_probs_copy(coder, options, buf + 17, NULL);
+}
@@ -42,6 +42,25 @@ extern bool lzma_lzma_lclppb_decode(
 		lzma_options_lzma *options, uint8_t byte);
 
 
+/// Get the size of the state that lzma_lzma_decoder_save() writes
+/// when the given lc/lp/pb are in use.
+extern size_t lzma_lzma_decoder_state_size(const lzma_options_lzma *options);
+
+/// \brief      Save the probabilities, the state, and the match distances
+///
+/// This is used between LZMA2 chunks, where the range decoder has no state.
+/// The size of buf must be lzma_lzma_decoder_state_size(options) bytes.
+extern void lzma_lzma_decoder_save(void *coder,
+		const lzma_options_lzma *options, uint8_t *buf);
+
+/// \brief      Restore the state saved by lzma_lzma_decoder_save()
+///
+/// \return     true if buf contains invalid values, false on success
+///
+extern bool lzma_lzma_decoder_restore(void *coder,
+		const lzma_options_lzma *options, const uint8_t *buf);
+
+
 #ifdef LZMA_LZ_DECODER_H
 /// Allocate and setup function pointers only. This is used by LZMA1 and
 /// LZMA2 decoders.
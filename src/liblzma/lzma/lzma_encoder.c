@@ -266,7 +266,7 @@ encode_symbol(lzma_lzma1_encoder *coder, lzma_mf *mf,
 static bool
 encode_init(lzma_lzma1_encoder *coder, lzma_mf *mf)
 {
-	assert(mf_position(mf) == 0);
+	assert(mf->read_ahead == 0);
 	assert(coder->uncomp_size == 0);
 
 	if (mf->read_pos == mf->read_limit) {
@@ -278,11 +278,14 @@ encode_init(lzma_lzma1_encoder *coder, lzma_mf *mf)
 		assert(mf->action == LZMA_FINISH);
 	} else {
 		// Do the actual initialization. The first LZMA symbol must
-		// always be a literal.
+		// always be a literal. It is at the beginning of the buffer
+		// unless the encoder has been reset with
+		// lzma_lzma_encoder_dict_reset().
+		const uint8_t cur_byte = mf->buffer[mf->read_pos];
 		mf_skip(mf, 1);
 		mf->read_ahead = 0;
 		rc_bit(&coder->rc, &coder->is_match[0][0], 0);
-		rc_bittree(&coder->rc, coder->literal + 0, 8, mf->buffer[0]);
+		rc_bittree(&coder->rc, coder->literal + 0, 8, cur_byte);
 		++coder->uncomp_size;
 	}
 
@@ -373,7 +376,7 @@ lzma_lzma_encode(lzma_lzma1_encoder *restrict coder, lzma_mf *restrict mf,
 		if (coder->fast_mode)
 			lzma_lzma_optimum_fast(coder, mf, &back, &len);
 		else
-			lzma_lzma_optimum_normal(coder, mf, &back, &len,
+			coder->optimum_normal(coder, mf, &back, &len,
 					(uint32_t)(coder->uncomp_size));
 
 		encode_symbol(coder, mf, back, len,
@@ -498,6 +501,10 @@ set_lz_options(lzma_lz_options *lz_options, const lzma_options_lzma *options)
 	lz_options->depth = options->depth;
 	lz_options->preset_dict = options->preset_dict;
 	lz_options->preset_dict_size = options->preset_dict_size;
+	lz_options->reset_interval = (options->mf & LZMA_MF_RESET_INTERVAL)
+			? options->reset_interval : 0;
+	lz_options->window_size = (options->mf & LZMA_MF_LONG_RANGE)
+			? options->window_size : 0;
 	return;
 }
 
@@ -598,6 +605,17 @@ lzma_lzma_encoder_reset(lzma_lzma1_encoder *coder,
 }
 
 
+extern void
+lzma_lzma_encoder_dict_reset(lzma_lzma1_encoder *coder)
+{
+	// The next symbol is encoded like the first symbol of the stream:
+	// a literal at position zero with zero as the previous byte.
+	coder->is_initialized = false;
+	coder->uncomp_size = 0;
+	return;
+}
+
+
 extern lzma_ret
 lzma_lzma_encoder_create(void **coder_ptr, const lzma_allocator *allocator,
 		lzma_vli id, const lzma_options_lzma *options,
@@ -606,6 +624,12 @@ lzma_lzma_encoder_create(void **coder_ptr, const lzma_allocator *allocator,
 	assert(id == LZMA_FILTER_LZMA1 || id == LZMA_FILTER_LZMA1EXT
 			|| id == LZMA_FILTER_LZMA2);
 
+	// Only LZMA2 can reset the dictionary in the middle of the stream.
+	if ((options->mf & LZMA_MF_RESET_INTERVAL)
+			&& (id != LZMA_FILTER_LZMA2 || options->reset_interval
+				< LZMA_DICT_SIZE_MIN))
+		return LZMA_OPTIONS_ERROR;
+
 	// Allocate lzma_lzma1_encoder if it wasn't already allocated.
 	if (*coder_ptr == NULL) {
 		*coder_ptr = lzma_alloc(sizeof(lzma_lzma1_encoder), allocator);
@@ -626,22 +650,35 @@ lzma_lzma_encoder_create(void **coder_ptr, const lzma_allocator *allocator,
 		case LZMA_MODE_NORMAL: {
 			coder->fast_mode = false;
 
+			// Select the optimum parser variant that uses
+			// the widest lzma_memcmplen() supported by
+			// the processor.
+			coder->optimum_normal = &lzma_lzma_optimum_normal;
+#ifdef LZMA_AVX512BW_DISPATCH
+			if (lzma_avx512bw_is_supported())
+				coder->optimum_normal
+					= &lzma_lzma_optimum_normal_avx512bw;
+			else
+#endif
+#ifdef LZMA_AVX2_DISPATCH
+			if (lzma_avx2_is_supported())
+				coder->optimum_normal
+					= &lzma_lzma_optimum_normal_avx2;
+#endif
+
 			// Set dist_table_size.
 			// Round the dictionary size up to next 2^n.
 			//
-			// Currently the maximum encoder dictionary size
-			// is 1.5 GiB due to lz_encoder.c and here we need
-			// to be below 2 GiB to make the rounded up value
-			// fit in an uint32_t and avoid an infinite while-loop
-			// (and undefined behavior due to a too large shift).
-			// So do the same check as in LZ encoder,
-			// limiting to 1.5 GiB.
-			if (options->dict_size > (UINT32_C(1) << 30)
-					+ (UINT32_C(1) << 29))
+			// The maximum encoder dictionary size is 3.5 GiB
+			// due to lz_encoder.c. The rounded up value doesn't
+			// fit in uint32_t, so the shift is done with
+			// uint64_t. Do the same check as in LZ encoder to
+			// keep dist_table_size at most DIST_SLOTS.
+			if (options->dict_size > LZ_ENC_DICT_SIZE_MAX)
 				return LZMA_OPTIONS_ERROR;
 
 			uint32_t log_size = 0;
-			while ((UINT32_C(1) << log_size) < options->dict_size)
+			while ((UINT64_C(1) << log_size) < options->dict_size)
 				++log_size;
 
 			coder->dist_table_size = log_size * 2;
@@ -47,6 +47,10 @@ extern lzma_ret lzma_lzma_encoder_create(
 extern lzma_ret lzma_lzma_encoder_reset(
 		lzma_lzma1_encoder *coder, const lzma_options_lzma *options);
 
+/// Makes the next symbol be encoded like the first symbol of the stream.
+/// This is used by LZMA2 after a dictionary reset.
+extern void lzma_lzma_encoder_dict_reset(lzma_lzma1_encoder *coder);
+
 
 extern lzma_ret lzma_lzma_encode(lzma_lzma1_encoder *restrict coder,
 		lzma_mf *restrict mf, uint8_t *restrict out,
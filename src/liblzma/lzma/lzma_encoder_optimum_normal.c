@@ -13,6 +13,24 @@
 #include "memcmplen.h"
 
 
+// lzma_encoder_optimum_normal_avx2.c and _avx512bw.c include this file
+// to build the optimum parser again with a faster lzma_memcmplen() for
+// the repeated match checks. lzma_encoder.c selects the variant at runtime.
+#if defined(LZMA_ENCODER_OPTIMUM_AVX512BW)
+#	define opt_name(name) name ## _avx512bw
+#	define opt_attr lzma_attr_avx512bw
+#	define opt_memcmplen lzma_memcmplen_avx512bw
+#elif defined(LZMA_ENCODER_OPTIMUM_AVX2)
+#	define opt_name(name) name ## _avx2
+#	define opt_attr lzma_attr_avx2
+#	define opt_memcmplen lzma_memcmplen_avx2
+#else
+#	define opt_name(name) name
+#	define opt_attr
+#	define opt_memcmplen lzma_memcmplen
+#endif
+
+
 ////////////
 // Prices //
 ////////////
@@ -267,6 +285,7 @@ backward(lzma_lzma1_encoder *restrict coder, uint32_t *restrict len_res,
 // Main //
 //////////
 
+opt_attr
 static inline uint32_t
 helper1(lzma_lzma1_encoder *restrict coder, lzma_mf *restrict mf,
 		uint32_t *restrict back_res, uint32_t *restrict len_res,
@@ -305,7 +324,7 @@ helper1(lzma_lzma1_encoder *restrict coder, lzma_mf *restrict mf,
 			continue;
 		}
 
-		rep_lens[i] = lzma_memcmplen(buf, buf_back, 2, buf_avail);
+		rep_lens[i] = opt_memcmplen(buf, buf_back, 2, buf_avail);
 
 		if (rep_lens[i] > rep_lens[rep_max_index])
 			rep_max_index = i;
@@ -439,6 +458,7 @@ helper1(lzma_lzma1_encoder *restrict coder, lzma_mf *restrict mf,
 }
 
 
+opt_attr
 static inline uint32_t
 helper2(lzma_lzma1_encoder *coder, uint32_t *reps, const uint8_t *buf,
 		uint32_t len_end, uint32_t position, const uint32_t cur,
@@ -564,7 +584,7 @@ helper2(lzma_lzma1_encoder *coder, uint32_t *reps, const uint8_t *buf,
 		const uint8_t *const buf_back = buf - reps[0] - 1;
 		const uint32_t limit = my_min(buf_avail_full, nice_len + 1);
 
-		const uint32_t len_test = lzma_memcmplen(buf, buf_back, 1, limit) - 1;
+		const uint32_t len_test = opt_memcmplen(buf, buf_back, 1, limit) - 1;
 
 		if (len_test >= 2) {
 			lzma_lzma_state state_2 = state;
@@ -604,7 +624,7 @@ helper2(lzma_lzma1_encoder *coder, uint32_t *reps, const uint8_t *buf,
 		if (not_equal_16(buf, buf_back))
 			continue;
 
-		uint32_t len_test = lzma_memcmplen(buf, buf_back, 2, buf_avail);
+		uint32_t len_test = opt_memcmplen(buf, buf_back, 2, buf_avail);
 
 		while (len_end < cur + len_test)
 			coder->opts[++len_end].price = RC_INFINITY_PRICE;
@@ -638,7 +658,7 @@ helper2(lzma_lzma1_encoder *coder, uint32_t *reps, const uint8_t *buf,
 		// NOTE: len_test_2 may be greater than limit so the call to
 		// lzma_memcmplen() must be done conditionally.
 		if (len_test_2 < limit)
-			len_test_2 = lzma_memcmplen(buf, buf_back, len_test_2, limit);
+			len_test_2 = opt_memcmplen(buf, buf_back, len_test_2, limit);
 
 		len_test_2 -= len_test + 1;
 
@@ -736,7 +756,7 @@ helper2(lzma_lzma1_encoder *coder, uint32_t *reps, const uint8_t *buf,
 				// so the call to lzma_memcmplen() must be
 				// done conditionally.
 				if (len_test_2 < limit)
-					len_test_2 = lzma_memcmplen(buf, buf_back,
+					len_test_2 = opt_memcmplen(buf, buf_back,
 							len_test_2, limit);
 
 				len_test_2 -= len_test + 1;
@@ -799,8 +819,9 @@ helper2(lzma_lzma1_encoder *coder, uint32_t *reps, const uint8_t *buf,
 }
 
 
+opt_attr
 extern void
-lzma_lzma_optimum_normal(lzma_lzma1_encoder *restrict coder,
+opt_name(lzma_lzma_optimum_normal)(lzma_lzma1_encoder *restrict coder,
 		lzma_mf *restrict mf,
 		uint32_t *restrict back_res, uint32_t *restrict len_res,
 		uint32_t position)
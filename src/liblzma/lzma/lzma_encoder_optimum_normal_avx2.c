@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       lzma_encoder_optimum_normal_avx2.c
+/// \brief      Optimum parser for x86 processors that support AVX2
+///
+/// This builds lzma_encoder_optimum_normal.c a second time so that
+/// the repeated match checks use lzma_memcmplen_avx2().
+/// If the build doesn't support runtime selection of AVX2 code,
+/// this file is empty.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "lzma_encoder_private.h"
+
+#ifdef LZMA_AVX2_DISPATCH
+#	define LZMA_ENCODER_OPTIMUM_AVX2 1
+#	include "lzma_encoder_optimum_normal.c"
+#endif
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       lzma_encoder_optimum_normal_avx512bw.c
+/// \brief      Optimum parser for x86 processors that support AVX-512BW
+///
+/// This builds lzma_encoder_optimum_normal.c a third time so that
+/// the repeated match checks use lzma_memcmplen_avx512bw().
+/// If the build doesn't support runtime selection of AVX-512BW code,
+/// this file is empty.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "lzma_encoder_private.h"
+
+#ifdef LZMA_AVX512BW_DISPATCH
+#	define LZMA_ENCODER_OPTIMUM_AVX512BW 1
+#	include "lzma_encoder_optimum_normal.c"
+#endif
@@ -102,6 +102,12 @@ struct lzma_lzma1_encoder_s {
 	/// True if using getoptimumfast
 	bool fast_mode;
 
+	/// lzma_lzma_optimum_normal() or a variant of it for the processor
+	/// in use. This is used when fast_mode is false.
+	void (*optimum_normal)(lzma_lzma1_encoder *restrict coder,
+			lzma_mf *restrict mf, uint32_t *restrict back_res,
+			uint32_t *restrict len_res, uint32_t position);
+
 	/// True if the encoder has been initialized by encoding the first
 	/// byte as a literal.
 	bool is_initialized;
@@ -158,4 +164,19 @@ extern void lzma_lzma_optimum_normal(lzma_lzma1_encoder *restrict coder,
 		lzma_mf *restrict mf, uint32_t *restrict back_res,
 		uint32_t *restrict len_res, uint32_t position);
 
+#ifdef LZMA_AVX2_DISPATCH
+lzma_attr_avx2
+extern void lzma_lzma_optimum_normal_avx2(lzma_lzma1_encoder *restrict coder,
+		lzma_mf *restrict mf, uint32_t *restrict back_res,
+		uint32_t *restrict len_res, uint32_t position);
+#endif
+
+#ifdef LZMA_AVX512BW_DISPATCH
+lzma_attr_avx512bw
+extern void lzma_lzma_optimum_normal_avx512bw(
+		lzma_lzma1_encoder *restrict coder,
+		lzma_mf *restrict mf, uint32_t *restrict back_res,
+		uint32_t *restrict len_res, uint32_t position);
+#endif
+
 #endif
@@ -84,6 +84,12 @@ static lzma_mt mt_options = {
 	.flags = 0,
 	.timeout = 300,
 };
+
+#	ifdef HAVE_DECODERS
+/// Index of the file being decompressed or NULL. This is given to
+/// the multithreaded decoder in mt_options.index.
+static lzma_index *mt_index = NULL;
+#	endif
 #endif
 
 
@@ -409,8 +415,7 @@ coder_set_compression_settings(void)
 	}
 
 	// The --flush-timeout option requires LZMA_SYNC_FLUSH support
-	// from the filter chain. Currently the threaded encoder doesn't
-	// support LZMA_SYNC_FLUSH so single-threaded mode must be used.
+	// from the filter chain.
 	if (opt_mode == MODE_COMPRESS && opt_flush_timeout != 0) {
 		for (unsigned i = 0; i < ARRAY_SIZE(chains); ++i) {
 			if (!(chains_used_mask & (1U << i)))
@@ -431,12 +436,6 @@ coder_set_compression_settings(void)
 				}
 			}
 		}
-
-		if (hardware_threads_is_mt()) {
-			message(V_WARNING, _("Switching to single-threaded "
-					"mode due to --flush-timeout"));
-			hardware_threads_set(1);
-		}
 	}
 
 	// Get memory limit and the memory usage of the used filter chains.
@@ -737,6 +736,89 @@ is_format_xz(void)
 }
 
 
+#ifdef MYTHREAD_ENABLED
+/// Read the Index of a .xz file so that the multithreaded decoder can
+/// decode in parallel also those Blocks whose Block Headers don't store
+/// the sizes of the Block. Some other .xz compressors create such files.
+/// xz always stores the sizes in multithreaded mode, so the Index isn't
+/// read if the first Block Header has them.
+///
+/// The first IO_BUFFER_SIZE bytes of the file must already be in in_buf.
+/// *idx is set to NULL if the Index isn't needed or cannot be decoded.
+/// Then the file is decoded without it and the decoder will report
+/// if the file is corrupt.
+///
+/// \return     On success, false is returned. On I/O error, an error
+///             message is printed and true is returned.
+static bool
+read_index(file_pair *pair, lzma_index **idx)
+{
+	*idx = NULL;
+
+	if (!io_src_is_regular(pair) || strm.avail_in
+			< LZMA_STREAM_HEADER_SIZE + 2)
+		return false;
+
+	// Check the Block Flags field of the first Block Header. If it is
+	// Index Indicator instead, the Stream has no Blocks.
+	const uint8_t *block_header = in_buf.u8 + LZMA_STREAM_HEADER_SIZE;
+	if (block_header[0] == 0x00 || (block_header[1] & 0xC0) == 0xC0)
+		return false;
+
+	lzma_stream istrm = LZMA_STREAM_INIT;
+	lzma_ret ret = lzma_file_info_decoder(&istrm, idx,
+			hardware_memlimit_get(MODE_DECOMPRESS),
+			(uint64_t)(pair->src_st.st_size));
+
+	// The beginning of the file is already in in_buf.
+	istrm.next_in = in_buf.u8;
+	istrm.avail_in = strm.avail_in;
+
+	io_buf buf;
+
+	while (ret == LZMA_OK) {
+		if (istrm.avail_in == 0) {
+			istrm.next_in = buf.u8;
+			istrm.avail_in = io_read(pair, &buf, IO_BUFFER_SIZE);
+			if (istrm.avail_in == SIZE_MAX)
+				goto error;
+		}
+
+		ret = lzma_code(&istrm, LZMA_RUN);
+
+		if (ret == LZMA_SEEK_NEEDED) {
+			if (io_seek_src(pair, istrm.seek_pos))
+				goto error;
+
+			istrm.avail_in = 0;
+			ret = LZMA_OK;
+		}
+	}
+
+	lzma_end(&istrm);
+
+	// *idx is set only when LZMA_STREAM_END is returned. Trailing
+	// garbage, for example, makes this fail. Such files are handled
+	// by the decoder like before.
+	if (ret != LZMA_STREAM_END)
+		*idx = NULL;
+
+	// Continue reading after the data that is already in in_buf.
+	if (io_seek_src(pair, strm.avail_in)) {
+		lzma_index_end(*idx, NULL);
+		*idx = NULL;
+		return true;
+	}
+
+	return false;
+
+error:
+	lzma_end(&istrm);
+	return true;
+}
+#endif
+
+
 /// Return true if the data in in_buf seems to be in the .lzma format.
 static bool
 is_format_lzma(void)
@@ -953,6 +1035,24 @@ coder_init(file_pair *pair)
 					= mt_options.threads == 1
 					? 0 : hardware_memlimit_mtdec_get();
 
+			// Big Blocks can be decoded in parallel if their
+			// LZMA2 data resets the dictionary now and then.
+			//
+			// If the input is a regular file, the sizes of
+			// the Blocks can be read from the Index when
+			// they are missing from the Block Headers.
+			if (mt_options.threads > 1) {
+				mt_options.flags |= LZMA_MT_SPLIT_BLOCKS;
+
+				if (read_index(pair, &mt_index))
+					return CODER_INIT_ERROR;
+
+				if (mt_index != NULL) {
+					mt_options.flags |= LZMA_MT_USE_INDEX;
+					mt_options.index = mt_index;
+				}
+			}
+
 			ret = lzma_stream_decoder_mt(&strm, &mt_options);
 #	else
 			ret = lzma_stream_decoder(&strm,
@@ -1444,10 +1544,23 @@ coder_run(const char *filename)
 					success = coder_normal(pair);
 
 				message_progress_end(success);
+
+#ifdef MYTHREAD_ENABLED
+				if (success && !is_passthru)
+					message_mt_stats(V_DEBUG, &strm);
+#endif
 			}
 		}
 	}
 
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_DECODERS)
+	// The decoder doesn't use the Index after the coding has finished.
+	// If the decoder is reinitialized for the next file, it will forget
+	// the old Index.
+	lzma_index_end(mt_index, NULL);
+	mt_index = NULL;
+#endif
+
 	// Close the file pair. It needs to know if coding was successful to
 	// know if the source or target file should be unlinked.
 	io_close(pair, success);
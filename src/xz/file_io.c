@@ -1309,6 +1309,14 @@ io_read(file_pair *pair, io_buf *buf, size_t size)
 }
 
 
+extern bool
+io_src_is_regular(const file_pair *pair)
+{
+	return pair->src_name != stdin_filename
+			&& S_ISREG(pair->src_st.st_mode);
+}
+
+
 extern bool
 io_seek_src(file_pair *pair, uint64_t pos)
 {
@@ -148,6 +148,15 @@ extern size_t io_read(file_pair *pair, io_buf *buf, size_t size);
 extern void io_fix_src_pos(file_pair *pair, size_t rewind_size);
 
 
+/// \brief      Check if the source file is a regular file opened by name
+///
+/// Only such files can be used with io_seek_src() and io_pread() when
+/// not in --list mode. Standard input is never considered seekable even
+/// if it is a regular file, because its reading position needn't be
+/// at the beginning of the file.
+extern bool io_src_is_regular(const file_pair *pair);
+
+
 /// \brief      Seek to the given absolute position in the source file
 ///
 /// This calls lseek() and also clears pair->src_eof.
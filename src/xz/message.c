@@ -917,6 +917,76 @@ message_filters_show(enum message_verbosity v, const lzma_filter *filters)
 }
 
 
+#ifdef MYTHREAD_ENABLED
+/// Convert microseconds to seconds for printing
+static double
+usec_to_sec(uint64_t usec)
+{
+	return (double)(usec) / 1000000.0;
+}
+
+
+extern void
+message_mt_stats(enum message_verbosity v, lzma_stream *strm)
+{
+	if (v > verbosity)
+		return;
+
+	// This fails if strm isn't a multithreaded encoder or decoder.
+	lzma_mt_stats stats;
+	if (lzma_mt_get_stats(strm, &stats, NULL, 0) != LZMA_OK
+			|| stats.threads == 0)
+		return;
+
+	lzma_mt_thread_stats *thread_stats
+			= xmalloc(stats.threads * sizeof(*thread_stats));
+	const uint32_t threads = stats.threads;
+	if (lzma_mt_get_stats(strm, &stats, thread_stats, threads)
+			!= LZMA_OK) {
+		free(thread_stats);
+		return;
+	}
+
+	message(v, _("Worker threads: %s, output queue peak: %s of %s "
+			"buffers"),
+			uint64_to_str(stats.threads, 0),
+			uint64_to_str(stats.outq_bufs_peak, 1),
+			uint64_to_str(stats.outq_bufs_limit, 2));
+
+	message(v, _("Waited %.2f s for a free thread and %.2f s for output"),
+			usec_to_sec(stats.wait_thread_usec),
+			usec_to_sec(stats.wait_out_usec));
+
+	if (opt_mode != MODE_COMPRESS)
+		message(v, _("Blocks delayed by the memory usage limit "
+				"for threading: %s, decompressed in "
+				"single-threaded mode: %s"),
+				uint64_to_str(stats.memlimit_waits, 0),
+				uint64_to_str(stats.memlimit_direct, 1));
+
+	for (uint32_t i = 0; i < threads && i < stats.threads; ++i) {
+		const lzma_mt_thread_stats *t = &thread_stats[i];
+		message(v, _("Thread %" PRIu32 ": %s Blocks, "
+				"%s uncompressed, %s compressed, "
+				"busy %.2f s, idle %.2f s, "
+				"waiting for input %.2f s"),
+				i + 1,
+				uint64_to_str(t->blocks, 0),
+				uint64_to_nicestr(t->uncompressed_size,
+					NICESTR_B, NICESTR_TIB, false, 1),
+				uint64_to_nicestr(t->compressed_size,
+					NICESTR_B, NICESTR_TIB, false, 2),
+				usec_to_sec(t->busy_usec),
+				usec_to_sec(t->idle_usec),
+				usec_to_sec(t->wait_in_usec));
+	}
+
+	free(thread_stats);
+	return;
+}
+#endif
+
+
 extern void
 message_try_help(void)
 {
@@ -1161,14 +1231,15 @@ message_help(bool long_help)
 
 		e |= tuklib_wrapf(stdout, &wrap3,
 			"preset=%s\v%s (0-9[e])\r"
-			"dict=%s\v%s \b(4KiB - 1536MiB; 8MiB)\b\r"
+			"dict=%s\v%s \b(4KiB - 3584MiB; 8MiB)\b\r"
 			"lc=%s\v%s \b(0-4; 3)\b\r"
 			"lp=%s\v%s \b(0-4; 0)\b\r"
 			"pb=%s\v%s \b(0-4; 2)\b\r"
 			"mode=%s\v%s (fast, normal; normal)\r"
 			"nice=%s\v%s \b(2-273; 64)\b\r"
-			"mf=%s\v%s (hc3, hc4, bt2, bt3, bt4; bt4)\r"
-			"depth=%s\v%s",
+			"mf=%s\v%s (hc3, hc4, hb4, bt2, bt3, bt4; bt4)\r"
+			"depth=%s\v%s\r"
+			"window=%s\v%s",
 			// TRANSLATORS: Short for PRESET. A longer string is
 			// fine but wider than 4 columns makes --long-help
 			// one line longer.
@@ -1187,7 +1258,9 @@ message_help(bool long_help)
 			_("NUM"), W_("nice length of a match"),
 			_("NAME"), W_("match finder"),
 			_("NUM"), W_("maximum search depth; "
-				"0=automatic (default)"));
+				"0=automatic (default)"),
+			_("NUM"), W_("match finder window; enables "
+				"long-range matching"));
 #endif
 
 		e |= tuklib_wrapf(stdout, &wrap2,
@@ -99,6 +99,13 @@ extern void message_filters_show(
 		enum message_verbosity v, const lzma_filter *filters);
 
 
+#ifdef MYTHREAD_ENABLED
+/// Print the statistics of the worker threads if strm is
+/// a multithreaded encoder or decoder.
+extern void message_mt_stats(enum message_verbosity v, lzma_stream *strm);
+#endif
+
+
 /// Print a message that user should try --help.
 extern void message_try_help(void);
 
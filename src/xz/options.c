@@ -239,6 +239,7 @@ enum {
 	OPT_NICE,
 	OPT_MF,
 	OPT_DEPTH,
+	OPT_WINDOW,
 };
 
 
@@ -312,6 +313,10 @@ set_lzma(void *options, unsigned key, uint64_t value, const char *valuestr)
 	case OPT_DEPTH:
 		opt->depth = value;
 		break;
+
+	case OPT_WINDOW:
+		opt->window_size = value;
+		break;
 	}
 }
 
@@ -328,6 +333,7 @@ options_lzma(const char *str)
 	static const name_id_map mfs[] = {
 		{ "hc3", LZMA_MF_HC3 },
 		{ "hc4", LZMA_MF_HC4 },
+		{ "hb4", LZMA_MF_HB4 },
 		{ "bt2", LZMA_MF_BT2 },
 		{ "bt3", LZMA_MF_BT3 },
 		{ "bt4", LZMA_MF_BT4 },
@@ -336,8 +342,7 @@ options_lzma(const char *str)
 
 	static const option_map opts[] = {
 		{ "preset", NULL,   UINT64_MAX, 0 },
-		{ "dict",   NULL,   LZMA_DICT_SIZE_MIN,
-				(UINT32_C(1) << 30) + (UINT32_C(1) << 29) },
+		{ "dict",   NULL,   LZMA_DICT_SIZE_MIN, UINT32_C(7) << 29 },
 		{ "lc",     NULL,   LZMA_LCLP_MIN, LZMA_LCLP_MAX },
 		{ "lp",     NULL,   LZMA_LCLP_MIN, LZMA_LCLP_MAX },
 		{ "pb",     NULL,   LZMA_PB_MIN, LZMA_PB_MAX },
@@ -345,6 +350,7 @@ options_lzma(const char *str)
 		{ "nice",   NULL,   2, 273 },
 		{ "mf",     mfs,    0, 0 },
 		{ "depth",  NULL,   0, UINT32_MAX },
+		{ "window", NULL,   LZMA_DICT_SIZE_MIN, UINT32_C(7) << 29 },
 		{ NULL,     NULL,   0, 0 }
 	};
 
@@ -352,10 +358,25 @@ options_lzma(const char *str)
 	if (lzma_lzma_preset(options, LZMA_PRESET_DEFAULT))
 		message_bug();
 
+	// A preset doesn't set window_size, so it stays zero
+	// unless window was specified.
+	options->window_size = 0;
+
 	parse_options(str, opts, &set_lzma, options);
 
 	if (options->lc + options->lp > LZMA_LCLP_MAX)
 		message_fatal(_("The sum of lc and lp must not exceed 4"));
 
+	// The window option enables the long-range match finder. This is
+	// done here because mf=NAME and preset=PRESET replace options->mf.
+	if (options->window_size != 0) {
+		if (options->window_size > options->dict_size)
+			message_fatal(_("The match finder window must not "
+					"be bigger than the dictionary"));
+
+		options->mf = (lzma_match_finder)(
+				options->mf | LZMA_MF_LONG_RANGE);
+	}
+
 	return options;
 }
@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_block_inplace.c
+/// \brief      Tests in-place decoding of .xz Blocks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+
+
+#define INPUT_SIZE (256U << 10)
+
+
+#if defined(HAVE_ENCODERS) && defined(HAVE_DECODERS)
+static uint8_t *input;
+
+
+// Fill input[] with data whose compressibility depends on kind:
+//   0  Text-like data that compresses well
+//   1  Random data that doesn't compress at all
+//   2  Zeros followed by random data. This is the worst case for
+//      in-place decoding because the end of the data expands.
+static void
+create_input(unsigned kind)
+{
+	uint32_t n = 5381;
+
+	for (size_t i = 0; i < INPUT_SIZE; ++i) {
+		n = n * 101771 + 12345;
+
+		switch (kind) {
+		case 0:
+			input[i] = (uint8_t)("lorem ipsum dolor sit amet\n"
+					[(n >> 16) % 27]);
+			break;
+
+		case 1:
+			input[i] = (uint8_t)(n >> 24);
+			break;
+
+		default:
+			input[i] = i < INPUT_SIZE / 2 ? 0 : (uint8_t)(n >> 24);
+			break;
+		}
+	}
+
+	return;
+}
+
+
+// Encode input[] as a Block to the end of a buffer that is
+// INPUT_SIZE + margin bytes, or big enough to hold the Block if that
+// is bigger. The Block Header is decoded into *block and filters[].
+static uint8_t *
+encode_block(lzma_block *block, lzma_filter *filters,
+		const lzma_filter *enc_filters, size_t margin,
+		size_t *buf_size, size_t *block_start)
+{
+	const size_t bound = lzma_block_buffer_bound(INPUT_SIZE);
+	uint8_t *tmp = tuktest_malloc(bound);
+	size_t tmp_size = 0;
+
+	lzma_block enc = {
+		.version = 1,
+		.check = LZMA_CHECK_CRC32,
+		.filters = (lzma_filter *)enc_filters,
+	};
+	assert_lzma_ret(lzma_block_buffer_encode(&enc, NULL, input,
+			INPUT_SIZE, tmp, &tmp_size, bound), LZMA_OK);
+
+	*buf_size = my_max(INPUT_SIZE + margin, tmp_size);
+	uint8_t *buf = tuktest_malloc(*buf_size);
+	*block_start = *buf_size - tmp_size;
+	memcpy(buf + *block_start, tmp, tmp_size);
+	tuktest_free(tmp);
+
+	*block = (lzma_block){
+		.version = 1,
+		.check = LZMA_CHECK_CRC32,
+		.header_size = lzma_block_header_size_decode(
+				buf[*block_start]),
+		.filters = filters,
+	};
+	assert_lzma_ret(lzma_block_header_decode(block, NULL,
+			buf + *block_start), LZMA_OK);
+
+	return buf;
+}
+#endif
+
+
+static void
+test_inplace_margin(void)
+{
+	assert_uint(lzma_block_inplace_margin(0), >, 0);
+	assert_uint(lzma_block_inplace_margin(1 << 20), >=,
+			lzma_block_inplace_margin(0));
+	assert_uint(lzma_block_inplace_margin(1 << 20), <, 1 << 20);
+
+	// The margin must not be too big to add to the size.
+	assert_uint_eq(lzma_block_inplace_margin(SIZE_MAX), 0);
+}
+
+
+static void
+test_inplace_decode(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1 << 16;
+
+	const lzma_filter lzma2_only[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const lzma_filter with_delta[] = {
+		{ .id = LZMA_FILTER_DELTA, .options = &(lzma_options_delta){
+			.type = LZMA_DELTA_TYPE_BYTE, .dist = 4 } },
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const size_t margin = lzma_block_inplace_margin(INPUT_SIZE);
+
+	for (unsigned kind = 0; kind < 3; ++kind) {
+		create_input(kind);
+
+		for (unsigned f = 0; f < 2; ++f) {
+			lzma_block block;
+			lzma_filter filters[LZMA_FILTERS_MAX + 1];
+			size_t buf_size;
+			size_t block_start;
+			uint8_t *buf = encode_block(&block, filters,
+					f == 0 ? lzma2_only : with_delta,
+					margin, &buf_size, &block_start);
+
+			size_t in_pos = block_start + block.header_size;
+			size_t out_pos = 0;
+			assert_lzma_ret(lzma_block_buffer_decode_inplace(
+					&block, NULL, buf, &in_pos, buf_size,
+					&out_pos, buf_size), LZMA_OK);
+			assert_uint_eq(in_pos, buf_size);
+			assert_uint_eq(out_pos, INPUT_SIZE);
+			assert_true(memcmp(buf, input, INPUT_SIZE) == 0);
+
+			lzma_filters_free(filters, NULL);
+			tuktest_free(buf);
+		}
+	}
+#endif
+}
+
+
+static void
+test_inplace_errors(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1 << 16;
+
+	const lzma_filter enc_filters[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	// The end of the data expands so without a margin the output
+	// would overwrite input that hasn't been read yet.
+	create_input(2);
+
+	lzma_block block;
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	size_t buf_size;
+	size_t block_start;
+	uint8_t *buf = encode_block(&block, filters, enc_filters, 0,
+			&buf_size, &block_start);
+	assert_uint_eq(buf_size, INPUT_SIZE);
+
+	const size_t in_start = block_start + block.header_size;
+	size_t in_pos = in_start;
+	size_t out_pos = 0;
+	assert_lzma_ret(lzma_block_buffer_decode_inplace(&block, NULL,
+			buf, &in_pos, buf_size, &out_pos, buf_size),
+			LZMA_BUF_ERROR);
+	assert_uint_eq(in_pos, in_start);
+	assert_uint_eq(out_pos, 0);
+
+	lzma_filters_free(filters, NULL);
+	tuktest_free(buf);
+
+	// With the margin it works. Test also the other errors.
+	buf = encode_block(&block, filters, enc_filters,
+			lzma_block_inplace_margin(INPUT_SIZE),
+			&buf_size, &block_start);
+
+	// The failed attempts overwrite the compressed data so keep a copy.
+	uint8_t *orig = tuktest_malloc(buf_size);
+	memcpy(orig, buf, buf_size);
+
+	in_pos = block_start + block.header_size;
+	out_pos = in_pos + 1;
+	assert_lzma_ret(lzma_block_buffer_decode_inplace(&block, NULL,
+			buf, &in_pos, buf_size, &out_pos, buf_size),
+			LZMA_PROG_ERROR);
+	assert_lzma_ret(lzma_block_buffer_decode_inplace(&block, NULL,
+			NULL, &in_pos, buf_size, &out_pos, buf_size),
+			LZMA_PROG_ERROR);
+
+	// Output buffer too small
+	out_pos = 0;
+	assert_lzma_ret(lzma_block_buffer_decode_inplace(&block, NULL,
+			buf, &in_pos, buf_size, &out_pos, INPUT_SIZE - 1),
+			LZMA_BUF_ERROR);
+
+	// Truncated input
+	memcpy(buf, orig, buf_size);
+	assert_lzma_ret(lzma_block_buffer_decode_inplace(&block, NULL,
+			buf, &in_pos, buf_size - 1, &out_pos, buf_size),
+			LZMA_DATA_ERROR);
+
+	memcpy(buf, orig, buf_size);
+	assert_lzma_ret(lzma_block_buffer_decode_inplace(&block, NULL,
+			buf, &in_pos, buf_size, &out_pos, buf_size),
+			LZMA_OK);
+	assert_uint_eq(out_pos, INPUT_SIZE);
+	assert_true(memcmp(buf, input, INPUT_SIZE) == 0);
+
+	lzma_filters_free(filters, NULL);
+	tuktest_free(orig);
+	tuktest_free(buf);
+#endif
+}
+
+
+extern int
+main(int argc, char **argv)
+{
+	tuktest_start(argc, argv);
+
+#if defined(HAVE_ENCODERS) && defined(HAVE_DECODERS)
+	input = tuktest_malloc(INPUT_SIZE);
+#endif
+
+	tuktest_run(test_inplace_margin);
+	tuktest_run(test_inplace_decode);
+	tuktest_run(test_inplace_errors);
+
+	return tuktest_end();
+}
@@ -0,0 +1,597 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_match_finder.c
+/// \brief      Tests the match finder variants of the LZMA2 encoder
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+
+
+#define INPUT_SIZE (640U << 10)
+
+// The smallest dictionary makes the history buffer small enough that
+// the window gets moved with INPUT_SIZE bytes of input.
+#define DICT_SIZE LZMA_DICT_SIZE_MIN
+
+// The bt4x match finder isn't in the public API. See lz_encoder.h.
+// Don't put LZMA_ at the beginning of the name so that it is obvious
+// that this constant doesn't come from the API headers.
+#define MF_BT4X ((lzma_match_finder)0x34)
+
+#if defined(HAVE_ENCODER_LZMA2) && defined(HAVE_DECODER_LZMA2)
+static const lzma_match_finder match_finders[] = {
+	LZMA_MF_HC3,
+	LZMA_MF_HC4,
+	LZMA_MF_HB4,
+	LZMA_MF_BT2,
+	LZMA_MF_BT3,
+	LZMA_MF_BT4,
+	MF_BT4X,
+};
+
+static uint8_t *input;
+
+// The number of bytes of input[] that encode() and verify_decode() use.
+// Only the tests that need the window to move use all of INPUT_SIZE.
+static size_t input_size = INPUT_SIZE;
+#endif
+
+
+#if defined(HAVE_ENCODER_LZMA2) && defined(HAVE_DECODER_LZMA2)
+// Compress input_size bytes of input[] with the raw LZMA2 encoder using
+// strm. At most in_chunk bytes are passed per lzma_code() call. If
+// flush_every is non-zero, LZMA_SYNC_FLUSH is done after every
+// flush_every bytes of input.
+static uint8_t *
+encode(lzma_stream *strm, const lzma_options_lzma *opt, size_t in_chunk,
+		size_t flush_every, size_t *out_size)
+{
+	const lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = (void *)opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	assert_lzma_ret(lzma_raw_encoder(strm, filters), LZMA_OK);
+
+	const size_t out_max = input_size + input_size / 4 + 4096;
+	uint8_t *out = tuktest_malloc(out_max);
+
+	size_t in_pos = 0;
+	size_t flush_pos = flush_every;
+	lzma_ret ret;
+
+	strm->next_out = out;
+	strm->avail_out = out_max;
+
+	do {
+		size_t in_end = input_size;
+		lzma_action action = LZMA_FINISH;
+
+		if (flush_every != 0 && flush_pos < input_size) {
+			in_end = flush_pos;
+			action = LZMA_SYNC_FLUSH;
+		}
+
+		const size_t avail_in = my_min(in_chunk, in_end - in_pos);
+		if (avail_in < in_end - in_pos)
+			action = LZMA_RUN;
+
+		strm->next_in = input + in_pos;
+		strm->avail_in = avail_in;
+
+		ret = lzma_code(strm, action);
+		in_pos += avail_in - strm->avail_in;
+
+		if (ret == LZMA_STREAM_END && action == LZMA_SYNC_FLUSH) {
+			flush_pos += flush_every;
+			ret = LZMA_OK;
+		}
+	} while (ret == LZMA_OK);
+
+	assert_lzma_ret(ret, LZMA_STREAM_END);
+	assert_uint_eq(in_pos, input_size);
+
+	*out_size = strm->total_out;
+	return out;
+}
+
+
+static void
+verify_decode(const lzma_options_lzma *opt, const uint8_t *in,
+		size_t in_size)
+{
+	const lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = (void *)opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	uint8_t *out = tuktest_malloc(input_size);
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+
+	assert_lzma_ret(lzma_raw_buffer_decode(filters, NULL, in, &in_pos,
+			in_size, out, &out_pos, input_size), LZMA_OK);
+	assert_uint_eq(in_pos, in_size);
+	assert_uint_eq(out_pos, input_size);
+	assert_true(memcmp(out, input, input_size) == 0);
+
+	tuktest_free(out);
+	return;
+}
+#endif
+
+
+static void
+test_mf_threaded(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2) || !defined(HAVE_DECODER_LZMA2)
+	assert_skip("LZMA2 encoder or decoder support disabled");
+#else
+	static const uint8_t preset_dict[] = "lorem ipsum dolor sit amet, ";
+
+	// The same lzma_stream is used for the threaded encoder every time
+	// to test that the thread is reused and reset correctly.
+	lzma_stream strm_threaded = LZMA_STREAM_INIT;
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+	for (size_t i = 0; i < ARRAY_SIZE(match_finders); ++i) {
+		if (!lzma_mf_is_supported(match_finders[i]))
+			continue;
+
+		assert_true(lzma_mf_is_supported((lzma_match_finder)(
+				match_finders[i] | LZMA_MF_THREADED)));
+		assert_false(lzma_mf_is_supported((lzma_match_finder)(
+				match_finders[i] | LZMA_MF_THREADED
+				| LZMA_MF_RESET_INTERVAL)));
+
+		for (unsigned j = 0; j < 2; ++j) {
+			// The normal mode asks the match finder for
+			// every position. A short nice_len keeps it fast.
+			lzma_options_lzma opt;
+			assert_false(lzma_lzma_preset(&opt, 1));
+			opt.dict_size = DICT_SIZE;
+			opt.mf = match_finders[i];
+
+			if ((i + j) & 1) {
+				opt.mode = LZMA_MODE_NORMAL;
+				opt.nice_len = 16;
+			}
+
+			// Small chunks together with frequent flushing
+			// test restarting the match finder after
+			// LZMA_SYNC_FLUSH. That doesn't need the window
+			// to move so less input is enough. Big chunks
+			// let the thread get further ahead of the encoder.
+			if (j & 1) {
+				opt.preset_dict = preset_dict;
+				opt.preset_dict_size = sizeof(preset_dict);
+				input_size = INPUT_SIZE / 5;
+			}
+
+			const size_t in_chunk = j & 1 ? 777 : SIZE_MAX;
+			const size_t flush_every = j & 1 ? 54321 : 0;
+
+			size_t expected_size;
+			uint8_t *expected = encode(&strm, &opt, in_chunk,
+					flush_every, &expected_size);
+
+			opt.mf = (lzma_match_finder)(
+					opt.mf | LZMA_MF_THREADED);
+
+			size_t out_size;
+			uint8_t *out = encode(&strm_threaded, &opt, in_chunk,
+					flush_every, &out_size);
+
+			assert_uint_eq(out_size, expected_size);
+			assert_true(memcmp(out, expected, out_size) == 0);
+
+			verify_decode(&opt, out, out_size);
+
+			tuktest_free(out);
+			tuktest_free(expected);
+			input_size = INPUT_SIZE;
+		}
+	}
+
+	lzma_end(&strm);
+	lzma_end(&strm_threaded);
+#endif
+}
+
+
+static void
+test_mf_bt4x(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2) || !defined(HAVE_DECODER_LZMA2)
+	assert_skip("LZMA2 encoder or decoder support disabled");
+#else
+	if (!lzma_mf_is_supported(LZMA_MF_BT4)
+			|| !lzma_mf_is_supported(MF_BT4X))
+		assert_skip("bt4 or bt4x match finder support disabled");
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+	// The window doesn't need to move to test the cached bytes.
+	input_size = INPUT_SIZE / 5;
+
+	// The cached bytes in the tree nodes must not change the matches
+	// that are found. With nice_len >= 8 the output must be identical
+	// to bt4 even with flushing.
+	for (unsigned i = 0; i < 4; ++i) {
+		lzma_options_lzma opt;
+		assert_false(lzma_lzma_preset(&opt, i & 1 ? 9 : 4));
+		opt.dict_size = DICT_SIZE;
+		opt.mf = LZMA_MF_BT4;
+
+		if (i & 2)
+			opt.nice_len = 8;
+
+		const size_t in_chunk = i & 2 ? 777 : SIZE_MAX;
+		const size_t flush_every = i & 2 ? 54321 : 0;
+
+		size_t expected_size;
+		uint8_t *expected = encode(&strm, &opt, in_chunk,
+				flush_every, &expected_size);
+
+		opt.mf = MF_BT4X;
+
+		size_t out_size;
+		uint8_t *out = encode(&strm, &opt, in_chunk, flush_every,
+				&out_size);
+
+		assert_uint_eq(out_size, expected_size);
+		assert_true(memcmp(out, expected, out_size) == 0);
+
+		tuktest_free(out);
+		tuktest_free(expected);
+	}
+
+	// With nice_len < 8 and flushing the output may differ but
+	// it must still decode correctly.
+	lzma_options_lzma opt;
+	assert_false(lzma_lzma_preset(&opt, 6));
+	opt.dict_size = DICT_SIZE;
+	opt.mf = MF_BT4X;
+	opt.nice_len = 5;
+
+	size_t out_size;
+	uint8_t *out = encode(&strm, &opt, 777, 12345, &out_size);
+	verify_decode(&opt, out, out_size);
+	tuktest_free(out);
+
+	lzma_end(&strm);
+	input_size = INPUT_SIZE;
+#endif
+}
+
+
+static void
+test_mf_bt4x_memusage(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2)
+	assert_skip("LZMA2 encoder support disabled");
+#else
+	if (!lzma_mf_is_supported(LZMA_MF_BT4)
+			|| !lzma_mf_is_supported(MF_BT4X))
+		assert_skip("bt4 or bt4x match finder support disabled");
+
+	lzma_options_lzma opt;
+	assert_false(lzma_lzma_preset(&opt, 6));
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const uint64_t memusage = lzma_raw_encoder_memusage(filters);
+	assert_true(memusage != UINT64_MAX);
+
+	// The nodes use eight more bytes per dictionary byte.
+	opt.mf = MF_BT4X;
+	assert_uint_eq(lzma_raw_encoder_memusage(filters),
+			memusage + 8 * ((uint64_t)opt.dict_size + 1));
+
+	// The whole 3.5 GiB dictionary is supported even though son[] has
+	// more than 2^32 elements.
+	opt.dict_size = UINT32_C(7) << 29;
+	assert_true(lzma_raw_encoder_memusage(filters)
+			> 18 * (uint64_t)opt.dict_size);
+#endif
+}
+
+
+static void
+test_mf_hb4(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2) || !defined(HAVE_DECODER_LZMA2)
+	assert_skip("LZMA2 encoder or decoder support disabled");
+#else
+	if (!lzma_mf_is_supported(LZMA_MF_HB4))
+		assert_skip("hb4 match finder support disabled");
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+	// The buckets are the main hash table so they must be cleared
+	// at every reset. Otherwise matches to the data before the reset
+	// would be found and decoding would fail. The dictionary is bigger
+	// than the reset interval so that such matches would be in range.
+	for (unsigned i = 0; i < 2; ++i) {
+		lzma_options_lzma opt;
+		assert_false(lzma_lzma_preset(&opt, i == 0 ? 1 : 6));
+		opt.dict_size = 1U << 16;
+		opt.mf = (lzma_match_finder)(
+				LZMA_MF_HB4 | LZMA_MF_RESET_INTERVAL);
+		opt.reset_interval = 1U << 14;
+
+		size_t out_size;
+		uint8_t *out = encode(&strm, &opt, SIZE_MAX, 0, &out_size);
+		verify_decode(&opt, out, out_size);
+		tuktest_free(out);
+	}
+
+	lzma_end(&strm);
+#endif
+}
+
+
+static void
+test_mf_hb4_memusage(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2)
+	assert_skip("LZMA2 encoder support disabled");
+#else
+	if (!lzma_mf_is_supported(LZMA_MF_HC4)
+			|| !lzma_mf_is_supported(LZMA_MF_HB4))
+		assert_skip("hc4 or hb4 match finder support disabled");
+
+	lzma_options_lzma opt;
+	assert_false(lzma_lzma_preset(&opt, 1));
+	opt.mf = LZMA_MF_HC4;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const uint64_t memusage = lzma_raw_encoder_memusage(filters);
+	assert_true(memusage != UINT64_MAX);
+
+	// With a dictionary size that is a power of two, hc4 needs six
+	// bytes per dictionary byte for the hash chains and the 4-byte
+	// hash table, and hb4 needs eight for the buckets. Up to 64 bytes
+	// are used for aligning the buckets.
+	opt.mf = LZMA_MF_HB4;
+	const uint64_t memusage_hb4 = lzma_raw_encoder_memusage(filters);
+	assert_true(memusage_hb4 >= memusage + 2 * (uint64_t)opt.dict_size);
+	assert_true(memusage_hb4 < memusage + 2 * (uint64_t)opt.dict_size
+			+ 64);
+#endif
+}
+
+
+static void
+test_mf_long_range(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2) || !defined(HAVE_DECODER_LZMA2)
+	assert_skip("LZMA2 encoder or decoder support disabled");
+#else
+	if (!lzma_mf_is_supported(LZMA_MF_HC4))
+		assert_skip("hc4 match finder support disabled");
+
+	// Random data where the last 200 KiB repeat the first 200 KiB.
+	// The repeat is much further away than the match finder window.
+	// encode() and verify_decode() use input[] so replace it for
+	// this test.
+	uint8_t *const normal_input = input;
+	input = tuktest_malloc(INPUT_SIZE);
+
+	uint32_t n = 5381;
+	for (size_t i = 0; i < INPUT_SIZE - (200U << 10); ++i) {
+		n = n * 101771 + 12345;
+		input[i] = (uint8_t)(n >> 22);
+	}
+
+	memcpy(input + INPUT_SIZE - (200U << 10), input, 200U << 10);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_stream strm_threaded = LZMA_STREAM_INIT;
+
+	lzma_options_lzma opt;
+	assert_false(lzma_lzma_preset(&opt, 1));
+	opt.dict_size = 1U << 20;
+	opt.mf = (lzma_match_finder)(LZMA_MF_HC4 | LZMA_MF_LONG_RANGE);
+	opt.window_size = LZMA_DICT_SIZE_MIN;
+
+	size_t out_size;
+	uint8_t *out = encode(&strm, &opt, 777, 0, &out_size);
+	verify_decode(&opt, out, out_size);
+
+	// Almost all of the repeat must have been found.
+	assert_true(out_size < INPUT_SIZE - (200U << 10) + (8U << 10));
+
+	// The match finder thread doesn't change the output.
+	opt.mf = (lzma_match_finder)(opt.mf | LZMA_MF_THREADED);
+	size_t out_threaded_size;
+	uint8_t *out_threaded = encode(&strm_threaded, &opt, SIZE_MAX, 0,
+			&out_threaded_size);
+	assert_uint_eq(out_threaded_size, out_size);
+	assert_true(memcmp(out_threaded, out, out_size) == 0);
+	tuktest_free(out_threaded);
+	tuktest_free(out);
+
+	// The anchors must be forgotten at every reset. With a reset
+	// in the middle, the repeat cannot be found.
+	opt.mf = (lzma_match_finder)(LZMA_MF_HC4 | LZMA_MF_LONG_RANGE
+			| LZMA_MF_RESET_INTERVAL);
+	opt.reset_interval = INPUT_SIZE / 2;
+	out = encode(&strm, &opt, SIZE_MAX, 12345, &out_size);
+	verify_decode(&opt, out, out_size);
+	assert_true(out_size > INPUT_SIZE);
+	tuktest_free(out);
+
+	lzma_end(&strm);
+	lzma_end(&strm_threaded);
+
+	tuktest_free(input);
+	input = normal_input;
+#endif
+}
+
+
+static void
+test_mf_long_range_memusage(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2)
+	assert_skip("LZMA2 encoder support disabled");
+#else
+	lzma_options_lzma opt;
+	assert_false(lzma_lzma_preset(&opt, 6));
+	opt.dict_size = 64U << 20;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const uint64_t memusage = lzma_raw_encoder_memusage(filters);
+	assert_true(memusage != UINT64_MAX);
+
+	// The anchor table needs dict_size / 32 bytes.
+	opt.mf = (lzma_match_finder)(opt.mf | LZMA_MF_LONG_RANGE);
+	opt.window_size = opt.dict_size;
+	assert_uint_eq(lzma_raw_encoder_memusage(filters),
+			memusage + opt.dict_size / 32);
+
+	// A small window makes the match finder much smaller.
+	opt.window_size = 1U << 20;
+	assert_true(lzma_raw_encoder_memusage(filters) < memusage / 4);
+
+	// The window must be at least LZMA_DICT_SIZE_MIN and at most
+	// dict_size.
+	opt.window_size = LZMA_DICT_SIZE_MIN - 1;
+	assert_uint_eq(lzma_raw_encoder_memusage(filters), UINT64_MAX);
+
+	opt.window_size = opt.dict_size + 1;
+	assert_uint_eq(lzma_raw_encoder_memusage(filters), UINT64_MAX);
+#endif
+}
+
+
+static void
+test_mf_dict_size_max(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2)
+	assert_skip("LZMA2 encoder support disabled");
+#else
+	lzma_options_lzma opt;
+	assert_false(lzma_lzma_preset(&opt, 6));
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	// Dictionaries up to 3.5 GiB are supported by all match finders.
+	// The memory usage per dictionary byte stays about the same as
+	// with 1 GiB. The counts of the elements in son[] don't fit
+	// in uint32_t with the binary trees.
+	static const lzma_match_finder mfs[] = {
+		LZMA_MF_HC3, LZMA_MF_HC4, LZMA_MF_HB4,
+		LZMA_MF_BT2, LZMA_MF_BT3, LZMA_MF_BT4, MF_BT4X,
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(mfs); ++i) {
+		if (!lzma_mf_is_supported(mfs[i]))
+			continue;
+
+		opt.mf = mfs[i];
+		opt.dict_size = UINT32_C(1) << 30;
+		const uint64_t memusage_1g
+				= lzma_raw_encoder_memusage(filters);
+		assert_true(memusage_1g != UINT64_MAX);
+
+		opt.dict_size = UINT32_C(7) << 29;
+		const uint64_t memusage_max
+				= lzma_raw_encoder_memusage(filters);
+		assert_true(memusage_max != UINT64_MAX);
+		assert_true(memusage_max > 3 * memusage_1g);
+		assert_true(memusage_max <= 4 * memusage_1g);
+
+		++opt.dict_size;
+		assert_uint_eq(lzma_raw_encoder_memusage(filters),
+				UINT64_MAX);
+	}
+
+	// With the long-range match finder the memory usage is mostly
+	// the history buffer which has to stay below 4 GiB.
+	if (lzma_mf_is_supported(LZMA_MF_HC4)) {
+		opt.mf = (lzma_match_finder)(
+				LZMA_MF_HC4 | LZMA_MF_LONG_RANGE);
+		opt.dict_size = UINT32_C(7) << 29;
+		opt.window_size = 64U << 20;
+		const uint64_t memusage = lzma_raw_encoder_memusage(filters);
+		assert_true(memusage > (uint64_t)opt.dict_size
+				+ opt.dict_size / 32);
+		assert_true(memusage < (UINT64_C(9) << 29));
+	}
+#endif
+}
+
+
+static void
+test_mf_threaded_memusage(void)
+{
+#if !defined(HAVE_ENCODER_LZMA2)
+	assert_skip("LZMA2 encoder support disabled");
+#else
+	lzma_options_lzma opt;
+	assert_false(lzma_lzma_preset(&opt, 6));
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const uint64_t memusage = lzma_raw_encoder_memusage(filters);
+	assert_true(memusage != UINT64_MAX);
+
+	opt.mf = (lzma_match_finder)(opt.mf | LZMA_MF_THREADED);
+	const uint64_t memusage_threaded = lzma_raw_encoder_memusage(filters);
+
+	// The match finder thread needs less than a mebibyte of memory.
+	assert_true(memusage_threaded >= memusage);
+	assert_true(memusage_threaded < memusage + (1 << 20));
+
+	// Unknown flags are still rejected.
+	opt.mf = (lzma_match_finder)(LZMA_MF_BT4 | 0x800);
+	assert_uint_eq(lzma_raw_encoder_memusage(filters), UINT64_MAX);
+	assert_false(lzma_mf_is_supported(opt.mf));
+#endif
+}
+
+
+extern int
+main(int argc, char **argv)
+{
+	tuktest_start(argc, argv);
+
+#if defined(HAVE_ENCODER_LZMA2) && defined(HAVE_DECODER_LZMA2)
+	input = tuktest_malloc(INPUT_SIZE);
+	create_test_input(input, INPUT_SIZE, 16);
+#endif
+
+	tuktest_run(test_mf_threaded);
+	tuktest_run(test_mf_threaded_memusage);
+	tuktest_run(test_mf_bt4x);
+	tuktest_run(test_mf_bt4x_memusage);
+	tuktest_run(test_mf_hb4);
+	tuktest_run(test_mf_hb4_memusage);
+	tuktest_run(test_mf_long_range);
+	tuktest_run(test_mf_long_range_memusage);
+	tuktest_run(test_mf_dict_size_max);
+
+	return tuktest_end();
+}
@@ -156,6 +156,70 @@ test_memlimit_auto_decoder(void)
 }
 
 
+static void
+test_memlimit_known_size(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	// lzma_stream_buffer_encode() stores the Uncompressed Size in
+	// the Block Header. The decoder doesn't need the 64 MiB
+	// dictionary for the sizeof(out) bytes of data.
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 9));
+	assert_uint_eq(opt_lzma.dict_size, 64U << 20);
+
+	lzma_filter filters[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	uint8_t data[sizeof(out)];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = (uint8_t)(i * i);
+
+	uint8_t comp[sizeof(data) + 1024];
+	size_t comp_size = 0;
+	assert_lzma_ret(lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32,
+			NULL, data, sizeof(data), comp, &comp_size,
+			sizeof(comp)), LZMA_OK);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_decoder(&strm, MEMLIMIT_HIGH_ENOUGH, 0),
+			LZMA_OK);
+
+	strm.next_in = comp;
+	strm.avail_in = comp_size;
+	strm.next_out = out;
+	strm.avail_out = sizeof(out);
+
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+	assert_true(lzma_memusage(&strm) < MEMLIMIT_HIGH_ENOUGH);
+	assert_true(memcmp(out, data, sizeof(data)) == 0);
+	lzma_end(&strm);
+
+#	ifdef MYTHREAD_ENABLED
+	lzma_mt mt = {
+		.threads = 2,
+		.memlimit_threading = MEMLIMIT_HIGH_ENOUGH,
+		.memlimit_stop = MEMLIMIT_HIGH_ENOUGH,
+	};
+
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt), LZMA_OK);
+
+	strm.next_in = comp;
+	strm.avail_in = comp_size;
+	strm.next_out = out;
+	strm.avail_out = sizeof(out);
+
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+	assert_true(memcmp(out, data, sizeof(data)) == 0);
+	lzma_end(&strm);
+#	endif
+#endif
+}
+
+
 extern int
 main(int argc, char **argv)
 {
@@ -167,6 +231,7 @@ main(int argc, char **argv)
 	tuktest_run(test_memlimit_stream_decoder_mt);
 	tuktest_run(test_memlimit_alone_decoder);
 	tuktest_run(test_memlimit_auto_decoder);
+	tuktest_run(test_memlimit_known_size);
 
 	return tuktest_end();
 }
@@ -110,8 +110,8 @@ test_encode_options(void)
 			LZMA_OPTIONS_ERROR);
 
 	// Maximum dictionary size for the encoder, as described in lzma12.h
-	// is 1.5 GiB.
-	opt_lzma.dict_size = (UINT32_C(1) << 30) + (UINT32_C(1) << 29) + 1;
+	// is 3.5 GiB.
+	opt_lzma.dict_size = (UINT32_C(7) << 29) + 1;
 	assert_lzma_ret(lzma_microlzma_encoder(&strm, &opt_lzma),
 			LZMA_OPTIONS_ERROR);
 
@@ -0,0 +1,683 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_seekable_decoder.c
+/// \brief      Tests the seekable decoder
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+
+
+#define INPUT_SIZE (3U << 19)
+
+// Uncompressed size of each Block in the test file
+#define BLOCK_SIZE (1U << 17)
+
+#if defined(HAVE_ENCODERS) && defined(HAVE_DECODERS)
+static uint8_t *input;
+
+// Two Streams with Stream Padding between them. The first Stream has
+// INPUT_SIZE / 2 bytes in Blocks of BLOCK_SIZE bytes, the second one
+// has the rest in a single Block.
+static uint8_t *file;
+static size_t file_size;
+
+// Statistics from the read callback
+typedef struct {
+	const uint8_t *buf;
+	size_t size;
+	uint64_t bytes_read;
+	uint32_t calls;
+
+	// If non-zero, the callback fails with this value.
+	lzma_ret fail;
+} read_state;
+
+
+// Encode input[in_start] to input[in_end - 1] as one Stream to the end
+// of file[]. A new Block is started every block_size bytes with
+// LZMA_FULL_FLUSH so the Block Headers don't contain the sizes.
+static void
+encode_stream(size_t in_start, size_t in_end, size_t block_size,
+		lzma_check check)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_easy_encoder(&strm, 1, check), LZMA_OK);
+
+	const size_t out_max = lzma_stream_buffer_bound(INPUT_SIZE) * 2;
+	size_t in_pos = in_start;
+
+	while (true) {
+		const size_t in_stop = my_min(in_end, in_pos + block_size);
+		const lzma_action action = in_stop == in_end
+				? LZMA_FINISH : LZMA_FULL_FLUSH;
+
+		strm.next_in = input + in_pos;
+		strm.avail_in = in_stop - in_pos;
+		strm.next_out = file + file_size;
+		strm.avail_out = out_max - file_size;
+
+		const lzma_ret ret = lzma_code(&strm, action);
+		file_size = (size_t)(strm.next_out - file);
+		in_pos = in_stop;
+
+		assert_lzma_ret(ret, LZMA_STREAM_END);
+		if (action == LZMA_FINISH)
+			break;
+	}
+
+	lzma_end(&strm);
+	return;
+}
+
+
+static void
+create_file(void)
+{
+	file = tuktest_malloc(lzma_stream_buffer_bound(INPUT_SIZE) * 2);
+	file_size = 0;
+
+	encode_stream(0, INPUT_SIZE / 2, BLOCK_SIZE, LZMA_CHECK_CRC32);
+
+	// Stream Padding
+	memzero(file + file_size, 8);
+	file_size += 8;
+
+	encode_stream(INPUT_SIZE / 2, INPUT_SIZE, INPUT_SIZE,
+			LZMA_CHECK_CRC64);
+	return;
+}
+
+
+static lzma_ret
+read_callback(void *opaque, uint8_t *buf, size_t size, uint64_t pos)
+{
+	read_state *rs = opaque;
+
+	assert_true(pos <= rs->size);
+	assert_true(size <= rs->size - pos);
+
+	++rs->calls;
+	rs->bytes_read += size;
+
+	if (rs->fail != LZMA_OK)
+		return rs->fail;
+
+	memcpy(buf, rs->buf + pos, size);
+	return LZMA_OK;
+}
+
+
+// This doesn't update the statistics so it is safe to use from
+// multiple threads.
+static lzma_ret
+read_callback_mt(void *opaque, uint8_t *buf, size_t size, uint64_t pos)
+{
+	const read_state *rs = opaque;
+	memcpy(buf, rs->buf + pos, size);
+	return LZMA_OK;
+}
+
+
+static lzma_seekable *
+seekable_init_cache(read_state *rs, const uint8_t *buf, size_t size,
+		uint32_t flags, uint64_t memlimit, uint64_t cache_size)
+{
+	*rs = (read_state){ .buf = buf, .size = size };
+
+	const lzma_seekable_options options = {
+		.read = (flags & LZMA_SEEKABLE_PREFETCH)
+				? &read_callback_mt : &read_callback,
+		.opaque = rs,
+		.file_size = size,
+		.memlimit = memlimit,
+		.flags = flags,
+		.cache_size = cache_size,
+	};
+
+	lzma_seekable *s = NULL;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL), LZMA_OK);
+	assert_true(s != NULL);
+	return s;
+}
+
+
+static lzma_seekable *
+seekable_init(read_state *rs, const uint8_t *buf, size_t size,
+		uint32_t flags, uint64_t memlimit)
+{
+	return seekable_init_cache(rs, buf, size, flags, memlimit, 0);
+}
+
+
+// Read size bytes from pos and compare them to the input.
+static void
+read_and_compare(lzma_seekable *s, uint64_t pos, size_t size)
+{
+	uint8_t *buf = tuktest_malloc(size + 1);
+	size_t buf_pos = 0;
+
+	assert_lzma_ret(lzma_seekable_read(s, pos, buf, &buf_pos, size + 1),
+			LZMA_OK);
+
+	const size_t expected = (size_t)my_min(size + 1, INPUT_SIZE - pos);
+	assert_uint_eq(buf_pos, expected);
+	assert_true(memcmp(buf, input + pos, expected) == 0);
+
+	tuktest_free(buf);
+	return;
+}
+
+
+// Replace the CRC32 in the last four bytes of a checkpoint sidecar.
+static void
+update_crc32(uint8_t *buf, size_t size)
+{
+	const uint32_t crc = lzma_crc32(buf, size - 4, 0);
+	buf[size - 4] = (uint8_t)crc;
+	buf[size - 3] = (uint8_t)(crc >> 8);
+	buf[size - 2] = (uint8_t)(crc >> 16);
+	buf[size - 1] = (uint8_t)(crc >> 24);
+	return;
+}
+#endif
+
+
+static void
+test_seekable_init(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	read_state rs = { .buf = file, .size = file_size };
+	lzma_seekable_options options = {
+		.read = &read_callback,
+		.opaque = &rs,
+		.file_size = file_size,
+		.memlimit = UINT64_MAX,
+	};
+
+	lzma_seekable *s = NULL;
+	assert_lzma_ret(lzma_seekable_decoder(NULL, &options, NULL),
+			LZMA_PROG_ERROR);
+	assert_lzma_ret(lzma_seekable_decoder(&s, NULL, NULL),
+			LZMA_PROG_ERROR);
+
+	options.read = NULL;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL),
+			LZMA_PROG_ERROR);
+	options.read = &read_callback;
+
+	options.flags = LZMA_CONCATENATED;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL),
+			LZMA_OPTIONS_ERROR);
+	options.flags = 0;
+
+	// Errors from the callback are passed through.
+	rs.fail = LZMA_BUF_ERROR;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL),
+			LZMA_BUF_ERROR);
+	rs.fail = LZMA_OK;
+
+	// Too low memory usage limit for the Index
+	options.memlimit = 1;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL),
+			LZMA_MEMLIMIT_ERROR);
+	options.memlimit = UINT64_MAX;
+
+	// Not .xz
+	static const uint8_t not_xz[64] = { 0 };
+	rs.buf = not_xz;
+	rs.size = sizeof(not_xz);
+	options.file_size = sizeof(not_xz);
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL),
+			LZMA_FORMAT_ERROR);
+
+	// Truncated file
+	rs.buf = file;
+	rs.size = file_size - 1;
+	options.file_size = file_size - 1;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL),
+			LZMA_DATA_ERROR);
+
+	// The whole Index information is available after init.
+	rs.size = file_size;
+	options.file_size = file_size;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL), LZMA_OK);
+
+	const lzma_index *idx = lzma_seekable_index(s);
+	assert_uint_eq(lzma_index_uncompressed_size(idx), INPUT_SIZE);
+	assert_uint_eq(lzma_index_stream_count(idx), 2);
+	assert_uint_eq(lzma_index_block_count(idx),
+			INPUT_SIZE / 2 / BLOCK_SIZE + 1);
+	assert_uint_eq(lzma_index_file_size(idx), file_size);
+
+	// No Blocks were read.
+	assert_true(rs.bytes_read < file_size / 4);
+
+	lzma_seekable_end(s);
+	lzma_seekable_end(NULL);
+#endif
+}
+
+
+static void
+test_seekable_read(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	read_state rs;
+	lzma_seekable *s = seekable_init(&rs, file, file_size, 0,
+			UINT64_MAX);
+
+	uint8_t buf[1];
+	size_t buf_pos = 0;
+	assert_lzma_ret(lzma_seekable_read(s, 0, NULL, &buf_pos, 0), LZMA_OK);
+	assert_lzma_ret(lzma_seekable_read(NULL, 0, buf, &buf_pos, 1),
+			LZMA_PROG_ERROR);
+	assert_lzma_ret(lzma_seekable_read(s, 0, NULL, &buf_pos, 1),
+			LZMA_PROG_ERROR);
+	assert_lzma_ret(lzma_seekable_read(s, 0, buf, NULL, 1),
+			LZMA_PROG_ERROR);
+
+	// Nothing is read at or past the end.
+	assert_lzma_ret(lzma_seekable_read(s, INPUT_SIZE, buf, &buf_pos, 1),
+			LZMA_OK);
+	assert_lzma_ret(lzma_seekable_read(s, UINT64_MAX, buf, &buf_pos, 1),
+			LZMA_OK);
+	assert_uint_eq(buf_pos, 0);
+
+	// A small read from the middle of the first Stream reads only
+	// the Block that contains it.
+	const uint64_t bytes_read = rs.bytes_read;
+	read_and_compare(s, 3 * BLOCK_SIZE + 12345, 4096);
+	assert_true(rs.bytes_read - bytes_read < file_size / 8);
+
+	// Backwards, across Blocks, and across Streams
+	read_and_compare(s, BLOCK_SIZE - 100, 200);
+	read_and_compare(s, 5, 3 * BLOCK_SIZE);
+	read_and_compare(s, INPUT_SIZE / 2 - 1000, 2000);
+	read_and_compare(s, INPUT_SIZE - 10, 20);
+	read_and_compare(s, INPUT_SIZE / 2 + 12345, 1);
+
+	// Pseudorandom reads
+	uint32_t n = 123;
+	for (unsigned i = 0; i < 50; ++i) {
+		n = n * 101771 + 12345;
+		const uint64_t pos = n % INPUT_SIZE;
+		n = n * 101771 + 12345;
+		read_and_compare(s, pos, n % 10000);
+	}
+
+	// Sequential reads in small pieces continue decoding where the
+	// previous read stopped.
+	uint8_t *out = tuktest_malloc(INPUT_SIZE);
+	size_t out_pos = 0;
+	while (out_pos < INPUT_SIZE) {
+		const size_t out_size = my_min(INPUT_SIZE, out_pos + 3333);
+		assert_lzma_ret(lzma_seekable_read(s, out_pos, out,
+				&out_pos, out_size), LZMA_OK);
+		assert_uint_eq(out_pos, out_size);
+	}
+
+	assert_true(memcmp(out, input, INPUT_SIZE) == 0);
+	tuktest_free(out);
+
+	lzma_seekable_end(s);
+#endif
+}
+
+
+static void
+test_seekable_errors(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	// The Index is fine but the last byte of the CRC32 of the second
+	// Block is wrong. Only reads that reach the end of that Block fail.
+	uint8_t *bad = tuktest_malloc(file_size);
+	memcpy(bad, file, file_size);
+
+	read_state rs;
+	lzma_seekable *s = seekable_init(&rs, bad, file_size, 0, UINT64_MAX);
+
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, lzma_seekable_index(s));
+	assert_false(lzma_index_iter_locate(&iter, BLOCK_SIZE));
+	bad[iter.block.compressed_file_offset + iter.block.total_size - 1]
+			^= 0x01;
+
+	read_and_compare(s, BLOCK_SIZE, 1000);
+
+	uint8_t *out = tuktest_malloc(BLOCK_SIZE);
+	size_t out_pos = 0;
+	assert_lzma_ret(lzma_seekable_read(s, BLOCK_SIZE + 1000, out,
+			&out_pos, BLOCK_SIZE), LZMA_DATA_ERROR);
+
+	// The Blocks before and after it can still be read.
+	read_and_compare(s, 0, BLOCK_SIZE);
+	read_and_compare(s, 2 * BLOCK_SIZE, BLOCK_SIZE);
+
+	// The callback errors are passed through.
+	rs.fail = LZMA_BUF_ERROR;
+	out_pos = 0;
+	assert_lzma_ret(lzma_seekable_read(s, 4 * BLOCK_SIZE, out,
+			&out_pos, 1), LZMA_BUF_ERROR);
+	rs.fail = LZMA_OK;
+
+	lzma_seekable_end(s);
+
+	// LZMA_IGNORE_CHECK
+	s = seekable_init(&rs, bad, file_size, LZMA_IGNORE_CHECK, UINT64_MAX);
+	read_and_compare(s, BLOCK_SIZE / 2, BLOCK_SIZE);
+	lzma_seekable_end(s);
+
+	// Too low memory usage limit for the Block decoder
+	s = seekable_init(&rs, file, file_size, 0, 1 << 16);
+	out_pos = 0;
+	assert_lzma_ret(lzma_seekable_read(s, 0, out, &out_pos, 1),
+			LZMA_MEMLIMIT_ERROR);
+	lzma_seekable_end(s);
+
+	tuktest_free(out);
+	tuktest_free(bad);
+#endif
+}
+
+
+static void
+test_seekable_cache(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	// Room for two Blocks of the first Stream. The Block of
+	// the second Stream is too big to be cached.
+	read_state rs;
+	lzma_seekable *s = seekable_init_cache(&rs, file, file_size, 0,
+			UINT64_MAX, 2 * BLOCK_SIZE);
+
+	// Reading the same Block again doesn't read the file.
+	read_and_compare(s, BLOCK_SIZE + 100, 100);
+	uint64_t bytes_read = rs.bytes_read;
+	read_and_compare(s, BLOCK_SIZE + 5000, 1000);
+	read_and_compare(s, BLOCK_SIZE, 10);
+	assert_uint_eq(rs.bytes_read, bytes_read);
+
+	// The least recently used Block is dropped.
+	read_and_compare(s, 2 * BLOCK_SIZE + 7, 1);
+	read_and_compare(s, 1 * BLOCK_SIZE + 7, 1);
+	read_and_compare(s, 3 * BLOCK_SIZE + 7, 1);
+	bytes_read = rs.bytes_read;
+	read_and_compare(s, BLOCK_SIZE, BLOCK_SIZE - 1);
+	read_and_compare(s, 3 * BLOCK_SIZE, BLOCK_SIZE - 1);
+	assert_uint_eq(rs.bytes_read, bytes_read);
+	read_and_compare(s, 2 * BLOCK_SIZE, 1);
+	assert_true(rs.bytes_read > bytes_read);
+
+	// Reads across cached and uncached Blocks
+	read_and_compare(s, 0, INPUT_SIZE);
+	read_and_compare(s, INPUT_SIZE / 2 - 10, 100);
+
+	uint32_t n = 456;
+	for (unsigned i = 0; i < 50; ++i) {
+		n = n * 101771 + 12345;
+		const uint64_t pos = n % INPUT_SIZE;
+		n = n * 101771 + 12345;
+		read_and_compare(s, pos, n % 20000);
+	}
+
+	lzma_seekable_end(s);
+
+	// With prefetching the results must be the same. Read the file
+	// sequentially and then randomly.
+	s = seekable_init_cache(&rs, file, file_size,
+			LZMA_SEEKABLE_PREFETCH, UINT64_MAX, 3 * BLOCK_SIZE);
+
+	for (uint64_t pos = 0; pos < INPUT_SIZE; pos += 10000)
+		read_and_compare(s, pos, 10000);
+
+	for (unsigned i = 0; i < 50; ++i) {
+		n = n * 101771 + 12345;
+		const uint64_t pos = n % INPUT_SIZE;
+		n = n * 101771 + 12345;
+		read_and_compare(s, pos, n % 20000);
+	}
+
+	lzma_seekable_end(s);
+
+	// Ending while the prefetch thread may still be working
+	s = seekable_init_cache(&rs, file, file_size,
+			LZMA_SEEKABLE_PREFETCH, UINT64_MAX, 3 * BLOCK_SIZE);
+	read_and_compare(s, 0, 1);
+	lzma_seekable_end(s);
+
+	// The Block decoder of the prefetch thread is counted against
+	// the memory usage limit. With room for only one Block decoder
+	// of the first Stream, prefetching is skipped or the reads wait
+	// for it, but the reads must not fail.
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = BLOCK_SIZE;
+	const lzma_filter filters[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+	const uint64_t decoder_memusage = lzma_raw_decoder_memusage(filters);
+	assert_true(decoder_memusage != UINT64_MAX);
+
+	s = seekable_init(&rs, file, file_size, 0, UINT64_MAX);
+	const uint64_t memlimit = lzma_index_memused(lzma_seekable_index(s))
+			+ decoder_memusage + decoder_memusage / 2;
+	lzma_seekable_end(s);
+
+	s = seekable_init_cache(&rs, file, file_size,
+			LZMA_SEEKABLE_PREFETCH, memlimit, 3 * BLOCK_SIZE);
+
+	// read_and_compare() reads one byte more than it is asked to.
+	const size_t first_size = INPUT_SIZE / 2 - 1;
+
+	for (uint64_t pos = 0; pos < first_size; pos += 10000)
+		read_and_compare(s, pos, my_min(10000, first_size - pos));
+
+	for (unsigned i = 0; i < 50; ++i) {
+		n = n * 101771 + 12345;
+		const uint64_t pos = n % first_size;
+		read_and_compare(s, pos, my_min(1000, first_size - pos));
+	}
+
+	lzma_seekable_end(s);
+#endif
+}
+
+
+static void
+test_seekable_checkpoints(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support disabled");
+#else
+	// A single-Block file whose dictionary is much smaller than
+	// the data so that the dictionary wraps around many times
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1U << 16;
+
+	lzma_filter filters[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const size_t one_size_max = lzma_stream_buffer_bound(INPUT_SIZE);
+	uint8_t *one = tuktest_malloc(one_size_max);
+	size_t one_size = 0;
+	assert_lzma_ret(lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32,
+			NULL, input, INPUT_SIZE, one, &one_size, one_size_max),
+			LZMA_OK);
+
+	// Decode the whole file once to create the checkpoints.
+	read_state rs = { .buf = one, .size = one_size };
+	lzma_seekable_options options = {
+		.read = &read_callback,
+		.opaque = &rs,
+		.file_size = one_size,
+		.memlimit = UINT64_MAX,
+		.checkpoint_interval = 1U << 17,
+	};
+
+	lzma_seekable *s = NULL;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL), LZMA_OK);
+
+	const uint64_t empty_size = lzma_seekable_checkpoints_size(s);
+	read_and_compare(s, 0, INPUT_SIZE);
+	const uint64_t size = lzma_seekable_checkpoints_size(s);
+	assert_true(size > empty_size + 3 * opt_lzma.dict_size);
+
+	// Reading the same data again doesn't add more checkpoints.
+	read_and_compare(s, 100, INPUT_SIZE / 2);
+	assert_uint_eq(lzma_seekable_checkpoints_size(s), size);
+
+	uint8_t *cps = tuktest_malloc((size_t)size + 1);
+	size_t cps_size = 1;
+	assert_lzma_ret(lzma_seekable_checkpoints_encode(NULL, cps,
+			&cps_size, (size_t)size + 1), LZMA_PROG_ERROR);
+	assert_lzma_ret(lzma_seekable_checkpoints_encode(s, cps,
+			&cps_size, (size_t)size), LZMA_BUF_ERROR);
+	assert_uint_eq(cps_size, 1);
+	assert_lzma_ret(lzma_seekable_checkpoints_encode(s, cps,
+			&cps_size, (size_t)size + 1), LZMA_OK);
+	assert_uint_eq(cps_size, size + 1);
+	lzma_seekable_end(s);
+
+	// Without checkpoints reading near the end of the Block has to
+	// decode all of it. With checkpoints much less is read.
+	options.checkpoint_interval = 0;
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL), LZMA_OK);
+	rs.bytes_read = 0;
+	read_and_compare(s, INPUT_SIZE - 1000, 100);
+	const uint64_t bytes_read = rs.bytes_read;
+
+	size_t in_pos = 1;
+	assert_lzma_ret(lzma_seekable_checkpoints_decode(s, cps, &in_pos,
+			cps_size), LZMA_OK);
+	assert_uint_eq(in_pos, cps_size);
+
+	rs.bytes_read = 0;
+	read_and_compare(s, INPUT_SIZE - 1000, 100);
+	assert_true(rs.bytes_read < bytes_read / 2);
+
+	uint32_t n = 789;
+	for (unsigned i = 0; i < 50; ++i) {
+		n = n * 101771 + 12345;
+		const uint64_t pos = n % INPUT_SIZE;
+		n = n * 101771 + 12345;
+		read_and_compare(s, pos, n % 50000);
+	}
+
+	// Resuming from a checkpoint up to the end of the Block
+	read_and_compare(s, INPUT_SIZE - 5000, 5000);
+	read_and_compare(s, 0, INPUT_SIZE);
+
+	// Wrong magic bytes, truncated input, and a CRC32 mismatch
+	in_pos = 1;
+	cps[1] ^= 0x01;
+	assert_lzma_ret(lzma_seekable_checkpoints_decode(s, cps, &in_pos,
+			cps_size), LZMA_FORMAT_ERROR);
+	cps[1] ^= 0x01;
+
+	assert_lzma_ret(lzma_seekable_checkpoints_decode(s, cps, &in_pos,
+			cps_size - 1), LZMA_DATA_ERROR);
+
+	cps[cps_size / 2] ^= 0x01;
+	assert_lzma_ret(lzma_seekable_checkpoints_decode(s, cps, &in_pos,
+			cps_size), LZMA_DATA_ERROR);
+	cps[cps_size / 2] ^= 0x01;
+	assert_uint_eq(in_pos, 1);
+
+	// Invalid lc/lp/pb in the first checkpoint is detected only
+	// when it is used.
+	uint8_t *state = cps + 1 + 30 + 32;
+	const uint8_t props = *state;
+	*state = 0xFF;
+	update_crc32(cps + 1, cps_size - 1);
+	assert_lzma_ret(lzma_seekable_checkpoints_decode(s, cps, &in_pos,
+			cps_size), LZMA_OK);
+
+	// The uncompressed offset of the first checkpoint
+	uint64_t cp_pos = 0;
+	for (unsigned i = 0; i < 8; ++i)
+		cp_pos |= (uint64_t)(cps[1 + 30 + 8 + i]) << (i * 8);
+
+	uint8_t buf[1];
+	size_t buf_pos = 0;
+	assert_lzma_ret(lzma_seekable_read(s, cp_pos, buf, &buf_pos, 1),
+			LZMA_DATA_ERROR);
+	assert_uint_eq(buf_pos, 0);
+
+	// Data before the checkpoint can still be read.
+	read_and_compare(s, cp_pos - 1000, 999);
+	lzma_seekable_end(s);
+
+	// The rep0-rep3 distances must be within the restored window.
+	// Otherwise the rep matches would read outside the dictionary.
+	// The CRC32 doesn't help because it can be recalculated.
+	*state = props;
+	uint8_t *rep0 = state + 3;
+	const uint8_t rep0_lsb = rep0[0];
+	rep0[0] = 0xF0;
+	rep0[1] = 0xFF;
+	rep0[2] = 0xFF;
+	rep0[3] = 0x7F;
+	update_crc32(cps + 1, cps_size - 1);
+
+	assert_lzma_ret(lzma_seekable_decoder(&s, &options, NULL), LZMA_OK);
+	in_pos = 1;
+	assert_lzma_ret(lzma_seekable_checkpoints_decode(s, cps, &in_pos,
+			cps_size), LZMA_OK);
+	assert_lzma_ret(lzma_seekable_read(s, cp_pos, buf, &buf_pos, 1),
+			LZMA_DATA_ERROR);
+	assert_uint_eq(buf_pos, 0);
+	lzma_seekable_end(s);
+
+	// Checkpoints of a different file are rejected.
+	rep0[0] = rep0_lsb;
+	rep0[1] = 0;
+	rep0[2] = 0;
+	rep0[3] = 0;
+	update_crc32(cps + 1, cps_size - 1);
+
+	s = seekable_init(&rs, file, file_size, 0, UINT64_MAX);
+	in_pos = 1;
+	assert_lzma_ret(lzma_seekable_checkpoints_decode(s, cps, &in_pos,
+			cps_size), LZMA_DATA_ERROR);
+	lzma_seekable_end(s);
+
+	tuktest_free(cps);
+	tuktest_free(one);
+#endif
+}
+
+
+extern int
+main(int argc, char **argv)
+{
+	tuktest_start(argc, argv);
+
+#if defined(HAVE_ENCODERS) && defined(HAVE_DECODERS)
+	input = tuktest_malloc(INPUT_SIZE);
+	create_test_input(input, INPUT_SIZE, 14);
+	create_file();
+#endif
+
+	tuktest_run(test_seekable_init);
+	tuktest_run(test_seekable_read);
+	tuktest_run(test_seekable_errors);
+	tuktest_run(test_seekable_cache);
+	tuktest_run(test_seekable_checkpoints);
+
+	return tuktest_end();
+}
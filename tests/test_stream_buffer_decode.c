@@ -93,6 +93,82 @@ test_buf_error(void)
 }
 
 
+static void
+test_large(void)
+{
+#if !defined(HAVE_ENCODERS) || !defined(HAVE_DECODERS)
+	assert_skip("Encoder or decoder support is disabled");
+#else
+	// The output buffer is used as the dictionary. Use data that is
+	// much bigger than the dictionary and has matches at distances
+	// near the dictionary size.
+	const size_t in_size = 300000;
+	const size_t dict_size = 4096;
+	uint8_t *in = tuktest_malloc(in_size);
+
+	uint32_t n = 5381;
+	for (size_t i = 0; i < in_size; ++i) {
+		n = n * 101771 + 12345;
+		in[i] = i >= dict_size && (n >> 20) % 4 != 0
+				? in[i - dict_size + (n >> 8) % 3]
+				: (uint8_t)(n >> 24);
+	}
+
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = dict_size;
+
+	lzma_filter filters[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const size_t comp_size_max = lzma_stream_buffer_bound(in_size);
+	uint8_t *comp = tuktest_malloc(comp_size_max);
+	size_t comp_size = 0;
+	assert_lzma_ret(lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32,
+			NULL, in, in_size, comp, &comp_size, comp_size_max),
+			LZMA_OK);
+
+	// Decode to the middle of a bigger buffer. The bytes before
+	// out_pos and after the decoded data must not be touched.
+	const size_t out_start = 100;
+	const size_t out_size = out_start + in_size + 100;
+	uint8_t *out = tuktest_malloc(out_size);
+	memset(out, 0xA5, out_size);
+
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = 0;
+	size_t out_pos = out_start;
+	assert_lzma_ret(lzma_stream_buffer_decode(&memlimit, 0, NULL,
+			comp, &in_pos, comp_size, out, &out_pos, out_size),
+			LZMA_OK);
+	assert_uint_eq(in_pos, comp_size);
+	assert_uint_eq(out_pos, out_start + in_size);
+	assert_true(memcmp(out + out_start, in, in_size) == 0);
+
+	for (size_t i = 0; i < out_start; ++i)
+		assert_uint_eq(out[i], 0xA5);
+
+	for (size_t i = out_pos; i < out_size; ++i)
+		assert_uint_eq(out[i], 0xA5);
+
+	// One byte too little output space
+	in_pos = 0;
+	out_pos = 0;
+	assert_lzma_ret(lzma_stream_buffer_decode(&memlimit, 0, NULL,
+			comp, &in_pos, comp_size, out, &out_pos, in_size - 1),
+			LZMA_BUF_ERROR);
+	assert_uint_eq(in_pos, 0);
+	assert_uint_eq(out_pos, 0);
+
+	tuktest_free(out);
+	tuktest_free(comp);
+	tuktest_free(in);
+#endif
+}
+
+
 extern int
 main(int argc, char **argv)
 {
@@ -104,6 +180,7 @@ main(int argc, char **argv)
 	tuktest_run(test_success);
 	tuktest_run(test_data_error);
 	tuktest_run(test_buf_error);
+	tuktest_run(test_large);
 
 	return tuktest_end();
 }
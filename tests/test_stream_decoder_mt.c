@@ -0,0 +1,470 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_stream_decoder_mt.c
+/// \brief      Tests the multithreaded .xz Stream decoder
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+#include "mythread.h"
+
+
+#define INPUT_SIZE (1U << 20)
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+static uint8_t *input;
+static uint8_t *compressed;
+static size_t compressed_size;
+
+
+// Compress input[] as one Stream. LZMA_FULL_FLUSH is done after every
+// block_size bytes so the Block Headers don't contain the sizes.
+static void
+encode_full_flush(size_t block_size)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_easy_encoder(&strm, 1, LZMA_CHECK_CRC32),
+			LZMA_OK);
+
+	const size_t out_max = lzma_stream_buffer_bound(INPUT_SIZE)
+			+ (INPUT_SIZE / block_size + 1) * 64;
+	compressed = tuktest_malloc(out_max);
+	strm.next_out = compressed;
+	strm.avail_out = out_max;
+
+	size_t in_pos = 0;
+	while (in_pos < INPUT_SIZE) {
+		const size_t size = my_min(block_size, INPUT_SIZE - in_pos);
+		strm.next_in = input + in_pos;
+		strm.avail_in = size;
+		in_pos += size;
+
+		assert_lzma_ret(lzma_code(&strm, in_pos == INPUT_SIZE
+				? LZMA_FINISH : LZMA_FULL_FLUSH),
+				LZMA_STREAM_END);
+	}
+
+	compressed_size = (size_t)strm.total_out;
+	lzma_end(&strm);
+	return;
+}
+
+
+static lzma_index *
+decode_index(void)
+{
+	lzma_stream_flags flags;
+	const uint8_t *footer = compressed + compressed_size
+			- LZMA_STREAM_HEADER_SIZE;
+	assert_lzma_ret(lzma_stream_footer_decode(&flags, footer), LZMA_OK);
+
+	lzma_index *idx;
+	uint64_t memlimit = UINT64_MAX;
+	size_t pos = 0;
+	assert_lzma_ret(lzma_index_buffer_decode(&idx, &memlimit, NULL,
+			footer - flags.backward_size, &pos,
+			flags.backward_size), LZMA_OK);
+
+	return idx;
+}
+
+
+// Get the statistics and sum the per-thread statistics of
+// the worker threads.
+static void
+sum_thread_stats(lzma_stream *strm, lzma_mt_stats *stats,
+		lzma_mt_thread_stats *sum)
+{
+	lzma_mt_thread_stats thread_stats[4];
+	assert_lzma_ret(lzma_mt_get_stats(strm, stats, thread_stats,
+			ARRAY_SIZE(thread_stats)), LZMA_OK);
+	assert_uint(stats->threads, <=, ARRAY_SIZE(thread_stats));
+
+	memzero(sum, sizeof(*sum));
+
+	for (uint32_t i = 0; i < stats->threads; ++i) {
+		sum->blocks += thread_stats[i].blocks;
+		sum->uncompressed_size += thread_stats[i].uncompressed_size;
+		sum->compressed_size += thread_stats[i].compressed_size;
+	}
+
+	return;
+}
+
+
+// Decode compressed[] with three threads and lzma_mt.index = idx.
+static lzma_ret
+decode_with_index(const lzma_index *idx, lzma_mt_thread_stats *sum)
+{
+	const lzma_mt mt = {
+		.flags = LZMA_MT_USE_INDEX,
+		.threads = 3,
+		.memlimit_threading = UINT64_MAX,
+		.memlimit_stop = UINT64_MAX,
+		.index = idx,
+	};
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt), LZMA_OK);
+
+	uint8_t *decompressed = tuktest_malloc(INPUT_SIZE);
+	strm.next_in = compressed;
+	strm.avail_in = compressed_size;
+	strm.next_out = decompressed;
+	strm.avail_out = INPUT_SIZE;
+
+	const lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+	if (ret == LZMA_STREAM_END) {
+		assert_uint_eq(strm.total_out, INPUT_SIZE);
+		assert_true(memcmp(decompressed, input, INPUT_SIZE) == 0);
+	}
+
+	lzma_mt_stats stats;
+	sum_thread_stats(&strm, &stats, sum);
+
+	lzma_end(&strm);
+	tuktest_free(decompressed);
+	return ret;
+}
+
+
+// Compress input[] with the multithreaded encoder so that the sizes are
+// stored in the Block Headers.
+static void
+encode_mt(const lzma_mt *mt)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, mt), LZMA_OK);
+
+	const size_t out_max = lzma_stream_buffer_bound(INPUT_SIZE);
+	compressed = tuktest_malloc(out_max);
+	strm.next_in = input;
+	strm.avail_in = INPUT_SIZE;
+	strm.next_out = compressed;
+	strm.avail_out = out_max;
+
+	lzma_ret ret;
+	do {
+		ret = lzma_code(&strm, LZMA_FINISH);
+	} while (ret == LZMA_OK);
+
+	assert_lzma_ret(ret, LZMA_STREAM_END);
+	compressed_size = (size_t)strm.total_out;
+	lzma_end(&strm);
+	return;
+}
+
+
+// Decode the first in_size bytes of compressed[] with the single-threaded
+// decoder and return the amount of output.
+static uint64_t
+decode_single(size_t in_size)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_decoder(&strm, UINT64_MAX, 0), LZMA_OK);
+
+	uint8_t *decompressed = tuktest_malloc(INPUT_SIZE);
+	strm.next_in = compressed;
+	strm.avail_in = in_size;
+	strm.next_out = decompressed;
+	strm.avail_out = INPUT_SIZE;
+
+	lzma_ret ret;
+	do {
+		ret = lzma_code(&strm, LZMA_FINISH);
+	} while (ret == LZMA_OK);
+
+	const uint64_t out_size = strm.total_out;
+	assert_true(memcmp(decompressed, input, (size_t)out_size) == 0);
+
+	lzma_end(&strm);
+	tuktest_free(decompressed);
+	return out_size;
+}
+
+
+// Decode the first in_size bytes of compressed[] with
+// LZMA_MT_SPLIT_BLOCKS giving at most in_chunk bytes per lzma_code() call.
+// The amount of output and the statistics are stored in split_out_size
+// and split_stats.
+static uint64_t split_out_size;
+static lzma_mt_stats split_stats;
+
+static lzma_ret
+decode_split(lzma_thread_pool *pool, uint64_t memlimit_threading,
+		size_t in_size, size_t in_chunk, lzma_mt_thread_stats *sum)
+{
+	const lzma_mt mt = {
+		.flags = LZMA_MT_SPLIT_BLOCKS
+			| (pool != NULL ? LZMA_MT_USE_THREAD_POOL : 0),
+		.threads = 3,
+		.memlimit_threading = memlimit_threading,
+		.memlimit_stop = UINT64_MAX,
+		.thread_pool = pool,
+	};
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt), LZMA_OK);
+
+	uint8_t *decompressed = tuktest_malloc(INPUT_SIZE);
+	strm.next_out = decompressed;
+	strm.avail_out = INPUT_SIZE;
+
+	size_t in_pos = 0;
+	lzma_ret ret;
+
+	do {
+		const size_t avail_in = my_min(in_chunk, in_size - in_pos);
+		strm.next_in = compressed + in_pos;
+		strm.avail_in = avail_in;
+
+		ret = lzma_code(&strm, in_pos + avail_in == in_size
+				? LZMA_FINISH : LZMA_RUN);
+
+		in_pos += avail_in - strm.avail_in;
+	} while (ret == LZMA_OK);
+
+	split_out_size = strm.total_out;
+	assert_true(memcmp(decompressed, input,
+			(size_t)split_out_size) == 0);
+
+	if (ret == LZMA_STREAM_END) {
+		assert_uint_eq(strm.total_out, INPUT_SIZE);
+
+		uint64_t progress_in;
+		uint64_t progress_out;
+		lzma_get_progress(&strm, &progress_in, &progress_out);
+		assert_uint_eq(progress_in, compressed_size);
+		assert_uint_eq(progress_out, INPUT_SIZE);
+	}
+
+	sum_thread_stats(&strm, &split_stats, sum);
+
+	lzma_end(&strm);
+	tuktest_free(decompressed);
+	return ret;
+}
+#endif
+
+
+static void
+test_use_index(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	// LZMA_FULL_FLUSH omits the sizes from the Block Headers.
+	const size_t block_size = 1 << 18;
+	encode_full_flush(block_size);
+
+	lzma_index *idx = decode_index();
+	const lzma_vli blocks = lzma_index_block_count(idx);
+	assert_uint_eq(blocks, INPUT_SIZE / block_size);
+
+	// Without the Index every Block is decoded in direct mode.
+	lzma_mt_thread_stats sum;
+	assert_lzma_ret(decode_with_index(NULL, &sum), LZMA_STREAM_END);
+	assert_uint_eq(sum.blocks, 0);
+
+	// With the Index the worker threads decode all of them.
+	assert_lzma_ret(decode_with_index(idx, &sum), LZMA_STREAM_END);
+	assert_uint_eq(sum.blocks, blocks);
+
+	// An Index whose sizes don't match the Blocks is an error.
+	// So is an Index that has fewer Blocks than the input.
+	lzma_index *wrong = lzma_index_init(NULL);
+	lzma_index *short_idx = lzma_index_init(NULL);
+	assert_true(wrong != NULL && short_idx != NULL);
+
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, idx);
+	while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+		const bool last = iter.block.number_in_file == blocks;
+		assert_lzma_ret(lzma_index_append(wrong, NULL,
+				iter.block.unpadded_size,
+				iter.block.uncompressed_size - last),
+				LZMA_OK);
+
+		if (!last)
+			assert_lzma_ret(lzma_index_append(short_idx, NULL,
+					iter.block.unpadded_size,
+					iter.block.uncompressed_size),
+					LZMA_OK);
+	}
+
+	assert_lzma_ret(decode_with_index(wrong, &sum), LZMA_DATA_ERROR);
+	assert_lzma_ret(decode_with_index(short_idx, &sum), LZMA_DATA_ERROR);
+
+	lzma_index_end(wrong, NULL);
+	lzma_index_end(short_idx, NULL);
+	lzma_index_end(idx, NULL);
+	tuktest_free(compressed);
+
+	// The flag isn't supported by the encoder.
+	const lzma_mt mt = {
+		.flags = LZMA_MT_USE_INDEX,
+		.threads = 3,
+		.block_size = block_size,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+	};
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt),
+			LZMA_OPTIONS_ERROR);
+	lzma_end(&strm);
+#endif
+}
+
+
+static void
+test_split_blocks(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.mf |= LZMA_MF_RESET_INTERVAL;
+	opt_lzma.reset_interval = 1 << 18;
+
+	lzma_filter filters[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_mt mt = {
+		.threads = 2,
+		.block_size = INPUT_SIZE,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC64,
+	};
+
+	encode_mt(&mt);
+
+	// The only Block is decoded in INPUT_SIZE / reset_interval parts.
+	lzma_thread_pool *pool = lzma_thread_pool_init(2, NULL);
+	assert_true(pool != NULL);
+
+	lzma_mt_thread_stats sum;
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size,
+			SIZE_MAX, &sum), LZMA_STREAM_END);
+	assert_uint_eq(sum.blocks, INPUT_SIZE / opt_lzma.reset_interval);
+
+	assert_lzma_ret(decode_split(pool, UINT64_MAX, compressed_size,
+			1000, &sum), LZMA_STREAM_END);
+	assert_uint_eq(sum.blocks, INPUT_SIZE / opt_lzma.reset_interval);
+
+	// If the Block fits in memlimit_threading only alone, the rest of
+	// the parts have to wait for the memory of the first one.
+	assert_lzma_ret(decode_split(NULL, 5U << 19, compressed_size,
+			SIZE_MAX, &sum), LZMA_STREAM_END);
+	assert_uint_eq(sum.blocks, INPUT_SIZE / opt_lzma.reset_interval);
+	assert_uint_eq(split_stats.memlimit_direct, 0);
+
+	// Truncated input. The first part is decoded like without
+	// splitting. The other parts are decoded only when all of
+	// their input is available.
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size / 2,
+			12345, &sum), LZMA_BUF_ERROR);
+	assert_uint(split_out_size, <=, decode_single(compressed_size / 2));
+
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size / 8,
+			SIZE_MAX, &sum), LZMA_BUF_ERROR);
+	assert_uint_eq(split_out_size, decode_single(compressed_size / 8));
+
+	// The last byte of the Check field is just before the Index.
+	lzma_index *idx = decode_index();
+	const size_t check_end = compressed_size - LZMA_STREAM_HEADER_SIZE
+			- (size_t)lzma_index_size(idx);
+	lzma_index_end(idx, NULL);
+
+	compressed[check_end - 1] ^= 1;
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size,
+			SIZE_MAX, &sum), LZMA_DATA_ERROR);
+	compressed[check_end - 1] ^= 1;
+
+	// Corrupt data in the last part
+	compressed[check_end - 8 - 2] ^= 0x80;
+	assert_lzma_ret(decode_split(pool, UINT64_MAX, compressed_size,
+			SIZE_MAX, &sum), LZMA_DATA_ERROR);
+	compressed[check_end - 8 - 2] ^= 0x80;
+
+	// Invalid control byte in the first LZMA2 chunk
+	const size_t first_chunk = LZMA_STREAM_HEADER_SIZE
+			+ lzma_block_header_size_decode(
+				compressed[LZMA_STREAM_HEADER_SIZE]);
+	compressed[first_chunk] = 0x03;
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size,
+			SIZE_MAX, &sum), LZMA_DATA_ERROR);
+	assert_uint_eq(sum.blocks, 0);
+	tuktest_free(compressed);
+
+	// Several Blocks with resets. Blocks aren't split while the
+	// integrity check of an earlier split Block is being calculated
+	// so the number of parts depends on timing.
+	mt.block_size = INPUT_SIZE / 2;
+	mt.check = LZMA_CHECK_SHA256;
+	encode_mt(&mt);
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size,
+			100000, &sum), LZMA_STREAM_END);
+	assert_lzma_ret(decode_split(pool, UINT64_MAX, compressed_size,
+			SIZE_MAX, &sum), LZMA_STREAM_END);
+	tuktest_free(compressed);
+
+	// Blocks with other filters than LZMA2 aren't split.
+	lzma_options_delta opt_delta = {
+		.type = LZMA_DELTA_TYPE_BYTE,
+		.dist = 4,
+	};
+	lzma_filter delta_filters[] = {
+		{ .id = LZMA_FILTER_DELTA, .options = &opt_delta },
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+	mt.filters = delta_filters;
+	mt.block_size = INPUT_SIZE;
+	encode_mt(&mt);
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size,
+			SIZE_MAX, &sum), LZMA_STREAM_END);
+	assert_uint_eq(sum.blocks, 1);
+	tuktest_free(compressed);
+
+	// Blocks without resets in the middle are decoded like without
+	// the flag. A truncated Block gives as much output as the
+	// single-threaded decoder.
+	mt.filters = NULL;
+	mt.preset = 1;
+	mt.block_size = INPUT_SIZE / 2;
+	encode_mt(&mt);
+	assert_lzma_ret(decode_split(NULL, UINT64_MAX, compressed_size / 3,
+			SIZE_MAX, &sum), LZMA_BUF_ERROR);
+	assert_uint_eq(split_out_size, decode_single(compressed_size / 3));
+	assert_uint_eq(sum.blocks, 0);
+	tuktest_free(compressed);
+
+	lzma_thread_pool_end(pool, NULL);
+#endif
+}
+
+
+extern int
+main(int argc, char **argv)
+{
+	tuktest_start(argc, argv);
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+	input = tuktest_malloc(INPUT_SIZE);
+	create_test_input(input, INPUT_SIZE, 16);
+#endif
+
+	tuktest_run(test_use_index);
+	tuktest_run(test_split_blocks);
+
+	return tuktest_end();
+}
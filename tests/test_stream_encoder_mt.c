@@ -0,0 +1,1037 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_stream_encoder_mt.c
+/// \brief      Tests the multithreaded .xz Stream encoder
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+#include "mythread.h"
+
+
+#define INPUT_SIZE (1U << 20)
+#define RATIO_SIZE (1U << 19)
+
+// Input that compresses well but needs a real match finder: words
+// picked pseudorandomly from a small vocabulary, and a few stretches
+// of incompressible data so that uncompressed LZMA2 chunks get used too.
+static uint8_t *input;
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+static uint8_t *compressed;
+static size_t compressed_size;
+static uint8_t *decompressed;
+#endif
+
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+// Compress in_size bytes from input[] feeding at most in_chunk bytes of
+// input and out_chunk bytes of output space per lzma_code() call.
+// If flush_pos is non-zero, LZMA_FULL_FLUSH is done at that position.
+static void
+encode_mt(const lzma_mt *mt, size_t in_size, size_t in_chunk,
+		size_t out_chunk, size_t flush_pos)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, mt), LZMA_OK);
+
+	const size_t out_max = lzma_stream_buffer_bound(in_size) + (1 << 16);
+	compressed = tuktest_malloc(out_max);
+
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+	bool flushed = flush_pos == 0;
+	lzma_ret ret;
+
+	do {
+		const size_t in_end = !flushed ? flush_pos : in_size;
+		const size_t avail_in = my_min(in_chunk, in_end - in_pos);
+		lzma_action action = LZMA_RUN;
+
+		if (avail_in == in_end - in_pos)
+			action = flushed ? LZMA_FINISH : LZMA_FULL_FLUSH;
+
+		strm.next_in = input + in_pos;
+		strm.avail_in = avail_in;
+		strm.next_out = compressed + out_pos;
+		strm.avail_out = my_min(out_chunk, out_max - out_pos);
+
+		ret = lzma_code(&strm, action);
+
+		in_pos += avail_in - strm.avail_in;
+		out_pos = (size_t)(strm.next_out - compressed);
+
+		if (ret == LZMA_STREAM_END && !flushed) {
+			assert_uint_eq(in_pos, flush_pos);
+			flushed = true;
+			ret = LZMA_OK;
+		}
+	} while (ret == LZMA_OK);
+
+	assert_lzma_ret(ret, LZMA_STREAM_END);
+	assert_uint_eq(in_pos, in_size);
+
+	compressed_size = out_pos;
+	lzma_end(&strm);
+	return;
+}
+
+
+static void
+verify_decode(size_t in_size)
+{
+	decompressed = tuktest_malloc(in_size + 1);
+
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+	assert_lzma_ret(lzma_stream_buffer_decode(&memlimit, 0, NULL,
+			compressed, &in_pos, compressed_size,
+			decompressed, &out_pos, in_size + 1), LZMA_OK);
+
+	assert_uint_eq(in_pos, compressed_size);
+	assert_uint_eq(out_pos, in_size);
+	assert_true(memcmp(decompressed, input, in_size) == 0);
+
+	tuktest_free(decompressed);
+	return;
+}
+
+
+static size_t
+encode_single_threaded_size(lzma_filter *filters, size_t in_size)
+{
+	const size_t out_max = lzma_stream_buffer_bound(in_size);
+	uint8_t *out = tuktest_malloc(out_max);
+	size_t out_pos = 0;
+
+	assert_lzma_ret(lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC64,
+			NULL, input, in_size, out, &out_pos, out_max),
+			LZMA_OK);
+
+	tuktest_free(out);
+	return out_pos;
+}
+#endif
+
+
+static void
+test_part_size_options(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS)
+	assert_skip("Threading or encoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+
+	lzma_options_delta opt_delta = { .type = LZMA_DELTA_TYPE_BYTE,
+			.dist = 1 };
+
+	lzma_filter filters[3] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_mt mt = {
+		.flags = LZMA_MT_USE_PART_SIZE,
+		.threads = 2,
+		.block_size = 1 << 20,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC32,
+		.part_size = 1 << 16,
+	};
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+
+	// Memory usage has to be smaller than without parts because
+	// the buffers are sized according to part_size.
+	const uint64_t memusage_parts = lzma_stream_encoder_mt_memusage(&mt);
+	assert_true(memusage_parts != UINT64_MAX);
+
+	// Only LZMA2 is supported when splitting Blocks into parts.
+	assert_lzma_ret(lzma_filters_update(&strm, filters), LZMA_OK);
+	filters[1] = filters[0];
+	filters[0].id = LZMA_FILTER_DELTA;
+	filters[0].options = &opt_delta;
+	assert_lzma_ret(lzma_filters_update(&strm, filters),
+			LZMA_OPTIONS_ERROR);
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt),
+			LZMA_OPTIONS_ERROR);
+	assert_uint_eq(lzma_stream_encoder_mt_memusage(&mt), UINT64_MAX);
+
+	filters[0] = filters[1];
+	filters[1].id = LZMA_VLI_UNKNOWN;
+
+	// Too small part size
+	mt.part_size = LZMA_DICT_SIZE_MIN - 1;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt),
+			LZMA_OPTIONS_ERROR);
+
+	// part_size is ignored without LZMA_MT_USE_PART_SIZE.
+	mt.flags = 0;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+	mt.flags = LZMA_MT_USE_PART_SIZE;
+
+	// part_size >= block_size is the same as no parts.
+	mt.part_size = mt.block_size;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+	mt.part_size = 0;
+	assert_true(lzma_stream_encoder_mt_memusage(&mt) > memusage_parts);
+
+	lzma_end(&strm);
+#endif
+}
+
+
+static void
+test_part_size_encode(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	static const lzma_check checks[] = {
+		LZMA_CHECK_NONE,
+		LZMA_CHECK_CRC32,
+		LZMA_CHECK_CRC64,
+		LZMA_CHECK_SHA256,
+	};
+
+	// The fast mode keeps the test quick. The normal mode is used
+	// only for the compression ratio comparison at the end.
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1 << 20;
+
+	// Exercise pb and lp. The history in front of each part must keep
+	// the position bits in sync with the decoder.
+	opt_lzma.pb = 4;
+	opt_lzma.lp = 2;
+	opt_lzma.lc = 1;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_mt mt = {
+		.flags = LZMA_MT_USE_PART_SIZE,
+		.threads = 4,
+		.block_size = 1 << 19,
+		.filters = filters,
+		.part_size = (1 << 17) + 123,
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(checks); ++i) {
+		if (!lzma_check_is_supported(checks[i]))
+			continue;
+
+		mt.check = checks[i];
+
+		encode_mt(&mt, INPUT_SIZE, SIZE_MAX, SIZE_MAX, 0);
+		verify_decode(INPUT_SIZE);
+		tuktest_free(compressed);
+	}
+
+	// Tiny input and output chunks hit the case where a part becomes
+	// full when no more input is available. A flush in the middle
+	// creates a short Block, and the end of the input needs a Block
+	// that consists of only one part.
+	mt.check = LZMA_CHECK_CRC64;
+	encode_mt(&mt, INPUT_SIZE - 1000, (1 << 17) + 123, 777,
+			(1 << 18) + 5);
+	verify_decode(INPUT_SIZE - 1000);
+	tuktest_free(compressed);
+
+	encode_mt(&mt, 12345, 4096, SIZE_MAX, 0);
+	verify_decode(12345);
+	tuktest_free(compressed);
+
+	// The compression ratio should be close to single-threaded
+	// compression of the same Block size. A short nice_len keeps
+	// the normal mode fast enough.
+	opt_lzma.mode = LZMA_MODE_NORMAL;
+	opt_lzma.nice_len = 16;
+	opt_lzma.pb = LZMA_PB_DEFAULT;
+	opt_lzma.lp = LZMA_LP_DEFAULT;
+	opt_lzma.lc = LZMA_LC_DEFAULT;
+	mt.block_size = RATIO_SIZE;
+	mt.part_size = 1 << 17;
+	encode_mt(&mt, RATIO_SIZE, SIZE_MAX, SIZE_MAX, 0);
+	verify_decode(RATIO_SIZE);
+
+	const size_t parts_size = compressed_size;
+	tuktest_free(compressed);
+
+	mt.part_size = 0;
+	mt.block_size = 1 << 17;
+	encode_mt(&mt, RATIO_SIZE, SIZE_MAX, SIZE_MAX, 0);
+	verify_decode(RATIO_SIZE);
+
+	const size_t blocks_size = compressed_size;
+	tuktest_free(compressed);
+
+	const size_t single_size = encode_single_threaded_size(
+			filters, RATIO_SIZE);
+
+	assert_true(parts_size < blocks_size);
+	assert_true(parts_size < single_size + single_size / 50);
+#endif
+}
+
+
+static void
+test_direct_input(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1 << 20;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_mt mt = {
+		.flags = LZMA_MT_DIRECT_INPUT,
+		.threads = 3,
+		.block_size = 1 << 18,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC32,
+		.part_size = 1 << 16,
+	};
+
+	// The input buffers aren't allocated up front.
+	const uint64_t memusage_direct = lzma_stream_encoder_mt_memusage(&mt);
+	mt.flags = 0;
+	assert_true(lzma_stream_encoder_mt_memusage(&mt)
+			>= memusage_direct + 3 * mt.block_size);
+	mt.flags = LZMA_MT_DIRECT_INPUT;
+
+	// Contiguous input in various chunk sizes, with a flush in
+	// the middle.
+	encode_mt(&mt, INPUT_SIZE, SIZE_MAX, SIZE_MAX, 0);
+	verify_decode(INPUT_SIZE);
+	tuktest_free(compressed);
+
+	encode_mt(&mt, INPUT_SIZE - 1000, 12345, 777, (1 << 19) + 5);
+	verify_decode(INPUT_SIZE - 1000);
+	tuktest_free(compressed);
+
+	// Same with Blocks split into parts. The history of a part is
+	// read from the application's buffer too.
+	mt.flags |= LZMA_MT_USE_PART_SIZE;
+	encode_mt(&mt, INPUT_SIZE, 100000, SIZE_MAX, 0);
+	verify_decode(INPUT_SIZE);
+	tuktest_free(compressed);
+
+	// Input that isn't contiguous needs to be copied. Every other
+	// chunk is taken from the original input and every other from
+	// a copy that has gaps between the chunks. All of them stay
+	// valid until the end of encoding.
+	const size_t chunk_size = 50000;
+	const size_t chunk_gap = 16;
+	const size_t chunks = (INPUT_SIZE + chunk_size - 1) / chunk_size;
+	uint8_t *copy = tuktest_malloc(chunks * (chunk_size + chunk_gap));
+
+	for (size_t flags_i = 0; flags_i < 2; ++flags_i) {
+		mt.flags = flags_i == 0 ? LZMA_MT_DIRECT_INPUT
+				: LZMA_MT_DIRECT_INPUT | LZMA_MT_USE_PART_SIZE;
+
+		lzma_stream strm = LZMA_STREAM_INIT;
+		assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+
+		const size_t out_max = lzma_stream_buffer_bound(INPUT_SIZE);
+		compressed = tuktest_malloc(out_max);
+		strm.next_out = compressed;
+		strm.avail_out = out_max;
+
+		for (size_t i = 0; i < chunks; ++i) {
+			const size_t pos = i * chunk_size;
+			const size_t size = my_min(chunk_size,
+					INPUT_SIZE - pos);
+			uint8_t *buf = copy + i * (chunk_size + chunk_gap);
+			memcpy(buf, input + pos, size);
+
+			strm.next_in = (i % 3) == 1 ? input + pos : buf;
+			strm.avail_in = size;
+
+			const lzma_action action = i == chunks - 1
+					? LZMA_FINISH : LZMA_RUN;
+			lzma_ret ret;
+			do {
+				ret = lzma_code(&strm, action);
+			} while (ret == LZMA_OK && strm.avail_in > 0);
+
+			assert_lzma_ret(ret, action == LZMA_FINISH
+					? LZMA_STREAM_END : LZMA_OK);
+		}
+
+		compressed_size = (size_t)strm.total_out;
+		lzma_end(&strm);
+
+		verify_decode(INPUT_SIZE);
+		tuktest_free(compressed);
+	}
+
+	tuktest_free(copy);
+
+	// Unknown flags are still rejected.
+	mt.flags = 0x8000;
+	assert_uint_eq(lzma_stream_encoder_mt_memusage(&mt), UINT64_MAX);
+#endif
+}
+
+
+static void
+test_outbuf_growth(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1 << 16;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_mt mt = {
+		.threads = 8,
+		.block_size = 8 << 20,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC64,
+		.part_size = 1 << 18,
+	};
+
+	// The output buffers aren't counted at their worst-case size.
+	// That would be two Blocks per thread.
+	assert_true(lzma_stream_encoder_mt_memusage(&mt)
+			< 2 * mt.threads * mt.block_size);
+
+	// Incompressible input makes the output buffers grow to their
+	// maximum size, and the Blocks are stored using uncompressed
+	// LZMA2 chunks. Small output chunks make the main thread read
+	// the segments of the buffers in small pieces.
+	const size_t random_size = (1 << 20) + 1234;
+	uint8_t *random = tuktest_malloc(random_size);
+	uint32_t n = 12345;
+	for (size_t i = 0; i < random_size; ++i) {
+		n = n * 1103515245 + 12345;
+		random[i] = (uint8_t)(n >> 23);
+	}
+
+	uint8_t *const input_orig = input;
+	input = random;
+
+	mt.threads = 2;
+	mt.block_size = (1 << 18) + 99;
+	encode_mt(&mt, random_size, 50000, 777, 0);
+	verify_decode(random_size);
+	assert_true(compressed_size > random_size);
+	tuktest_free(compressed);
+
+	// The same when encoding parts
+	mt.flags = LZMA_MT_USE_PART_SIZE;
+	mt.block_size = 1 << 20;
+	mt.part_size = (1 << 17) + 11;
+	encode_mt(&mt, random_size, 50000, 777, (1 << 19) + 1);
+	verify_decode(random_size);
+	tuktest_free(compressed);
+
+	// A Block that has only one part
+	encode_mt(&mt, 100000, SIZE_MAX, SIZE_MAX, 0);
+	verify_decode(100000);
+	tuktest_free(compressed);
+
+	input = input_orig;
+	tuktest_free(random);
+#endif
+}
+
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+static mythread_mutex notify_mutex;
+static mythread_cond notify_cond;
+
+
+static void
+notify_callback(void *opaque)
+{
+	mythread_sync(notify_mutex) {
+		++*(uint32_t *)opaque;
+		mythread_cond_signal(&notify_cond);
+	}
+}
+
+
+// Run strm like an event loop would: call lzma_code() and, if it made
+// no progress, wait until the notification callback has been called.
+// Input and output are given in chunks of the specified sizes.
+static size_t
+code_with_notify(lzma_stream *strm, uint32_t *notify_count,
+		const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t out_size, size_t chunk_size)
+{
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+	lzma_ret ret;
+
+	do {
+		uint32_t seen;
+		mythread_sync(notify_mutex) {
+			seen = *notify_count;
+		}
+
+		const size_t avail_in = my_min(chunk_size, in_size - in_pos);
+		strm->next_in = in + in_pos;
+		strm->avail_in = avail_in;
+		strm->next_out = out + out_pos;
+		strm->avail_out = my_min(chunk_size, out_size - out_pos);
+
+		ret = lzma_code(strm, avail_in == in_size - in_pos
+				? LZMA_FINISH : LZMA_RUN);
+
+		const size_t in_used = avail_in - strm->avail_in;
+		const size_t out_used = (size_t)(strm->next_out - out)
+				- out_pos;
+		in_pos += in_used;
+		out_pos += out_used;
+
+		// lzma_code() doesn't wait for the worker threads so if
+		// nothing happened, wait for the callback instead.
+		if (ret == LZMA_OK && in_used == 0 && out_used == 0) {
+			mythread_sync(notify_mutex) {
+				while (*notify_count == seen)
+					mythread_cond_wait(&notify_cond,
+							&notify_mutex);
+			}
+		}
+	} while (ret == LZMA_OK);
+
+	assert_lzma_ret(ret, LZMA_STREAM_END);
+	assert_uint_eq(in_pos, in_size);
+	return out_pos;
+}
+#endif
+
+
+static void
+test_notify(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	assert_false(mythread_mutex_init(&notify_mutex));
+	assert_false(mythread_cond_init(&notify_cond));
+
+	uint32_t notify_count = 0;
+
+	lzma_mt mt = {
+		.flags = LZMA_MT_USE_NOTIFY,
+		.threads = 3,
+		.block_size = 1 << 18,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+		.notify = &notify_callback,
+		.notify_opaque = &notify_count,
+	};
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+
+	const size_t out_max = lzma_stream_buffer_bound(INPUT_SIZE);
+	compressed = tuktest_malloc(out_max);
+	compressed_size = code_with_notify(&strm, &notify_count,
+			input, INPUT_SIZE, compressed, out_max, 1 << 16);
+	lzma_end(&strm);
+
+	assert_uint(notify_count, >, 0);
+	verify_decode(INPUT_SIZE);
+
+	// Decode it with the threaded decoder. Small output chunks
+	// make the partial updates of the Block being read matter.
+	mt.memlimit_threading = UINT64_MAX;
+	mt.memlimit_stop = UINT64_MAX;
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt), LZMA_OK);
+
+	decompressed = tuktest_malloc(INPUT_SIZE);
+	notify_count = 0;
+	assert_uint_eq(code_with_notify(&strm, &notify_count,
+			compressed, compressed_size,
+			decompressed, INPUT_SIZE, 4096), INPUT_SIZE);
+	assert_true(memcmp(decompressed, input, INPUT_SIZE) == 0);
+	assert_uint(notify_count, >, 0);
+	lzma_end(&strm);
+
+	tuktest_free(decompressed);
+	tuktest_free(compressed);
+	mythread_cond_destroy(&notify_cond);
+	mythread_mutex_destroy(&notify_mutex);
+#endif
+}
+
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+// Sum the per-thread statistics and check that they are sane.
+static void
+sum_thread_stats(lzma_stream *strm, lzma_mt_stats *stats,
+		lzma_mt_thread_stats *sum)
+{
+	lzma_mt_thread_stats thread_stats[4];
+	assert_lzma_ret(lzma_mt_get_stats(strm, stats, thread_stats,
+			ARRAY_SIZE(thread_stats)), LZMA_OK);
+	assert_uint(stats->threads, <=, ARRAY_SIZE(thread_stats));
+	assert_uint(stats->outq_bufs_peak, <=, stats->outq_bufs_limit);
+
+	memzero(sum, sizeof(*sum));
+
+	for (uint32_t i = 0; i < stats->threads; ++i) {
+		sum->blocks += thread_stats[i].blocks;
+		sum->uncompressed_size += thread_stats[i].uncompressed_size;
+		sum->compressed_size += thread_stats[i].compressed_size;
+		sum->busy_usec += thread_stats[i].busy_usec;
+	}
+
+	return;
+}
+
+
+static void
+decode_with_stats(uint64_t memlimit_threading, lzma_mt_stats *stats,
+		lzma_mt_thread_stats *sum)
+{
+	const lzma_mt mt = {
+		.threads = 3,
+		.memlimit_threading = memlimit_threading,
+		.memlimit_stop = UINT64_MAX,
+	};
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt), LZMA_OK);
+
+	decompressed = tuktest_malloc(INPUT_SIZE);
+	strm.next_in = compressed;
+	strm.avail_in = compressed_size;
+	strm.next_out = decompressed;
+	strm.avail_out = INPUT_SIZE;
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+	assert_uint_eq(strm.total_out, INPUT_SIZE);
+	assert_true(memcmp(decompressed, input, INPUT_SIZE) == 0);
+
+	sum_thread_stats(&strm, stats, sum);
+	assert_uint_eq(stats->outq_bufs, 0);
+
+	lzma_end(&strm);
+	tuktest_free(decompressed);
+	return;
+}
+#endif
+
+
+static void
+test_numa(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	// The result must be the same whether or not the system has
+	// more than one NUMA node. On a single node this is a no-op.
+	lzma_mt mt = {
+		.flags = LZMA_MT_NUMA,
+		.threads = 4,
+		.block_size = 1 << 19,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+	};
+
+	encode_mt(&mt, INPUT_SIZE, SIZE_MAX, SIZE_MAX, 0);
+	verify_decode(INPUT_SIZE);
+
+	// Toggling the flag when reinitializing recreates the threads.
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+	mt.flags = 0;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+	lzma_end(&strm);
+
+	// Multithreaded decoding
+	const lzma_mt mt_dec = {
+		.flags = LZMA_MT_NUMA,
+		.threads = 4,
+		.memlimit_threading = UINT64_MAX,
+		.memlimit_stop = UINT64_MAX,
+	};
+
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt_dec), LZMA_OK);
+
+	decompressed = tuktest_malloc(INPUT_SIZE);
+	strm.next_in = compressed;
+	strm.avail_in = compressed_size;
+	strm.next_out = decompressed;
+	strm.avail_out = INPUT_SIZE;
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+	assert_uint_eq(strm.total_out, INPUT_SIZE);
+	assert_true(memcmp(decompressed, input, INPUT_SIZE) == 0);
+
+	lzma_end(&strm);
+	tuktest_free(decompressed);
+	tuktest_free(compressed);
+#endif
+}
+
+
+static void
+test_mt_stats(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	lzma_mt_stats stats;
+	lzma_mt_thread_stats thread_stats[2];
+	lzma_mt_thread_stats sum;
+
+	// Only multithreaded coders support this.
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_mt_get_stats(&strm, &stats, NULL, 0),
+			LZMA_PROG_ERROR);
+	assert_lzma_ret(lzma_easy_encoder(&strm, 1, LZMA_CHECK_CRC32),
+			LZMA_OK);
+	assert_lzma_ret(lzma_mt_get_stats(&strm, &stats, NULL, 0),
+			LZMA_PROG_ERROR);
+
+	const lzma_mt mt = {
+		.threads = 3,
+		.block_size = 1 << 18,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+	};
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+
+	assert_lzma_ret(lzma_mt_get_stats(&strm, NULL, NULL, 0),
+			LZMA_PROG_ERROR);
+	assert_lzma_ret(lzma_mt_get_stats(&strm, &stats, NULL, 1),
+			LZMA_PROG_ERROR);
+
+	// No threads have been created before the first Block.
+	assert_lzma_ret(lzma_mt_get_stats(&strm, &stats, NULL, 0), LZMA_OK);
+	assert_uint_eq(stats.threads, 0);
+
+	const size_t out_max = lzma_stream_buffer_bound(INPUT_SIZE);
+	compressed = tuktest_malloc(out_max);
+	strm.next_in = input;
+	strm.avail_in = INPUT_SIZE;
+	strm.next_out = compressed;
+	strm.avail_out = out_max;
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+	compressed_size = (size_t)(strm.total_out);
+	verify_decode(INPUT_SIZE);
+
+	// The Blocks and the data are split between the threads. The
+	// compressed sizes don't include the Stream Header, Index, and
+	// Stream Footer.
+	sum_thread_stats(&strm, &stats, &sum);
+	assert_uint(stats.threads, >=, 1);
+	assert_uint(stats.threads, <=, 3);
+	assert_uint(stats.outq_bufs_peak, >=, 1);
+	assert_uint_eq(stats.outq_bufs, 0);
+	assert_uint_eq(stats.memlimit_waits, 0);
+	assert_uint_eq(stats.memlimit_direct, 0);
+	assert_uint_eq(sum.blocks, INPUT_SIZE / (1 << 18));
+	assert_uint_eq(sum.uncompressed_size, INPUT_SIZE);
+	assert_uint(sum.compressed_size, >, 0);
+	assert_uint(sum.compressed_size, <, compressed_size);
+
+	// Only thread_stats_count elements are written.
+	memset(thread_stats, 0xA5, sizeof(thread_stats));
+	assert_lzma_ret(lzma_mt_get_stats(&strm, &stats, thread_stats, 1),
+			LZMA_OK);
+	assert_uint(thread_stats[0].blocks, <=, sum.blocks);
+	assert_uint_eq(thread_stats[1].blocks, UINT64_C(0xA5A5A5A5A5A5A5A5));
+
+	// Reinitialization resets the statistics.
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+	sum_thread_stats(&strm, &stats, &sum);
+	assert_uint_eq(sum.blocks, 0);
+	assert_uint_eq(sum.uncompressed_size, 0);
+	assert_uint_eq(stats.wait_thread_usec + stats.wait_out_usec, 0);
+	lzma_end(&strm);
+
+	// Decoding without a memory usage limit
+	decode_with_stats(UINT64_MAX, &stats, &sum);
+	assert_uint(stats.threads, >=, 1);
+	assert_uint_eq(stats.memlimit_direct, 0);
+	assert_uint_eq(sum.blocks, INPUT_SIZE / (1 << 18));
+	assert_uint_eq(sum.uncompressed_size, INPUT_SIZE);
+	assert_uint(sum.compressed_size, <, compressed_size);
+
+	// A limit that is enough for one Block at a time. The Block
+	// Headers contain the Uncompressed Size so the dictionary needs
+	// only as much memory as a Block.
+	decode_with_stats(1 << 20, &stats, &sum);
+	assert_uint_eq(stats.threads, 1);
+	assert_uint_eq(stats.memlimit_direct, 0);
+	assert_uint(stats.memlimit_waits, <, INPUT_SIZE / (1 << 18));
+	assert_uint_eq(sum.blocks, INPUT_SIZE / (1 << 18));
+
+	// A limit that is too low for any threads makes every Block
+	// be decoded in the single-threaded mode.
+	decode_with_stats(1, &stats, &sum);
+	assert_uint_eq(stats.threads, 0);
+	assert_uint_eq(stats.memlimit_direct, INPUT_SIZE / (1 << 18));
+
+	tuktest_free(compressed);
+#endif
+}
+
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+// Compress in_size bytes from input[] using LZMA_SYNC_FLUSH after every
+// chunk_size bytes. After each flush, the output so far must decompress
+// to all of the input so far.
+static void
+encode_sync_flush(const lzma_mt *mt, size_t in_size, size_t chunk_size)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, mt), LZMA_OK);
+
+	lzma_stream dec = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_decoder(&dec, UINT64_MAX, 0), LZMA_OK);
+
+	const size_t out_max = lzma_stream_buffer_bound(in_size)
+			+ (in_size / chunk_size + 1) * 64;
+	compressed = tuktest_malloc(out_max);
+	decompressed = tuktest_malloc(in_size);
+
+	strm.next_out = compressed;
+	strm.avail_out = out_max;
+	dec.next_in = compressed;
+	dec.next_out = decompressed;
+	dec.avail_out = in_size;
+
+	size_t in_pos = 0;
+	while (in_pos < in_size) {
+		const size_t size = my_min(chunk_size, in_size - in_pos);
+		strm.next_in = input + in_pos;
+		strm.avail_in = size;
+
+		lzma_ret ret;
+		do {
+			ret = lzma_code(&strm, LZMA_SYNC_FLUSH);
+		} while (ret == LZMA_OK);
+
+		assert_lzma_ret(ret, LZMA_STREAM_END);
+		assert_uint_eq(strm.avail_in, 0);
+		in_pos += size;
+
+		dec.avail_in = (size_t)(strm.next_out - dec.next_in);
+		assert_lzma_ret(lzma_code(&dec, LZMA_RUN), LZMA_OK);
+		assert_uint_eq(dec.avail_in, 0);
+		assert_uint_eq(dec.total_out, in_pos);
+	}
+
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+	compressed_size = (size_t)strm.total_out;
+	lzma_end(&strm);
+
+	dec.avail_in = (size_t)(strm.next_out - dec.next_in);
+	assert_lzma_ret(lzma_code(&dec, LZMA_FINISH), LZMA_STREAM_END);
+	assert_uint_eq(dec.total_out, in_size);
+	assert_true(memcmp(decompressed, input, in_size) == 0);
+	lzma_end(&dec);
+
+	tuktest_free(decompressed);
+	return;
+}
+
+
+static lzma_index *
+decode_index(void)
+{
+	lzma_stream_flags flags;
+	const uint8_t *footer = compressed + compressed_size
+			- LZMA_STREAM_HEADER_SIZE;
+	assert_lzma_ret(lzma_stream_footer_decode(&flags, footer), LZMA_OK);
+
+	lzma_index *idx;
+	uint64_t memlimit = UINT64_MAX;
+	size_t pos = 0;
+	assert_lzma_ret(lzma_index_buffer_decode(&idx, &memlimit, NULL,
+			footer - flags.backward_size, &pos,
+			flags.backward_size), LZMA_OK);
+
+	return idx;
+}
+
+
+static lzma_vli
+count_blocks(void)
+{
+	lzma_index *idx = decode_index();
+	const lzma_vli count = lzma_index_block_count(idx);
+	lzma_index_end(idx, NULL);
+	return count;
+}
+#endif
+
+
+static void
+test_sync_flush(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1 << 16;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_mt mt = {
+		.threads = 3,
+		.block_size = 1 << 18,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC32,
+		.part_size = 1 << 16,
+	};
+
+	// The Blocks are flushed in the middle. They have no size
+	// information in the Block Headers but the Index is still
+	// correct.
+	encode_sync_flush(&mt, INPUT_SIZE, 100003);
+	verify_decode(INPUT_SIZE);
+	assert_uint_eq(count_blocks(), INPUT_SIZE / mt.block_size);
+	tuktest_free(compressed);
+
+	// Flushing often, with chunks that aren't aligned with
+	// the Blocks
+	mt.block_size = 50000;
+	encode_sync_flush(&mt, 300000, 4097);
+	verify_decode(300000);
+	tuktest_free(compressed);
+
+	// LZMA_SYNC_FLUSH finishes the parts. Chunks of less than
+	// PART_TAIL_SIZE bytes end the Blocks instead.
+	mt.flags = LZMA_MT_USE_PART_SIZE;
+	mt.block_size = 1 << 18;
+	encode_sync_flush(&mt, INPUT_SIZE, 100003);
+	verify_decode(INPUT_SIZE);
+	assert_uint_eq(count_blocks(), INPUT_SIZE / mt.block_size);
+	tuktest_free(compressed);
+
+	encode_sync_flush(&mt, 3000, 3);
+	verify_decode(3000);
+	tuktest_free(compressed);
+
+	// With a thread pool, LZMA_SYNC_FLUSH finishes the Block.
+	lzma_thread_pool *pool = lzma_thread_pool_init(2, NULL);
+	assert_true(pool != NULL);
+	mt.flags = LZMA_MT_USE_THREAD_POOL;
+	mt.thread_pool = pool;
+	encode_sync_flush(&mt, INPUT_SIZE, 200000);
+	verify_decode(INPUT_SIZE);
+	assert_uint_eq(count_blocks(), (INPUT_SIZE + 199999) / 200000);
+	tuktest_free(compressed);
+
+	lzma_thread_pool_end(pool, NULL);
+#endif
+}
+
+
+static void
+test_reset_interval(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.mf |= LZMA_MF_RESET_INTERVAL;
+	opt_lzma.reset_interval = 1 << 18;
+
+	lzma_filter filters[] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const lzma_mt mt = {
+		.threads = 2,
+		.block_size = INPUT_SIZE,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC64,
+	};
+
+	// The single-threaded decoder doesn't need to know about the
+	// resets. Give the encoder small buffers to test that the resets
+	// don't break the data when the input arrives in pieces.
+	// test_stream_decoder_mt.c tests decoding the parts in parallel.
+	encode_mt(&mt, INPUT_SIZE, 4567, 3001, 0);
+	verify_decode(INPUT_SIZE);
+	tuktest_free(compressed);
+
+	// Unsupported option combinations
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+	opt_lzma.reset_interval = LZMA_DICT_SIZE_MIN - 1;
+	assert_lzma_ret(lzma_raw_encoder(&strm, filters),
+			LZMA_OPTIONS_ERROR);
+
+	opt_lzma.reset_interval = LZMA_DICT_SIZE_MIN;
+	assert_lzma_ret(lzma_raw_encoder(&strm, filters), LZMA_OK);
+
+	opt_lzma.mf |= LZMA_MF_THREADED;
+	assert_lzma_ret(lzma_raw_encoder(&strm, filters),
+			LZMA_OPTIONS_ERROR);
+
+	opt_lzma.mf &= ~LZMA_MF_THREADED;
+	assert_lzma_ret(lzma_alone_encoder(&strm, &opt_lzma),
+			LZMA_OPTIONS_ERROR);
+
+	lzma_end(&strm);
+#endif
+}
+
+extern int
+main(int argc, char **argv)
+{
+	tuktest_start(argc, argv);
+
+	input = tuktest_malloc(INPUT_SIZE);
+	create_test_input(input, INPUT_SIZE, 18);
+
+	tuktest_run(test_part_size_options);
+	tuktest_run(test_part_size_encode);
+	tuktest_run(test_direct_input);
+	tuktest_run(test_outbuf_growth);
+	tuktest_run(test_notify);
+	tuktest_run(test_sync_flush);
+	tuktest_run(test_mt_stats);
+	tuktest_run(test_numa);
+	tuktest_run(test_reset_interval);
+
+	return tuktest_end();
+}
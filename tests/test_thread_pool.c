@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: 0BSD
+
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_thread_pool.c
+/// \brief      Tests sharing a thread pool between multithreaded coders
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+#include "mythread.h"
+
+
+#define INPUT_SIZE (1U << 20)
+
+// Number of coders that share the pool in the tests
+#define CODER_COUNT 3
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+static uint8_t *input;
+
+typedef struct {
+	lzma_stream strm;
+	uint8_t *out;
+	size_t out_max;
+	size_t in_pos;
+	bool finished;
+} coder_state;
+#endif
+
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+// Call lzma_code() for each coder in turn, giving at most in_chunk bytes
+// of input per call, until all coders have finished. The input of coder i
+// is in[i] with in_size[i] bytes.
+static void
+run_coders(coder_state *coders, const uint8_t *const *in,
+		const size_t *in_size, size_t in_chunk)
+{
+	size_t finished = 0;
+
+	while (finished < CODER_COUNT) {
+		for (size_t i = 0; i < CODER_COUNT; ++i) {
+			coder_state *c = &coders[i];
+			if (c->finished)
+				continue;
+
+			const size_t avail_in = my_min(in_chunk,
+					in_size[i] - c->in_pos);
+
+			c->strm.next_in = in[i] + c->in_pos;
+			c->strm.avail_in = avail_in;
+			c->strm.next_out = c->out + c->strm.total_out;
+			c->strm.avail_out = (size_t)(c->out_max
+					- c->strm.total_out);
+
+			const lzma_ret ret = lzma_code(&c->strm,
+					c->in_pos + avail_in == in_size[i]
+						? LZMA_FINISH : LZMA_RUN);
+
+			c->in_pos += avail_in - c->strm.avail_in;
+
+			if (ret == LZMA_STREAM_END) {
+				c->finished = true;
+				++finished;
+			} else {
+				assert_lzma_ret(ret, LZMA_OK);
+			}
+		}
+	}
+
+	return;
+}
+#endif
+
+
+static void
+test_thread_pool_init(void)
+{
+#ifndef MYTHREAD_ENABLED
+	assert_skip("Threading support disabled");
+#else
+	assert_true(lzma_thread_pool_init(0, NULL) == NULL);
+	assert_true(lzma_thread_pool_init(UINT32_MAX, NULL) == NULL);
+
+	lzma_thread_pool *pool = lzma_thread_pool_init(3, NULL);
+	assert_true(pool != NULL);
+	lzma_thread_pool_end(pool, NULL);
+
+	// NULL is silently ignored.
+	lzma_thread_pool_end(NULL, NULL);
+#endif
+}
+
+
+static void
+test_thread_pool_options(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	lzma_mt mt = {
+		.flags = LZMA_MT_USE_THREAD_POOL,
+		.threads = 2,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+		.memlimit_threading = UINT64_MAX,
+		.memlimit_stop = UINT64_MAX,
+	};
+
+	// A NULL pool is the same as not setting the flag.
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt), LZMA_OK);
+
+	// Unknown flags are still rejected.
+	mt.flags = 0x8000;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt),
+			LZMA_OPTIONS_ERROR);
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt),
+			LZMA_OPTIONS_ERROR);
+
+	// thread_pool isn't read without LZMA_MT_USE_THREAD_POOL. If it
+	// were, the invalid pointer would most likely crash the test.
+	mt.flags = 0;
+	mt.thread_pool = (lzma_thread_pool *)(void *)&mt;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+
+	uint8_t out[1024];
+	strm.next_in = input;
+	strm.avail_in = 4096;
+	strm.next_out = out;
+	strm.avail_out = sizeof(out);
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+
+	lzma_end(&strm);
+#endif
+}
+
+
+static void
+test_thread_pool_coders(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	// Fewer threads in the pool than Blocks in progress in a single
+	// coder makes jobs of all coders wait in the queue.
+	lzma_thread_pool *pool = lzma_thread_pool_init(2, NULL);
+	assert_true(pool != NULL);
+
+	lzma_options_lzma opt_lzma;
+	assert_false(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.dict_size = 1 << 16;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_mt mt = {
+		.flags = LZMA_MT_USE_THREAD_POOL,
+		.threads = 3,
+		.block_size = 1 << 17,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC64,
+		.memlimit_threading = UINT64_MAX,
+		.memlimit_stop = UINT64_MAX,
+		.thread_pool = pool,
+	};
+
+	// Each coder compresses a different amount of the input.
+	// The last one splits its Blocks into parts.
+	const uint8_t *in[CODER_COUNT];
+	size_t in_size[CODER_COUNT];
+	coder_state coders[CODER_COUNT];
+
+	for (size_t i = 0; i < CODER_COUNT; ++i) {
+		in[i] = input;
+		in_size[i] = INPUT_SIZE - i * 100000;
+
+		coders[i] = (coder_state){ .strm = LZMA_STREAM_INIT };
+		coders[i].out_max = lzma_stream_buffer_bound(in_size[i]);
+		coders[i].out = tuktest_malloc(coders[i].out_max);
+
+		if (i == CODER_COUNT - 1) {
+			mt.flags |= LZMA_MT_USE_PART_SIZE;
+			mt.part_size = 1 << 16;
+		}
+
+		assert_lzma_ret(lzma_stream_encoder_mt(&coders[i].strm, &mt),
+				LZMA_OK);
+	}
+
+	run_coders(coders, in, in_size, 10000);
+
+	// Decompress all the Streams at the same time using the same pool
+	// and compare to the original input.
+	const uint8_t *compressed[CODER_COUNT];
+	size_t compressed_size[CODER_COUNT];
+
+	mt.flags = LZMA_MT_USE_THREAD_POOL;
+
+	for (size_t i = 0; i < CODER_COUNT; ++i) {
+		compressed[i] = coders[i].out;
+		compressed_size[i] = (size_t)coders[i].strm.total_out;
+		lzma_end(&coders[i].strm);
+
+		coders[i] = (coder_state){ .strm = LZMA_STREAM_INIT };
+		coders[i].out_max = in_size[i];
+		coders[i].out = tuktest_malloc(coders[i].out_max);
+
+		assert_lzma_ret(lzma_stream_decoder_mt(&coders[i].strm, &mt),
+				LZMA_OK);
+	}
+
+	run_coders(coders, compressed, compressed_size, 7777);
+
+	for (size_t i = 0; i < CODER_COUNT; ++i) {
+		assert_uint_eq(coders[i].strm.total_out, in_size[i]);
+		assert_true(memcmp(coders[i].out, input, in_size[i]) == 0);
+
+		lzma_end(&coders[i].strm);
+		tuktest_free(coders[i].out);
+		tuktest_free((void *)compressed[i]);
+	}
+
+	lzma_thread_pool_end(pool, NULL);
+#endif
+}
+
+
+static void
+test_thread_pool_end_early(void)
+{
+#if !defined(MYTHREAD_ENABLED) || !defined(HAVE_ENCODERS) \
+		|| !defined(HAVE_DECODERS)
+	assert_skip("Threading, encoder, or decoder support disabled");
+#else
+	// lzma_end() must be safe while jobs are queued or running.
+	lzma_thread_pool *pool = lzma_thread_pool_init(1, NULL);
+	assert_true(pool != NULL);
+
+	lzma_mt mt = {
+		.flags = LZMA_MT_USE_THREAD_POOL,
+		.threads = 4,
+		.block_size = 1 << 16,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+		.memlimit_threading = UINT64_MAX,
+		.memlimit_stop = UINT64_MAX,
+		.thread_pool = pool,
+	};
+
+	const size_t out_max = lzma_stream_buffer_bound(INPUT_SIZE);
+	uint8_t *out = tuktest_malloc(out_max);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+
+	strm.next_in = input;
+	strm.avail_in = INPUT_SIZE;
+	strm.next_out = out;
+	strm.avail_out = out_max;
+	assert_lzma_ret(lzma_code(&strm, LZMA_RUN), LZMA_OK);
+
+	// Reinitialization has to wait for the jobs too.
+	assert_lzma_ret(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+
+	strm.next_in = input;
+	strm.avail_in = INPUT_SIZE;
+	strm.next_out = out;
+	strm.avail_out = out_max;
+	assert_lzma_ret(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+	const size_t out_size = (size_t)strm.total_out;
+
+	// Decode a part of the Stream and then end the decoder.
+	assert_lzma_ret(lzma_stream_decoder_mt(&strm, &mt), LZMA_OK);
+
+	uint8_t *decompressed = tuktest_malloc(INPUT_SIZE);
+	strm.next_in = out;
+	strm.avail_in = out_size / 2;
+	strm.next_out = decompressed;
+	strm.avail_out = INPUT_SIZE;
+	assert_lzma_ret(lzma_code(&strm, LZMA_RUN), LZMA_OK);
+
+	lzma_end(&strm);
+	lzma_thread_pool_end(pool, NULL);
+
+	tuktest_free(decompressed);
+	tuktest_free(out);
+#endif
+}
+
+
+extern int
+main(int argc, char **argv)
+{
+	tuktest_start(argc, argv);
+
+#if defined(MYTHREAD_ENABLED) && defined(HAVE_ENCODERS) \
+		&& defined(HAVE_DECODERS)
+	input = tuktest_malloc(INPUT_SIZE);
+	create_test_input(input, INPUT_SIZE, 16);
+#endif
+
+	tuktest_run(test_thread_pool_init);
+	tuktest_run(test_thread_pool_options);
+	tuktest_run(test_thread_pool_coders);
+	tuktest_run(test_thread_pool_end_early);
+
+	return tuktest_end();
+}
@@ -53,6 +53,7 @@ if(BUILD_TESTING)
     set(LIBLZMA_TESTS
         test_bcj_exact_size
         test_block_header
+        test_block_inplace
         test_check
         test_filter_flags
         test_filter_str
@@ -60,9 +61,14 @@ if(BUILD_TESTING)
         test_index
         test_index_hash
         test_lzip_decoder
+        test_match_finder
         test_memlimit
+        test_seekable_decoder
         test_stream_buffer_decode
+        test_stream_decoder_mt
+        test_stream_encoder_mt
         test_stream_flags
+        test_thread_pool
         test_vli
     )
 
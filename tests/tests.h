@@ -71,4 +71,45 @@ static const char enum_strings_lzma_check[][24] = {
 #define assert_lzma_check(test_expr, ref_val) \
 	assert_enum_eq(test_expr, ref_val, enum_strings_lzma_check)
 
+
+// Fill buf[size] with text-like data that is the same on every run.
+// The data is handled in segments of (1 << segment_shift) bytes. Out of
+// every five segments, one is incompressible, one repeats the data from
+// 1000 bytes back, and the rest are words picked pseudo-randomly.
+static inline void
+create_test_input(uint8_t *buf, size_t size, unsigned segment_shift)
+{
+	static const char *const words[] = {
+		"lorem ", "ipsum ", "dolor ", "sit ", "amet, ",
+		"consectetur ", "adipiscing ", "elit. ", "sed ", "do\n",
+		"eiusmod ", "tempor ", "incididunt ", "ut ", "labore ",
+	};
+
+	uint32_t n = 5381;
+	size_t pos = 0;
+
+	while (pos < size) {
+		n = n * 101771 + 12345;
+
+		const size_t segment = (pos >> segment_shift) % 5;
+
+		if (segment == 3) {
+			buf[pos++] = (uint8_t)(n >> 22);
+			continue;
+		}
+
+		if (segment == 1 && pos >= 1000) {
+			buf[pos] = buf[pos - 1000];
+			++pos;
+			continue;
+		}
+
+		const char *w = words[(n >> 16) % ARRAY_SIZE(words)];
+		while (*w != '\0' && pos < size)
+			buf[pos++] = (uint8_t)(*w++);
+	}
+
+	return;
+}
+
 #endif